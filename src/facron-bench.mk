@@ -0,0 +1,92 @@
+# This file is part of facron.
+#
+# Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+#
+# facron is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# facron is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with facron.  If not, see <http://www.gnu.org/licenses/>.
+
+# Not built by default, run "make bench"
+EXTRA_PROGRAMS += \
+	bench/facron-bench \
+	$(NULL)
+
+bench_facron_bench_SOURCES = \
+	src/facron-bench/facron-bench.c \
+	src/facron/facron-arena.h \
+	src/facron/facron-arena.c \
+	src/facron/facron-batcher.h \
+	src/facron/facron-batcher.c \
+	src/facron/facron-builtin.h \
+	src/facron/facron-builtin.c \
+	src/facron/facron-cache.h \
+	src/facron/facron-cache.c \
+	src/facron/facron-command.h \
+	src/facron/facron-command.c \
+	src/facron/facron-conf.h \
+	src/facron/facron-conf.c \
+	src/facron/facron-conf-entry.h \
+	src/facron/facron-conf-entry.c \
+	src/facron/facron-debounce.h \
+	src/facron/facron-debounce.c \
+	src/facron/facron-executor.h \
+	src/facron/facron-executor.c \
+	src/facron/facron-glob.h \
+	src/facron/facron-glob.c \
+	src/facron/facron-index.h \
+	src/facron/facron-index.c \
+	src/facron/facron-lexer.h \
+	src/facron/facron-lexer.c \
+	src/facron/facron-limit.h \
+	src/facron/facron-limit.c \
+	src/facron/facron-lineage.h \
+	src/facron/facron-lineage.c \
+	src/facron/facron-marks.h \
+	src/facron/facron-marks.c \
+	src/facron/facron-metrics.h \
+	src/facron/facron-metrics.c \
+	src/facron/facron-parser.h \
+	src/facron/facron-parser.c \
+	src/facron/facron-permission.h \
+	src/facron/facron-permission.c \
+	src/facron/facron-ring.h \
+	src/facron/facron-ring.c \
+	src/facron/facron-stream.h \
+	src/facron/facron-stream.c \
+	src/facron/facron-timers.h \
+	src/facron/facron-timers.c \
+	src/facron/facron-util.h \
+	src/facron/facron-util.c \
+	$(NULL)
+
+bench_facron_bench_CFLAGS = \
+	$(AM_CFLAGS) \
+	-I$(srcdir)/src/facron \
+	-pthread \
+	$(NULL)
+
+# Allocations get counted and nothing gets actually spawned
+bench_facron_bench_LDFLAGS = \
+	-pthread \
+	-Wl,--wrap=malloc \
+	-Wl,--wrap=calloc \
+	-Wl,--wrap=realloc \
+	-Wl,--wrap=posix_spawn \
+	$(NULL)
+
+CLEANFILES += \
+	bench/facron-bench \
+	$(NULL)
+
+bench: bench/facron-bench
+
+.PHONY: bench
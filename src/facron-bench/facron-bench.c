@@ -0,0 +1,525 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-conf.h"
+#include "facron-metrics.h"
+#include "facron-parser.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+/*
+ * Matches synthetic events against synthetic configurations, the way the
+ * matcher threads and the main loop do, without fanotify nor root. The
+ * spawns are stubbed out and the allocations counted by wrapping them at
+ * link time. With --parse, times the parsing of a generated configuration
+ * instead.
+ */
+
+#define N_EVENTS     4096
+#define BATCH_EVENTS 64
+#define PARSE_ROUNDS 5
+
+typedef enum
+{
+    KIND_EXACT,
+    KIND_CHILD,
+    KIND_MIXED,
+    KIND_GLOB,
+    N_KINDS
+} FacronBenchKind;
+
+static const char *kinds[N_KINDS] = {
+    [KIND_EXACT] = "exact",
+    [KIND_CHILD] = "child",
+    [KIND_MIXED] = "mixed",
+    [KIND_GLOB]  = "glob",
+};
+
+typedef struct
+{
+    char               path[PATH_MAX];
+    size_t             len;
+    unsigned long long mask;
+} FacronBenchEvent;
+
+static atomic_ulong n_allocs;
+static atomic_ulong n_spawns;
+
+void *__real_malloc  (size_t size);
+void *__real_calloc  (size_t nmemb,
+                      size_t size);
+void *__real_realloc (void  *ptr,
+                      size_t size);
+void *__wrap_malloc  (size_t size);
+void *__wrap_calloc  (size_t nmemb,
+                      size_t size);
+void *__wrap_realloc (void  *ptr,
+                      size_t size);
+int   __wrap_posix_spawn (pid_t                            *pid,
+                          const char                       *path,
+                          const posix_spawn_file_actions_t *file_actions,
+                          const posix_spawnattr_t          *attrp,
+                          char *const                       argv[],
+                          char *const                       envp[]);
+
+void *
+__wrap_malloc (size_t size)
+{
+    atomic_fetch_add_explicit (&n_allocs, 1, memory_order_relaxed);
+    return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t nmemb,
+               size_t size)
+{
+    atomic_fetch_add_explicit (&n_allocs, 1, memory_order_relaxed);
+    return __real_calloc (nmemb, size);
+}
+
+void *
+__wrap_realloc (void  *ptr,
+                size_t size)
+{
+    atomic_fetch_add_explicit (&n_allocs, 1, memory_order_relaxed);
+    return __real_realloc (ptr, size);
+}
+
+int
+__wrap_posix_spawn (pid_t                            *pid,
+                    const char                       *path,
+                    const posix_spawn_file_actions_t *file_actions,
+                    const posix_spawnattr_t          *attrp,
+                    char *const                       argv[],
+                    char *const                       envp[])
+{
+    (void) path;
+    (void) file_actions;
+    (void) attrp;
+    (void) argv;
+    (void) envp;
+
+    *pid = 1;
+    atomic_fetch_add_explicit (&n_spawns, 1, memory_order_relaxed);
+    return 0;
+}
+
+/* xorshift64, the same run is generated every time */
+static uint64_t
+facron_bench_random (uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/* Entry i watches d<i> for its children, or d<i>/f itself, or matches it with a pattern */
+static bool
+facron_bench_is_child (FacronBenchKind kind,
+                       unsigned int    i)
+{
+    return kind == KIND_CHILD || (kind == KIND_MIXED && i % 3 == 1);
+}
+
+static bool
+facron_bench_write_conf (const char      *root,
+                         const char      *filename,
+                         FacronBenchKind  kind,
+                         unsigned int     n_entries)
+{
+    FILE *conf = fopen (filename, "w");
+
+    if (!conf)
+    {
+        fprintf (stderr, "Error: could not write \"%s\": %s\n", filename, strerror (errno));
+        return false;
+    }
+
+    for (unsigned int i = 0; i < n_entries; ++i)
+    {
+        if (kind == KIND_GLOB && i % 2)
+            fprintf (conf, "%s/d%u/**/[ef] FAN_CLOSE_WRITE /bin/true $$ $#\n", root, i);
+        else if (kind == KIND_GLOB)
+            fprintf (conf, "%s/d%u/?* FAN_CLOSE_WRITE /bin/true $$ $#\n", root, i);
+        else if (facron_bench_is_child (kind, i))
+            fprintf (conf, "%s/d%u FAN_CLOSE_WRITE|FAN_EVENT_ON_CHILD /bin/true $$ $@ $#\n", root, i);
+        else if (kind == KIND_MIXED && i % 3 == 2)
+            fprintf (conf, "%s/d%u/f FAN_MODIFY,FAN_CLOSE_WRITE|FAN_OPEN /bin/true $$ $*\n", root, i);
+        else
+            fprintf (conf, "%s/d%u/f FAN_CLOSE_WRITE /bin/true $$ $#\n", root, i);
+    }
+
+    fclose (conf);
+    return true;
+}
+
+/* Three events out of four are for a watched path, the others come from elsewhere */
+static void
+facron_bench_make_events (FacronBenchEvent *events,
+                          const char       *root,
+                          unsigned int      n_entries)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (unsigned int i = 0; i < N_EVENTS; ++i)
+    {
+        unsigned int entry = facron_bench_random (&state) % n_entries;
+        bool miss = !(facron_bench_random (&state) % 4);
+
+        events[i].len = snprintf (events[i].path, sizeof (events[i].path), "%s/%s%u/f", root, (miss) ? "miss" : "d", entry);
+        events[i].mask = (facron_bench_random (&state) % 2) ? FAN_CLOSE_WRITE : FAN_MODIFY|FAN_CLOSE_WRITE;
+    }
+}
+
+static void
+facron_bench_run (const char      *root,
+                  FacronBenchKind  kind,
+                  unsigned int     n_entries,
+                  unsigned long    n_events)
+{
+    static FacronBenchEvent events[N_EVENTS];
+    char filename[PATH_MAX];
+
+    snprintf (filename, sizeof (filename), "%s/%s.conf", root, kinds[kind]);
+    if (!facron_bench_write_conf (root, filename, kind, n_entries))
+        return;
+
+    FacronTimers *timers = facron_timers_new ();
+    FacronExecutor *executor = (timers) ? facron_executor_new (0, 0, FACRON_LIMIT_QUEUE, timers) : NULL;
+    FacronConf *conf = (executor) ? facron_conf_new (filename, NULL) : NULL;
+
+    if (!conf)
+    {
+        facron_executor_free (executor);
+        facron_timers_free (timers);
+        return;
+    }
+
+    facron_bench_make_events (events, root, n_entries);
+
+    FacronMetadata metadata = {
+        .event_len = FAN_EVENT_METADATA_LEN,
+        .vers = FANOTIFY_METADATA_VERSION,
+        .metadata_len = FAN_EVENT_METADATA_LEN,
+        .fd = FAN_NOFD,
+        .pid = getpid (),
+    };
+    FacronEvent event = { .metadata = &metadata };
+    unsigned long allocs = atomic_load (&n_allocs);
+    unsigned long spawns = atomic_load (&n_spawns);
+    uint64_t start = facron_metrics_now ();
+
+    /* Handled per batch against a pinned generation, then dispatched, like facron does */
+    for (unsigned long i = 0; i < n_events;)
+    {
+        FacronConfGeneration *generation = facron_conf_acquire (conf);
+
+        for (unsigned int j = 0; j < BATCH_EVENTS && i < n_events; ++j, ++i)
+        {
+            const FacronBenchEvent *e = &events[i % N_EVENTS];
+
+            metadata.mask = e->mask;
+            event.path = e->path;
+            event.path_len = e->len;
+            event.stamp = start;
+            facron_conf_handle (generation, executor, &event);
+        }
+
+        facron_conf_release (generation);
+        facron_executor_dispatch (executor);
+    }
+
+    uint64_t elapsed = facron_metrics_now () - start;
+
+    allocs = atomic_load (&n_allocs) - allocs;
+    spawns = atomic_load (&n_spawns) - spawns;
+
+    printf ("%-5s %7u entries: %10.0f events/s %8.1f ns/event %6.2f allocs/event %6.2f commands/event\n",
+            kinds[kind], n_entries, n_events / (elapsed / 1e9), (double) elapsed / n_events,
+            (double) allocs / n_events, (double) spawns / n_events);
+
+    facron_conf_free (conf, -1);
+    facron_executor_free (executor);
+    facron_timers_free (timers);
+    unlink (filename);
+}
+
+/* A generated configuration, one line in ten being a mistake or a blank */
+static bool
+facron_bench_write_parse_conf (const char    *root,
+                               const char    *filename,
+                               unsigned int   n_entries,
+                               unsigned long  n_lines,
+                               size_t        *size)
+{
+    FILE *conf = fopen (filename, "w");
+
+    if (!conf)
+    {
+        fprintf (stderr, "Error: could not write \"%s\": %s\n", filename, strerror (errno));
+        return false;
+    }
+
+    for (unsigned long i = 0; i < n_lines; ++i)
+    {
+        unsigned int entry = i % n_entries;
+
+        switch (i % 10)
+        {
+        case 0:
+            fprintf (conf, "%s/d%u/missing FAN_CLOSE_WRITE /bin/true\n", root, entry);
+            break;
+        case 1:
+            fputs ("\n", conf);
+            break;
+        case 2:
+            fprintf (conf, "%s/d%u FAN_CLOSE_WRITE|FAN_EVENT_ON_CHILD debounce=100 /bin/echo \"$@ $#\" $*\n", root, entry);
+            break;
+        case 3:
+            fprintf (conf, "%s/d%u/f FAN_MODIFY,FAN_CLOSE_WRITE|FAN_OPEN batch=50:10 @log %s/log $$\n", root, entry, root);
+            break;
+        default:
+            fprintf (conf, "%s/d%u/f FAN_CLOSE_WRITE limit=10/s:queue /bin/true $$ $+\n", root, entry);
+        }
+    }
+
+    *size = ftell (conf);
+    fclose (conf);
+    return true;
+}
+
+/* A whole generation, parsed and indexed or mapped from an image */
+static uint64_t
+facron_bench_load (const char    *filename,
+                   const char    *cache_file,
+                   unsigned long *allocs)
+{
+    unsigned long before = atomic_load (&n_allocs);
+    uint64_t start = facron_metrics_now ();
+    FacronConf *conf = facron_conf_new (filename, cache_file);
+    uint64_t elapsed = facron_metrics_now () - start;
+
+    *allocs = atomic_load (&n_allocs) - before;
+    facron_conf_free (conf, -1);
+
+    return elapsed;
+}
+
+static void
+facron_bench_parse (const char    *root,
+                    unsigned int   n_entries,
+                    unsigned long  n_lines)
+{
+    char filename[PATH_MAX];
+    char cache_file[PATH_MAX];
+    size_t size;
+
+    snprintf (filename, sizeof (filename), "%s/parse.conf", root);
+    snprintf (cache_file, sizeof (cache_file), "%s/parse.cache", root);
+    if (!facron_bench_write_parse_conf (root, filename, n_entries, n_lines, &size))
+        return;
+
+    FacronParser *parser = facron_parser_new (filename);
+    uint64_t best = UINT64_MAX;
+    unsigned int n_parsed = 0;
+
+    /* stderr would be flooded by the mistakes */
+    int err = dup (STDERR_FILENO);
+    int null = open ("/dev/null", O_WRONLY|O_CLOEXEC);
+
+    fflush (stderr);
+    dup2 (null, STDERR_FILENO);
+
+    for (unsigned int round = 0; round < PARSE_ROUNDS; ++round)
+    {
+        uint64_t start = facron_metrics_now ();
+
+        facron_parser_reload (parser);
+
+        FacronArena *entries = facron_parser_parse (parser);
+        uint64_t elapsed = facron_metrics_now () - start;
+
+        n_parsed = facron_conf_entries_count (entries);
+        facron_conf_entries_free (entries);
+        if (elapsed < best)
+            best = elapsed;
+    }
+
+    unsigned long text_allocs, image_allocs;
+    uint64_t text = facron_bench_load (filename, NULL, &text_allocs);
+    uint64_t image = UINT64_MAX;
+
+    /* The first one compiles and saves the image */
+    facron_bench_load (filename, cache_file, &image_allocs);
+    for (unsigned int round = 0; round < PARSE_ROUNDS; ++round)
+    {
+        uint64_t elapsed = facron_bench_load (filename, cache_file, &image_allocs);
+
+        if (elapsed < image)
+            image = elapsed;
+    }
+
+    fflush (stderr);
+    dup2 (err, STDERR_FILENO);
+    close (err);
+    close (null);
+
+    printf ("parse %7lu lines:   %10.0f lines/s  %8.1f MB/s    %7u entries, best of %d\n",
+            n_lines, n_lines / (best / 1e9), size / (best / 1e3), n_parsed, PARSE_ROUNDS);
+    printf ("load  %7lu lines:   %10.2f ms from text  %8.2f ms from image  %7lu / %lu allocs\n",
+            n_lines, text / 1e6, image / 1e6, text_allocs, image_allocs);
+
+    facron_parser_free (parser);
+    unlink (cache_file);
+    unlink (filename);
+}
+
+static bool
+facron_bench_make_tree (const char   *root,
+                        unsigned int  n_entries)
+{
+    char path[PATH_MAX];
+
+    for (unsigned int i = 0; i < n_entries; ++i)
+    {
+        int fd;
+
+        snprintf (path, sizeof (path), "%s/d%u", root, i);
+        if (mkdir (path, 0700) < 0 && errno != EEXIST)
+            goto fail;
+
+        snprintf (path, sizeof (path), "%s/d%u/f", root, i);
+        if ((fd = open (path, O_WRONLY|O_CREAT|O_CLOEXEC, 0600)) < 0)
+            goto fail;
+        close (fd);
+    }
+
+    return true;
+
+fail:
+    fprintf (stderr, "Error: could not create \"%s\": %s\n", path, strerror (errno));
+    return false;
+}
+
+static void
+facron_bench_remove_tree (const char   *root,
+                          unsigned int  n_entries)
+{
+    char path[PATH_MAX];
+
+    for (unsigned int i = 0; i < n_entries; ++i)
+    {
+        snprintf (path, sizeof (path), "%s/d%u/f", root, i);
+        unlink (path);
+        snprintf (path, sizeof (path), "%s/d%u", root, i);
+        rmdir (path);
+    }
+
+    rmdir (root);
+}
+
+static inline void
+usage (char *callee)
+{
+    fprintf (stderr, "USAGE: %s [--entries|-n entries] [--events|-e events] [--kind|-k exact|child|mixed|glob] [--parse|-p lines]\n", callee);
+    exit (EXIT_FAILURE);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+    struct option long_options[] = {
+        { "entries", required_argument, NULL, 'n' },
+        { "events",  required_argument, NULL, 'e' },
+        { "kind",    required_argument, NULL, 'k' },
+        { "parse",   required_argument, NULL, 'p' },
+        { 0,         no_argument,       NULL, 0   }
+    };
+
+    unsigned int n_entries = 1000;
+    unsigned long n_events = 1000000;
+    unsigned long n_lines = 0;
+    int kind = -1;
+    int c;
+
+    while ((c = getopt_long (argc, argv, "e:k:n:p:", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'e':
+            n_events = strtoul (optarg, NULL, 10);
+            break;
+        case 'k':
+            for (kind = 0; kind < N_KINDS && strcmp (kinds[kind], optarg); ++kind);
+            if (kind == N_KINDS)
+                usage (argv[0]);
+            break;
+        case 'n':
+            n_entries = strtoul (optarg, NULL, 10);
+            break;
+        case 'p':
+            if (!(n_lines = strtoul (optarg, NULL, 10)))
+                usage (argv[0]);
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+
+    if (!n_entries || !n_events)
+        usage (argv[0]);
+
+    char root[] = "/tmp/facron-bench.XXXXXX";
+
+    if (!mkdtemp (root))
+    {
+        fprintf (stderr, "Error: could not create a temporary directory: %s\n", strerror (errno));
+        return EXIT_FAILURE;
+    }
+
+    bool ok = facron_bench_make_tree (root, n_entries);
+
+    /* Only the configuration parsing is measured then */
+    if (ok && n_lines)
+        facron_bench_parse (root, n_entries, n_lines);
+
+    for (int k = 0; ok && !n_lines && k < N_KINDS; ++k)
+    {
+        if (kind < 0 || kind == k)
+            facron_bench_run (root, k, n_entries, n_events);
+    }
+
+    facron_bench_remove_tree (root, n_entries);
+
+    return (ok) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
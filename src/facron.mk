@@ -21,20 +21,69 @@ sbin_PROGRAMS += \
 
 sbin_facron_SOURCES = \
 	src/facron/facron.c \
+	src/facron/facron-arena.h \
+	src/facron/facron-arena.c \
+	src/facron/facron-batcher.h \
+	src/facron/facron-batcher.c \
+	src/facron/facron-builtin.h \
+	src/facron/facron-builtin.c \
+	src/facron/facron-cache.h \
+	src/facron/facron-cache.c \
+	src/facron/facron-command.h \
+	src/facron/facron-command.c \
 	src/facron/facron-conf.h \
 	src/facron/facron-conf.c \
 	src/facron/facron-conf-entry.h \
 	src/facron/facron-conf-entry.c \
+	src/facron/facron-debounce.h \
+	src/facron/facron-debounce.c \
+	src/facron/facron-executor.h \
+	src/facron/facron-executor.c \
+	src/facron/facron-fid.h \
+	src/facron/facron-fid.c \
+	src/facron/facron-glob.h \
+	src/facron/facron-glob.c \
+	src/facron/facron-index.h \
+	src/facron/facron-index.c \
 	src/facron/facron-lexer.h \
 	src/facron/facron-lexer.c \
+	src/facron/facron-limit.h \
+	src/facron/facron-limit.c \
+	src/facron/facron-lineage.h \
+	src/facron/facron-lineage.c \
+	src/facron/facron-loop.h \
+	src/facron/facron-loop.c \
+	src/facron/facron-marks.h \
+	src/facron/facron-marks.c \
+	src/facron/facron-metrics.h \
+	src/facron/facron-metrics.c \
 	src/facron/facron-parser.h \
 	src/facron/facron-parser.c \
+	src/facron/facron-permission.h \
+	src/facron/facron-permission.c \
+	src/facron/facron-pipeline.h \
+	src/facron/facron-pipeline.c \
+	src/facron/facron-recovery.h \
+	src/facron/facron-recovery.c \
+	src/facron/facron-ring.h \
+	src/facron/facron-ring.c \
+	src/facron/facron-stream.h \
+	src/facron/facron-stream.c \
+	src/facron/facron-timers.h \
+	src/facron/facron-timers.c \
+	src/facron/facron-trace.h \
+	src/facron/facron-trace.c \
 	src/facron/facron-util.h \
 	src/facron/facron-util.c \
 	$(NULL)
 
 sbin_facron_CFLAGS = \
 	$(AM_CFLAGS) \
+	-pthread \
+	$(NULL)
+
+sbin_facron_LDFLAGS = \
+	-pthread \
 	$(NULL)
 
 sbin_facron_LDADD = \
@@ -0,0 +1,100 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-arena.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct FacronArena
+{
+    char  *data;
+    size_t len;
+    size_t size;
+    bool   view;
+};
+
+size_t
+facron_arena_alloc (FacronArena *arena,
+                    size_t       size)
+{
+    size_t offset = arena->len;
+
+    size = (size + FACRON_ARENA_ALIGN - 1) & ~((size_t) FACRON_ARENA_ALIGN - 1);
+
+    if (offset + size > arena->size)
+    {
+        size_t new_size = (arena->size) ? arena->size : 4096;
+
+        while (offset + size > new_size)
+            new_size *= 2;
+
+        arena->data = (char *) realloc (arena->data, new_size);
+        arena->size = new_size;
+    }
+
+    memset (arena->data + offset, 0, size);
+    arena->len += size;
+
+    return offset;
+}
+
+void *
+facron_arena_get (const FacronArena *arena,
+                  size_t             offset)
+{
+    return arena->data + offset;
+}
+
+size_t
+facron_arena_get_size (const FacronArena *arena)
+{
+    return arena->len;
+}
+
+void
+facron_arena_free (FacronArena *arena)
+{
+    if (!arena)
+        return;
+
+    if (!arena->view)
+        free (arena->data);
+    free (arena);
+}
+
+FacronArena *
+facron_arena_new (void)
+{
+    return (FacronArena *) calloc (1, sizeof (FacronArena));
+}
+
+FacronArena *
+facron_arena_new_view (const void *data,
+                       size_t      size)
+{
+    FacronArena *arena = facron_arena_new ();
+
+    arena->data = (char *) data;
+    arena->len = size;
+    arena->view = true;
+
+    return arena;
+}
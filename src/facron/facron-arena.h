@@ -0,0 +1,49 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_ARENA_H__
+#define __FACRON_ARENA_H__
+
+#include <stddef.h>
+
+/*
+ * A single contiguous, growable block. Allocations are addressed by their
+ * offset since growing the block may move it: pointers are only stable
+ * once nothing more gets allocated.
+ */
+typedef struct FacronArena FacronArena;
+
+#define FACRON_ARENA_ALIGN 8
+
+size_t facron_arena_alloc (FacronArena *arena,
+                           size_t       size);
+
+void  *facron_arena_get      (const FacronArena *arena,
+                              size_t             offset);
+size_t facron_arena_get_size (const FacronArena *arena);
+
+void facron_arena_free (FacronArena *arena);
+
+FacronArena *facron_arena_new (void);
+
+/* A read only view over a block owned by someone else, never allocated from */
+FacronArena *facron_arena_new_view (const void *data,
+                                    size_t      size);
+
+#endif /* __FACRON_ARENA_H__ */
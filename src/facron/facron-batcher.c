@@ -0,0 +1,261 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-batcher.h"
+#include "facron-metrics.h"
+#include "facron-util.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A batch exists for each entry which got an event less than a window
+ * ago, found through a hash table by the owner key of the entry. It
+ * carries its own copy of the command so that it outlives a configuration
+ * reload, and a set of the indices of its paths to spot duplicates.
+ */
+typedef struct FacronBatch FacronBatch;
+struct FacronBatch
+{
+    FacronBatch   *next;
+    FacronBatcher *batcher;
+    FacronTimer    timer;
+    uint64_t       owner;
+    FacronCommand *command;
+    pid_t          pid;
+    unsigned int   max;
+    char         **paths;
+    uint64_t      *hashes;
+    size_t         n_paths;
+    size_t         size;
+    uint32_t      *set;
+};
+
+struct FacronBatcher
+{
+    FacronTimers   *timers;
+    FacronExecutor *executor;
+    FacronBatch   **buckets;
+    size_t          size;
+    size_t          n_batches;
+};
+
+static inline FacronBatch **
+facron_batcher_get_bucket (const FacronBatcher *batcher,
+                           uint64_t             owner)
+{
+    return &batcher->buckets[((owner * 0x9E3779B97F4A7C15ULL) >> 32) & (batcher->size - 1)];
+}
+
+static void
+facron_batcher_grow (FacronBatcher *batcher)
+{
+    FacronBatch **old = batcher->buckets;
+    size_t old_size = batcher->size;
+
+    batcher->size *= 2;
+    batcher->buckets = (FacronBatch **) calloc (batcher->size, sizeof (FacronBatch *));
+
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        for (FacronBatch *batch = old[i], *next; batch; batch = next)
+        {
+            FacronBatch **bucket = facron_batcher_get_bucket (batcher, batch->owner);
+
+            next = batch->next;
+            batch->next = *bucket;
+            *bucket = batch;
+        }
+    }
+
+    free (old);
+}
+
+static void
+facron_batch_free (FacronBatch *batch)
+{
+    for (size_t i = 0; i < batch->n_paths; ++i)
+        free (batch->paths[i]);
+    free (batch->paths);
+    free (batch->hashes);
+    free (batch->set);
+    free (batch->command);
+    free (batch);
+}
+
+static void
+facron_batch_fire (FacronTimer *timer,
+                   void        *data)
+{
+    FacronBatch *batch = (FacronBatch *) data;
+    FacronBatcher *batcher = batch->batcher;
+
+    facron_timers_cancel (batcher->timers, timer);
+
+    for (FacronBatch **link = facron_batcher_get_bucket (batcher, batch->owner); *link; link = &(*link)->next)
+    {
+        if (*link == batch)
+        {
+            *link = batch->next;
+            break;
+        }
+    }
+    --batcher->n_batches;
+
+    facron_executor_exec_paths (batcher->executor, batch->command, batch->paths, batch->n_paths, batch->pid);
+    facron_batch_free (batch);
+}
+
+/* The set is twice as large as the paths array, so that it never fills up */
+static void
+facron_batch_grow (FacronBatch *batch)
+{
+    batch->size = (batch->size) ? batch->size * 2 : 64;
+    batch->paths = (char **) realloc (batch->paths, batch->size * sizeof (char *));
+    batch->hashes = (uint64_t *) realloc (batch->hashes, batch->size * sizeof (uint64_t));
+
+    free (batch->set);
+    batch->set = (uint32_t *) calloc (2 * batch->size, sizeof (uint32_t));
+
+    for (size_t i = 0; i < batch->n_paths; ++i)
+    {
+        size_t slot = batch->hashes[i] & (2 * batch->size - 1);
+
+        while (batch->set[slot])
+            slot = (slot + 1) & (2 * batch->size - 1);
+        batch->set[slot] = i + 1;
+    }
+}
+
+/* Returns false if the path already is in the batch */
+static bool
+facron_batch_add (FacronBatch *batch,
+                  const char  *path)
+{
+    size_t len = strlen (path);
+    uint64_t hash = facron_hash (path, len);
+
+    if (batch->n_paths == batch->size)
+        facron_batch_grow (batch);
+
+    size_t slot = hash & (2 * batch->size - 1);
+
+    for (; batch->set[slot]; slot = (slot + 1) & (2 * batch->size - 1))
+    {
+        uint32_t i = batch->set[slot] - 1;
+
+        if (batch->hashes[i] == hash && !strcmp (batch->paths[i], path))
+            return false;
+    }
+
+    batch->set[slot] = batch->n_paths + 1;
+    batch->hashes[batch->n_paths] = hash;
+    batch->paths[batch->n_paths++] = memcpy (malloc (len + 1), path, len + 1);
+
+    return true;
+}
+
+void
+facron_batcher_submit (FacronBatcher       *batcher,
+                       uint64_t             owner,
+                       const FacronCommand *command,
+                       const char          *path,
+                       pid_t                pid,
+                       unsigned int         window,
+                       unsigned int         max)
+{
+    FacronBatch **bucket = facron_batcher_get_bucket (batcher, owner);
+    FacronBatch *batch = *bucket;
+
+    while (batch && batch->owner != owner)
+        batch = batch->next;
+
+    if (!batch)
+    {
+        size_t size = facron_command_get_size (command);
+
+        batch = (FacronBatch *) calloc (1, sizeof (FacronBatch));
+        batch->batcher = batcher;
+        batch->timer = (FacronTimer) FACRON_TIMER_INIT (facron_batch_fire, batch);
+        batch->owner = owner;
+        batch->command = (FacronCommand *) memcpy (malloc (size), command, size);
+        batch->max = max;
+
+        batch->next = *bucket;
+        *bucket = batch;
+        if (++batcher->n_batches > batcher->size)
+            facron_batcher_grow (batcher);
+
+        facron_timers_schedule (batcher->timers, &batch->timer, facron_timers_now () + window);
+    }
+
+    batch->pid = pid;
+
+    if (!facron_batch_add (batch, path))
+    {
+        facron_metrics_inc (FACRON_METRIC_COALESCED);
+        return;
+    }
+
+    facron_metrics_inc (FACRON_METRIC_BATCHED);
+
+    if (batch->max && batch->n_paths >= batch->max)
+        facron_batch_fire (&batch->timer, batch);
+}
+
+bool
+facron_batcher_is_idle (const FacronBatcher *batcher)
+{
+    return !batcher->n_batches;
+}
+
+void
+facron_batcher_free (FacronBatcher *batcher)
+{
+    if (!batcher)
+        return;
+
+    for (size_t i = 0; i < batcher->size; ++i)
+    {
+        for (FacronBatch *batch = batcher->buckets[i], *next; batch; batch = next)
+        {
+            next = batch->next;
+            facron_timers_cancel (batcher->timers, &batch->timer);
+            facron_batch_free (batch);
+        }
+    }
+
+    free (batcher->buckets);
+    free (batcher);
+}
+
+FacronBatcher *
+facron_batcher_new (FacronTimers   *timers,
+                    FacronExecutor *executor)
+{
+    FacronBatcher *batcher = (FacronBatcher *) calloc (1, sizeof (FacronBatcher));
+
+    batcher->timers = timers;
+    batcher->executor = executor;
+    batcher->size = 64;
+    batcher->buckets = (FacronBatch **) calloc (batcher->size, sizeof (FacronBatch *));
+
+    return batcher;
+}
@@ -0,0 +1,53 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_BATCHER_H__
+#define __FACRON_BATCHER_H__
+
+#include "facron-executor.h"
+#include "facron-timers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * Collects the paths matched by an entry from its first event on, until
+ * window milliseconds passed or max paths got collected, then runs its
+ * command once for all of them. The same path is only collected once.
+ */
+typedef struct FacronBatcher FacronBatcher;
+
+/* owner identifies the entry, across generations */
+void facron_batcher_submit (FacronBatcher       *batcher,
+                            uint64_t             owner,
+                            const FacronCommand *command,
+                            const char          *path,
+                            pid_t                pid,
+                            unsigned int         window,
+                            unsigned int         max);
+
+bool facron_batcher_is_idle (const FacronBatcher *batcher);
+
+void facron_batcher_free (FacronBatcher *batcher);
+
+FacronBatcher *facron_batcher_new (FacronTimers   *timers,
+                                   FacronExecutor *executor);
+
+#endif /* __FACRON_BATCHER_H__ */
@@ -0,0 +1,173 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-builtin.h"
+#include "facron-command.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/* Longest line @log and @fifo write, anything longer is refused */
+#define MAX_LINE_LEN (2 * PATH_MAX)
+
+static const struct
+{
+    const char   *name;
+    FacronBuiltin builtin;
+    int           min_args;
+    int           max_args;
+} builtins[] = {
+    { "@log",   FACRON_BUILTIN_LOG,   2, MAX_CMD_LEN },
+    { "@touch", FACRON_BUILTIN_TOUCH, 2, 2           },
+    { "@fifo",  FACRON_BUILTIN_FIFO,  2, MAX_CMD_LEN },
+    { "@count", FACRON_BUILTIN_COUNT, 1, 2           },
+};
+
+FacronBuiltin
+facron_builtin_lookup (const char *name)
+{
+    for (size_t i = 0; i < sizeof (builtins) / sizeof (*builtins); ++i)
+    {
+        if (!strcmp (builtins[i].name, name))
+            return builtins[i].builtin;
+    }
+
+    return FACRON_BUILTIN_NONE;
+}
+
+bool
+facron_builtin_validate (const char *name,
+                         int         argc)
+{
+    for (size_t i = 0; i < sizeof (builtins) / sizeof (*builtins); ++i)
+    {
+        if (strcmp (builtins[i].name, name))
+            continue;
+
+        if (argc >= builtins[i].min_args && argc <= builtins[i].max_args)
+            return true;
+
+        fprintf (stderr, "Error: wrong number of arguments for %s\n", name);
+        return false;
+    }
+
+    fprintf (stderr, "Error: unknown built-in action: \"%s\"\n", name);
+    return false;
+}
+
+/* The args from argv[2] on, space separated, as a single line */
+static ssize_t
+facron_builtin_format_line (char **argv,
+                            char  *line)
+{
+    char *c = line;
+
+    for (char **arg = &argv[2]; *arg; ++arg)
+    {
+        size_t len = strlen (*arg);
+
+        if (len + 2 > (size_t) (line + MAX_LINE_LEN - c))
+        {
+            fprintf (stderr, "Warning: line too long for %s \"%s\", skipping\n", argv[0], argv[1]);
+            return -1;
+        }
+
+        if (c != line)
+            *c++ = ' ';
+        c = mempcpy (c, *arg, len);
+    }
+    *c++ = '\n';
+
+    return c - line;
+}
+
+/* A single write, so that lines from concurrent events never interleave */
+static bool
+facron_builtin_write_line (char **argv,
+                           int    flags)
+{
+    char line[MAX_LINE_LEN];
+    ssize_t len = facron_builtin_format_line (argv, line);
+    int fd;
+
+    if (len < 0)
+        return false;
+
+    if ((fd = open (argv[1], O_WRONLY|O_CLOEXEC|O_NOCTTY|flags, 0644)) < 0)
+    {
+        /* Nobody reading the fifo is no reason to complain */
+        if (errno != ENXIO)
+            fprintf (stderr, "Warning: could not open \"%s\": %s\n", argv[1], strerror (errno));
+        return false;
+    }
+
+    bool written = (write (fd, line, len) == len);
+
+    if (!written && errno != EAGAIN)
+        fprintf (stderr, "Warning: could not write to \"%s\": %s\n", argv[1], strerror (errno));
+    close (fd);
+
+    return written;
+}
+
+static bool
+facron_builtin_touch (const char *path)
+{
+    int fd;
+
+    if (!utimensat (AT_FDCWD, path, NULL, 0))
+        return true;
+
+    if (errno == ENOENT && (fd = open (path, O_WRONLY|O_CREAT|O_CLOEXEC|O_NOCTTY, 0644)) >= 0)
+    {
+        close (fd);
+        return true;
+    }
+
+    fprintf (stderr, "Warning: could not touch \"%s\": %s\n", path, strerror (errno));
+    return false;
+}
+
+bool
+facron_builtin_run (FacronBuiltin   builtin,
+                    char          **argv)
+{
+    switch (builtin)
+    {
+    case FACRON_BUILTIN_LOG:
+        return facron_builtin_write_line (argv, O_APPEND|O_CREAT);
+    case FACRON_BUILTIN_TOUCH:
+        return facron_builtin_touch (argv[1]);
+    case FACRON_BUILTIN_FIFO:
+        return facron_builtin_write_line (argv, O_NONBLOCK);
+    case FACRON_BUILTIN_COUNT:
+        facron_command_count_add ((argv[1]) ? strtol (argv[1], NULL, 10) : 1);
+        return true;
+    case FACRON_BUILTIN_NONE:
+        break;
+    }
+
+    return false;
+}
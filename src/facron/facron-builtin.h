@@ -0,0 +1,52 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_BUILTIN_H__
+#define __FACRON_BUILTIN_H__
+
+#include <stdbool.h>
+
+/*
+ * Actions run from within facron instead of spawning a process, named by
+ * the first word of the command with a leading '@':
+ *   @log <file> <args>   appends the args, space separated, to file
+ *   @touch <file>        creates file or updates its mtime
+ *   @fifo <fifo> <args>  writes the args as a line to fifo, if read
+ *   @count [delta]       adds delta, 1 by default, to the $= counter
+ */
+typedef enum
+{
+    FACRON_BUILTIN_NONE,
+    FACRON_BUILTIN_LOG,
+    FACRON_BUILTIN_TOUCH,
+    FACRON_BUILTIN_FIFO,
+    FACRON_BUILTIN_COUNT
+} FacronBuiltin;
+
+FacronBuiltin facron_builtin_lookup (const char *name);
+
+/* Checks the name and the number of arguments, argv[0] included */
+bool facron_builtin_validate (const char *name,
+                              int         argc);
+
+/* Any thread, returns false if the action failed */
+bool facron_builtin_run (FacronBuiltin   builtin,
+                         char          **argv);
+
+#endif /* __FACRON_BUILTIN_H__ */
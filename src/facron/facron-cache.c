@@ -0,0 +1,421 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-cache.h"
+#include "facron-glob.h"
+#include "facron-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Bump the last byte whenever the layout of entries, commands or the index changes */
+#define MAGIC     "facron\0\x83"
+#define MAGIC_LEN 8
+
+/* Tells apart machines of another endianness */
+#define BYTE_ORDER_MARK 0x01020304
+
+#define SECTION_ALIGN 8
+
+#define CHECK_THREADS 16
+#define CHECK_SPLIT   64
+
+typedef enum
+{
+    SECTION_ENTRIES,
+    SECTION_INDEX,
+    /* NUL terminated paths, checked again on load */
+    SECTION_READABLE,
+    SECTION_UNREADABLE,
+    N_SECTIONS
+} FacronCacheSection;
+
+typedef struct
+{
+    char     magic[MAGIC_LEN];
+    char     version[24];
+    uint32_t byte_order;
+    uint32_t padding;
+    uint64_t source_size;
+    int64_t  source_mtime_sec;
+    int64_t  source_mtime_nsec;
+    uint64_t source_hash;
+    struct
+    {
+        uint64_t offset;
+        uint64_t size;
+    } sections[N_SECTIONS];
+} FacronCacheHeader;
+
+struct FacronCache
+{
+    const char *map;
+    size_t      size;
+};
+
+static inline const void *
+facron_cache_get_section (const FacronCache  *cache,
+                          FacronCacheSection  section,
+                          size_t             *size)
+{
+    const FacronCacheHeader *header = (const FacronCacheHeader *) cache->map;
+
+    *size = header->sections[section].size;
+    return cache->map + header->sections[section].offset;
+}
+
+const void *
+facron_cache_get_entries (const FacronCache *cache,
+                          size_t            *size)
+{
+    return facron_cache_get_section (cache, SECTION_ENTRIES, size);
+}
+
+const void *
+facron_cache_get_index (const FacronCache *cache,
+                        size_t            *size)
+{
+    return facron_cache_get_section (cache, SECTION_INDEX, size);
+}
+
+uint64_t
+facron_cache_hash (const char *data,
+                   size_t      size)
+{
+    uint64_t hash = FACRON_HASH_INIT ^ size;
+    size_t i = 0;
+
+    for (; i + sizeof (uint64_t) <= size; i += sizeof (uint64_t))
+    {
+        uint64_t word;
+
+        memcpy (&word, data + i, sizeof (word));
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; ++i)
+        hash = facron_hash_step (hash, data[i]);
+
+    return hash;
+}
+
+static void
+facron_cache_header_init (FacronCacheHeader       *header,
+                          const FacronCacheSource *source)
+{
+    memset (header, 0, sizeof (FacronCacheHeader));
+    memcpy (header->magic, MAGIC, MAGIC_LEN);
+    strncpy (header->version, PACKAGE_VERSION, sizeof (header->version) - 1);
+    header->byte_order = BYTE_ORDER_MARK;
+    header->source_size = source->size;
+    header->source_mtime_sec = source->mtime.tv_sec;
+    header->source_mtime_nsec = source->mtime.tv_nsec;
+    header->source_hash = source->hash;
+}
+
+static size_t
+facron_cache_get_paths_size (const char *const *paths,
+                             size_t             n_paths)
+{
+    size_t size = 0;
+
+    for (size_t i = 0; i < n_paths; ++i)
+        size += strlen (paths[i]) + 1;
+
+    return size;
+}
+
+static bool
+facron_cache_write_paths (FILE              *file,
+                          uint64_t          *position,
+                          uint64_t           offset,
+                          const char *const *paths,
+                          size_t             n_paths)
+{
+    static const char zeros[SECTION_ALIGN];
+
+    fwrite (zeros, offset - *position, 1, file);
+
+    for (size_t i = 0; i < n_paths; ++i)
+    {
+        size_t size = strlen (paths[i]) + 1;
+
+        if (fwrite (paths[i], size, 1, file) != 1)
+            return false;
+        offset += size;
+    }
+    *position = offset;
+
+    return true;
+}
+
+static bool
+facron_cache_write_section (FILE       *file,
+                            uint64_t   *position,
+                            uint64_t    offset,
+                            const void *data,
+                            size_t      size)
+{
+    static const char zeros[SECTION_ALIGN];
+
+    fwrite (zeros, offset - *position, 1, file);
+    *position = offset + size;
+
+    return !size || fwrite (data, size, 1, file) == 1;
+}
+
+bool
+facron_cache_save (const char              *path,
+                   const FacronCacheSource *source,
+                   const void              *entries,
+                   size_t                   entries_size,
+                   const void              *index,
+                   size_t                   index_size,
+                   const char *const       *readable,
+                   size_t                   n_readable,
+                   const char *const       *unreadable,
+                   size_t                   n_unreadable)
+{
+    FacronCacheHeader header;
+    size_t sizes[N_SECTIONS] = {
+        entries_size,
+        index_size,
+        facron_cache_get_paths_size (readable, n_readable),
+        facron_cache_get_paths_size (unreadable, n_unreadable)
+    };
+    uint64_t offset = sizeof (FacronCacheHeader);
+    FILE *file = NULL;
+    int fd;
+
+    facron_cache_header_init (&header, source);
+    for (unsigned int s = 0; s < N_SECTIONS; ++s)
+    {
+        offset = (offset + SECTION_ALIGN - 1) & ~((uint64_t) SECTION_ALIGN - 1);
+        header.sections[s].offset = offset;
+        header.sections[s].size = sizes[s];
+        offset += sizes[s];
+    }
+
+    /* Written aside then renamed over, so that a mapped image never changes */
+    char *tmp = (char *) malloc (strlen (path) + sizeof (".XXXXXX"));
+    sprintf (tmp, "%s.XXXXXX", path);
+
+    bool ok = (fd = mkostemp (tmp, O_CLOEXEC)) >= 0 && (file = fdopen (fd, "w"));
+
+    if (ok)
+    {
+        uint64_t position = sizeof (FacronCacheHeader);
+
+        ok = fwrite (&header, sizeof (FacronCacheHeader), 1, file) == 1 &&
+             facron_cache_write_section (file, &position, header.sections[SECTION_ENTRIES].offset, entries, entries_size) &&
+             facron_cache_write_section (file, &position, header.sections[SECTION_INDEX].offset, index, index_size) &&
+             facron_cache_write_paths (file, &position, header.sections[SECTION_READABLE].offset, readable, n_readable) &&
+             facron_cache_write_paths (file, &position, header.sections[SECTION_UNREADABLE].offset, unreadable, n_unreadable);
+
+        ok = ok && !fflush (file) && !fdatasync (fd);
+    }
+
+    if (file)
+        ok = !fclose (file) && ok;
+    else if (fd >= 0)
+        close (fd);
+
+    if (!ok || rename (tmp, path) < 0)
+    {
+        fprintf (stderr, "Error: could not save compiled configuration \"%s\": %s\n", path, strerror (errno));
+        if (fd >= 0)
+            unlink (tmp);
+        ok = false;
+    }
+
+    free (tmp);
+
+    return ok;
+}
+
+static bool
+facron_cache_check_sections (const FacronCacheHeader *header,
+                             size_t                   size)
+{
+    for (unsigned int s = 0; s < N_SECTIONS; ++s)
+    {
+        uint64_t offset = header->sections[s].offset;
+
+        if (offset % SECTION_ALIGN || offset < sizeof (FacronCacheHeader) || offset > size || header->sections[s].size > size - offset)
+            return false;
+    }
+
+    for (unsigned int s = SECTION_READABLE; s <= SECTION_UNREADABLE; ++s)
+    {
+        uint64_t offset = header->sections[s].offset;
+        uint64_t n = header->sections[s].size;
+
+        if (n && ((const char *) header)[offset + n - 1])
+            return false;
+    }
+
+    return true;
+}
+
+typedef struct
+{
+    const char  **paths;
+    size_t        n_readable;
+    /* Of a path which is no longer as it was, SIZE_MAX while there is none */
+    atomic_size_t changed;
+} FacronCacheCheck;
+
+static void
+facron_cache_check_path (size_t  i,
+                         void   *data)
+{
+    FacronCacheCheck *check = (FacronCacheCheck *) data;
+
+    /* Any of them is enough to compile again, the others may wait on slow filesystems */
+    if (atomic_load_explicit (&check->changed, memory_order_relaxed) != SIZE_MAX)
+        return;
+
+    if (facron_glob_is_readable (check->paths[i]) != (i < check->n_readable))
+        atomic_store_explicit (&check->changed, i, memory_order_relaxed);
+}
+
+static size_t
+facron_cache_collect_paths (const FacronCache  *cache,
+                            FacronCacheSection  section,
+                            const char        **paths,
+                            size_t              n_paths)
+{
+    size_t size;
+    const char *path = (const char *) facron_cache_get_section (cache, section, &size);
+
+    for (const char *end = path + size; path < end; path += strlen (path) + 1)
+        paths[n_paths++] = path;
+
+    return n_paths;
+}
+
+/*
+ * Entries were kept or skipped by whether their path was readable, which
+ * should still be the case. The paths get checked like on compilation.
+ */
+static bool
+facron_cache_check_paths (const FacronCache *cache)
+{
+    size_t readable_size, unreadable_size;
+    FacronCacheCheck check;
+
+    facron_cache_get_section (cache, SECTION_READABLE, &readable_size);
+    facron_cache_get_section (cache, SECTION_UNREADABLE, &unreadable_size);
+
+    /* Each path takes at least two bytes with its NUL */
+    check.paths = (const char **) malloc (((readable_size + unreadable_size) / 2 + 1) * sizeof (char *));
+    check.n_readable = facron_cache_collect_paths (cache, SECTION_READABLE, check.paths, 0);
+    size_t n_paths = facron_cache_collect_paths (cache, SECTION_UNREADABLE, check.paths, check.n_readable);
+    atomic_init (&check.changed, SIZE_MAX);
+
+    facron_util_parallel_for (n_paths, CHECK_SPLIT, CHECK_THREADS, facron_cache_check_path, &check);
+
+    size_t changed = atomic_load (&check.changed);
+
+    if (changed != SIZE_MAX)
+        fprintf (stderr, "Notice: \"%s\" %s, compiling the configuration again\n", check.paths[changed],
+                 (changed < check.n_readable) ? "is no longer readable" : "became readable");
+
+    free (check.paths);
+
+    return changed == SIZE_MAX;
+}
+
+void
+facron_cache_free (FacronCache *cache)
+{
+    if (!cache)
+        return;
+
+    munmap ((void *) cache->map, cache->size);
+    free (cache);
+}
+
+FacronCache *
+facron_cache_load (const char              *path,
+                   const FacronCacheSource *source)
+{
+    FacronCacheHeader expected;
+    struct stat st;
+    int fd;
+
+    if ((fd = open (path, O_RDONLY|O_CLOEXEC)) < 0)
+    {
+        if (errno != ENOENT)
+            fprintf (stderr, "Warning: could not open compiled configuration \"%s\": %s\n", path, strerror (errno));
+        return NULL;
+    }
+
+    /* It is trusted as much as the configuration itself */
+    if (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode) || st.st_uid != geteuid () || (st.st_mode & (S_IWGRP|S_IWOTH)))
+    {
+        fprintf (stderr, "Warning: ignoring compiled configuration \"%s\", it should be a regular file only its owner can write\n", path);
+        close (fd);
+        return NULL;
+    }
+
+    void *map = (st.st_size >= (off_t) sizeof (FacronCacheHeader)) ? mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    const FacronCacheHeader *header = (map != MAP_FAILED) ? (const FacronCacheHeader *) map : NULL;
+
+    close (fd);
+    facron_cache_header_init (&expected, source);
+
+    if (!header || memcmp (header, &expected, offsetof (FacronCacheHeader, source_size)))
+        fprintf (stderr, "Notice: compiled configuration \"%s\" is invalid or from another version of facron, ignoring it\n", path);
+    else if (!facron_cache_check_sections (header, st.st_size))
+        fprintf (stderr, "Warning: compiled configuration \"%s\" is corrupted, ignoring it\n", path);
+    else if (memcmp (&header->source_size, &expected.source_size, offsetof (FacronCacheHeader, sections) - offsetof (FacronCacheHeader, source_size)))
+        fprintf (stderr, "Notice: compiled configuration \"%s\" is out of date\n", path);
+    else
+    {
+        FacronCache *cache = (FacronCache *) calloc (1, sizeof (FacronCache));
+
+        cache->map = (const char *) map;
+        cache->size = st.st_size;
+
+        if (facron_cache_check_paths (cache))
+        {
+            fprintf (stderr, "Notice: using compiled configuration \"%s\"\n", path);
+            return cache;
+        }
+
+        free (cache);
+    }
+
+    if (header)
+        munmap (map, st.st_size);
+
+    return NULL;
+}
@@ -0,0 +1,71 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_CACHE_H__
+#define __FACRON_CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * A compiled configuration saved as a single file: the entries, their
+ * index and the entry paths, by whether they were readable, which get
+ * checked again on load. Images are
+ * tied to the exact content of their source file and to the build of
+ * facron which wrote them, then get mapped and used in place.
+ */
+typedef struct FacronCache FacronCache;
+
+typedef struct
+{
+    size_t          size;
+    struct timespec mtime;
+    uint64_t        hash;
+} FacronCacheSource;
+
+/* Of the whole content of a source file, a word at a time */
+uint64_t facron_cache_hash (const char *data,
+                            size_t      size);
+
+const void *facron_cache_get_entries (const FacronCache *cache,
+                                      size_t            *size);
+const void *facron_cache_get_index   (const FacronCache *cache,
+                                      size_t            *size);
+
+/* Replaces the image at path atomically */
+bool facron_cache_save (const char              *path,
+                        const FacronCacheSource *source,
+                        const void              *entries,
+                        size_t                   entries_size,
+                        const void              *index,
+                        size_t                   index_size,
+                        const char *const       *readable,
+                        size_t                   n_readable,
+                        const char *const       *unreadable,
+                        size_t                   n_unreadable);
+
+void facron_cache_free (FacronCache *cache);
+
+/* NULL unless the image was compiled from that source and is still accurate */
+FacronCache *facron_cache_load (const char              *path,
+                                const FacronCacheSource *source);
+
+#endif /* __FACRON_CACHE_H__ */
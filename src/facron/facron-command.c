@@ -0,0 +1,385 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2012-2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-command.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef enum
+{
+    ARG_LITERAL,
+    ARG_PATH,
+    ARG_DIRNAME,
+    ARG_BASENAME,
+    ARG_PID,
+    ARG_COUNT_INC,
+    ARG_COUNT_DEC,
+    ARG_COUNT
+} FacronArgKind;
+
+typedef struct
+{
+    uint32_t kind;
+    uint32_t offset;
+} FacronArg;
+
+struct FacronCommand
+{
+    uint32_t  size;
+    uint32_t  argc;
+    uint32_t  builtin;
+    uint32_t  stream;
+    FacronArg args[];
+    /* followed by the literal arguments */
+};
+
+static const struct
+{
+    const char   *token;
+    FacronArgKind kind;
+} substitutions[] = {
+    { "$$", ARG_PATH      },
+    { "$@", ARG_DIRNAME   },
+    { "$#", ARG_BASENAME  },
+    { "$*", ARG_PID       },
+    { "$+", ARG_COUNT_INC },
+    { "$-", ARG_COUNT_DEC },
+    { "$=", ARG_COUNT     },
+};
+
+static atomic_uint count;
+
+static FacronArgKind
+facron_command_get_kind (const char *field)
+{
+    for (size_t i = 0; i < sizeof (substitutions) / sizeof (*substitutions); ++i)
+    {
+        if (!strcmp (substitutions[i].token, field))
+            return substitutions[i].kind;
+    }
+
+    return ARG_LITERAL;
+}
+
+size_t
+facron_command_measure (char             **argv,
+                        int                argc,
+                        FacronStreamFormat stream)
+{
+    size_t size = sizeof (FacronCommand) + argc * sizeof (FacronArg);
+
+    for (int i = 0; i < argc; ++i)
+    {
+        if (stream || facron_command_get_kind (argv[i]) == ARG_LITERAL)
+            size += strlen (argv[i]) + 1;
+    }
+
+    return size;
+}
+
+void
+facron_command_compile (FacronCommand     *command,
+                        char             **argv,
+                        int                argc,
+                        FacronStreamFormat stream)
+{
+    char *str = (char *) &command->args[argc];
+
+    command->argc = argc;
+    command->builtin = (argc && !stream) ? facron_builtin_lookup (argv[0]) : FACRON_BUILTIN_NONE;
+    command->stream = stream;
+
+    for (int i = 0; i < argc; ++i)
+    {
+        command->args[i].kind = (stream) ? ARG_LITERAL : facron_command_get_kind (argv[i]);
+        command->args[i].offset = 0;
+
+        if (command->args[i].kind == ARG_LITERAL)
+        {
+            command->args[i].offset = str - (char *) command;
+            str = stpcpy (str, argv[i]) + 1;
+        }
+    }
+
+    command->size = str - (char *) command;
+}
+
+size_t
+facron_command_get_size (const FacronCommand *command)
+{
+    return command->size;
+}
+
+FacronBuiltin
+facron_command_get_builtin (const FacronCommand *command)
+{
+    return command->builtin;
+}
+
+FacronStreamFormat
+facron_command_get_stream (const FacronCommand *command)
+{
+    return command->stream;
+}
+
+unsigned int
+facron_command_count_add (int delta)
+{
+    return atomic_fetch_add (&count, delta) + delta;
+}
+
+const char *
+facron_command_dirname (const char *filename,
+                        size_t     *len)
+{
+    const char *c = strrchr (filename, '/');
+
+    if (c && c[1] == '\0')
+    {
+        while (c != filename && c[-1] == '/')
+            --c;
+        if (c == filename)
+        {
+            *len = 1;
+            return "/";
+        }
+        c = memrchr (filename, '/', c - filename);
+    }
+
+    if (!c)
+    {
+        *len = 1;
+        return ".";
+    }
+
+    while (c != filename && c[-1] == '/')
+        --c;
+
+    if (c != filename)
+    {
+        *len = c - filename;
+        return filename;
+    }
+
+    *len = (filename[1] == '/') ? 2 : 1;
+    return "//";
+}
+
+bool
+facron_command_expand (const FacronCommand *command,
+                       const char          *path,
+                       pid_t                pid,
+                       char                *scratch,
+                       size_t               size,
+                       char                *argv[MAX_CMD_LEN])
+{
+    char *end = scratch + size;
+    char *dirname = NULL;
+    char *pidstr = NULL;
+
+    for (uint32_t i = 0; i < command->argc; ++i)
+    {
+        const FacronArg *arg = &command->args[i];
+        int len = 0;
+
+        switch (arg->kind)
+        {
+        case ARG_LITERAL:
+            argv[i] = (char *) command + arg->offset;
+            continue;
+        case ARG_PATH:
+            argv[i] = (char *) path;
+            continue;
+        case ARG_BASENAME:
+        {
+            const char *bn = strrchr (path, '/');
+            argv[i] = (char *) (bn ? bn + 1 : path);
+            continue;
+        }
+        case ARG_DIRNAME:
+            if (!dirname)
+            {
+                size_t dir_len;
+                const char *dir = facron_command_dirname (path, &dir_len);
+
+                if (dir_len >= (size_t) (end - scratch))
+                    return false;
+                dirname = memcpy (scratch, dir, dir_len);
+                dirname[dir_len] = '\0';
+                scratch += dir_len + 1;
+            }
+            argv[i] = dirname;
+            continue;
+        case ARG_PID:
+            if (!pidstr)
+            {
+                if ((len = snprintf (scratch, end - scratch, "%d", pid)) >= end - scratch)
+                    return false;
+                pidstr = scratch;
+                scratch += len + 1;
+            }
+            argv[i] = pidstr;
+            continue;
+        case ARG_COUNT_INC:
+            len = snprintf (scratch, end - scratch, "%u", atomic_fetch_add (&count, 1) + 1);
+            break;
+        case ARG_COUNT_DEC:
+            len = snprintf (scratch, end - scratch, "%u", atomic_fetch_sub (&count, 1) - 1);
+            break;
+        case ARG_COUNT:
+            len = snprintf (scratch, end - scratch, "%u", atomic_load (&count));
+            break;
+        }
+
+        if (len >= end - scratch)
+            return false;
+        argv[i] = scratch;
+        scratch += len + 1;
+    }
+
+    argv[command->argc] = NULL;
+
+    return true;
+}
+
+/* What an argument costs on the command line, for ARG_MAX */
+static inline size_t
+facron_command_arg_cost (size_t len)
+{
+    return len + 1 + sizeof (char *);
+}
+
+/* Room for a numeric substitution */
+#define NUMBER_SIZE 12
+
+size_t
+facron_command_expand_paths (const FacronCommand *command,
+                             char *const         *paths,
+                             size_t               n_paths,
+                             pid_t                pid,
+                             char                *scratch,
+                             size_t               size,
+                             char               **argv,
+                             size_t               max_argv,
+                             size_t               limit)
+{
+    size_t cost = 0, argc = 0, n_path_args = 0, n_dirname_args = 0, n = 0;
+
+    for (uint32_t i = 0; i < command->argc; ++i)
+    {
+        const FacronArg *arg = &command->args[i];
+
+        if (arg->kind == ARG_LITERAL)
+            cost += facron_command_arg_cost (strlen ((char *) command + arg->offset));
+        else if (arg->kind == ARG_PID || arg->kind >= ARG_COUNT_INC)
+            cost += facron_command_arg_cost (NUMBER_SIZE);
+        else
+        {
+            ++n_path_args;
+            if (arg->kind == ARG_DIRNAME)
+                ++n_dirname_args;
+            continue;
+        }
+        ++argc;
+    }
+
+    /* The numeric substitutions go first in scratch, the dirnames after them */
+    size_t used = command->argc * NUMBER_SIZE;
+
+    for (; n < n_paths; ++n)
+    {
+        size_t dir_len = 0;
+
+        if (n_dirname_args)
+            facron_command_dirname (paths[n], &dir_len);
+
+        size_t path_cost = n_path_args * facron_command_arg_cost (strlen (paths[n]));
+        size_t path_used = n_dirname_args * (dir_len + 1);
+
+        if (cost + path_cost > limit || used + path_used > size || argc + n_path_args >= max_argv)
+            break;
+
+        cost += path_cost;
+        used += path_used;
+        argc += n_path_args;
+    }
+
+    if (!n)
+        return 0;
+
+    char *dirs = scratch + command->argc * NUMBER_SIZE;
+    size_t a = 0;
+
+    for (uint32_t i = 0; i < command->argc; ++i)
+    {
+        const FacronArg *arg = &command->args[i];
+        int len = 0;
+
+        switch (arg->kind)
+        {
+        case ARG_LITERAL:
+            argv[a++] = (char *) command + arg->offset;
+            continue;
+        case ARG_PATH:
+            for (size_t p = 0; p < n; ++p)
+                argv[a++] = paths[p];
+            continue;
+        case ARG_BASENAME:
+            for (size_t p = 0; p < n; ++p)
+            {
+                const char *bn = strrchr (paths[p], '/');
+                argv[a++] = (char *) (bn ? bn + 1 : paths[p]);
+            }
+            continue;
+        case ARG_DIRNAME:
+            for (size_t p = 0; p < n; ++p)
+            {
+                size_t dir_len;
+                const char *dir = facron_command_dirname (paths[p], &dir_len);
+
+                argv[a++] = memcpy (dirs, dir, dir_len);
+                dirs[dir_len] = '\0';
+                dirs += dir_len + 1;
+            }
+            continue;
+        case ARG_PID:
+            len = snprintf (scratch, NUMBER_SIZE, "%d", pid);
+            break;
+        case ARG_COUNT_INC:
+            len = snprintf (scratch, NUMBER_SIZE, "%u", atomic_fetch_add (&count, 1) + 1);
+            break;
+        case ARG_COUNT_DEC:
+            len = snprintf (scratch, NUMBER_SIZE, "%u", atomic_fetch_sub (&count, 1) - 1);
+            break;
+        case ARG_COUNT:
+            len = snprintf (scratch, NUMBER_SIZE, "%u", atomic_load (&count));
+            break;
+        }
+
+        argv[a++] = scratch;
+        scratch += len + 1;
+    }
+
+    argv[a] = NULL;
+
+    return n;
+}
@@ -0,0 +1,101 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2012-2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_COMMAND_H__
+#define __FACRON_COMMAND_H__
+
+#include "facron-builtin.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include <linux/limits.h>
+
+#define MAX_CMD_LEN 512
+
+/* Room for a dirname and the numeric substitutions of a full command */
+#define FACRON_COMMAND_SCRATCH_SIZE (PATH_MAX + MAX_CMD_LEN * 12)
+
+/* How events are written to the stdin of a stream handler, one record each */
+typedef enum
+{
+    FACRON_STREAM_NONE,
+    FACRON_STREAM_LINES,
+    FACRON_STREAM_NUL
+} FacronStreamFormat;
+
+/*
+ * A command line with its $ substitutions resolved at parse time. It is
+ * a single relocatable block, never modified once compiled, which can be
+ * copied around with memcpy.
+ */
+typedef struct FacronCommand FacronCommand;
+
+/*
+ * Stream handlers get the events on their stdin, their command line is
+ * taken literally.
+ */
+size_t facron_command_measure (char             **argv,
+                               int                argc,
+                               FacronStreamFormat stream);
+void   facron_command_compile (FacronCommand     *command,
+                               char             **argv,
+                               int                argc,
+                               FacronStreamFormat stream);
+
+size_t             facron_command_get_size    (const FacronCommand *command);
+FacronBuiltin      facron_command_get_builtin (const FacronCommand *command);
+FacronStreamFormat facron_command_get_stream  (const FacronCommand *command);
+
+/* Same rules as dirname(1), the result is the first *len bytes */
+const char *facron_command_dirname (const char *filename,
+                                    size_t     *len);
+
+/* Adds delta to the counter behind $+, $- and $=, returns its new value */
+unsigned int facron_command_count_add (int delta);
+
+/*
+ * Fills argv, NULL terminated, with pointers into the command, path and
+ * scratch. Returns false if scratch is too small.
+ */
+bool facron_command_expand (const FacronCommand *command,
+                            const char          *path,
+                            pid_t                pid,
+                            char                *scratch,
+                            size_t               size,
+                            char                *argv[MAX_CMD_LEN]);
+
+/*
+ * Same, with $$, $@ and $# expanded once for each path, in order. Takes as
+ * many of the first paths as fit in scratch, in max_argv arguments and in
+ * limit bytes of command line as execve counts them. Returns how many, 0
+ * if not even one fits.
+ */
+size_t facron_command_expand_paths (const FacronCommand *command,
+                                    char *const         *paths,
+                                    size_t               n_paths,
+                                    pid_t                pid,
+                                    char                *scratch,
+                                    size_t               size,
+                                    char               **argv,
+                                    size_t               max_argv,
+                                    size_t               limit);
+
+#endif /* __FACRON_COMMAND_H__ */
@@ -18,127 +18,512 @@
  */
 
 #include "facron-conf-entry.h"
+#include "facron-glob.h"
+#include "facron-metrics.h"
+#include "facron-permission.h"
 #include "facron-util.h"
 
-#include <fcntl.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Entries are laid out back to back in the arena of their generation: the
+ * fixed header, the mask groups, the compiled command, the path and
+ * finally the pattern if any, the path then being its root. Every reference is an offset from the entry itself so that a
+ * whole generation can be moved around as a single block.
+ */
 struct FacronConfEntry
 {
-    FacronConfEntry   *next;
+    uint32_t           next;
+    uint32_t           id;
+    uint32_t           command;
+    uint32_t           path;
+    uint32_t           path_len;
+    /* 0 unless the entry is a pattern */
+    uint32_t           pattern;
+    uint32_t           debounce;
+    uint32_t           batch;
+    uint32_t           batch_max;
+    uint64_t           hash;
+    uint64_t           limit_interval;
+    uint32_t           limit_burst;
+    uint32_t           limit_policy;
+    unsigned long long mask_union;
+    uint32_t           mark_type;
+    uint32_t           n_masks;
+    bool               debounce_leading;
+    bool               ignore_own;
+    unsigned long long mask[];
+};
+
+struct FacronConfEntryBuilder
+{
+    FacronArena       *arena;
+    size_t             last;
+    unsigned int       n_entries;
     char              *path;
     unsigned long long mask[MAX_MASK_LEN];
+    /* Masks set so far, to only clear those */
+    int                n_masks;
     char              *command[MAX_CMD_LEN];
     int                n_command;
+    unsigned int       debounce;
+    bool               debounce_leading;
+    bool               ignore_own;
+    unsigned int       batch;
+    unsigned int       batch_max;
+    uint64_t           limit_interval;
+    unsigned int       limit_burst;
+    FacronLimitPolicy  limit_policy;
+    unsigned int       mark_type;
+    FacronStreamFormat stream;
 };
 
-typedef struct CommandBackup CommandBackup;
-struct CommandBackup
+static inline const char *
+facron_conf_entry_get_string (const FacronConfEntry *entry,
+                              uint32_t               offset)
 {
-    int            index;
-    char          *field;
-    CommandBackup *next;
-};
+    return (const char *) entry + offset;
+}
 
 const FacronConfEntry *
 facron_conf_entry_get_next (const FacronConfEntry *entry)
 {
-    return (entry) ? entry->next : NULL;
+    return (entry && entry->next) ? (const FacronConfEntry *) ((const char *) entry + entry->next) : NULL;
 }
 
-void
-facron_conf_entry_apply_mask (FacronConfEntry   *entry,
-                              int                n_mask,
-                              unsigned long long mask)
+const char *
+facron_conf_entry_get_path (const FacronConfEntry *entry)
 {
-    entry->mask[n_mask] |= mask;
+    return facron_conf_entry_get_string (entry, entry->path);
 }
 
-void
-facron_conf_entry_add_command (FacronConfEntry *entry,
-                               char            *command)
+size_t
+facron_conf_entry_get_path_len (const FacronConfEntry *entry)
+{
+    return entry->path_len;
+}
+
+const char *
+facron_conf_entry_get_pattern (const FacronConfEntry *entry)
+{
+    return (entry->pattern) ? facron_conf_entry_get_string (entry, entry->pattern) : NULL;
+}
+
+uint64_t
+facron_conf_entry_get_hash (const FacronConfEntry *entry)
 {
-    entry->command[entry->n_command++] = command;
+    return entry->hash;
+}
+
+unsigned int
+facron_conf_entry_get_id (const FacronConfEntry *entry)
+{
+    return entry->id;
+}
+
+const FacronCommand *
+facron_conf_entry_get_command (const FacronConfEntry *entry)
+{
+    return (const FacronCommand *) facron_conf_entry_get_string (entry, entry->command);
+}
+
+unsigned int
+facron_conf_entry_get_mark_type (const FacronConfEntry *entry)
+{
+    return entry->mark_type;
 }
 
 bool
-facron_conf_entry_validate (const FacronConfEntry *entry)
+facron_conf_entry_is_recursive (const FacronConfEntry *entry)
 {
-    return entry && entry->mask[0];
+    return entry->mark_type != FAN_MARK_INODE;
 }
 
-void
-facron_conf_entry_apply (const FacronConfEntry *entry,
-                         int                    fanotify_fd,
-                         int                    flag,
-                         bool                   notice)
+unsigned long long
+facron_conf_entry_get_mask (const FacronConfEntry *entry)
 {
-    if (notice)
-        fprintf (stderr, "Notice: tracking \"%s\"\n", entry->path);
+    return entry->mask_union;
+}
+
+unsigned long long
+facron_conf_entry_get_child_mask (const FacronConfEntry *entry)
+{
+    unsigned long long mask = 0;
 
-    for (int i = 0; i < MAX_MASK_LEN && entry->mask[i]; ++i)
-        fanotify_mark (fanotify_fd, flag, entry->mask[i], AT_FDCWD, entry->path);
+    for (unsigned int i = 0; i < entry->n_masks; ++i)
+    {
+        if (entry->mask[i] & FAN_EVENT_ON_CHILD)
+            mask |= (entry->mask[i] & ~FAN_EVENT_ON_CHILD);
+    }
+
+    return mask;
 }
 
-void
+bool
+facron_conf_entry_has_limit (const FacronConfEntry *entry)
+{
+    return entry->limit_interval;
+}
+
+/*
+ * Identifies the entry for batches and debounce, which outlive a reload,
+ * unlike its address which the next generation may reuse.
+ */
+static inline uint64_t
+facron_conf_entry_get_owner (const FacronConfEntry *entry,
+                             const FacronEvent     *event)
+{
+    return ((uint64_t) event->generation << 32) | entry->id;
+}
+
+/* Returns false if the event got ignored, or a rate limit dropped or coalesced it */
+static inline bool
+facron_conf_entry_run (const FacronConfEntry *entry,
+                       FacronLimit           *limit,
+                       FacronExecutor        *executor,
+                       const FacronEvent     *event)
+{
+    const FacronCommand *command = facron_conf_entry_get_command (entry);
+    uint64_t deadline = 0;
+
+    if (entry->ignore_own && facron_executor_is_own (executor, event->metadata->pid))
+    {
+        facron_metrics_inc (FACRON_METRIC_OWN_EVENTS);
+        return false;
+    }
+
+    /* Permission events are answered one by one, limits, batches and debounce don't apply */
+    if (event->verdict)
+        return facron_verdict_add (event->verdict, command, event->path, event->metadata->pid);
+
+    if (entry->limit_interval && !facron_limit_admit (limit, entry->limit_interval, entry->limit_burst, entry->limit_policy, &deadline))
+        return false;
+
+    if (deadline)
+        facron_executor_defer (executor, command, event->path, event->metadata->pid, deadline);
+    else if (entry->batch)
+        facron_executor_batch (executor, facron_conf_entry_get_owner (entry, event), command, event->path, event->metadata->pid, entry->batch, entry->batch_max);
+    else if (entry->debounce)
+        facron_executor_debounce (executor, facron_conf_entry_get_owner (entry, event), command, event->path, event->metadata->pid, entry->debounce, entry->debounce_leading);
+    else
+        facron_executor_run (executor, command, event->path, event->metadata->pid, event->stamp);
+
+    return true;
+}
+
+unsigned int
 facron_conf_entry_handle (const FacronConfEntry *entry,
-                          const char            *path,
-                          size_t                 path_len,
-                          const FacronMetadata  *metadata)
+                          FacronLimit           *limit,
+                          FacronExecutor        *executor,
+                          const FacronEvent     *event)
 {
-    if (!strcmp (entry->path, path))
+    unsigned long long mask = event->metadata->mask;
+    unsigned int n = 0;
+
+    if (!(entry->mask_union & mask))
+        return 0;
+
+    for (unsigned int i = 0; i < entry->n_masks; ++i)
     {
-        for (int i = 0; i < MAX_MASK_LEN && entry->mask[i]; ++i)
+        if ((entry->mask[i] & mask) == entry->mask[i])
         {
-            if ((entry->mask[i] & metadata->mask) == entry->mask[i])
-                facron_exec_command ((char **) entry->command, path, metadata->pid);
+            if (facron_conf_entry_run (entry, limit, executor, event))
+                ++n;
         }
     }
-    else
+
+    return n;
+}
+
+unsigned int
+facron_conf_entry_handle_child (const FacronConfEntry *entry,
+                                FacronLimit           *limit,
+                                FacronExecutor        *executor,
+                                const FacronEvent     *event)
+{
+    unsigned long long mask = event->metadata->mask;
+    unsigned int n = 0;
+
+    if (!(entry->mask_union & mask))
+        return 0;
+
+    for (unsigned int i = 0; i < entry->n_masks; ++i)
     {
-        size_t plen = strlen (entry->path);
-        for (int i = 0; i < MAX_MASK_LEN && entry->mask[i]; ++i)
+        if ((entry->mask[i] & FAN_EVENT_ON_CHILD) &&
+            (entry->mask[i] & mask) == (entry->mask[i] & ~FAN_EVENT_ON_CHILD))
         {
-            if ((entry->mask[i] & FAN_EVENT_ON_CHILD) &&
-                (size_t)path_len >= plen &&
-                (entry->path[plen - 1] == '/' || path[plen] == '/') &&
-                !memcmp (entry->path, path, plen) &&
-                (entry->mask[i] & metadata->mask) == (entry->mask[i] & ~FAN_EVENT_ON_CHILD))
-                    facron_exec_command ((char **) entry->command, path, metadata->pid);
+            if (facron_conf_entry_run (entry, limit, executor, event))
+                ++n;
         }
     }
+
+    return n;
+}
+
+unsigned int
+facron_conf_entry_handle_tree (const FacronConfEntry *entry,
+                               FacronLimit           *limit,
+                               FacronExecutor        *executor,
+                               const FacronEvent     *event)
+{
+    unsigned long long mask = event->metadata->mask;
+    unsigned int n = 0;
+
+    if (!(entry->mask_union & mask))
+        return 0;
+
+    for (unsigned int i = 0; i < entry->n_masks; ++i)
+    {
+        if ((entry->mask[i] & mask) == (entry->mask[i] & ~FAN_EVENT_ON_CHILD))
+        {
+            if (facron_conf_entry_run (entry, limit, executor, event))
+                ++n;
+        }
+    }
+
+    return n;
+}
+
+const FacronConfEntry *
+facron_conf_entries_get_first (const FacronArena *entries)
+{
+    return (entries && facron_arena_get_size (entries)) ? (const FacronConfEntry *) facron_arena_get (entries, 0) : NULL;
+}
+
+unsigned int
+facron_conf_entries_count (const FacronArena *entries)
+{
+    unsigned int n = 0;
+
+    for (const FacronConfEntry *entry = facron_conf_entries_get_first (entries); entry; entry = facron_conf_entry_get_next (entry))
+        ++n;
+
+    return n;
+}
+
+void
+facron_conf_entries_free (FacronArena *entries)
+{
+    facron_arena_free (entries);
+}
+
+void
+facron_conf_entry_builder_start (FacronConfEntryBuilder *builder,
+                                 char                   *path)
+{
+    facron_conf_entry_builder_discard (builder);
+    builder->path = path;
+}
+
+void
+facron_conf_entry_builder_apply_mask (FacronConfEntryBuilder *builder,
+                                      int                     n_mask,
+                                      unsigned long long      mask)
+{
+    builder->mask[n_mask] |= mask;
+    if (n_mask >= builder->n_masks)
+        builder->n_masks = n_mask + 1;
+}
+
+void
+facron_conf_entry_builder_add_command (FacronConfEntryBuilder *builder,
+                                       char                   *command)
+{
+    builder->command[builder->n_command++] = command;
+}
+
+void
+facron_conf_entry_builder_set_debounce (FacronConfEntryBuilder *builder,
+                                        unsigned int            window,
+                                        bool                    leading)
+{
+    builder->debounce = window;
+    builder->debounce_leading = leading;
+}
+
+void
+facron_conf_entry_builder_set_batch (FacronConfEntryBuilder *builder,
+                                     unsigned int            window,
+                                     unsigned int            max)
+{
+    builder->batch = window;
+    builder->batch_max = max;
+}
+
+void
+facron_conf_entry_builder_set_ignore_own (FacronConfEntryBuilder *builder)
+{
+    builder->ignore_own = true;
+}
+
+void
+facron_conf_entry_builder_set_limit (FacronConfEntryBuilder *builder,
+                                     uint64_t                interval,
+                                     unsigned int            burst,
+                                     FacronLimitPolicy       policy)
+{
+    builder->limit_interval = interval;
+    builder->limit_burst = burst;
+    builder->limit_policy = policy;
+}
+
+void
+facron_conf_entry_builder_set_stream (FacronConfEntryBuilder *builder,
+                                      FacronStreamFormat      format)
+{
+    builder->stream = format;
 }
 
 void
-facron_conf_entry_free (FacronConfEntry *entry)
+facron_conf_entry_builder_set_recursive (FacronConfEntryBuilder *builder,
+                                         unsigned int            mark_type)
 {
-    free (entry->path);
-    for (int i = 0; i < MAX_CMD_LEN && entry->command[i]; ++i)
-        free (entry->command[i]);
-    free (entry);
+    builder->mark_type = mark_type;
+}
+
+bool
+facron_conf_entry_builder_validate (const FacronConfEntryBuilder *builder)
+{
+    return builder->path && builder->mask[0];
 }
 
 void
-facron_conf_entries_free (FacronConfEntry *entry)
+facron_conf_entry_builder_commit (FacronConfEntryBuilder *builder)
 {
-    while (entry)
+    size_t n_masks = 0;
+    const char *path = builder->path;
+    size_t path_len = strlen (path);
+    size_t pattern_len = 0;
+    char *root = NULL;
+    size_t command_size = facron_command_measure (builder->command, builder->n_command, builder->stream);
+
+    while (n_masks < MAX_MASK_LEN && builder->mask[n_masks])
+        ++n_masks;
+
+    /* Patterns are watched from their root, events never come with a trailing slash */
+    if (facron_glob_is_pattern (builder->path))
+    {
+        pattern_len = path_len;
+        while (pattern_len > 1 && builder->path[pattern_len - 1] == '/')
+            --pattern_len;
+
+        root = (char *) malloc (path_len + 1);
+        path_len = facron_glob_copy_root (builder->path, root);
+        path = root;
+    }
+
+    size_t offset = facron_arena_alloc (builder->arena, sizeof (FacronConfEntry) + n_masks * sizeof (unsigned long long) + command_size +
+                                                        path_len + 1 + ((pattern_len) ? pattern_len + 1 : 0));
+    FacronConfEntry *entry = (FacronConfEntry *) facron_arena_get (builder->arena, offset);
+    FacronCommand *command = (FacronCommand *) (entry->mask + n_masks);
+
+    facron_command_compile (command, builder->command, builder->n_command, builder->stream);
+
+    entry->id = builder->n_entries++;
+    entry->command = (char *) command - (char *) entry;
+    entry->path = entry->command + command_size;
+    entry->path_len = path_len;
+    entry->hash = facron_hash (path, path_len);
+    entry->debounce = builder->debounce;
+    entry->debounce_leading = builder->debounce_leading;
+    entry->ignore_own = builder->ignore_own;
+    entry->batch = builder->batch;
+    entry->batch_max = builder->batch_max;
+    entry->limit_interval = builder->limit_interval;
+    entry->limit_burst = builder->limit_burst;
+    entry->limit_policy = builder->limit_policy;
+    entry->mark_type = builder->mark_type;
+    entry->n_masks = n_masks;
+
+    for (size_t i = 0; i < n_masks; ++i)
     {
-        FacronConfEntry *next = entry->next;
-        facron_conf_entry_free (entry);
-        entry = next;
+        entry->mask[i] = builder->mask[i];
+        entry->mask_union |= builder->mask[i];
     }
+
+    memcpy ((char *) entry + entry->path, path, path_len + 1);
+
+    if (pattern_len)
+    {
+        char *pattern = (char *) entry + entry->path + path_len + 1;
+
+        memcpy (pattern, builder->path, pattern_len);
+        pattern[pattern_len] = '\0';
+        entry->pattern = pattern - (char *) entry;
+
+        /*
+         * Children of the root get reported by an inode mark, anything
+         * deeper needs the events of the whole mount.
+         */
+        if (!facron_glob_is_deep (pattern))
+        {
+            for (size_t i = 0; i < n_masks; ++i)
+                entry->mask[i] |= FAN_EVENT_ON_CHILD;
+            entry->mask_union |= FAN_EVENT_ON_CHILD;
+        }
+        else if (entry->mark_type == FAN_MARK_INODE)
+            entry->mark_type = FAN_MARK_MOUNT;
+
+        free (root);
+    }
+
+    if (builder->last)
+    {
+        FacronConfEntry *previous = (FacronConfEntry *) facron_arena_get (builder->arena, builder->last - 1);
+        previous->next = offset - (builder->last - 1);
+    }
+    builder->last = offset + 1;
+
+    facron_conf_entry_builder_discard (builder);
+}
+
+void
+facron_conf_entry_builder_discard (FacronConfEntryBuilder *builder)
+{
+    builder->path = NULL;
+    memset (builder->mask, 0, builder->n_masks * sizeof (*builder->mask));
+    builder->n_masks = 0;
+    builder->n_command = 0;
+    builder->debounce = 0;
+    builder->debounce_leading = false;
+    builder->ignore_own = false;
+    builder->batch = 0;
+    builder->batch_max = 0;
+    builder->limit_interval = 0;
+    builder->limit_burst = 0;
+    builder->limit_policy = FACRON_LIMIT_DROP;
+    builder->mark_type = FAN_MARK_INODE;
+    builder->stream = FACRON_STREAM_NONE;
+}
+
+FacronArena *
+facron_conf_entry_builder_finish (FacronConfEntryBuilder *builder)
+{
+    FacronArena *entries = builder->arena;
+
+    facron_conf_entry_builder_discard (builder);
+    builder->arena = facron_arena_new ();
+    builder->last = 0;
+    builder->n_entries = 0;
+
+    return entries;
+}
+
+void
+facron_conf_entry_builder_free (FacronConfEntryBuilder *builder)
+{
+    facron_conf_entry_builder_discard (builder);
+    facron_arena_free (builder->arena);
+    free (builder);
 }
 
-FacronConfEntry *
-facron_conf_entry_new (FacronConfEntry *next,
-                       char            *path)
+FacronConfEntryBuilder *
+facron_conf_entry_builder_new (void)
 {
-    FacronConfEntry *entry = (FacronConfEntry *) malloc (sizeof (FacronConfEntry));
+    FacronConfEntryBuilder *builder = (FacronConfEntryBuilder *) calloc (1, sizeof (FacronConfEntryBuilder));
 
-    entry->next = next;
-    entry->path = path;
+    builder->arena = facron_arena_new ();
 
-    return entry;
+    return builder;
 }
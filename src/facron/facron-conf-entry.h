@@ -20,7 +20,12 @@
 #ifndef __FACRON_CONF_ENTRY_H__
 #define __FACRON_CONF_ENTRY_H__
 
+#include "facron-arena.h"
+#include "facron-executor.h"
+#include "facron-limit.h"
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #include <sys/fanotify.h>
@@ -28,33 +33,112 @@
 #define MAX_MASK_LEN 512
 
 typedef struct FacronConfEntry FacronConfEntry;
+typedef struct FacronConfEntryBuilder FacronConfEntryBuilder;
 typedef struct fanotify_event_metadata FacronMetadata;
+typedef struct FacronVerdict FacronVerdict;
+
+/*
+ * An event being matched, stamped with the time it was read at. Permission
+ * events carry the verdict their matching entries contribute to instead of
+ * running anything through the executor.
+ */
+typedef struct
+{
+    const char           *path;
+    size_t                path_len;
+    const FacronMetadata *metadata;
+    uint64_t              stamp;
+    FacronVerdict        *verdict;
+    /* Of the configuration matching it, set by facron_conf_handle */
+    unsigned int          generation;
+} FacronEvent;
+
+const FacronConfEntry *facron_conf_entry_get_next     (const FacronConfEntry *entry);
+const char            *facron_conf_entry_get_path     (const FacronConfEntry *entry);
+size_t                 facron_conf_entry_get_path_len (const FacronConfEntry *entry);
+/* NULL unless the entry is a pattern, its path then being the root of the pattern */
+const char            *facron_conf_entry_get_pattern  (const FacronConfEntry *entry);
+const FacronCommand   *facron_conf_entry_get_command  (const FacronConfEntry *entry);
+uint64_t               facron_conf_entry_get_hash     (const FacronConfEntry *entry);
+/* Position of the entry in its generation */
+unsigned int           facron_conf_entry_get_id       (const FacronConfEntry *entry);
+
+unsigned int       facron_conf_entry_get_mark_type  (const FacronConfEntry *entry);
+bool               facron_conf_entry_is_recursive   (const FacronConfEntry *entry);
+unsigned long long facron_conf_entry_get_mask       (const FacronConfEntry *entry);
+unsigned long long facron_conf_entry_get_child_mask (const FacronConfEntry *entry);
+
+/* Its token bucket is only used when the entry has a rate limit */
+bool facron_conf_entry_has_limit (const FacronConfEntry *entry);
+
+/* Return how many commands the event triggered */
+unsigned int facron_conf_entry_handle       (const FacronConfEntry *entry,
+                                             FacronLimit           *limit,
+                                             FacronExecutor        *executor,
+                                             const FacronEvent     *event);
+unsigned int facron_conf_entry_handle_child (const FacronConfEntry *entry,
+                                             FacronLimit           *limit,
+                                             FacronExecutor        *executor,
+                                             const FacronEvent     *event);
+unsigned int facron_conf_entry_handle_tree  (const FacronConfEntry *entry,
+                                             FacronLimit           *limit,
+                                             FacronExecutor        *executor,
+                                             const FacronEvent     *event);
+
+/* All the entries of a generation live in a single arena */
+const FacronConfEntry *facron_conf_entries_get_first (const FacronArena *entries);
+unsigned int           facron_conf_entries_count     (const FacronArena *entries);
+
+void facron_conf_entries_free (FacronArena *entries);
+
+/*
+ * Entries are parsed into a reusable builder, then committed compactly to
+ * the arena of the generation being built, which finish hands over. The
+ * strings it is given are only borrowed, until commit or discard.
+ */
+void facron_conf_entry_builder_start (FacronConfEntryBuilder *builder,
+                                      char                   *path);
+
+void facron_conf_entry_builder_apply_mask (FacronConfEntryBuilder *builder,
+                                           int                     n_mask,
+                                           unsigned long long      mask);
+
+void facron_conf_entry_builder_add_command (FacronConfEntryBuilder *builder,
+                                            char                   *command);
+
+void facron_conf_entry_builder_set_debounce (FacronConfEntryBuilder *builder,
+                                             unsigned int            window,
+                                             bool                    leading);
+
+/* Up to max paths, 0 for no limit, during window milliseconds */
+void facron_conf_entry_builder_set_batch (FacronConfEntryBuilder *builder,
+                                          unsigned int            window,
+                                          unsigned int            max);
+
+/* Events caused by facron's own commands don't trigger the entry */
+void facron_conf_entry_builder_set_ignore_own (FacronConfEntryBuilder *builder);
 
-const FacronConfEntry *facron_conf_entry_get_next (const FacronConfEntry *entry);
+/* A token every interval nanoseconds, at most burst of them at once */
+void facron_conf_entry_builder_set_limit (FacronConfEntryBuilder *builder,
+                                          uint64_t                interval,
+                                          unsigned int            burst,
+                                          FacronLimitPolicy       policy);
 
-void facron_conf_entry_apply_mask (FacronConfEntry   *entry,
-                                   int                n_mask,
-                                   unsigned long long mask);
+void facron_conf_entry_builder_set_recursive (FacronConfEntryBuilder *builder,
+                                              unsigned int            mark_type);
 
-void facron_conf_entry_add_command (FacronConfEntry *entry,
-                                    char            *command);
+void facron_conf_entry_builder_set_stream (FacronConfEntryBuilder *builder,
+                                           FacronStreamFormat      format);
 
-bool facron_conf_entry_validate (const FacronConfEntry *entry);
+bool facron_conf_entry_builder_validate (const FacronConfEntryBuilder *builder);
 
-void facron_conf_entry_apply (const FacronConfEntry *entry,
-                              int                    fanotify_fd,
-                              int                    flag,
-                              bool                   notice);
+void facron_conf_entry_builder_commit  (FacronConfEntryBuilder *builder);
+void facron_conf_entry_builder_discard (FacronConfEntryBuilder *builder);
 
-void facron_conf_entry_handle (const FacronConfEntry *entry,
-                               const char            *path,
-                               size_t                 path_len,
-                               const FacronMetadata  *metadata);
+FacronArena *facron_conf_entry_builder_finish (FacronConfEntryBuilder *builder);
 
-void facron_conf_entry_free (FacronConfEntry *entry);
-void facron_conf_entries_free (FacronConfEntry *entry);
+void facron_conf_entry_builder_free (FacronConfEntryBuilder *builder);
 
-FacronConfEntry *facron_conf_entry_new (FacronConfEntry *next,
-                                        char            *path);
+FacronConfEntryBuilder *facron_conf_entry_builder_new (void);
 
 #endif /* __FACRON_CONF_ENTRY_H_ */
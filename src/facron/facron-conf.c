@@ -17,129 +17,469 @@
  *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "facron-cache.h"
 #include "facron-conf.h"
+#include "facron-index.h"
+#include "facron-marks.h"
+#include "facron-metrics.h"
 #include "facron-parser.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <sys/eventfd.h>
+
+/* Steps of loading and applying a generation, reported once it's applied */
+typedef enum
+{
+    PHASE_READ,
+    PHASE_TOKENIZE,
+    PHASE_CHECK,
+    PHASE_PARSE,
+    PHASE_INDEX,
+    PHASE_CACHE,
+    PHASE_MARKS,
+    N_PHASES
+} FacronConfPhase;
+
+static const char *phases[N_PHASES] = {
+    [PHASE_READ]     = "reading",
+    [PHASE_TOKENIZE] = "tokenizing",
+    [PHASE_CHECK]    = "checking paths",
+    [PHASE_PARSE]    = "parsing",
+    [PHASE_INDEX]    = "indexing",
+    [PHASE_CACHE]    = "caching",
+    [PHASE_MARKS]    = "marking",
+};
+
+struct FacronConfGeneration
+{
+    atomic_uint  refs;
+    unsigned int serial;
+    FacronArena *entries;
+    FacronIndex *index;
+    FacronMarks *marks;
+    /* Where entries and index live when they were mapped */
+    FacronCache *cache;
+    uint64_t     timings[N_PHASES];
+};
+
+/*
+ * Readers pin the current generation with a reference. A new generation
+ * is parsed and indexed by a loader thread while events keep being
+ * handled, then published by an atomic swap from the main loop. The old
+ * one is freed once its last reader is done with it.
+ */
 struct FacronConf
 {
-    FacronParser    *parser;
-    FacronConfEntry *entries;
-    const char      *filename;
+    FacronParser                   *parser;
+    const char                     *filename;
+    const char                     *cache_file;
+    _Atomic (FacronConfGeneration *) current;
+    atomic_uint                     readers;
+    unsigned int                    serial;
+    int                             fd;
+    /* The FAN_CLASS_CONTENT group, if any */
+    int                             permission_fd;
+    pthread_t                       loader;
+    FacronConfGeneration           *loaded;
+    bool                            loading;
+    bool                            pending;
 };
 
-typedef enum
+static void
+facron_conf_generation_free (FacronConfGeneration *generation)
 {
-    ADD,
-    REMOVE
-} FacronAction;
+    facron_marks_free (generation->marks);
+    facron_index_free (generation->index);
+    facron_conf_entries_free (generation->entries);
+    facron_cache_free (generation->cache);
+    free (generation);
+}
 
 static bool
-facron_conf_load (FacronConf *conf)
+facron_conf_load_cache (FacronConf              *conf,
+                        FacronConfGeneration    *generation,
+                        const FacronCacheSource *source)
 {
-    if (!facron_parser_reload (conf->parser))
+    size_t entries_size, index_size;
+
+    if (!(generation->cache = facron_cache_load (conf->cache_file, source)))
         return false;
 
-    fprintf (stderr, "Notice: loading configuration from %s\n", conf->filename);
+    const void *entries = facron_cache_get_entries (generation->cache, &entries_size);
+    const void *index = facron_cache_get_index (generation->cache, &index_size);
 
-    for (FacronConfEntry *entry; (entry = facron_parser_parse_entry (conf->parser, conf->entries)); conf->entries = entry);
+    generation->entries = facron_arena_new_view (entries, entries_size);
+    if (!(generation->index = facron_index_load (facron_conf_entries_get_first (generation->entries), index, index_size)))
+    {
+        fprintf (stderr, "Warning: compiled configuration \"%s\" has an invalid index, ignoring it\n", conf->cache_file);
+        facron_conf_entries_free (generation->entries);
+        facron_cache_free (generation->cache);
+        generation->entries = NULL;
+        generation->cache = NULL;
+        return false;
+    }
 
     return true;
 }
 
-static FacronConfEntry *
-facron_conf_reload (FacronConf *conf)
+static void
+facron_conf_compile (FacronConf              *conf,
+                     FacronConfGeneration    *generation,
+                     const FacronCacheSource *source)
 {
-    FacronConfEntry *entries = conf->entries;
+    generation->entries = facron_parser_parse (conf->parser);
 
-    conf->entries = NULL;
+    const FacronParserTimings *timings = facron_parser_get_timings (conf->parser);
+    uint64_t start = facron_metrics_now ();
 
-    if (facron_conf_load (conf))
-        return entries;
+    generation->timings[PHASE_TOKENIZE] = timings->tokenize;
+    generation->timings[PHASE_CHECK] = timings->check;
+    generation->timings[PHASE_PARSE] = timings->parse;
+    generation->index = facron_index_new (facron_conf_entries_get_first (generation->entries));
+    generation->timings[PHASE_INDEX] = facron_metrics_now () - start;
 
-    conf->entries = entries;
-    return NULL;
+    if (conf->cache_file)
+    {
+        start = facron_metrics_now ();
+        size_t index_size, n_readable, n_unreadable;
+        const void *index = facron_index_get_image (generation->index, &index_size);
+        const char *const *readable = facron_parser_get_readable (conf->parser, &n_readable);
+        const char *const *unreadable = facron_parser_get_unreadable (conf->parser, &n_unreadable);
+
+        facron_cache_save (conf->cache_file, source,
+                           facron_conf_entries_get_first (generation->entries), facron_arena_get_size (generation->entries),
+                           index, index_size, readable, n_readable, unreadable, n_unreadable);
+        generation->timings[PHASE_CACHE] += facron_metrics_now () - start;
+    }
 }
 
 static void
-facron_conf_walk (FacronAction           action,
-                  const FacronConfEntry *entries,
-                  int                    fanotify_fd)
-{
-    int flag;
-    bool notice = false;
-
-    switch (action) {
-    case ADD:
-        flag = FAN_MARK_ADD;
-        notice = true;
-        break;
-    default:
-        flag = FAN_MARK_REMOVE;
-        break;
+facron_conf_report (const FacronConfGeneration *generation)
+{
+    char buffer[512];
+    uint64_t total = 0;
+    int len = 0;
+
+    /* Nothing got loaded */
+    if (!generation->entries)
+        return;
+
+    for (unsigned int p = 0; p < N_PHASES; ++p)
+    {
+        if (!generation->timings[p])
+            continue;
+
+        len += snprintf (buffer + len, sizeof (buffer) - len, "%s %s %.1fms", (total) ? "," : ":", phases[p], generation->timings[p] / 1e6);
+        total += generation->timings[p];
     }
 
+    fprintf (stderr, "Notice: configuration loaded in %.1fms%s\n", total / 1e6, (total) ? buffer : "");
+}
+
+static FacronConfGeneration *
+facron_conf_load (FacronConf *conf)
+{
+    uint64_t start = facron_metrics_now ();
+
+    if (!facron_parser_reload (conf->parser))
+        return NULL;
+
+    fprintf (stderr, "Notice: loading configuration from %s\n", conf->filename);
+
+    FacronConfGeneration *generation = (FacronConfGeneration *) calloc (1, sizeof (FacronConfGeneration));
+    FacronCacheSource source = { 0 };
+    bool cached = false;
+
+    generation->timings[PHASE_READ] = facron_metrics_now () - start;
+
+    /* The source gets hashed before the parser modifies it in place */
+    if (conf->cache_file)
+    {
+        const char *data = facron_parser_get_source (conf->parser, &source.size, &source.mtime);
+
+        start = facron_metrics_now ();
+        source.hash = facron_cache_hash (data, source.size);
+        cached = facron_conf_load_cache (conf, generation, &source);
+        generation->timings[PHASE_CACHE] = facron_metrics_now () - start;
+    }
+
+    if (!cached)
+        facron_conf_compile (conf, generation, &source);
+
+    start = facron_metrics_now ();
+    atomic_init (&generation->refs, 1);
+    generation->serial = ++conf->serial;
+    generation->marks = facron_marks_new (facron_conf_entries_get_first (generation->entries));
+    generation->timings[PHASE_MARKS] = facron_metrics_now () - start;
+
+    return generation;
+}
+
+static void *
+facron_conf_loader (void *data)
+{
+    FacronConf *conf = (FacronConf *) data;
+    uint64_t one = 1;
+
+    conf->loaded = facron_conf_load (conf);
+    if (write (conf->fd, &one, sizeof (one)) < 0)
+        fprintf (stderr, "Error: could not notify the end of the configuration loading: %s\n", strerror (errno));
+
+    return NULL;
+}
+
+FacronConfGeneration *
+facron_conf_acquire (FacronConf *conf)
+{
+    /* The publisher waits for readers to leave this window before dropping its reference */
+    atomic_fetch_add (&conf->readers, 1);
+    FacronConfGeneration *generation = atomic_load (&conf->current);
+    atomic_fetch_add (&generation->refs, 1);
+    atomic_fetch_sub (&conf->readers, 1);
+
+    return generation;
+}
+
+void
+facron_conf_release (FacronConfGeneration *generation)
+{
+    if (atomic_fetch_sub (&generation->refs, 1) == 1)
+        facron_conf_generation_free (generation);
+}
+
+const FacronConfEntry *
+facron_conf_get_entries (const FacronConfGeneration *generation)
+{
+    return facron_conf_entries_get_first (generation->entries);
+}
+
+unsigned int
+facron_conf_get_generation (const FacronConfGeneration *generation)
+{
+    return generation->serial;
+}
+
+bool
+facron_conf_may_match_dir (const FacronConfGeneration *generation,
+                           const char                 *dir,
+                           size_t                      dir_len)
+{
+    return generation->index && facron_index_may_match_dir (generation->index, dir, dir_len);
+}
+
+unsigned int
+facron_conf_handle (const FacronConfGeneration *generation,
+                    FacronExecutor             *executor,
+                    const FacronEvent          *event)
+{
+    if (!generation->index)
+        return 0;
+
+    FacronEvent stamped = *event;
+
+    stamped.generation = generation->serial;
+    return facron_index_handle (generation->index, executor, &stamped);
+}
+
+void
+facron_conf_sweep_streams (FacronConf     *conf,
+                           FacronExecutor *executor)
+{
+    FacronConfGeneration *generation = facron_conf_acquire (conf);
+
+    for (const FacronConfEntry *entry = facron_conf_get_entries (generation); entry; entry = facron_conf_entry_get_next (entry))
+    {
+        if (facron_command_get_stream (facron_conf_entry_get_command (entry)))
+            facron_executor_retain_stream (executor, facron_conf_entry_get_command (entry));
+    }
+
+    facron_conf_release (generation);
+    facron_executor_sweep_streams (executor);
+}
+
+void
+facron_conf_print_metrics (FacronConf *conf,
+                           FILE       *out)
+{
+    FacronConfGeneration *generation = facron_conf_acquire (conf);
+    const FacronConfEntry *entries = facron_conf_get_entries (generation);
+
+    fprintf (out, "# HELP facron_conf_generation Serial of the current configuration generation.\n"
+                  "# TYPE facron_conf_generation gauge\n"
+                  "facron_conf_generation %u\n", generation->serial);
+    fprintf (out, "# HELP facron_conf_entries Entries in the current configuration generation.\n"
+                  "# TYPE facron_conf_entries gauge\n"
+                  "facron_conf_entries %u\n", facron_conf_entries_count (generation->entries));
+    fprintf (out, "# HELP facron_entry_matches_total Commands triggered by each entry since its generation got loaded.\n"
+                  "# TYPE facron_entry_matches_total counter\n");
+
     for (const FacronConfEntry *entry = entries; entry; entry = facron_conf_entry_get_next (entry))
-        facron_conf_entry_apply (entry, fanotify_fd, flag, notice);
+    {
+        fprintf (out, "facron_entry_matches_total{entry=\"%u\",path=\"", facron_conf_entry_get_id (entry));
+        facron_metrics_print_label (out, (facron_conf_entry_get_pattern (entry)) ? facron_conf_entry_get_pattern (entry) : facron_conf_entry_get_path (entry));
+        fprintf (out, "\"} %lu\n", facron_index_get_matches (generation->index, entry));
+    }
+
+    fprintf (out, "# HELP facron_entry_rate_limited_total Events dropped or coalesced by the rate limit of each entry since its generation got loaded.\n"
+                  "# TYPE facron_entry_rate_limited_total counter\n");
+
+    for (const FacronConfEntry *entry = entries; entry; entry = facron_conf_entry_get_next (entry))
+    {
+        if (!facron_conf_entry_has_limit (entry))
+            continue;
+
+        fprintf (out, "facron_entry_rate_limited_total{entry=\"%u\",path=\"", facron_conf_entry_get_id (entry));
+        facron_metrics_print_label (out, (facron_conf_entry_get_pattern (entry)) ? facron_conf_entry_get_pattern (entry) : facron_conf_entry_get_path (entry));
+        fprintf (out, "\"} %lu\n", facron_index_get_rejected (generation->index, entry));
+    }
+
+    facron_conf_release (generation);
+}
+
+void
+facron_conf_set_permission_fd (FacronConf *conf,
+                               int         permission_fd)
+{
+    conf->permission_fd = permission_fd;
 }
 
 void
 facron_conf_apply (FacronConf *conf,
                    int         fanotify_fd)
 {
-    facron_conf_walk (ADD, conf->entries, fanotify_fd);
+    FacronConfGeneration *generation = atomic_load (&conf->current);
+    uint64_t start = facron_metrics_now ();
+
+    facron_marks_update (NULL, generation->marks, fanotify_fd, conf->permission_fd);
+    generation->timings[PHASE_MARKS] += facron_metrics_now () - start;
+    facron_conf_report (generation);
+}
+
+void
+facron_conf_reload (FacronConf *conf)
+{
+    if (conf->loading)
+    {
+        conf->pending = true;
+        return;
+    }
+
+    int err = pthread_create (&conf->loader, NULL, facron_conf_loader, conf);
+    if (err)
+    {
+        fprintf (stderr, "Error: could not start loading the configuration: %s\n", strerror (err));
+        return;
+    }
+
+    conf->loading = true;
+    conf->pending = false;
 }
 
-static inline void
-facron_conf_unapply (const FacronConfEntry *entries,
-                     int                    fanotify_fd)
+int
+facron_conf_get_fd (const FacronConf *conf)
 {
-    facron_conf_walk (REMOVE, entries, fanotify_fd);
+    return conf->fd;
 }
 
-void
-facron_conf_reapply (FacronConf *conf,
-                     int         fanotify_fd)
+static void
+facron_conf_join (FacronConf *conf)
 {
-    FacronConfEntry *old_entries = facron_conf_reload (conf);
+    uint64_t count;
+
+    if (!conf->loading)
+        return;
 
-    facron_conf_unapply (old_entries, fanotify_fd);
-    facron_conf_apply (conf, fanotify_fd);
-    facron_conf_entries_free (old_entries);
+    pthread_join (conf->loader, NULL);
+    conf->loading = false;
+    if (read (conf->fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+        fprintf (stderr, "Error: could not read the configuration loading notification: %s\n", strerror (errno));
 }
 
-void
-facron_conf_handle(FacronConf     *conf,
-                   const char     *path,
-                   size_t          path_len,
-                   FacronMetadata *metadata)
+bool
+facron_conf_dispatch (FacronConf *conf,
+                      int         fanotify_fd)
 {
-    for (const FacronConfEntry *entry = conf->entries; entry; entry = facron_conf_entry_get_next (entry))
-        facron_conf_entry_handle (entry, path, path_len, metadata);
+    facron_conf_join (conf);
+
+    FacronConfGeneration *generation = conf->loaded;
+    conf->loaded = NULL;
+
+    if (generation)
+    {
+        FacronConfGeneration *old = atomic_exchange (&conf->current, generation);
+
+        /* Nobody can pin the old generation anymore once this is over */
+        while (atomic_load (&conf->readers))
+            sched_yield ();
+
+        uint64_t start = facron_metrics_now ();
+
+        facron_marks_update (old->marks, generation->marks, fanotify_fd, conf->permission_fd);
+        generation->timings[PHASE_MARKS] += facron_metrics_now () - start;
+        facron_conf_report (generation);
+        facron_conf_release (old);
+    }
+
+    if (conf->pending)
+        facron_conf_reload (conf);
+
+    return generation != NULL;
 }
 
 void
 facron_conf_free (FacronConf *conf,
                   int         fanotify_fd)
 {
-    facron_conf_unapply (conf->entries, fanotify_fd);
-    facron_conf_entries_free (conf->entries);
+    if (!conf)
+        return;
+
+    FacronConfGeneration *generation = atomic_load (&conf->current);
+
+    facron_conf_join (conf);
+    if (conf->loaded)
+        facron_conf_release (conf->loaded);
+
+    facron_marks_update (generation->marks, NULL, fanotify_fd, conf->permission_fd);
+    facron_conf_release (generation);
     facron_parser_free (conf->parser);
+    close (conf->fd);
     free (conf);
 }
 
 FacronConf *
-facron_conf_new (const char *filename)
+facron_conf_new (const char *filename,
+                 const char *cache_file)
 {
-    FacronConf *conf = (FacronConf *) malloc (sizeof (FacronConf));
+    FacronConf *conf = (FacronConf *) calloc (1, sizeof (FacronConf));
+
+    if ((conf->fd = eventfd (0, EFD_CLOEXEC|EFD_NONBLOCK)) < 0)
+    {
+        fprintf (stderr, "Error: could not create eventfd: %s\n", strerror (errno));
+        free (conf);
+        return NULL;
+    }
 
     conf->parser = facron_parser_new (filename);
-    conf->entries = NULL;
     conf->filename = filename;
+    conf->cache_file = cache_file;
+    conf->permission_fd = -1;
 
-    facron_conf_load (conf);
+    FacronConfGeneration *generation = facron_conf_load (conf);
+    if (!generation)
+    {
+        generation = (FacronConfGeneration *) calloc (1, sizeof (FacronConfGeneration));
+        atomic_init (&generation->refs, 1);
+    }
+    atomic_init (&conf->current, generation);
+    atomic_init (&conf->readers, 0);
 
     return conf;
 }
@@ -22,21 +22,57 @@
 
 #include "facron-conf-entry.h"
 
+#include <stdio.h>
+
 typedef struct FacronConf FacronConf;
+typedef struct FacronConfGeneration FacronConfGeneration;
+
+/* Pins the current generation, which stays valid until released */
+FacronConfGeneration *facron_conf_acquire (FacronConf           *conf);
+void                  facron_conf_release (FacronConfGeneration *generation);
+
+const FacronConfEntry *facron_conf_get_entries    (const FacronConfGeneration *generation);
+unsigned int           facron_conf_get_generation (const FacronConfGeneration *generation);
+
+bool facron_conf_may_match_dir (const FacronConfGeneration *generation,
+                                const char                 *dir,
+                                size_t                      dir_len);
+
+/* Returns how many commands the event triggered */
+unsigned int facron_conf_handle(const FacronConfGeneration *generation,
+                                FacronExecutor             *executor,
+                                const FacronEvent          *event);
 
-void facron_conf_apply   (FacronConf *conf,
-                          int         fanotify_fd);
-void facron_conf_reapply (FacronConf *conf,
-                          int         fanotify_fd);
+/* Stops the stream handlers no entry of the current generation uses */
+void facron_conf_sweep_streams (FacronConf     *conf,
+                                FacronExecutor *executor);
 
-void facron_conf_handle(FacronConf     *conf,
-                        const char     *path,
-                        size_t          path_len,
-                        FacronMetadata *metadata);
+/* The current generation and its per entry counters */
+void facron_conf_print_metrics (FacronConf *conf,
+                                FILE       *out);
+
+/* Permission events get marked there, they are ignored if it's never set */
+void facron_conf_set_permission_fd (FacronConf *conf,
+                                    int         permission_fd);
+
+void facron_conf_apply (FacronConf *conf,
+                        int         fanotify_fd);
+
+/*
+ * Loads the configuration again in the background, its fd becomes
+ * readable when the new generation is ready to be published by dispatch,
+ * which tells whether it got published.
+ */
+void facron_conf_reload   (FacronConf       *conf);
+int  facron_conf_get_fd   (const FacronConf *conf);
+bool facron_conf_dispatch (FacronConf       *conf,
+                           int               fanotify_fd);
 
 void facron_conf_free (FacronConf *conf,
                        int         fanotify_fd);
 
-FacronConf *facron_conf_new (const char *filename);
+/* The compiled configuration gets saved to cache_file and used from there when up to date, if set */
+FacronConf *facron_conf_new (const char *filename,
+                             const char *cache_file);
 
 #endif /* __FACRON_CONF_H_ */
@@ -0,0 +1,203 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-debounce.h"
+#include "facron-metrics.h"
+#include "facron-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A record exists for each (entry, path) couple which got an event less
+ * than a window ago. Leading records only swallow the events following
+ * the one which was run, trailing ones carry their own copy of the
+ * command so that they outlive a configuration reload.
+ */
+typedef struct FacronDebounceRecord FacronDebounceRecord;
+struct FacronDebounceRecord
+{
+    FacronDebounceRecord *next;
+    FacronDebounce       *debounce;
+    FacronTimer           timer;
+    uint64_t              owner;
+    uint64_t              hash;
+    pid_t                 pid;
+    FacronCommand        *command;
+    char                  path[];
+};
+
+struct FacronDebounce
+{
+    FacronTimers          *timers;
+    FacronExecutor        *executor;
+    FacronDebounceRecord **buckets;
+    size_t                 size;
+    size_t                 n_records;
+};
+
+static inline uint64_t
+facron_debounce_hash (uint64_t    owner,
+                      const char *path)
+{
+    return facron_hash (path, strlen (path)) ^ (owner * 0x9E3779B97F4A7C15ULL);
+}
+
+static FacronDebounceRecord **
+facron_debounce_lookup (FacronDebounce *debounce,
+                        uint64_t        owner,
+                        const char     *path,
+                        uint64_t        hash)
+{
+    FacronDebounceRecord **record = &debounce->buckets[hash & (debounce->size - 1)];
+
+    for (; *record; record = &(*record)->next)
+    {
+        if ((*record)->hash == hash && (*record)->owner == owner && !strcmp ((*record)->path, path))
+            break;
+    }
+
+    return record;
+}
+
+static void
+facron_debounce_grow (FacronDebounce *debounce)
+{
+    FacronDebounceRecord **old = debounce->buckets;
+    size_t old_size = debounce->size;
+
+    debounce->size *= 2;
+    debounce->buckets = (FacronDebounceRecord **) calloc (debounce->size, sizeof (FacronDebounceRecord *));
+
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        for (FacronDebounceRecord *record = old[i], *next; record; record = next)
+        {
+            FacronDebounceRecord **bucket = &debounce->buckets[record->hash & (debounce->size - 1)];
+
+            next = record->next;
+            record->next = *bucket;
+            *bucket = record;
+        }
+    }
+
+    free (old);
+}
+
+static void
+facron_debounce_record_free (FacronDebounceRecord *record)
+{
+    free (record->command);
+    free (record);
+}
+
+static void
+facron_debounce_fire (FacronTimer *timer,
+                      void        *data)
+{
+    FacronDebounceRecord *record = (FacronDebounceRecord *) data;
+    FacronDebounce *debounce = record->debounce;
+    FacronDebounceRecord **link = facron_debounce_lookup (debounce, record->owner, record->path, record->hash);
+
+    (void) timer;
+
+    *link = record->next;
+    --debounce->n_records;
+
+    if (record->command)
+        facron_executor_exec (debounce->executor, record->command, record->path, record->pid);
+
+    facron_debounce_record_free (record);
+}
+
+void
+facron_debounce_submit (FacronDebounce      *debounce,
+                        uint64_t             owner,
+                        const FacronCommand *command,
+                        const char          *path,
+                        pid_t                pid,
+                        unsigned int         window,
+                        bool                 leading)
+{
+    uint64_t hash = facron_debounce_hash (owner, path);
+    FacronDebounceRecord **link = facron_debounce_lookup (debounce, owner, path, hash);
+
+    /* Already within a window, this event is coalesced into it */
+    if (*link)
+    {
+        (*link)->pid = pid;
+        facron_metrics_inc (FACRON_METRIC_COALESCED);
+        return;
+    }
+
+    size_t path_len = strlen (path) + 1;
+    FacronDebounceRecord *record = (FacronDebounceRecord *) malloc (sizeof (FacronDebounceRecord) + path_len);
+
+    memcpy (record->path, path, path_len);
+    record->next = NULL;
+    record->debounce = debounce;
+    record->timer = (FacronTimer) FACRON_TIMER_INIT (facron_debounce_fire, record);
+    record->owner = owner;
+    record->hash = hash;
+    record->pid = pid;
+    record->command = (leading) ? NULL : memcpy (malloc (facron_command_get_size (command)), command, facron_command_get_size (command));
+
+    *link = record;
+    if (++debounce->n_records > debounce->size)
+        facron_debounce_grow (debounce);
+
+    facron_timers_schedule (debounce->timers, &record->timer, facron_timers_now () + window);
+
+    if (leading)
+        facron_executor_exec (debounce->executor, command, path, pid);
+}
+
+void
+facron_debounce_free (FacronDebounce *debounce)
+{
+    if (!debounce)
+        return;
+
+    for (size_t i = 0; i < debounce->size; ++i)
+    {
+        for (FacronDebounceRecord *record = debounce->buckets[i], *next; record; record = next)
+        {
+            next = record->next;
+            facron_timers_cancel (debounce->timers, &record->timer);
+            facron_debounce_record_free (record);
+        }
+    }
+
+    free (debounce->buckets);
+    free (debounce);
+}
+
+FacronDebounce *
+facron_debounce_new (FacronTimers   *timers,
+                     FacronExecutor *executor)
+{
+    FacronDebounce *debounce = (FacronDebounce *) calloc (1, sizeof (FacronDebounce));
+
+    debounce->timers = timers;
+    debounce->executor = executor;
+    debounce->size = 64;
+    debounce->buckets = (FacronDebounceRecord **) calloc (debounce->size, sizeof (FacronDebounceRecord *));
+
+    return debounce;
+}
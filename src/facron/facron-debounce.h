@@ -0,0 +1,46 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_DEBOUNCE_H__
+#define __FACRON_DEBOUNCE_H__
+
+#include "facron-executor.h"
+#include "facron-timers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+typedef struct FacronDebounce FacronDebounce;
+
+/* owner identifies the entry, across generations */
+void facron_debounce_submit (FacronDebounce      *debounce,
+                             uint64_t             owner,
+                             const FacronCommand *command,
+                             const char          *path,
+                             pid_t                pid,
+                             unsigned int         window,
+                             bool                 leading);
+
+void facron_debounce_free (FacronDebounce *debounce);
+
+FacronDebounce *facron_debounce_new (FacronTimers   *timers,
+                                     FacronExecutor *executor);
+
+#endif /* __FACRON_DEBOUNCE_H__ */
@@ -0,0 +1,838 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-batcher.h"
+#include "facron-debounce.h"
+#include "facron-executor.h"
+#include "facron-lineage.h"
+#include "facron-metrics.h"
+#include "facron-ring.h"
+#include "facron-stream.h"
+#include "facron-util.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#define MAX_REQUESTS 4096
+
+/* Most requests fit in a slot of a pool instead of getting allocated */
+#define REQUEST_SLOTS     1024
+#define REQUEST_SLOT_SIZE 1024
+
+/*
+ * Requests are handed over from the matcher threads to the loop thread
+ * through a ring, each in a single block starting with its kind.
+ */
+typedef enum
+{
+    REQUEST_SPAWN,
+    REQUEST_DEBOUNCE,
+    REQUEST_BATCH,
+    REQUEST_DEFER,
+    REQUEST_STREAM
+} FacronRequestKind;
+
+typedef struct FacronJob FacronJob;
+struct FacronJob
+{
+    FacronRequestKind kind;
+    FacronJob        *next;
+    /* When the event got read, 0 when unknown */
+    uint64_t          stamp;
+    /* Of the strings argv points to, which follow each other */
+    uint64_t          hash;
+    size_t            size;
+    char             *argv[];
+};
+
+typedef struct
+{
+    FacronRequestKind kind;
+    uint64_t          owner;
+    FacronCommand    *command;
+    char             *path;
+    pid_t             pid;
+    unsigned int      window;
+    bool              leading;
+    uint32_t          data[];
+} FacronDebounceRequest;
+
+typedef struct
+{
+    FacronRequestKind kind;
+    uint64_t          owner;
+    FacronCommand    *command;
+    char             *path;
+    pid_t             pid;
+    unsigned int      window;
+    unsigned int      max;
+    uint32_t          data[];
+} FacronBatchRequest;
+
+/* Kept as is by the loop thread until its timer fires */
+typedef struct FacronDeferRequest FacronDeferRequest;
+struct FacronDeferRequest
+{
+    FacronRequestKind    kind;
+    FacronTimer          timer;
+    FacronExecutor      *executor;
+    FacronDeferRequest  *next;
+    FacronDeferRequest **prev;
+    FacronCommand       *command;
+    char                *path;
+    pid_t                pid;
+    uint64_t             deadline;
+    uint32_t             data[];
+};
+
+typedef struct
+{
+    FacronRequestKind kind;
+    uint64_t          stamp;
+    FacronCommand    *command;
+    char             *record;
+    size_t            len;
+    uint32_t          data[];
+} FacronStreamRequest;
+
+struct FacronExecutor
+{
+    int                 signal_fd;
+    posix_spawnattr_t   attr;
+    FacronDebounce     *debounce;
+    FacronBatcher      *batcher;
+    FacronTimers       *timers;
+    FacronLineage      *lineage;
+    /* Runs a rate limit delayed */
+    FacronDeferRequest *deferred;
+    FacronStreams      *streams;
+    FacronRing         *requests;
+    char               *slots;
+    FacronRing         *free_slots;
+    unsigned int        max_jobs;
+    unsigned int        max_pending;
+    FacronLimitPolicy   overflow;
+    bool                dry_run;
+    unsigned int        n_running;
+    unsigned int        n_pending;
+    FacronJob          *pending;
+    FacronJob          *pending_tail;
+    size_t              arg_max;
+    /* For batches, allocated on first use */
+    char               *batch_scratch;
+    char              **batch_argv;
+};
+
+static void
+facron_executor_launch (FacronExecutor *executor,
+                        char          **argv,
+                        uint64_t        stamp)
+{
+    pid_t pid;
+    int err = (executor->dry_run) ? 0 : posix_spawn (&pid, argv[0], NULL, &executor->attr, argv, environ);
+
+    if (err)
+    {
+        fprintf (stderr, "Warning: could not run \"%s\": %s\n", argv[0], strerror (err));
+        facron_metrics_inc (FACRON_METRIC_SPAWN_FAILURES);
+        return;
+    }
+
+    if (!executor->dry_run)
+    {
+        facron_lineage_add (executor->lineage, pid);
+        ++executor->n_running;
+    }
+    facron_metrics_inc (FACRON_METRIC_SPAWNED);
+    if (stamp)
+        facron_metrics_record (FACRON_HISTOGRAM_EXEC, facron_metrics_now () - stamp);
+}
+
+/* Built-in actions run right away, from whichever thread handled the event */
+static void
+facron_executor_builtin (FacronExecutor *executor,
+                         FacronBuiltin   builtin,
+                         char          **argv,
+                         uint64_t        stamp)
+{
+    if (!executor->dry_run && !facron_builtin_run (builtin, argv))
+    {
+        facron_metrics_inc (FACRON_METRIC_BUILTIN_FAILURES);
+        return;
+    }
+
+    facron_metrics_inc (FACRON_METRIC_BUILTINS);
+    if (stamp)
+        facron_metrics_record (FACRON_HISTOGRAM_EXEC, facron_metrics_now () - stamp);
+}
+
+/* Loop thread, hands the record over to the command's stream handler */
+static void
+facron_executor_write_record (FacronExecutor      *executor,
+                              const FacronCommand *command,
+                              const char          *record,
+                              size_t               len,
+                              uint64_t             stamp)
+{
+    if (!executor->dry_run && !facron_streams_write (executor->streams, command, record, len))
+        return;
+
+    facron_metrics_inc (FACRON_METRIC_STREAMED);
+    if (stamp)
+        facron_metrics_record (FACRON_HISTOGRAM_EXEC, facron_metrics_now () - stamp);
+}
+
+static void *
+facron_executor_request_new (FacronExecutor *executor,
+                             size_t          size)
+{
+    void *request;
+
+    if (size <= REQUEST_SLOT_SIZE && (request = facron_ring_try_pop (executor->free_slots)))
+        return request;
+
+    return malloc (size);
+}
+
+static void
+facron_executor_request_free (FacronExecutor *executor,
+                              void           *request)
+{
+    uintptr_t slot = (uintptr_t) request;
+    uintptr_t slots = (uintptr_t) executor->slots;
+
+    if (slot >= slots && slot < slots + REQUEST_SLOTS * REQUEST_SLOT_SIZE)
+        facron_ring_push (executor->free_slots, request);
+    else
+        free (request);
+}
+
+static FacronJob *
+facron_executor_job_new (FacronExecutor *executor,
+                         char          **argv,
+                         uint64_t        stamp)
+{
+    size_t argc = 0, size = 0;
+
+    for (; argv[argc]; ++argc)
+        size += strlen (argv[argc]) + 1;
+
+    /* One block holds the job, its argv and the strings it points to */
+    FacronJob *job = (FacronJob *) facron_executor_request_new (executor, sizeof (FacronJob) + (argc + 1) * sizeof (char *) + size);
+    char *str = (char *) &job->argv[argc + 1];
+
+    for (size_t i = 0; i < argc; ++i)
+    {
+        size_t len = strlen (argv[i]) + 1;
+        job->argv[i] = memcpy (str, argv[i], len);
+        str += len;
+    }
+    job->argv[argc] = NULL;
+    job->kind = REQUEST_SPAWN;
+    job->next = NULL;
+    job->stamp = stamp;
+    job->hash = facron_hash (job->argv[0], size);
+    job->size = size;
+
+    return job;
+}
+
+static inline bool
+facron_executor_job_equal (const FacronJob *a,
+                           const FacronJob *b)
+{
+    return a->hash == b->hash && a->size == b->size && !memcmp (a->argv[0], b->argv[0], a->size);
+}
+
+/* For commands finding no job slot, the overflow policy applies */
+static void
+facron_executor_queue (FacronExecutor *executor,
+                       FacronJob      *job)
+{
+    if (executor->overflow == FACRON_LIMIT_DROP || executor->n_pending >= executor->max_pending)
+        goto reject;
+
+    /* At most max_pending of them to look at */
+    if (executor->overflow == FACRON_LIMIT_COALESCE)
+    {
+        for (const FacronJob *pending = executor->pending; pending; pending = pending->next)
+        {
+            if (facron_executor_job_equal (pending, job))
+                goto reject;
+        }
+    }
+
+    ++executor->n_pending;
+    if (executor->pending_tail)
+        executor->pending_tail->next = job;
+    else
+        executor->pending = job;
+    executor->pending_tail = job;
+    return;
+
+reject:
+    facron_metrics_inc (FACRON_METRIC_JOBS_REJECTED);
+    facron_executor_request_free (executor, job);
+}
+
+void
+facron_executor_spawn (FacronExecutor *executor,
+                       char          **argv)
+{
+    if (executor->max_jobs && executor->n_running >= executor->max_jobs)
+        facron_executor_queue (executor, facron_executor_job_new (executor, argv, 0));
+    else
+        facron_executor_launch (executor, argv, 0);
+}
+
+static inline bool
+facron_executor_expand (const FacronCommand *command,
+                        const char          *path,
+                        pid_t                pid,
+                        char                *scratch,
+                        char                *argv[MAX_CMD_LEN])
+{
+    if (!facron_command_expand (command, path, pid, scratch, FACRON_COMMAND_SCRATCH_SIZE, argv))
+    {
+        fprintf (stderr, "Warning: command line too long for \"%s\", skipping\n", path);
+        return false;
+    }
+
+    return argv[0];
+}
+
+void
+facron_executor_exec (FacronExecutor      *executor,
+                      const FacronCommand *command,
+                      const char          *path,
+                      pid_t                pid)
+{
+    char scratch[FACRON_COMMAND_SCRATCH_SIZE];
+    char *argv[MAX_CMD_LEN];
+
+    if (facron_command_get_stream (command))
+    {
+        char record[FACRON_STREAM_RECORD_SIZE];
+        size_t len = facron_stream_format (facron_command_get_stream (command), path, pid, record, sizeof (record));
+
+        if (len)
+            facron_executor_write_record (executor, command, record, len, 0);
+        return;
+    }
+
+    if (!facron_executor_expand (command, path, pid, scratch, argv))
+        return;
+
+    if (facron_command_get_builtin (command))
+        facron_executor_builtin (executor, facron_command_get_builtin (command), argv, 0);
+    else
+        facron_executor_spawn (executor, argv);
+}
+
+void
+facron_executor_exec_paths (FacronExecutor      *executor,
+                            const FacronCommand *command,
+                            char *const         *paths,
+                            size_t               n_paths,
+                            pid_t                pid)
+{
+    if (facron_command_get_stream (command))
+    {
+        for (size_t i = 0; i < n_paths; ++i)
+            facron_executor_exec (executor, command, paths[i], pid);
+        return;
+    }
+
+    /* Every argument costs more than a pointer, scratch never outgrows the limit */
+    size_t max_argv = executor->arg_max / sizeof (char *);
+
+    if (!executor->batch_scratch)
+    {
+        executor->batch_scratch = (char *) malloc (executor->arg_max);
+        executor->batch_argv = (char **) malloc (max_argv * sizeof (char *));
+    }
+
+    /* As many invocations as it takes for each to fit in ARG_MAX */
+    for (size_t done = 0, n; done < n_paths; done += n)
+    {
+        char **argv = executor->batch_argv;
+
+        if (!(n = facron_command_expand_paths (command, paths + done, n_paths - done, pid, executor->batch_scratch,
+                                               executor->arg_max, argv, max_argv, executor->arg_max)))
+        {
+            fprintf (stderr, "Warning: command line too long for \"%s\", skipping\n", paths[done]);
+            n = 1;
+            continue;
+        }
+
+        if (!argv[0])
+            return;
+
+        if (facron_command_get_builtin (command))
+            facron_executor_builtin (executor, facron_command_get_builtin (command), argv, 0);
+        else
+            facron_executor_spawn (executor, argv);
+    }
+}
+
+static void
+facron_executor_submit (FacronExecutor *executor,
+                        void           *request)
+{
+    /* Back pressure, the loop thread is lagging behind */
+    facron_ring_push_wait (executor->requests, request);
+}
+
+static void
+facron_executor_stream (FacronExecutor      *executor,
+                        const FacronCommand *command,
+                        const char          *path,
+                        pid_t                pid,
+                        uint64_t             stamp)
+{
+    char record[FACRON_STREAM_RECORD_SIZE];
+    size_t len = facron_stream_format (facron_command_get_stream (command), path, pid, record, sizeof (record));
+
+    if (!len)
+    {
+        fprintf (stderr, "Warning: record too long for \"%s\", skipping\n", path);
+        return;
+    }
+
+    if (executor->dry_run)
+    {
+        facron_metrics_inc (FACRON_METRIC_STREAMED);
+        if (stamp)
+            facron_metrics_record (FACRON_HISTOGRAM_EXEC, facron_metrics_now () - stamp);
+        return;
+    }
+
+    size_t command_size = facron_command_get_size (command);
+    FacronStreamRequest *request = (FacronStreamRequest *) facron_executor_request_new (executor, sizeof (FacronStreamRequest) + command_size + len);
+
+    request->kind = REQUEST_STREAM;
+    request->stamp = stamp;
+    request->len = len;
+    request->command = (FacronCommand *) memcpy (request->data, command, command_size);
+    request->record = (char *) memcpy ((char *) request->data + command_size, record, len);
+
+    facron_executor_submit (executor, request);
+}
+
+void
+facron_executor_run (FacronExecutor      *executor,
+                     const FacronCommand *command,
+                     const char          *path,
+                     pid_t                pid,
+                     uint64_t             stamp)
+{
+    char scratch[FACRON_COMMAND_SCRATCH_SIZE];
+    char *argv[MAX_CMD_LEN];
+
+    if (facron_command_get_stream (command))
+    {
+        facron_executor_stream (executor, command, path, pid, stamp);
+        return;
+    }
+
+    if (!facron_executor_expand (command, path, pid, scratch, argv))
+        return;
+
+    if (facron_command_get_builtin (command))
+        facron_executor_builtin (executor, facron_command_get_builtin (command), argv, stamp);
+    else
+        facron_executor_submit (executor, facron_executor_job_new (executor, argv, stamp));
+}
+
+void
+facron_executor_debounce (FacronExecutor      *executor,
+                          uint64_t             owner,
+                          const FacronCommand *command,
+                          const char          *path,
+                          pid_t                pid,
+                          unsigned int         window,
+                          bool                 leading)
+{
+    size_t path_len = strlen (path) + 1;
+    size_t command_size = facron_command_get_size (command);
+    FacronDebounceRequest *request = (FacronDebounceRequest *) facron_executor_request_new (executor, sizeof (FacronDebounceRequest) + path_len + command_size);
+
+    request->kind = REQUEST_DEBOUNCE;
+    request->owner = owner;
+    request->pid = pid;
+    request->window = window;
+    request->leading = leading;
+    request->command = (FacronCommand *) memcpy (request->data, command, command_size);
+    request->path = (char *) memcpy ((char *) request->data + command_size, path, path_len);
+
+    facron_executor_submit (executor, request);
+}
+
+void
+facron_executor_batch (FacronExecutor      *executor,
+                       uint64_t             owner,
+                       const FacronCommand *command,
+                       const char          *path,
+                       pid_t                pid,
+                       unsigned int         window,
+                       unsigned int         max)
+{
+    size_t path_len = strlen (path) + 1;
+    size_t command_size = facron_command_get_size (command);
+    FacronBatchRequest *request = (FacronBatchRequest *) facron_executor_request_new (executor, sizeof (FacronBatchRequest) + path_len + command_size);
+
+    request->kind = REQUEST_BATCH;
+    request->owner = owner;
+    request->pid = pid;
+    request->window = window;
+    request->max = max;
+    request->command = (FacronCommand *) memcpy (request->data, command, command_size);
+    request->path = (char *) memcpy ((char *) request->data + command_size, path, path_len);
+
+    facron_executor_submit (executor, request);
+}
+
+static void
+facron_executor_unlink_deferred (FacronDeferRequest *defer)
+{
+    *defer->prev = defer->next;
+    if (defer->next)
+        defer->next->prev = defer->prev;
+}
+
+static void
+facron_executor_run_deferred (FacronTimer *timer,
+                              void        *data)
+{
+    FacronDeferRequest *defer = (FacronDeferRequest *) data;
+    FacronExecutor *executor = defer->executor;
+
+    facron_timers_cancel (executor->timers, timer);
+    facron_executor_unlink_deferred (defer);
+    facron_executor_exec (executor, defer->command, defer->path, defer->pid);
+    facron_executor_request_free (executor, defer);
+}
+
+void
+facron_executor_defer (FacronExecutor      *executor,
+                       const FacronCommand *command,
+                       const char          *path,
+                       pid_t                pid,
+                       uint64_t             deadline)
+{
+    size_t path_len = strlen (path) + 1;
+    size_t command_size = facron_command_get_size (command);
+    FacronDeferRequest *request = (FacronDeferRequest *) facron_executor_request_new (executor, sizeof (FacronDeferRequest) + path_len + command_size);
+
+    request->kind = REQUEST_DEFER;
+    request->timer = (FacronTimer) FACRON_TIMER_INIT (facron_executor_run_deferred, request);
+    request->executor = executor;
+    request->pid = pid;
+    request->deadline = deadline;
+    request->command = (FacronCommand *) memcpy (request->data, command, command_size);
+    request->path = (char *) memcpy ((char *) request->data + command_size, path, path_len);
+
+    facron_executor_submit (executor, request);
+}
+
+int
+facron_executor_get_fd (const FacronExecutor *executor)
+{
+    return executor->signal_fd;
+}
+
+int
+facron_executor_get_queue_fd (const FacronExecutor *executor)
+{
+    return facron_ring_get_fd (executor->requests);
+}
+
+void
+facron_executor_dispatch (FacronExecutor *executor)
+{
+    void *request;
+
+    while ((request = facron_ring_try_pop (executor->requests)))
+    {
+        switch (*(FacronRequestKind *) request)
+        {
+        case REQUEST_SPAWN:
+        {
+            FacronJob *job = (FacronJob *) request;
+
+            if (executor->max_jobs && executor->n_running >= executor->max_jobs)
+                facron_executor_queue (executor, job);
+            else
+            {
+                facron_executor_launch (executor, job->argv, job->stamp);
+                facron_executor_request_free (executor, job);
+            }
+            break;
+        }
+        case REQUEST_DEBOUNCE:
+        {
+            FacronDebounceRequest *debounce = (FacronDebounceRequest *) request;
+
+            facron_debounce_submit (executor->debounce, debounce->owner, debounce->command, debounce->path, debounce->pid, debounce->window, debounce->leading);
+            facron_executor_request_free (executor, debounce);
+            break;
+        }
+        case REQUEST_BATCH:
+        {
+            FacronBatchRequest *batch = (FacronBatchRequest *) request;
+
+            facron_batcher_submit (executor->batcher, batch->owner, batch->command, batch->path, batch->pid, batch->window, batch->max);
+            facron_executor_request_free (executor, batch);
+            break;
+        }
+        case REQUEST_DEFER:
+        {
+            FacronDeferRequest *defer = (FacronDeferRequest *) request;
+
+            defer->prev = &executor->deferred;
+            defer->next = executor->deferred;
+            if (defer->next)
+                defer->next->prev = &defer->next;
+            executor->deferred = defer;
+            facron_timers_schedule (executor->timers, &defer->timer, defer->deadline);
+            break;
+        }
+        case REQUEST_STREAM:
+        {
+            FacronStreamRequest *stream = (FacronStreamRequest *) request;
+
+            facron_executor_write_record (executor, stream->command, stream->record, stream->len, stream->stamp);
+            facron_executor_request_free (executor, stream);
+            break;
+        }
+        }
+    }
+}
+
+bool
+facron_executor_is_own (const FacronExecutor *executor,
+                        pid_t                 pid)
+{
+    return facron_lineage_contains (executor->lineage, pid);
+}
+
+bool
+facron_executor_is_idle (const FacronExecutor *executor)
+{
+    return !executor->n_running && !executor->pending && !facron_ring_get_depth (executor->requests) &&
+           !executor->deferred && facron_batcher_is_idle (executor->batcher) && facron_streams_is_idle (executor->streams);
+}
+
+void
+facron_executor_retain_stream (FacronExecutor      *executor,
+                               const FacronCommand *command)
+{
+    facron_streams_retain (executor->streams, command);
+}
+
+void
+facron_executor_sweep_streams (FacronExecutor *executor)
+{
+    facron_streams_sweep (executor->streams);
+}
+
+void
+facron_executor_set_dry_run (FacronExecutor *executor,
+                             bool            dry_run)
+{
+    executor->dry_run = dry_run;
+}
+
+bool
+facron_executor_is_dry_run (const FacronExecutor *executor)
+{
+    return executor->dry_run;
+}
+
+void
+facron_executor_print_metrics (const FacronExecutor *executor,
+                               FILE                 *out)
+{
+    fprintf (out, "# HELP facron_jobs_running Commands currently running.\n"
+                  "# TYPE facron_jobs_running gauge\n"
+                  "facron_jobs_running %u\n", executor->n_running);
+    fprintf (out, "# HELP facron_jobs_pending Commands waiting for a job slot.\n"
+                  "# TYPE facron_jobs_pending gauge\n"
+                  "facron_jobs_pending %u\n", executor->n_pending);
+    fprintf (out, "# HELP facron_requests_queued Requests waiting for the main loop.\n"
+                  "# TYPE facron_requests_queued gauge\n"
+                  "facron_requests_queued %zu\n", facron_ring_get_depth (executor->requests));
+}
+
+void
+facron_executor_reap (FacronExecutor *executor)
+{
+    struct signalfd_siginfo info[16];
+
+    /* SIGCHLD coalesces, the siginfo are only used as a wakeup */
+    while (read (executor->signal_fd, info, sizeof (info)) > 0);
+
+    for (pid_t pid; (pid = waitpid (-1, NULL, WNOHANG)) > 0;)
+    {
+        facron_lineage_exited (executor->lineage, pid);
+        if (facron_streams_reap (executor->streams, pid))
+            continue;
+        if (executor->n_running)
+            --executor->n_running;
+    }
+
+    while (executor->pending && (!executor->max_jobs || executor->n_running < executor->max_jobs))
+    {
+        FacronJob *job = executor->pending;
+
+        executor->pending = job->next;
+        if (!executor->pending)
+            executor->pending_tail = NULL;
+        --executor->n_pending;
+
+        facron_executor_launch (executor, job->argv, job->stamp);
+        facron_executor_request_free (executor, job);
+    }
+}
+
+void
+facron_executor_free (FacronExecutor *executor)
+{
+    if (!executor)
+        return;
+
+    facron_debounce_free (executor->debounce);
+    facron_batcher_free (executor->batcher);
+
+    for (FacronDeferRequest *next; executor->deferred; executor->deferred = next)
+    {
+        next = executor->deferred->next;
+        facron_timers_cancel (executor->timers, &executor->deferred->timer);
+        facron_executor_request_free (executor, executor->deferred);
+    }
+    facron_streams_free (executor->streams);
+    facron_lineage_free (executor->lineage);
+
+    for (void *request; (request = facron_ring_try_pop (executor->requests));)
+        facron_executor_request_free (executor, request);
+    facron_ring_free (executor->requests);
+
+    for (FacronJob *next; executor->pending; executor->pending = next)
+    {
+        next = executor->pending->next;
+        facron_executor_request_free (executor, executor->pending);
+    }
+
+    facron_ring_free (executor->free_slots);
+    free (executor->slots);
+
+    free (executor->batch_scratch);
+    free (executor->batch_argv);
+    posix_spawnattr_destroy (&executor->attr);
+    close (executor->signal_fd);
+    free (executor);
+}
+
+/* What is left of ARG_MAX for arguments once our environment is passed along */
+static size_t
+facron_executor_get_arg_max (void)
+{
+    long arg_max = sysconf (_SC_ARG_MAX);
+    size_t size = (arg_max > 0) ? (size_t) arg_max : ARG_MAX;
+    size_t env = 0;
+
+    for (char **e = environ; *e; ++e)
+        env += strlen (*e) + 1 + sizeof (char *);
+
+    /* Slack for the executable name and the NULL terminators */
+    env += PATH_MAX + 2 * sizeof (char *);
+
+    return (size > env + ARG_MAX / 2) ? size - env : ARG_MAX / 2;
+}
+
+FacronExecutor *
+facron_executor_new (unsigned int       max_jobs,
+                     unsigned int       max_pending,
+                     FacronLimitPolicy  overflow,
+                     FacronTimers      *timers)
+{
+    FacronExecutor *executor = (FacronExecutor *) calloc (1, sizeof (FacronExecutor));
+    sigset_t mask, empty, pipe;
+
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGCHLD);
+    sigprocmask (SIG_BLOCK, &mask, NULL);
+
+    if ((executor->signal_fd = signalfd (-1, &mask, SFD_NONBLOCK|SFD_CLOEXEC)) < 0)
+    {
+        fprintf (stderr, "Error: could not create signalfd: %s\n", strerror (errno));
+        free (executor);
+        return NULL;
+    }
+
+    /* Writing to a stream handler which died must fail instead of killing us */
+    signal (SIGPIPE, SIG_IGN);
+
+    /*
+     * Children must not inherit our blocked SIGCHLD nor ignored SIGPIPE.
+     * They lead their own process group, for their descendants to be
+     * recognized as ours.
+     */
+    sigemptyset (&empty);
+    sigemptyset (&pipe);
+    sigaddset (&pipe, SIGPIPE);
+    posix_spawnattr_init (&executor->attr);
+    posix_spawnattr_setsigmask (&executor->attr, &empty);
+    posix_spawnattr_setsigdefault (&executor->attr, &pipe);
+    posix_spawnattr_setpgroup (&executor->attr, 0);
+    posix_spawnattr_setflags (&executor->attr, POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETPGROUP);
+
+    if (!(executor->requests = facron_ring_new (MAX_REQUESTS, FACRON_RING_WAKE_BATCH)))
+    {
+        close (executor->signal_fd);
+        free (executor);
+        return NULL;
+    }
+
+    executor->slots = (char *) malloc (REQUEST_SLOTS * REQUEST_SLOT_SIZE);
+    executor->free_slots = facron_ring_new (REQUEST_SLOTS, FACRON_RING_WAKE_NONE);
+    for (size_t i = 0; i < REQUEST_SLOTS; ++i)
+        facron_ring_push (executor->free_slots, executor->slots + i * REQUEST_SLOT_SIZE);
+
+    executor->max_jobs = max_jobs;
+    executor->max_pending = max_pending;
+    executor->overflow = overflow;
+    executor->timers = timers;
+    executor->debounce = facron_debounce_new (timers, executor);
+    executor->batcher = facron_batcher_new (timers, executor);
+    executor->arg_max = facron_executor_get_arg_max ();
+    executor->lineage = facron_lineage_new ();
+    executor->streams = facron_streams_new (timers, &executor->attr, executor->lineage);
+
+    return executor;
+}
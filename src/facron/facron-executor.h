@@ -0,0 +1,128 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_EXECUTOR_H__
+#define __FACRON_EXECUTOR_H__
+
+#include "facron-command.h"
+#include "facron-limit.h"
+#include "facron-timers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+typedef struct FacronExecutor FacronExecutor;
+
+/* Loop thread only */
+void facron_executor_spawn    (FacronExecutor      *executor,
+                               char               **argv);
+void facron_executor_exec     (FacronExecutor      *executor,
+                               const FacronCommand *command,
+                               const char          *path,
+                               pid_t                pid);
+
+/*
+ * $$, $@ and $# expand to all of the paths, split across as many commands
+ * as it takes for each to fit in ARG_MAX. Stream commands get a record
+ * for each path.
+ */
+void facron_executor_exec_paths (FacronExecutor      *executor,
+                                 const FacronCommand *command,
+                                 char *const         *paths,
+                                 size_t               n_paths,
+                                 pid_t                pid);
+
+/*
+ * Any thread, the requests are carried out by facron_executor_dispatch,
+ * except for built-in actions which run right away. Stream commands get
+ * the event written to their handler instead. stamp is when the event
+ * got read, for the latency metrics.
+ */
+void facron_executor_run      (FacronExecutor      *executor,
+                               const FacronCommand *command,
+                               const char          *path,
+                               pid_t                pid,
+                               uint64_t             stamp);
+void facron_executor_debounce (FacronExecutor      *executor,
+                               uint64_t             owner,
+                               const FacronCommand *command,
+                               const char          *path,
+                               pid_t                pid,
+                               unsigned int         window,
+                               bool                 leading);
+/*
+ * Runs the command at deadline, in milliseconds as facron_timers_now
+ * counts them, without going through debounce nor batches.
+ */
+void facron_executor_defer    (FacronExecutor      *executor,
+                               const FacronCommand *command,
+                               const char          *path,
+                               pid_t                pid,
+                               uint64_t             deadline);
+void facron_executor_batch    (FacronExecutor      *executor,
+                               uint64_t             owner,
+                               const FacronCommand *command,
+                               const char          *path,
+                               pid_t                pid,
+                               unsigned int         window,
+                               unsigned int         max);
+
+int  facron_executor_get_fd       (const FacronExecutor *executor);
+int  facron_executor_get_queue_fd (const FacronExecutor *executor);
+void facron_executor_reap         (FacronExecutor       *executor);
+void facron_executor_dispatch     (FacronExecutor       *executor);
+
+/* Any thread, whether pid is facron or was spawned by it, directly or not */
+bool facron_executor_is_own (const FacronExecutor *executor,
+                             pid_t                 pid);
+
+/* Nothing running, waiting for a slot, a batch window, a deadline nor for dispatch */
+bool facron_executor_is_idle (const FacronExecutor *executor);
+
+/*
+ * Loop thread, closes the stream handlers of the commands which were not
+ * retained since the last sweep.
+ */
+void facron_executor_retain_stream (FacronExecutor      *executor,
+                                    const FacronCommand *command);
+void facron_executor_sweep_streams (FacronExecutor      *executor);
+
+/* Commands are then accounted for as if they ran, without being spawned */
+void facron_executor_set_dry_run (FacronExecutor       *executor,
+                                  bool                  dry_run);
+bool facron_executor_is_dry_run  (const FacronExecutor *executor);
+
+void facron_executor_print_metrics (const FacronExecutor *executor,
+                                    FILE                 *out);
+
+void facron_executor_free (FacronExecutor *executor);
+
+/*
+ * Once max_jobs commands are running, the others are dropped, coalesced
+ * with an identical one waiting, or wait for a slot, as the overflow
+ * policy says. At most max_pending of them wait, the others are dropped.
+ */
+FacronExecutor *facron_executor_new (unsigned int       max_jobs,
+                                     unsigned int       max_pending,
+                                     FacronLimitPolicy  overflow,
+                                     FacronTimers      *timers);
+
+#endif /* __FACRON_EXECUTOR_H__ */
@@ -0,0 +1,391 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-fid.h"
+#include "facron-timers.h"
+#include "facron-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/statfs.h>
+
+#include <linux/limits.h>
+
+#define MAX_RECORDS 65536
+
+/* Milliseconds a negative record is trusted for */
+#define NEGATIVE_TTL 1000
+
+/* Older headers lack it, older kernels reject it */
+#ifndef AT_HANDLE_FID
+#define AT_HANDLE_FID 0x200
+#endif
+
+/*
+ * Directories are identified by their filesystem id and file handle. Each
+ * one we have seen is resolved once, then remembered either with its path
+ * or, if no entry can match anything in it, as a negative record so that
+ * later events in there are dropped without any syscall.
+ *
+ * Directories get renamed and moved around meanwhile. A path is checked
+ * to still lead to the same handle before being used, which is a single
+ * lookup, cheaper than resolving the handle. Negative records get resolved
+ * again once they are NEGATIVE_TTL old instead, for a directory moved to
+ * where entries can match in it.
+ */
+typedef struct FacronFidRecord FacronFidRecord;
+struct FacronFidRecord
+{
+    FacronFidRecord *next;
+    uint64_t         hash;
+    char            *path;
+    size_t           path_len;
+    /* When a negative record got resolved */
+    uint64_t         stamp;
+    size_t           key_len;
+    unsigned char    key[];
+};
+
+typedef struct
+{
+    __kernel_fsid_t fsid;
+    int             fd;
+} FacronFidMount;
+
+struct FacronFidCache
+{
+    FacronFidRecord **buckets;
+    size_t            size;
+    size_t            n_records;
+    FacronFidMount   *mounts;
+    size_t            n_mounts;
+    unsigned int      generation;
+    bool              ready;
+};
+
+static void
+facron_fid_cache_clear (FacronFidCache *cache)
+{
+    for (size_t i = 0; i < cache->size; ++i)
+    {
+        for (FacronFidRecord *record = cache->buckets[i], *next; record; record = next)
+        {
+            next = record->next;
+            free (record->path);
+            free (record);
+        }
+        cache->buckets[i] = NULL;
+    }
+
+    cache->n_records = 0;
+}
+
+static int
+facron_fid_cache_get_mount (const FacronFidCache  *cache,
+                            const __kernel_fsid_t *fsid)
+{
+    for (size_t i = 0; i < cache->n_mounts; ++i)
+    {
+        if (!memcmp (&cache->mounts[i].fsid, fsid, sizeof (*fsid)))
+            return cache->mounts[i].fd;
+    }
+
+    return -1;
+}
+
+/*
+ * open_by_handle_at needs a real, not O_PATH, fd on the filesystem of each
+ * handle. Use the parent directories of the entries so that we do not
+ * generate events on the entries themselves.
+ */
+static void
+facron_fid_cache_reset (FacronFidCache             *cache,
+                        const FacronConfGeneration *conf)
+{
+    facron_fid_cache_clear (cache);
+
+    for (size_t i = 0; i < cache->n_mounts; ++i)
+        close (cache->mounts[i].fd);
+    cache->n_mounts = 0;
+
+    for (const FacronConfEntry *entry = facron_conf_get_entries (conf); entry; entry = facron_conf_entry_get_next (entry))
+    {
+        const char *path = facron_conf_entry_get_path (entry);
+        char *sep = strrchr (path, '/');
+        char *dir = (sep && sep != path) ? strndup (path, sep - path) : strdup ("/");
+        struct statfs st;
+        __kernel_fsid_t fsid;
+        int fd = open (dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+        free (dir);
+
+        if (fd < 0)
+            continue;
+
+        if (fstatfs (fd, &st) < 0)
+        {
+            close (fd);
+            continue;
+        }
+
+        memcpy (&fsid, &st.f_fsid, sizeof (fsid));
+        if (facron_fid_cache_get_mount (cache, &fsid) >= 0)
+        {
+            close (fd);
+            continue;
+        }
+
+        cache->mounts = (FacronFidMount *) realloc (cache->mounts, (cache->n_mounts + 1) * sizeof (FacronFidMount));
+        cache->mounts[cache->n_mounts].fsid = fsid;
+        cache->mounts[cache->n_mounts++].fd = fd;
+    }
+
+    cache->generation = facron_conf_get_generation (conf);
+    cache->ready = true;
+}
+
+static FacronFidRecord *
+facron_fid_cache_lookup (const FacronFidCache *cache,
+                         const unsigned char  *key,
+                         size_t                key_len,
+                         uint64_t              hash)
+{
+    for (FacronFidRecord *record = cache->buckets[hash & (cache->size - 1)]; record; record = record->next)
+    {
+        if (record->hash == hash && record->key_len == key_len && !memcmp (record->key, key, key_len))
+            return record;
+    }
+
+    return NULL;
+}
+
+/* The current path of the directory behind raw_handle, NUL terminated */
+static ssize_t
+facron_fid_cache_get_dir (const FacronFidCache  *cache,
+                          const __kernel_fsid_t *fsid,
+                          const unsigned char   *raw_handle,
+                          char                   dir[PATH_MAX])
+{
+    union {
+        struct file_handle handle;
+        char               buf[sizeof (struct file_handle) + MAX_HANDLE_SZ];
+    } fh;
+    char proc_path[sizeof ("/proc/self/fd/") + 3 * sizeof (int)];
+    int mount_fd = facron_fid_cache_get_mount (cache, fsid);
+
+    if (mount_fd < 0)
+        return -1;
+
+    memcpy (&fh.handle, raw_handle, sizeof (struct file_handle));
+    if (fh.handle.handle_bytes > MAX_HANDLE_SZ)
+        return -1;
+    memcpy (fh.handle.f_handle, raw_handle + sizeof (struct file_handle), fh.handle.handle_bytes);
+
+    int fd = open_by_handle_at (mount_fd, &fh.handle, O_PATH|O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    sprintf (proc_path, "/proc/self/fd/%d", fd);
+    ssize_t dir_len = readlink (proc_path, dir, PATH_MAX - 1);
+    close (fd);
+    if (dir_len >= 0)
+        dir[dir_len] = '\0';
+
+    return dir_len;
+}
+
+/* Whether the path of record still leads to the directory it got resolved for */
+static bool
+facron_fid_record_is_current (const FacronFidRecord *record)
+{
+    union {
+        struct file_handle handle;
+        char               buf[sizeof (struct file_handle) + MAX_HANDLE_SZ];
+    } fh;
+    /* The key is the fsid followed by the whole struct file_handle */
+    const unsigned char *handle = record->key + sizeof (__kernel_fsid_t);
+    size_t handle_len = record->key_len - sizeof (__kernel_fsid_t);
+    int mount_id;
+
+    /* The kind of handle fanotify reports, which any filesystem has */
+    fh.handle.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at (AT_FDCWD, record->path, &fh.handle, &mount_id, AT_HANDLE_FID) < 0)
+    {
+        fh.handle.handle_bytes = MAX_HANDLE_SZ;
+        if (errno != EINVAL || name_to_handle_at (AT_FDCWD, record->path, &fh.handle, &mount_id, 0) < 0)
+            return false;
+    }
+
+    return sizeof (struct file_handle) + fh.handle.handle_bytes == handle_len &&
+           !memcmp (&fh.handle, handle, handle_len);
+}
+
+static void
+facron_fid_record_set_dir (FacronFidRecord            *record,
+                           const FacronConfGeneration *conf,
+                           const char                 *dir,
+                           size_t                      dir_len)
+{
+    free (record->path);
+    record->path = (facron_conf_may_match_dir (conf, dir, dir_len)) ? strndup (dir, dir_len) : NULL;
+    record->path_len = dir_len;
+    record->stamp = (record->path) ? 0 : facron_timers_now ();
+}
+
+static FacronFidRecord *
+facron_fid_cache_insert (FacronFidCache             *cache,
+                         const FacronConfGeneration *conf,
+                         const unsigned char        *key,
+                         size_t                      key_len,
+                         uint64_t                    hash,
+                         const __kernel_fsid_t      *fsid,
+                         const unsigned char        *raw_handle)
+{
+    char dir[PATH_MAX];
+    ssize_t dir_len = facron_fid_cache_get_dir (cache, fsid, raw_handle, dir);
+
+    if (dir_len < 0)
+        return NULL;
+
+    if (cache->n_records >= MAX_RECORDS)
+        facron_fid_cache_clear (cache);
+
+    FacronFidRecord *record = (FacronFidRecord *) malloc (sizeof (FacronFidRecord) + key_len);
+    FacronFidRecord **bucket = &cache->buckets[hash & (cache->size - 1)];
+
+    record->hash = hash;
+    record->key_len = key_len;
+    memcpy (record->key, key, key_len);
+    record->path = NULL;
+    facron_fid_record_set_dir (record, conf, dir, dir_len);
+    record->next = *bucket;
+    *bucket = record;
+    ++cache->n_records;
+
+    return record;
+}
+
+/* Resolves the handle of a record again, false if it is gone */
+static bool
+facron_fid_cache_refresh (FacronFidCache             *cache,
+                          const FacronConfGeneration *conf,
+                          FacronFidRecord            *record,
+                          const __kernel_fsid_t      *fsid,
+                          const unsigned char        *raw_handle)
+{
+    char dir[PATH_MAX];
+    ssize_t dir_len = facron_fid_cache_get_dir (cache, fsid, raw_handle, dir);
+
+    if (dir_len < 0)
+        return false;
+
+    facron_fid_record_set_dir (record, conf, dir, dir_len);
+    return true;
+}
+
+ssize_t
+facron_fid_cache_resolve (FacronFidCache             *cache,
+                          const FacronConfGeneration *conf,
+                          const FacronMetadata       *metadata,
+                          char                       *path,
+                          size_t                      size)
+{
+    const struct fanotify_event_info_fid *fid = NULL;
+
+    if (!cache->ready || cache->generation != facron_conf_get_generation (conf))
+        facron_fid_cache_reset (cache, conf);
+
+    for (const char *info = (const char *) metadata + metadata->metadata_len, *end = (const char *) metadata + metadata->event_len; info < end;)
+    {
+        const struct fanotify_event_info_header *header = (const struct fanotify_event_info_header *) info;
+
+        if (!header->len)
+            break;
+        if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+        {
+            fid = (const struct fanotify_event_info_fid *) info;
+            break;
+        }
+        info += header->len;
+    }
+
+    if (!fid)
+        return -1;
+
+    /* The key is the fsid followed by the whole struct file_handle */
+    struct file_handle handle;
+    memcpy (&handle, fid->handle, sizeof (handle));
+
+    const unsigned char *key = (const unsigned char *) &fid->fsid;
+    size_t key_len = sizeof (fid->fsid) + sizeof (struct file_handle) + handle.handle_bytes;
+    const char *name = (const char *) fid->handle + sizeof (struct file_handle) + handle.handle_bytes;
+    uint64_t hash = facron_hash ((const char *) key, key_len);
+
+    FacronFidRecord *record = facron_fid_cache_lookup (cache, key, key_len, hash);
+    if (!record)
+        record = facron_fid_cache_insert (cache, conf, key, key_len, hash, &fid->fsid, fid->handle);
+    else if ((record->path) ? !facron_fid_record_is_current (record) : facron_timers_now () - record->stamp > NEGATIVE_TTL)
+    {
+        if (!facron_fid_cache_refresh (cache, conf, record, &fid->fsid, fid->handle))
+            return -1;
+    }
+    if (!record || !record->path)
+        return -1;
+
+    if (!strcmp (name, "."))
+    {
+        if (record->path_len >= size)
+            return -1;
+        memcpy (path, record->path, record->path_len + 1);
+        return record->path_len;
+    }
+
+    int len = snprintf (path, size, "%s/%s", (record->path_len > 1) ? record->path : "", name);
+
+    return (len < 0 || (size_t) len >= size) ? -1 : len;
+}
+
+void
+facron_fid_cache_free (FacronFidCache *cache)
+{
+    if (!cache)
+        return;
+
+    facron_fid_cache_clear (cache);
+    for (size_t i = 0; i < cache->n_mounts; ++i)
+        close (cache->mounts[i].fd);
+    free (cache->mounts);
+    free (cache->buckets);
+    free (cache);
+}
+
+FacronFidCache *
+facron_fid_cache_new (void)
+{
+    FacronFidCache *cache = (FacronFidCache *) calloc (1, sizeof (FacronFidCache));
+
+    cache->size = MAX_RECORDS;
+    cache->buckets = (FacronFidRecord **) calloc (cache->size, sizeof (FacronFidRecord *));
+
+    return cache;
+}
@@ -0,0 +1,41 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_FID_H__
+#define __FACRON_FID_H__
+
+#include "facron-conf.h"
+
+typedef struct FacronFidCache FacronFidCache;
+
+/*
+ * Resolves the path of an event reported with FAN_REPORT_DFID_NAME into
+ * path, returns its length or -1 when it cannot match any entry.
+ */
+ssize_t facron_fid_cache_resolve (FacronFidCache             *cache,
+                                  const FacronConfGeneration *conf,
+                                  const FacronMetadata       *metadata,
+                                  char                       *path,
+                                  size_t                      size);
+
+void facron_fid_cache_free (FacronFidCache *cache);
+
+FacronFidCache *facron_fid_cache_new (void);
+
+#endif /* __FACRON_FID_H__ */
@@ -0,0 +1,735 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-glob.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * The automaton is a nondeterministic one, built as a trie of the patterns
+ * so that those sharing a prefix share its states, and simulated with a
+ * set of current states. A state may loop on the characters of a * or a
+ * **, epsilon edges lead into those loops without consuming anything.
+ */
+typedef enum
+{
+    EDGE_LITERAL,
+    EDGE_ANY,
+    EDGE_CLASS,
+    EDGE_EPSILON,
+    /* Epsilon edges while building, kept apart so that only alike wildcards get shared */
+    EDGE_STAR,
+    EDGE_GLOBSTAR,
+    EDGE_TAIL
+} FacronGlobEdgeKind;
+
+typedef enum
+{
+    LOOP_NONE,
+    LOOP_NOSLASH,
+    LOOP_ANY
+} FacronGlobLoop;
+
+typedef struct
+{
+    uint64_t bits[4];
+} FacronGlobClass;
+
+typedef struct
+{
+    uint8_t  kind;
+    uint8_t  c;
+    uint32_t class;
+    uint32_t target;
+} FacronGlobEdge;
+
+/* Literal edges come first, sorted by character */
+typedef struct
+{
+    uint32_t edges;
+    uint32_t n_literals;
+    uint32_t n_edges;
+    uint32_t values;
+    uint32_t n_values;
+    uint32_t loop;
+} FacronGlobState;
+
+/* Followed by the classes, the states, the edges and the values of the accepting states */
+struct FacronGlob
+{
+    uint32_t n_states;
+    uint32_t n_edges;
+    uint32_t n_classes;
+    uint32_t n_values;
+};
+
+typedef struct
+{
+    FacronGlobEdge *edges;
+    size_t          n_edges;
+    uint32_t       *values;
+    size_t          n_values;
+    FacronGlobLoop  loop;
+} FacronGlobNode;
+
+struct FacronGlobBuilder
+{
+    FacronGlobNode  *nodes;
+    size_t           n_nodes;
+    size_t           nodes_size;
+    FacronGlobClass *classes;
+    size_t           n_classes;
+    size_t           n_edges;
+    size_t           n_values;
+};
+
+typedef struct
+{
+    uint32_t *sparse;
+    uint32_t *dense;
+    size_t    n;
+} FacronGlobSet;
+
+typedef struct
+{
+    size_t   size;
+    uint32_t memory[];
+} FacronGlobScratch;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static inline const FacronGlobClass *
+facron_glob_get_classes (const FacronGlob *glob)
+{
+    return (const FacronGlobClass *) (glob + 1);
+}
+
+static inline const FacronGlobState *
+facron_glob_get_states (const FacronGlob *glob)
+{
+    return (const FacronGlobState *) (facron_glob_get_classes (glob) + glob->n_classes);
+}
+
+static inline const FacronGlobEdge *
+facron_glob_get_edges (const FacronGlob *glob)
+{
+    return (const FacronGlobEdge *) (facron_glob_get_states (glob) + glob->n_states);
+}
+
+static inline const uint32_t *
+facron_glob_get_values (const FacronGlob *glob)
+{
+    return (const uint32_t *) (facron_glob_get_edges (glob) + glob->n_edges);
+}
+
+static inline bool
+facron_glob_class_has (const FacronGlobClass *class,
+                       unsigned char          c)
+{
+    return class->bits[c / 64] & (1ULL << (c % 64));
+}
+
+/* Returns what follows the class, NULL if it is not closed, then not a class */
+static const char *
+facron_glob_parse_class (const char      *p,
+                         FacronGlobClass *class)
+{
+    bool negate = (*p == '!' || *p == '^');
+
+    memset (class, 0, sizeof (*class));
+    if (negate)
+        ++p;
+
+    for (bool first = true; *p && (first || *p != ']'); first = false)
+    {
+        unsigned char lo = *p, hi;
+
+        if (lo == '\\' && p[1])
+            lo = *++p;
+        hi = lo;
+        ++p;
+
+        if (*p == '-' && p[1] && p[1] != ']')
+        {
+            hi = *++p;
+            if (hi == '\\' && p[1])
+                hi = *++p;
+            ++p;
+        }
+
+        for (unsigned int c = lo; c <= hi; ++c)
+            class->bits[c / 64] |= 1ULL << (c % 64);
+    }
+
+    if (!*p)
+        return NULL;
+
+    for (unsigned int i = 0; negate && i < 4; ++i)
+        class->bits[i] = ~class->bits[i];
+
+    /* Classes only ever match within a component */
+    class->bits[0] &= ~((1ULL << '/') | 1ULL);
+
+    return p + 1;
+}
+
+static const char *
+facron_glob_find_wildcard (const char *path)
+{
+    FacronGlobClass class;
+
+    for (const char *p = path; *p; ++p)
+    {
+        if (*p == '\\' && p[1])
+            ++p;
+        else if (*p == '*' || *p == '?' || (*p == '[' && facron_glob_parse_class (p + 1, &class)))
+            return p;
+    }
+
+    return NULL;
+}
+
+bool
+facron_glob_is_pattern (const char *path)
+{
+    return facron_glob_find_wildcard (path);
+}
+
+size_t
+facron_glob_copy_root (const char *pattern,
+                       char       *root)
+{
+    const char *end = facron_glob_find_wildcard (pattern);
+    size_t len = 0;
+
+    if (!end)
+        end = pattern + strlen (pattern);
+    while (end > pattern && end[-1] != '/')
+        --end;
+
+    /* Up to the last separator before the wildcard, excluded */
+    for (const char *p = pattern; p + 1 < end; ++p)
+    {
+        if (*p == '\\' && p + 2 < end)
+            ++p;
+        root[len++] = *p;
+    }
+
+    if (!len)
+        root[len++] = '/';
+    root[len] = '\0';
+
+    return len;
+}
+
+bool
+facron_glob_is_deep (const char *pattern)
+{
+    const char *wildcard = facron_glob_find_wildcard (pattern);
+
+    return wildcard && (strchr (wildcard, '/') || strstr (wildcard, "**"));
+}
+
+bool
+facron_glob_is_readable (const char *path)
+{
+    if (!facron_glob_is_pattern (path))
+        return !access (path, R_OK);
+
+    char *root = (char *) malloc (strlen (path) + 1);
+    bool readable;
+
+    facron_glob_copy_root (path, root);
+    readable = !access (root, R_OK);
+    free (root);
+
+    return readable;
+}
+
+static void
+facron_glob_free_scratch (void *scratch)
+{
+    free (scratch);
+}
+
+static void
+facron_glob_create_scratch_key (void)
+{
+    pthread_key_create (&scratch_key, facron_glob_free_scratch);
+}
+
+/* Each thread keeps room for two sets as large as the largest automaton it ran */
+static void
+facron_glob_get_sets (const FacronGlob *glob,
+                      FacronGlobSet     sets[2])
+{
+    FacronGlobScratch *scratch;
+
+    pthread_once (&scratch_once, facron_glob_create_scratch_key);
+    scratch = (FacronGlobScratch *) pthread_getspecific (scratch_key);
+
+    if (!scratch || scratch->size < glob->n_states)
+    {
+        free (scratch);
+        scratch = (FacronGlobScratch *) calloc (1, sizeof (FacronGlobScratch) + 4 * glob->n_states * sizeof (uint32_t));
+        scratch->size = glob->n_states;
+        pthread_setspecific (scratch_key, scratch);
+    }
+
+    for (unsigned int i = 0; i < 2; ++i)
+    {
+        sets[i].sparse = scratch->memory + 2 * i * scratch->size;
+        sets[i].dense = sets[i].sparse + scratch->size;
+        sets[i].n = 0;
+    }
+}
+
+static inline void
+facron_glob_set_add (FacronGlobSet *set,
+                     uint32_t       state)
+{
+    uint32_t i = set->sparse[state];
+
+    if (i < set->n && set->dense[i] == state)
+        return;
+
+    set->sparse[state] = set->n;
+    set->dense[set->n++] = state;
+}
+
+/* Adds whatever the epsilon edges reach, the set doubling as the work list */
+static void
+facron_glob_close (const FacronGlob *glob,
+                   FacronGlobSet    *set)
+{
+    const FacronGlobState *states = facron_glob_get_states (glob);
+    const FacronGlobEdge *edges = facron_glob_get_edges (glob);
+
+    for (size_t i = 0; i < set->n; ++i)
+    {
+        const FacronGlobState *state = &states[set->dense[i]];
+
+        for (uint32_t e = state->edges + state->n_literals; e < state->edges + state->n_edges; ++e)
+        {
+            if (edges[e].kind == EDGE_EPSILON)
+                facron_glob_set_add (set, edges[e].target);
+        }
+    }
+}
+
+static void
+facron_glob_step (const FacronGlob    *glob,
+                  const FacronGlobSet *from,
+                  FacronGlobSet       *to,
+                  unsigned char        c)
+{
+    const FacronGlobClass *classes = facron_glob_get_classes (glob);
+    const FacronGlobState *states = facron_glob_get_states (glob);
+    const FacronGlobEdge *edges = facron_glob_get_edges (glob);
+
+    to->n = 0;
+
+    for (size_t i = 0; i < from->n; ++i)
+    {
+        const FacronGlobState *state = &states[from->dense[i]];
+        const FacronGlobEdge *literals = edges + state->edges;
+
+        if (state->loop == LOOP_ANY || (state->loop == LOOP_NOSLASH && c != '/'))
+            facron_glob_set_add (to, from->dense[i]);
+
+        for (size_t lo = 0, hi = state->n_literals; lo < hi;)
+        {
+            size_t mid = (lo + hi) / 2;
+
+            if (literals[mid].c == c)
+            {
+                facron_glob_set_add (to, literals[mid].target);
+                break;
+            }
+            if (literals[mid].c < c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for (uint32_t e = state->n_literals; e < state->n_edges; ++e)
+        {
+            const FacronGlobEdge *edge = &literals[e];
+
+            if ((edge->kind == EDGE_ANY && c != '/') || (edge->kind == EDGE_CLASS && facron_glob_class_has (&classes[edge->class], c)))
+                facron_glob_set_add (to, edge->target);
+        }
+    }
+
+    facron_glob_close (glob, to);
+}
+
+/* Returns the set of the states reached, NULL once none is left */
+static FacronGlobSet *
+facron_glob_run (const FacronGlob *glob,
+                 FacronGlobSet     sets[2],
+                 const char       *path,
+                 size_t            len)
+{
+    FacronGlobSet *current = &sets[0], *next = &sets[1];
+
+    facron_glob_set_add (current, 0);
+    facron_glob_close (glob, current);
+
+    for (size_t i = 0; i < len; ++i)
+    {
+        facron_glob_step (glob, current, next, path[i]);
+        if (!next->n)
+            return NULL;
+
+        FacronGlobSet *swap = current;
+        current = next;
+        next = swap;
+    }
+
+    return current;
+}
+
+void
+facron_glob_match (const FacronGlob *glob,
+                   const char       *path,
+                   size_t            len,
+                   FacronGlobFunc    func,
+                   void             *data)
+{
+    const FacronGlobState *states = facron_glob_get_states (glob);
+    const uint32_t *values = facron_glob_get_values (glob);
+    FacronGlobSet sets[2], *reached;
+
+    facron_glob_get_sets (glob, sets);
+
+    if (!(reached = facron_glob_run (glob, sets, path, len)))
+        return;
+
+    for (size_t i = 0; i < reached->n; ++i)
+    {
+        const FacronGlobState *state = &states[reached->dense[i]];
+
+        for (uint32_t v = 0; v < state->n_values; ++v)
+            func (values[state->values + v], data);
+    }
+}
+
+bool
+facron_glob_may_match_dir (const FacronGlob *glob,
+                           const char       *dir,
+                           size_t            len)
+{
+    const FacronGlobState *states = facron_glob_get_states (glob);
+    FacronGlobSet sets[2], *reached;
+
+    facron_glob_get_sets (glob, sets);
+
+    if (!(reached = facron_glob_run (glob, sets, dir, len)))
+        return false;
+
+    /* Only / comes with its separator */
+    if (len && dir[len - 1] == '/')
+        return true;
+
+    for (size_t i = 0; i < reached->n; ++i)
+    {
+        if (states[reached->dense[i]].n_values)
+            return true;
+    }
+
+    FacronGlobSet *below = (reached == &sets[0]) ? &sets[1] : &sets[0];
+
+    facron_glob_step (glob, reached, below, '/');
+
+    return below->n;
+}
+
+/* Grows arrays when they get full, their capacity being the next power of two */
+static void *
+facron_glob_grow (void   *array,
+                  size_t  n,
+                  size_t  size)
+{
+    if (n && (n & (n - 1)))
+        return array;
+
+    return realloc (array, ((n) ? 2 * n : 1) * size);
+}
+
+static uint32_t
+facron_glob_builder_add_node (FacronGlobBuilder *builder,
+                              FacronGlobLoop     loop)
+{
+    if (builder->n_nodes == builder->nodes_size)
+    {
+        builder->nodes_size = (builder->nodes_size) ? builder->nodes_size * 2 : 64;
+        builder->nodes = (FacronGlobNode *) realloc (builder->nodes, builder->nodes_size * sizeof (FacronGlobNode));
+    }
+
+    builder->nodes[builder->n_nodes] = (FacronGlobNode) { .loop = loop };
+
+    return builder->n_nodes++;
+}
+
+static void
+facron_glob_builder_add_edge (FacronGlobBuilder  *builder,
+                              uint32_t            from,
+                              FacronGlobEdgeKind  kind,
+                              unsigned char       c,
+                              uint32_t            class,
+                              uint32_t            target)
+{
+    FacronGlobNode *node = &builder->nodes[from];
+
+    node->edges = (FacronGlobEdge *) facron_glob_grow (node->edges, node->n_edges, sizeof (FacronGlobEdge));
+    node->edges[node->n_edges++] = (FacronGlobEdge) { .kind = kind, .c = c, .class = class, .target = target };
+    ++builder->n_edges;
+}
+
+/* The state an alike edge already leads to, or a new one */
+static uint32_t
+facron_glob_builder_child (FacronGlobBuilder  *builder,
+                           uint32_t            from,
+                           FacronGlobEdgeKind  kind,
+                           unsigned char       c,
+                           uint32_t            class,
+                           FacronGlobLoop      loop,
+                           bool               *created)
+{
+    const FacronGlobNode *node = &builder->nodes[from];
+
+    for (size_t i = 0; i < node->n_edges; ++i)
+    {
+        const FacronGlobEdge *edge = &node->edges[i];
+
+        if (edge->kind == kind && (kind != EDGE_LITERAL || edge->c == c) && (kind != EDGE_CLASS || edge->class == class))
+        {
+            *created = false;
+            return edge->target;
+        }
+    }
+
+    uint32_t target = facron_glob_builder_add_node (builder, loop);
+
+    facron_glob_builder_add_edge (builder, from, kind, c, class, target);
+    *created = true;
+
+    return target;
+}
+
+static uint32_t
+facron_glob_builder_intern_class (FacronGlobBuilder     *builder,
+                                  const FacronGlobClass *class)
+{
+    for (size_t i = 0; i < builder->n_classes; ++i)
+    {
+        if (!memcmp (&builder->classes[i], class, sizeof (*class)))
+            return i;
+    }
+
+    builder->classes = (FacronGlobClass *) facron_glob_grow (builder->classes, builder->n_classes, sizeof (FacronGlobClass));
+    builder->classes[builder->n_classes] = *class;
+
+    return builder->n_classes++;
+}
+
+void
+facron_glob_builder_add (FacronGlobBuilder *builder,
+                         const char        *pattern,
+                         uint32_t           value)
+{
+    size_t len = strlen (pattern);
+    uint32_t state = 0;
+    bool created;
+
+    for (size_t i = 0; i < len;)
+    {
+        FacronGlobClass class;
+        const char *end;
+
+        if (pattern[i] == '*')
+        {
+            size_t stars = i;
+
+            while (stars < len && pattern[stars] == '*')
+                ++stars;
+
+            /* A ** only spans directories as a whole component */
+            if (stars - i > 1 && i && pattern[i - 1] == '/' && stars == len)
+                state = facron_glob_builder_child (builder, state, EDGE_TAIL, 0, 0, LOOP_ANY, &created);
+            else if (stars - i > 1 && i && pattern[i - 1] == '/' && pattern[stars] == '/')
+            {
+                /* Either nothing, or anything up to a separator, then back here */
+                uint32_t next = facron_glob_builder_child (builder, state, EDGE_GLOBSTAR, 0, 0, LOOP_NONE, &created);
+
+                if (created)
+                {
+                    uint32_t loop = facron_glob_builder_add_node (builder, LOOP_ANY);
+
+                    facron_glob_builder_add_edge (builder, next, EDGE_EPSILON, 0, 0, loop);
+                    facron_glob_builder_add_edge (builder, loop, EDGE_LITERAL, '/', 0, next);
+                }
+
+                state = next;
+                ++stars;
+            }
+            else
+                state = facron_glob_builder_child (builder, state, EDGE_STAR, 0, 0, LOOP_NOSLASH, &created);
+
+            i = stars;
+        }
+        else if (pattern[i] == '?')
+        {
+            state = facron_glob_builder_child (builder, state, EDGE_ANY, 0, 0, LOOP_NONE, &created);
+            ++i;
+        }
+        else if (pattern[i] == '[' && (end = facron_glob_parse_class (pattern + i + 1, &class)))
+        {
+            uint32_t id = facron_glob_builder_intern_class (builder, &class);
+
+            state = facron_glob_builder_child (builder, state, EDGE_CLASS, 0, id, LOOP_NONE, &created);
+            i = end - pattern;
+        }
+        else
+        {
+            if (pattern[i] == '\\' && i + 1 < len)
+                ++i;
+            state = facron_glob_builder_child (builder, state, EDGE_LITERAL, pattern[i], 0, LOOP_NONE, &created);
+            ++i;
+        }
+    }
+
+    FacronGlobNode *node = &builder->nodes[state];
+
+    node->values = (uint32_t *) facron_glob_grow (node->values, node->n_values, sizeof (uint32_t));
+    node->values[node->n_values++] = value;
+    ++builder->n_values;
+}
+
+bool
+facron_glob_builder_is_empty (const FacronGlobBuilder *builder)
+{
+    return !builder->n_values;
+}
+
+size_t
+facron_glob_builder_measure (const FacronGlobBuilder *builder)
+{
+    return sizeof (FacronGlob) + builder->n_classes * sizeof (FacronGlobClass) + builder->n_nodes * sizeof (FacronGlobState) +
+           builder->n_edges * sizeof (FacronGlobEdge) + builder->n_values * sizeof (uint32_t);
+}
+
+static int
+facron_glob_compare_edges (const void *a,
+                           const void *b)
+{
+    const FacronGlobEdge *edge_a = (const FacronGlobEdge *) a;
+    const FacronGlobEdge *edge_b = (const FacronGlobEdge *) b;
+    bool literal_a = edge_a->kind == EDGE_LITERAL;
+    bool literal_b = edge_b->kind == EDGE_LITERAL;
+
+    if (literal_a != literal_b)
+        return (literal_a) ? -1 : 1;
+
+    return (literal_a) ? edge_a->c - edge_b->c : 0;
+}
+
+void
+facron_glob_builder_compile (const FacronGlobBuilder *builder,
+                             FacronGlob              *glob)
+{
+    glob->n_states = builder->n_nodes;
+    glob->n_edges = builder->n_edges;
+    glob->n_classes = builder->n_classes;
+    glob->n_values = builder->n_values;
+
+    FacronGlobClass *classes = (FacronGlobClass *) facron_glob_get_classes (glob);
+    FacronGlobState *states = (FacronGlobState *) facron_glob_get_states (glob);
+    FacronGlobEdge *edges = (FacronGlobEdge *) facron_glob_get_edges (glob);
+    uint32_t *values = (uint32_t *) facron_glob_get_values (glob);
+    uint32_t n_edges = 0, n_values = 0;
+
+    if (builder->n_classes)
+        memcpy (classes, builder->classes, builder->n_classes * sizeof (FacronGlobClass));
+
+    for (size_t i = 0; i < builder->n_nodes; ++i)
+    {
+        const FacronGlobNode *node = &builder->nodes[i];
+        FacronGlobState *state = &states[i];
+
+        *state = (FacronGlobState) {
+            .edges = n_edges,
+            .n_edges = node->n_edges,
+            .values = n_values,
+            .n_values = node->n_values,
+            .loop = node->loop
+        };
+
+        if (node->n_edges)
+            memcpy (edges + n_edges, node->edges, node->n_edges * sizeof (FacronGlobEdge));
+        qsort (edges + n_edges, node->n_edges, sizeof (FacronGlobEdge), facron_glob_compare_edges);
+
+        for (uint32_t e = n_edges; e < n_edges + node->n_edges; ++e)
+        {
+            if (edges[e].kind == EDGE_LITERAL)
+                ++state->n_literals;
+            else if (edges[e].kind > EDGE_EPSILON)
+                edges[e].kind = EDGE_EPSILON;
+        }
+
+        if (node->n_values)
+            memcpy (values + n_values, node->values, node->n_values * sizeof (uint32_t));
+
+        n_edges += node->n_edges;
+        n_values += node->n_values;
+    }
+}
+
+void
+facron_glob_builder_free (FacronGlobBuilder *builder)
+{
+    if (!builder)
+        return;
+
+    for (size_t i = 0; i < builder->n_nodes; ++i)
+    {
+        free (builder->nodes[i].edges);
+        free (builder->nodes[i].values);
+    }
+
+    free (builder->nodes);
+    free (builder->classes);
+    free (builder);
+}
+
+FacronGlobBuilder *
+facron_glob_builder_new (void)
+{
+    FacronGlobBuilder *builder = (FacronGlobBuilder *) calloc (1, sizeof (FacronGlobBuilder));
+
+    /* The initial state */
+    facron_glob_builder_add_node (builder, LOOP_NONE);
+
+    return builder;
+}
@@ -0,0 +1,85 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_GLOB_H__
+#define __FACRON_GLOB_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Patterns are absolute paths where * matches any run of characters but
+ * /, ? a single one, [...] one out of a class, [!...] or [^...] one out
+ * of its complement, and ** a whole run of directories. A backslash takes
+ * the next character literally.
+ */
+bool facron_glob_is_pattern (const char *path);
+
+/*
+ * The deepest directory above the first wildcard, unescaped, written to
+ * root which must be as large as the pattern. Returns its length.
+ */
+size_t facron_glob_copy_root (const char *pattern,
+                              char       *root);
+
+/* Whether the pattern may match further than the children of its root */
+bool facron_glob_is_deep (const char *pattern);
+
+/* Whether the path, or the root of a pattern, can be read */
+bool facron_glob_is_readable (const char *path);
+
+/*
+ * All the patterns of a generation are compiled together in a single
+ * automaton, which shares their common prefixes and is run once over a
+ * path to find every pattern matching it. It is a single relocatable
+ * block, like commands.
+ */
+typedef struct FacronGlob FacronGlob;
+typedef struct FacronGlobBuilder FacronGlobBuilder;
+
+/* Called with the value of each pattern matching the path */
+typedef void (*FacronGlobFunc) (uint32_t  value,
+                                void     *data);
+
+void facron_glob_match (const FacronGlob *glob,
+                        const char       *path,
+                        size_t            len,
+                        FacronGlobFunc    func,
+                        void             *data);
+
+/* Whether some pattern may match the directory or something below it */
+bool facron_glob_may_match_dir (const FacronGlob *glob,
+                                const char       *dir,
+                                size_t            len);
+
+void facron_glob_builder_add (FacronGlobBuilder *builder,
+                              const char        *pattern,
+                              uint32_t           value);
+
+bool   facron_glob_builder_is_empty (const FacronGlobBuilder *builder);
+size_t facron_glob_builder_measure  (const FacronGlobBuilder *builder);
+void   facron_glob_builder_compile  (const FacronGlobBuilder *builder,
+                                     FacronGlob              *glob);
+
+void facron_glob_builder_free (FacronGlobBuilder *builder);
+
+FacronGlobBuilder *facron_glob_builder_new (void);
+
+#endif /* __FACRON_GLOB_H__ */
@@ -0,0 +1,606 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-index.h"
+#include "facron-glob.h"
+#include "facron-util.h"
+
+#include "facron-metrics.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A bucket groups all the entries sharing the very same key, in
+ * configuration order. Buckets live in open addressed tables whose size
+ * is a power of two, at most half full.
+ *
+ * The whole index is a single block without any pointer, so that it can
+ * be saved along with the entries and mapped back as is. Keys are always
+ * a prefix of the path of some entry and are stored as an offset from the
+ * first entry, as are the entries of each bucket. Patterns are left out of
+ * the tables, all of them are compiled into a single automaton at the end
+ * of the block.
+ */
+typedef struct
+{
+    uint64_t hash;
+    uint32_t key;
+    /* 0 for an empty slot */
+    uint32_t key_len;
+    /* Where the entries of the bucket are listed in the block */
+    uint32_t entries;
+    uint32_t n_entries;
+} FacronIndexBucket;
+
+typedef struct
+{
+    FacronIndexBucket *buckets;
+    size_t             size;
+    size_t             n_buckets;
+    unsigned long long mask;
+} FacronIndexTable;
+
+typedef enum
+{
+    TABLE_EXACT,
+    TABLE_CHILD,
+    TABLE_TREE,
+    TABLE_DIRS,
+    N_TABLES
+} FacronIndexTableId;
+
+/* The beginning of the block */
+typedef struct
+{
+    struct
+    {
+        uint32_t           buckets;
+        uint32_t           size;
+        uint32_t           n_buckets;
+        unsigned long long mask;
+    } tables[N_TABLES];
+    uint32_t           n_entries;
+    /* 0 without patterns */
+    uint32_t           glob;
+    uint32_t           glob_size;
+    unsigned long long glob_mask;
+} FacronIndexHeader;
+
+typedef unsigned int (*FacronIndexHandler) (const FacronConfEntry *entry,
+                                            FacronLimit           *limit,
+                                            FacronExecutor        *executor,
+                                            const FacronEvent     *event);
+
+struct FacronIndex
+{
+    /* The first entry, which keys and entries are relative to */
+    const char         *base;
+    FacronIndexTable    tables[N_TABLES];
+    const FacronGlob   *glob;
+    /* Union of the masks of the patterns */
+    unsigned long long  glob_mask;
+    /* Patterns, while building */
+    FacronGlobBuilder  *patterns;
+    const char         *image;
+    size_t              image_size;
+    /* Owns the block, unless it was loaded */
+    FacronArena        *arena;
+    /* Commands triggered by each entry, by id */
+    atomic_ulong       *matches;
+    /* Token buckets of the entries with a rate limit, by id */
+    FacronLimit        *limits;
+    unsigned int        n_entries;
+};
+
+static FacronIndexBucket *
+facron_index_table_lookup (const FacronIndex      *index,
+                           const FacronIndexTable *table,
+                           const char             *key,
+                           size_t                  key_len,
+                           uint64_t                hash)
+{
+    if (!table->n_buckets)
+        return NULL;
+
+    for (size_t i = hash & (table->size - 1); table->buckets[i].key_len; i = (i + 1) & (table->size - 1))
+    {
+        FacronIndexBucket *bucket = &table->buckets[i];
+        if (bucket->hash == hash && bucket->key_len == key_len && !memcmp (index->base + bucket->key, key, key_len))
+            return bucket;
+    }
+
+    return NULL;
+}
+
+static void
+facron_index_table_grow (FacronIndexTable *table)
+{
+    FacronIndexBucket *old = table->buckets;
+    size_t old_size = table->size;
+
+    table->size = (old_size) ? old_size * 2 : 64;
+    table->buckets = (FacronIndexBucket *) calloc (table->size, sizeof (FacronIndexBucket));
+
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        if (!old[i].key_len)
+            continue;
+
+        size_t j = old[i].hash & (table->size - 1);
+        while (table->buckets[j].key_len)
+            j = (j + 1) & (table->size - 1);
+        table->buckets[j] = old[i];
+    }
+
+    free (old);
+}
+
+static FacronIndexBucket *
+facron_index_table_insert_key (FacronIndex      *index,
+                               FacronIndexTable *table,
+                               const char       *key,
+                               size_t            key_len,
+                               uint64_t          hash)
+{
+    FacronIndexBucket *bucket = facron_index_table_lookup (index, table, key, key_len, hash);
+
+    if (!bucket)
+    {
+        if (2 * (table->n_buckets + 1) > table->size)
+            facron_index_table_grow (table);
+
+        size_t i = hash & (table->size - 1);
+        while (table->buckets[i].key_len)
+            i = (i + 1) & (table->size - 1);
+
+        bucket = &table->buckets[i];
+        bucket->key = key - index->base;
+        bucket->key_len = key_len;
+        bucket->hash = hash;
+        ++table->n_buckets;
+    }
+
+    return bucket;
+}
+
+/*
+ * Entries are first only counted, then listed once the block got room for
+ * all of them, in the same order.
+ */
+static void
+facron_index_table_insert (FacronIndex           *index,
+                           FacronIndexTable      *table,
+                           const FacronConfEntry *entry,
+                           size_t                 key_len,
+                           unsigned long long     mask,
+                           char                  *block)
+{
+    const char *path = facron_conf_entry_get_path (entry);
+    uint64_t hash = (key_len == facron_conf_entry_get_path_len (entry)) ? facron_conf_entry_get_hash (entry) : facron_hash (path, key_len);
+    FacronIndexBucket *bucket = facron_index_table_insert_key (index, table, path, key_len, hash);
+
+    if (block)
+        ((uint32_t *) (block + bucket->entries))[bucket->n_entries] = (const char *) entry - index->base;
+    ++bucket->n_entries;
+    table->mask |= mask;
+}
+
+static void
+facron_index_add_dir (FacronIndex *index,
+                      const char  *path,
+                      size_t       len)
+{
+    while (len > 1 && path[len - 1] == '/')
+        --len;
+
+    facron_index_table_insert_key (index, &index->tables[TABLE_DIRS], path, len, facron_hash (path, len));
+}
+
+static void
+facron_index_add_dirs (FacronIndex           *index,
+                       const FacronConfEntry *entry)
+{
+    const char *path = facron_conf_entry_get_path (entry);
+    size_t len = facron_conf_entry_get_path_len (entry);
+
+    /*
+     * Events are reported relative to their parent directory, which is the
+     * entry itself for children and for events on the entry itself, which
+     * come with the name ".".
+     */
+    facron_index_add_dir (index, path, len);
+
+    while (len > 1 && path[len - 1] == '/')
+        --len;
+    while (len > 1 && path[len - 1] != '/')
+        --len;
+    facron_index_add_dir (index, path, len);
+}
+
+static void
+facron_index_add (FacronIndex           *index,
+                  const FacronConfEntry *entry,
+                  char                  *block)
+{
+    const char *path = facron_conf_entry_get_path (entry);
+    size_t len = facron_conf_entry_get_path_len (entry);
+    unsigned long long child_mask = facron_conf_entry_get_child_mask (entry);
+
+    if (!block)
+        index->n_entries = facron_conf_entry_get_id (entry) + 1;
+
+    if (facron_conf_entry_get_pattern (entry))
+    {
+        if (!block)
+        {
+            facron_glob_builder_add (index->patterns, facron_conf_entry_get_pattern (entry), (const char *) entry - index->base);
+            index->glob_mask |= facron_conf_entry_get_mask (entry);
+        }
+        return;
+    }
+
+    if (!block)
+        facron_index_add_dirs (index, entry);
+
+    if (facron_conf_entry_is_recursive (entry))
+    {
+        while (len > 1 && path[len - 1] == '/')
+            --len;
+        facron_index_table_insert (index, &index->tables[TABLE_TREE], entry, len, facron_conf_entry_get_mask (entry), block);
+        return;
+    }
+
+    facron_index_table_insert (index, &index->tables[TABLE_EXACT], entry, len, facron_conf_entry_get_mask (entry), block);
+    if (child_mask)
+        facron_index_table_insert (index, &index->tables[TABLE_CHILD], entry, len, child_mask, block);
+}
+
+/* Moves the tables to the block, with room for the entries of each bucket */
+static char *
+facron_index_build_block (FacronIndex *index)
+{
+    size_t offsets[N_TABLES];
+    size_t n_listed = 0;
+
+    for (unsigned int t = 0; t < N_TABLES; ++t)
+    {
+        for (size_t i = 0; i < index->tables[t].size; ++i)
+            n_listed += index->tables[t].buckets[i].n_entries;
+    }
+
+    index->arena = facron_arena_new ();
+
+    size_t header_offset = facron_arena_alloc (index->arena, sizeof (FacronIndexHeader));
+    size_t list = facron_arena_alloc (index->arena, n_listed * sizeof (uint32_t));
+
+    for (unsigned int t = 0; t < N_TABLES; ++t)
+        offsets[t] = facron_arena_alloc (index->arena, index->tables[t].size * sizeof (FacronIndexBucket));
+
+    size_t glob_size = (facron_glob_builder_is_empty (index->patterns)) ? 0 : facron_glob_builder_measure (index->patterns);
+    size_t glob_offset = (glob_size) ? facron_arena_alloc (index->arena, glob_size) : 0;
+
+    /* Nothing gets allocated from there on, pointers are stable */
+    char *block = (char *) facron_arena_get (index->arena, 0);
+    FacronIndexHeader *header = (FacronIndexHeader *) (block + header_offset);
+
+    for (unsigned int t = 0; t < N_TABLES; ++t)
+    {
+        FacronIndexTable *table = &index->tables[t];
+        FacronIndexBucket *buckets = (FacronIndexBucket *) (block + offsets[t]);
+
+        if (table->size)
+            memcpy (buckets, table->buckets, table->size * sizeof (FacronIndexBucket));
+        free (table->buckets);
+        table->buckets = buckets;
+
+        for (size_t i = 0; i < table->size; ++i)
+        {
+            buckets[i].entries = list;
+            list += buckets[i].n_entries * sizeof (uint32_t);
+            buckets[i].n_entries = 0;
+        }
+
+        header->tables[t].buckets = offsets[t];
+        header->tables[t].size = table->size;
+        header->tables[t].n_buckets = table->n_buckets;
+        header->tables[t].mask = table->mask;
+    }
+    header->n_entries = index->n_entries;
+
+    if (glob_size)
+    {
+        facron_glob_builder_compile (index->patterns, (FacronGlob *) (block + glob_offset));
+        index->glob = (const FacronGlob *) (block + glob_offset);
+        header->glob = glob_offset;
+        header->glob_size = glob_size;
+        header->glob_mask = index->glob_mask;
+    }
+    facron_glob_builder_free (index->patterns);
+    index->patterns = NULL;
+
+    index->image = block;
+    index->image_size = facron_arena_get_size (index->arena);
+
+    return block;
+}
+
+static bool
+facron_index_in_tree (const FacronIndex *index,
+                      const char        *path,
+                      size_t             path_len)
+{
+    const FacronIndexTable *tree = &index->tables[TABLE_TREE];
+
+    if (!tree->n_buckets)
+        return false;
+
+    uint64_t hash = FACRON_HASH_INIT;
+    for (size_t i = 0; i < path_len; ++i)
+    {
+        if (path[i] == '/' && i + 1 < path_len)
+        {
+            if (i && facron_index_table_lookup (index, tree, path, i, hash))
+                return true;
+            hash = facron_hash_step (hash, '/');
+            if (!i && facron_index_table_lookup (index, tree, path, 1, hash))
+                return true;
+        }
+        else
+            hash = facron_hash_step (hash, path[i]);
+    }
+
+    return facron_index_table_lookup (index, tree, path, path_len, hash);
+}
+
+bool
+facron_index_may_match_dir (const FacronIndex *index,
+                            const char        *dir,
+                            size_t             dir_len)
+{
+    return facron_index_table_lookup (index, &index->tables[TABLE_DIRS], dir, dir_len, facron_hash (dir, dir_len)) ||
+           facron_index_in_tree (index, dir, dir_len) ||
+           (index->glob && facron_glob_may_match_dir (index->glob, dir, dir_len));
+}
+
+static inline unsigned int
+facron_index_run (const FacronIndex     *index,
+                  FacronIndexHandler     handler,
+                  const FacronConfEntry *entry,
+                  FacronExecutor        *executor,
+                  const FacronEvent     *event)
+{
+    unsigned int id = facron_conf_entry_get_id (entry);
+    unsigned int n = handler (entry, &index->limits[id], executor, event);
+
+    if (n)
+    {
+        atomic_fetch_add_explicit (&index->matches[id], n, memory_order_relaxed);
+        facron_metrics_add (FACRON_METRIC_MATCHES, n);
+    }
+
+    return n;
+}
+
+static inline unsigned int
+facron_index_probe (const FacronIndex      *index,
+                    const FacronIndexTable *table,
+                    FacronIndexHandler      handler,
+                    FacronExecutor         *executor,
+                    size_t                  key_len,
+                    uint64_t                hash,
+                    const FacronEvent      *event)
+{
+    const FacronIndexBucket *bucket = facron_index_table_lookup (index, table, event->path, key_len, hash);
+    unsigned int total = 0;
+
+    if (bucket)
+    {
+        const uint32_t *entries = (const uint32_t *) (index->image + bucket->entries);
+
+        for (size_t i = 0; i < bucket->n_entries; ++i)
+            total += facron_index_run (index, handler, (const FacronConfEntry *) (index->base + entries[i]), executor, event);
+    }
+
+    return total;
+}
+
+typedef struct
+{
+    const FacronIndex *index;
+    FacronExecutor    *executor;
+    const FacronEvent *event;
+    unsigned int       n;
+} FacronIndexMatch;
+
+static void
+facron_index_match_pattern (uint32_t  entry,
+                            void     *data)
+{
+    FacronIndexMatch *match = (FacronIndexMatch *) data;
+
+    match->n += facron_index_run (match->index, facron_conf_entry_handle_tree, (const FacronConfEntry *) (match->index->base + entry),
+                                  match->executor, match->event);
+}
+
+unsigned int
+facron_index_handle (const FacronIndex *index,
+                     FacronExecutor    *executor,
+                     const FacronEvent *event)
+{
+    const FacronIndexTable *exact = &index->tables[TABLE_EXACT];
+    const FacronIndexTable *child_table = &index->tables[TABLE_CHILD];
+    const FacronIndexTable *tree_table = &index->tables[TABLE_TREE];
+    const char *path = event->path;
+    size_t path_len = event->path_len;
+    bool child = child_table->mask & event->metadata->mask;
+    bool tree = tree_table->mask & event->metadata->mask;
+    unsigned int n = 0;
+
+    if (exact->mask & event->metadata->mask)
+        n += facron_index_probe (index, exact, facron_conf_entry_handle, executor, path_len, facron_hash (path, path_len), event);
+
+    /* Every pattern is matched at once */
+    if (index->glob && (index->glob_mask & event->metadata->mask))
+    {
+        FacronIndexMatch match = { .index = index, .executor = executor, .event = event };
+
+        facron_glob_match (index->glob, path, path_len, facron_index_match_pattern, &match);
+        n += match.n;
+    }
+
+    if (!child && !tree)
+        return n;
+
+    /*
+     * Every strict ancestor of path may carry a FAN_EVENT_ON_CHILD entry,
+     * spelled either with or without its trailing slash, or a recursive
+     * one. Walk the path once, hashing it as we go, and probe the tables
+     * at each separator.
+     */
+    uint64_t hash = FACRON_HASH_INIT;
+    for (size_t i = 0; i < path_len; ++i)
+    {
+        if (path[i] == '/' && i + 1 < path_len)
+        {
+            if (child)
+                n += facron_index_probe (index, child_table, facron_conf_entry_handle_child, executor, i, hash, event);
+            if (tree && i)
+                n += facron_index_probe (index, tree_table, facron_conf_entry_handle_tree, executor, i, hash, event);
+            hash = facron_hash_step (hash, '/');
+            if (child)
+                n += facron_index_probe (index, child_table, facron_conf_entry_handle_child, executor, i + 1, hash, event);
+            if (tree && !i)
+                n += facron_index_probe (index, tree_table, facron_conf_entry_handle_tree, executor, 1, hash, event);
+        }
+        else
+            hash = facron_hash_step (hash, path[i]);
+    }
+
+    /* Recursive entries also match their own root */
+    if (tree)
+        n += facron_index_probe (index, tree_table, facron_conf_entry_handle_tree, executor, path_len, hash, event);
+
+    return n;
+}
+
+unsigned long
+facron_index_get_matches (const FacronIndex     *index,
+                          const FacronConfEntry *entry)
+{
+    return atomic_load_explicit (&index->matches[facron_conf_entry_get_id (entry)], memory_order_relaxed);
+}
+
+unsigned long
+facron_index_get_rejected (const FacronIndex     *index,
+                           const FacronConfEntry *entry)
+{
+    return facron_limit_get_rejected (&index->limits[facron_conf_entry_get_id (entry)]);
+}
+
+const void *
+facron_index_get_image (const FacronIndex *index,
+                        size_t            *size)
+{
+    *size = index->image_size;
+    return index->image;
+}
+
+void
+facron_index_free (FacronIndex *index)
+{
+    if (!index)
+        return;
+
+    facron_arena_free (index->arena);
+    free (index->matches);
+    free (index->limits);
+    facron_glob_builder_free (index->patterns);
+    free (index);
+}
+
+static FacronIndex *
+facron_index_alloc_counters (FacronIndex *index)
+{
+    index->matches = (atomic_ulong *) calloc (index->n_entries, sizeof (atomic_ulong));
+    index->limits = (FacronLimit *) calloc (index->n_entries, sizeof (FacronLimit));
+
+    return index;
+}
+
+/*
+ * The image is trusted as much as the configuration it was compiled from,
+ * see facron_cache_load: beyond its header fitting, nothing in it gets
+ * checked, no more than the entries it points into.
+ */
+FacronIndex *
+facron_index_load (const FacronConfEntry *entries,
+                   const void            *image,
+                   size_t                 size)
+{
+    const FacronIndexHeader *header = (const FacronIndexHeader *) image;
+
+    if (size < sizeof (FacronIndexHeader))
+        return NULL;
+
+    FacronIndex *index = (FacronIndex *) calloc (1, sizeof (FacronIndex));
+
+    index->base = (const char *) entries;
+    index->image = (const char *) image;
+    index->image_size = size;
+    index->n_entries = header->n_entries;
+
+    for (unsigned int t = 0; t < N_TABLES; ++t)
+    {
+        FacronIndexTable *table = &index->tables[t];
+
+        table->buckets = (FacronIndexBucket *) (index->image + header->tables[t].buckets);
+        table->size = header->tables[t].size;
+        table->n_buckets = header->tables[t].n_buckets;
+        table->mask = header->tables[t].mask;
+    }
+
+    if (header->glob)
+    {
+        index->glob = (const FacronGlob *) (index->image + header->glob);
+        index->glob_mask = header->glob_mask;
+    }
+
+    return facron_index_alloc_counters (index);
+}
+
+FacronIndex *
+facron_index_new (const FacronConfEntry *entries)
+{
+    FacronIndex *index = (FacronIndex *) calloc (1, sizeof (FacronIndex));
+
+    index->base = (const char *) entries;
+    index->patterns = facron_glob_builder_new ();
+
+    for (const FacronConfEntry *entry = entries; entry; entry = facron_conf_entry_get_next (entry))
+        facron_index_add (index, entry, NULL);
+
+    char *block = facron_index_build_block (index);
+
+    for (const FacronConfEntry *entry = entries; entry; entry = facron_conf_entry_get_next (entry))
+        facron_index_add (index, entry, block);
+
+    return facron_index_alloc_counters (index);
+}
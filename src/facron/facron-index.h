@@ -0,0 +1,57 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_INDEX_H__
+#define __FACRON_INDEX_H__
+
+#include "facron-conf-entry.h"
+
+typedef struct FacronIndex FacronIndex;
+
+/* Returns how many commands the event triggered */
+unsigned int facron_index_handle (const FacronIndex *index,
+                                  FacronExecutor    *executor,
+                                  const FacronEvent *event);
+
+/* Commands the entry triggered since its generation got loaded */
+unsigned long facron_index_get_matches (const FacronIndex     *index,
+                                        const FacronConfEntry *entry);
+
+/* Events its rate limit dropped or coalesced since its generation got loaded */
+unsigned long facron_index_get_rejected (const FacronIndex     *index,
+                                         const FacronConfEntry *entry);
+
+bool facron_index_may_match_dir (const FacronIndex *index,
+                                 const char        *dir,
+                                 size_t             dir_len);
+
+/* A single block without pointers, valid along with the entries */
+const void *facron_index_get_image (const FacronIndex *index,
+                                    size_t            *size);
+
+void facron_index_free (FacronIndex *index);
+
+FacronIndex *facron_index_new (const FacronConfEntry *entries);
+
+/* Uses an image of the index of those very entries in place, NULL if it's invalid */
+FacronIndex *facron_index_load (const FacronConfEntry *entries,
+                                const void            *image,
+                                size_t                 size);
+
+#endif /* __FACRON_INDEX_H__ */
@@ -18,21 +18,59 @@
  */
 
 #include "facron-lexer.h"
+#include "facron-glob.h"
+#include "facron-util.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <linux/fanotify.h>
 
+/* Below that, a chunk isn't worth a thread */
+#define MIN_CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNKS     16
+
+#define CHECK_THREADS 16
+#define CHECK_SPLIT   64
+
+typedef struct
+{
+    char            *begin;
+    char            *end;
+    FacronLexeme    *tokens;
+    size_t           n_tokens;
+    size_t           tokens_size;
+    FacronLexerLine *lines;
+    size_t           n_lines;
+    size_t           lines_size;
+    pthread_t        thread;
+    bool             started;
+} FacronLexerChunk;
+
+/*
+ * The file is mapped privately with a spare byte after its end, so that
+ * tokens can be NUL terminated in place, the last one included.
+ */
 struct FacronLexer
 {
-    const char *filename;
-    FILE       *file;
-    char       *line;
-    char       *line_beg;
-    ssize_t     len;
-    ssize_t     index;
+    const char       *filename;
+    char             *map;
+    size_t            map_size;
+    size_t            size;
+    struct timespec   mtime;
+    FacronLexerChunk  chunks[MAX_CHUNKS];
+    unsigned int      n_chunks;
+    FacronLexerLine  *lines;
+    size_t            n_lines;
 };
 
 static FacronChar
@@ -289,109 +327,207 @@ is_space (char c)
     return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
 }
 
-bool
-facron_lexer_read_line (FacronLexer *lexer)
+static void
+facron_lexer_chunk_add_token (FacronLexerChunk *chunk,
+                              char             *str,
+                              size_t            len,
+                              bool              quoted)
 {
-    if (lexer->line_beg)
-        free (lexer->line_beg);
+    if (chunk->n_tokens == chunk->tokens_size)
+    {
+        chunk->tokens_size = (chunk->tokens_size) ? chunk->tokens_size * 2 : 1024;
+        chunk->tokens = (FacronLexeme *) realloc (chunk->tokens, chunk->tokens_size * sizeof (FacronLexeme));
+    }
+
+    chunk->tokens[chunk->n_tokens++] = (FacronLexeme) { .str = str, .len = len, .quoted = quoted };
+}
+
+/* Lines starting with a space, empty ones included, are skipped */
+static void
+facron_lexer_chunk_tokenize_line (FacronLexerChunk *chunk,
+                                  char             *line,
+                                  char             *end)
+{
+    if (line == end || is_space (*line))
+        return;
+
+    size_t first = chunk->n_tokens;
+
+    for (char *c = line; c < end; ++c)
+    {
+        if (is_space (*c))
+            continue;
+
+        /* Quoted strings run to their closing quote or to the end of the line */
+        char delim = (*c == '"' || *c == '\'') ? *(c++) : '\0';
+        char *str = c;
 
-    size_t dummy_len = 0;
+        while (c < end && ((delim == '\0') ? !is_space (*c) : *c != delim))
+            ++c;
+
+        *c = '\0';
+        facron_lexer_chunk_add_token (chunk, str, c - str, delim != '\0');
+    }
 
-    lexer->len = getline (&lexer->line, &dummy_len, lexer->file);
-    lexer->line_beg = lexer->line;
-    lexer->index = 0;
+    if (chunk->n_lines == chunk->lines_size)
+    {
+        chunk->lines_size = (chunk->lines_size) ? chunk->lines_size * 2 : 256;
+        chunk->lines = (FacronLexerLine *) realloc (chunk->lines, chunk->lines_size * sizeof (FacronLexerLine));
+    }
 
-    return (lexer->len >= 1);
+    chunk->lines[chunk->n_lines++] = (FacronLexerLine) {
+        /* An offset for now, the tokens may still move */
+        .tokens = (const FacronLexeme *) (uintptr_t) first,
+        .n_tokens = chunk->n_tokens - first,
+    };
 }
 
-bool
-facron_lexer_invalid_line (FacronLexer *lexer)
+static void *
+facron_lexer_chunk_tokenize (void *data)
 {
-    return (lexer->line == NULL || is_space (lexer->line[0]));
+    FacronLexerChunk *chunk = (FacronLexerChunk *) data;
+
+    for (char *line = chunk->begin; line < chunk->end;)
+    {
+        char *end = (char *) memchr (line, '\n', chunk->end - line);
+
+        if (!end)
+            end = chunk->end;
+        facron_lexer_chunk_tokenize_line (chunk, line, end);
+        line = end + 1;
+    }
+
+    for (size_t i = 0; i < chunk->n_lines; ++i)
+        chunk->lines[i].tokens = chunk->tokens + (uintptr_t) chunk->lines[i].tokens;
+
+    return NULL;
 }
 
-bool
-facron_lexer_end_of_line (FacronLexer *lexer)
+static void
+facron_lexer_clear (FacronLexer *lexer)
 {
-    return (!lexer->len || lexer->index == lexer->len);
+    for (unsigned int i = 0; i < lexer->n_chunks; ++i)
+    {
+        free (lexer->chunks[i].tokens);
+        free (lexer->chunks[i].lines);
+    }
+    memset (lexer->chunks, 0, sizeof (lexer->chunks));
+    lexer->n_chunks = 0;
+
+    free (lexer->lines);
+    lexer->lines = NULL;
+    lexer->n_lines = 0;
+
+    if (lexer->map)
+        munmap (lexer->map, lexer->map_size);
+    lexer->map = NULL;
 }
 
-char *
-facron_lexer_read_string (FacronLexer *lexer)
+size_t
+facron_lexer_tokenize (FacronLexer *lexer)
 {
-    if (!lexer->line || !lexer->len)
-        return NULL;
-
-    char delim = (lexer->line[0] == '"' || lexer->line[0] == '\'') ? lexer->line[0] : '\0';
+    long n_cpus = sysconf (_SC_NPROCESSORS_ONLN);
+    size_t n_chunks = lexer->size / MIN_CHUNK_SIZE;
+    char *begin = lexer->map;
+    char *end = lexer->map + lexer->size;
+
+    if (n_chunks > (size_t) n_cpus)
+        n_chunks = n_cpus;
+    if (n_chunks > MAX_CHUNKS)
+        n_chunks = MAX_CHUNKS;
+    if (!n_chunks)
+        n_chunks = 1;
+
+    /* Split at line boundaries, chunks are tokenized concurrently */
+    for (size_t i = 0; i < n_chunks && begin < end; ++i)
+    {
+        FacronLexerChunk *chunk = &lexer->chunks[lexer->n_chunks++];
+        char *split = lexer->map + lexer->size * (i + 1) / n_chunks;
+
+        if (split < begin)
+            split = begin;
+        if (split < end && !(split = (char *) memchr (split, '\n', end - split)))
+            split = end;
+
+        chunk->begin = begin;
+        chunk->end = split;
+        begin = split + 1;
+
+        /* The last chunk is ours */
+        if (i + 1 < n_chunks && !pthread_create (&chunk->thread, NULL, facron_lexer_chunk_tokenize, chunk))
+            chunk->started = true;
+        else
+            facron_lexer_chunk_tokenize (chunk);
+    }
 
-    if (delim != '\0')
+    for (unsigned int i = 0; i < lexer->n_chunks; ++i)
     {
-        ++lexer->line;
-        --lexer->len;
+        if (lexer->chunks[i].started)
+            pthread_join (lexer->chunks[i].thread, NULL);
+        lexer->n_lines += lexer->chunks[i].n_lines;
     }
 
-    const char *line_beg = lexer->line;
+    lexer->lines = (FacronLexerLine *) malloc (lexer->n_lines * sizeof (FacronLexerLine));
 
-    while (0 < lexer->len &&
-           ((delim == '\0' && !is_space (lexer->line[0])) ||
-           (delim != '\0' && lexer->line[0] != delim)))
+    size_t n = 0;
+    for (unsigned int i = 0; i < lexer->n_chunks; ++i)
     {
-        ++lexer->line;
-        --lexer->len;
+        memcpy (lexer->lines + n, lexer->chunks[i].lines, lexer->chunks[i].n_lines * sizeof (FacronLexerLine));
+        n += lexer->chunks[i].n_lines;
     }
 
-    lexer->line[0] = '\0';
-    ++lexer->line;
-    --lexer->len;
+    return lexer->n_lines;
+}
+
+static void
+facron_lexer_check_line (size_t  i,
+                         void   *data)
+{
+    FacronLexerLine *line = &((FacronLexerLine *) data)[i];
 
-    return strdup (line_beg);
+    line->readable = facron_glob_is_readable (line->tokens[0].str);
 }
 
 void
-facron_lexer_skip_spaces (FacronLexer *lexer)
+facron_lexer_check_paths (FacronLexer *lexer)
 {
-    while (is_space (lexer->line[0]))
-    {
-        ++lexer->line;
-        --lexer->len;
-    }
+    facron_util_parallel_for (lexer->n_lines, CHECK_SPLIT, CHECK_THREADS, facron_lexer_check_line, lexer->lines);
+}
+
+const FacronLexerLine *
+facron_lexer_get_line (const FacronLexer *lexer,
+                       size_t             n)
+{
+    return &lexer->lines[n];
 }
 
 FacronResult
-facron_lexer_next_token (FacronLexer        *lexer,
+facron_lexer_next_token (const char        **cursor,
                          unsigned long long *mask)
 {
-    if (lexer->line == NULL)
-        return R_ERROR;
-
     FacronState state = EMPTY;
 
-    while (lexer->index < lexer->len)
+    for (const char *c = *cursor;; ++c)
     {
         FacronState prev_state = state;
-        FacronChar c = char_to_FacronChar (lexer->line[lexer->index]);
+        /* The token is NUL terminated where its trailing space was */
+        FacronChar ch = (*c) ? char_to_FacronChar (*c) : C_SPACE;
 
-        state = state_transitions_table[state][c];
+        state = state_transitions_table[state][ch];
 
         switch (state)
         {
         case ERROR:
-            lexer->line[lexer->len - 1] = '\0';
-            fprintf (stderr, "Error at char %c: \"%s\" not understood\n", lexer->line[lexer->index], lexer->line + lexer->index);
+            fprintf (stderr, "Error at char %c: \"%s\" not understood\n", (*c) ? *c : ' ', c);
 
             return R_ERROR;
         case EMPTY:
             *mask = FacronToken_to_mask (prev_state);
-            ++lexer->line;
-            --lexer->len;
+            *cursor = c + 1;
 
-            switch (c)
+            switch (ch)
             {
             case C_SPACE:
-                lexer->line += (lexer->index);
-                lexer->len -= (lexer->index);
-                lexer->index = 0;
-
                 return R_END;
             case C_COMMA:
                 return R_COMMA;
@@ -403,50 +539,91 @@ facron_lexer_next_token (FacronLexer        *lexer,
         default:
             break;
         }
-
-        ++lexer->index;
     }
-
-    return R_ERROR;
 }
 
 bool
 facron_lexer_reload_file (FacronLexer *lexer)
 {
-    if (lexer->file)
-        fclose (lexer->file);
+    struct stat st;
+    int fd;
 
-    lexer->file = fopen (lexer->filename, "ro");
-    lexer->line = lexer->line_beg = NULL;
-    lexer->index = 0;
+    facron_lexer_clear (lexer);
 
-    if (!lexer->file)
+    if ((fd = open (lexer->filename, O_RDONLY|O_CLOEXEC)) < 0 || fstat (fd, &st) < 0)
     {
+        if (fd >= 0)
+            close (fd);
         fprintf (stderr, "Error: could not load configuration file, does \"" SYSCONFDIR "/facron.conf\" exist?\n");
 
         return false;
     }
 
+    /*
+     * Read into anonymous memory, with a spare byte, rather than mapping
+     * the file: truncating it while we tokenize must not be a SIGBUS.
+     */
+    lexer->size = 0;
+    lexer->mtime = st.st_mtim;
+    lexer->map_size = st.st_size + 1;
+    lexer->map = (char *) mmap (NULL, lexer->map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+    if (lexer->map == MAP_FAILED)
+        goto fail;
+
+    /* A file shrinking meanwhile is only read up to its new end */
+    while (lexer->size < (size_t) st.st_size)
+    {
+        ssize_t len = read (fd, lexer->map + lexer->size, st.st_size - lexer->size);
+
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+            goto fail;
+        if (!len)
+            break;
+        lexer->size += len;
+    }
+
+    close (fd);
+
     return true;
+
+fail:
+    fprintf (stderr, "Error: could not read configuration file \"%s\": %s\n", lexer->filename, strerror (errno));
+    if (lexer->map != MAP_FAILED)
+        munmap (lexer->map, lexer->map_size);
+    lexer->map = NULL;
+    lexer->size = 0;
+    close (fd);
+
+    return false;
+}
+
+const char *
+facron_lexer_get_source (const FacronLexer *lexer,
+                         size_t            *size,
+                         struct timespec   *mtime)
+{
+    *size = lexer->size;
+    *mtime = lexer->mtime;
+
+    return lexer->map;
 }
 
 void
 facron_lexer_free (FacronLexer *lexer)
 {
-    if (lexer->file)
-        fclose (lexer->file);
-    if (lexer->line_beg)
-        free (lexer->line_beg);
+    facron_lexer_clear (lexer);
     free (lexer);
 }
 
 FacronLexer *
 facron_lexer_new (const char *filename)
 {
-    FacronLexer *lexer = (FacronLexer *) malloc (sizeof (FacronLexer));
+    FacronLexer *lexer = (FacronLexer *) calloc (1, sizeof (FacronLexer));
 
     lexer->filename = filename;
-    lexer->file = NULL;
     facron_lexer_reload_file (lexer);
 
     return lexer;
@@ -21,6 +21,8 @@
 #define __FACRON_CONF_LEXER_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
 
 typedef struct FacronLexer FacronLexer;
 
@@ -228,17 +230,46 @@ typedef enum
     R_COMMA
 } FacronResult;
 
-bool  facron_lexer_read_line    (FacronLexer *lexer);
-bool  facron_lexer_invalid_line (FacronLexer *lexer);
-bool  facron_lexer_end_of_line  (FacronLexer *lexer);
-char *facron_lexer_read_string  (FacronLexer *lexer);
-void  facron_lexer_skip_spaces  (FacronLexer *lexer);
+/* A token, NUL terminated in place, quotes excluded */
+typedef struct
+{
+    char   *str;
+    size_t  len;
+    bool    quoted;
+} FacronLexeme;
+
+/* The whitespace separated tokens of a line which doesn't start with a space */
+typedef struct
+{
+    const FacronLexeme *tokens;
+    size_t              n_tokens;
+    /* Whether its first token, the path, is readable, once checked */
+    bool                readable;
+} FacronLexerLine;
+
+/*
+ * Splits the mapped file in chunks at line boundaries, each tokenized by
+ * its own thread when the file is big enough. Returns the number of
+ * lines, which stay valid until the file gets reloaded.
+ */
+size_t                 facron_lexer_tokenize (FacronLexer       *lexer);
+const FacronLexerLine *facron_lexer_get_line (const FacronLexer *lexer,
+                                              size_t             n);
 
-FacronResult facron_lexer_next_token (FacronLexer        *lexer,
+/* Fills in readable, from a pool of threads for slow filesystems */
+void facron_lexer_check_paths (FacronLexer *lexer);
+
+/* Reads the next mask of a masks token, moving the cursor past it */
+FacronResult facron_lexer_next_token (const char        **cursor,
                                       unsigned long long *mask);
 
 bool facron_lexer_reload_file (FacronLexer *lexer);
 
+/* The file as mapped by the last reload, until it gets tokenized */
+const char *facron_lexer_get_source (const FacronLexer *lexer,
+                                     size_t            *size,
+                                     struct timespec   *mtime);
+
 void facron_lexer_free (FacronLexer *lexer);
 
 FacronLexer *facron_lexer_new (const char *filename);
@@ -0,0 +1,116 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-limit.h"
+#include "facron-metrics.h"
+
+#include <string.h>
+
+/* Beyond that many tokens of debt, queued events get dropped */
+#define MAX_QUEUED 1024
+
+bool
+facron_limit_admit (FacronLimit       *limit,
+                    uint64_t           interval,
+                    unsigned int       burst,
+                    FacronLimitPolicy  policy,
+                    uint64_t          *deadline)
+{
+    uint64_t now = facron_metrics_now ();
+    uint64_t tolerance = (uint64_t) (burst - 1) * interval;
+    uint64_t tat = atomic_load_explicit (&limit->tat, memory_order_relaxed);
+    uint64_t start;
+
+    do
+    {
+        start = (tat > now) ? tat : now;
+        *deadline = 0;
+
+        if (start <= now + tolerance)
+            continue;
+
+        switch (policy)
+        {
+        case FACRON_LIMIT_DROP:
+            goto reject;
+        case FACRON_LIMIT_COALESCE:
+            if (atomic_load_explicit (&limit->deferred, memory_order_relaxed) > now)
+                goto reject;
+            break;
+        case FACRON_LIMIT_QUEUE:
+            if (start > now + tolerance + MAX_QUEUED * interval)
+                goto reject;
+            break;
+        }
+
+        /* The time at which this event would have found a token */
+        *deadline = start - tolerance;
+    } while (!atomic_compare_exchange_weak_explicit (&limit->tat, &tat, start + interval, memory_order_relaxed, memory_order_relaxed));
+
+    if (!*deadline)
+        return true;
+
+    /*
+     * Two threads may both see no pending run and defer one each, they
+     * took a token each so that the rate still holds.
+     */
+    if (policy == FACRON_LIMIT_COALESCE)
+        atomic_store_explicit (&limit->deferred, *deadline, memory_order_relaxed);
+
+    facron_metrics_inc (FACRON_METRIC_DEFERRED);
+    *deadline = (*deadline + 999999) / 1000000;
+    return true;
+
+reject:
+    atomic_fetch_add_explicit (&limit->rejected, 1, memory_order_relaxed);
+    facron_metrics_inc (FACRON_METRIC_RATE_LIMITED);
+    return false;
+}
+
+bool
+facron_limit_policy_from_string (const char        *name,
+                                 FacronLimitPolicy *policy)
+{
+    static const struct
+    {
+        const char       *name;
+        FacronLimitPolicy policy;
+    } policies[] = {
+        { "drop",     FACRON_LIMIT_DROP     },
+        { "coalesce", FACRON_LIMIT_COALESCE },
+        { "queue",    FACRON_LIMIT_QUEUE    },
+    };
+
+    for (size_t i = 0; i < sizeof (policies) / sizeof (*policies); ++i)
+    {
+        if (!strcmp (policies[i].name, name))
+        {
+            *policy = policies[i].policy;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+unsigned long
+facron_limit_get_rejected (const FacronLimit *limit)
+{
+    return atomic_load_explicit (&limit->rejected, memory_order_relaxed);
+}
@@ -0,0 +1,69 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_LIMIT_H__
+#define __FACRON_LIMIT_H__
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* What happens to the events of an entry which ran out of tokens */
+typedef enum
+{
+    FACRON_LIMIT_DROP,
+    /* A single run for all of them once a token is available, with the path of the first one */
+    FACRON_LIMIT_COALESCE,
+    /* A run for each of them as tokens become available */
+    FACRON_LIMIT_QUEUE
+} FacronLimitPolicy;
+
+/*
+ * The token bucket of an entry, shared by the matcher threads. It is kept
+ * the GCRA way, as the time at which it will be full again, so that a
+ * single compare and swap takes a token. All zeroes is a full bucket.
+ */
+typedef struct
+{
+    atomic_uint_least64_t tat;
+    /* Until when a coalesced run is pending */
+    atomic_uint_least64_t deferred;
+    atomic_ulong          rejected;
+} FacronLimit;
+
+/*
+ * A token every interval nanoseconds, at most burst of them at once.
+ * Returns false if the event is dropped or coalesced. Otherwise, *deadline
+ * is 0 if the command can run right away, or when it should run, in
+ * milliseconds as facron_timers_now counts them.
+ */
+bool facron_limit_admit (FacronLimit       *limit,
+                         uint64_t           interval,
+                         unsigned int       burst,
+                         FacronLimitPolicy  policy,
+                         uint64_t          *deadline);
+
+/* "drop", "coalesce" or "queue" */
+bool facron_limit_policy_from_string (const char        *name,
+                                      FacronLimitPolicy *policy);
+
+/* Events dropped or coalesced so far */
+unsigned long facron_limit_get_rejected (const FacronLimit *limit);
+
+#endif /* __FACRON_LIMIT_H__ */
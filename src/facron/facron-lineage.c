@@ -0,0 +1,256 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-lineage.h"
+#include "facron-timers.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Must be a power of two */
+#define N_SLOTS 16384
+
+/* Seconds an exited child is still recognized for */
+#define GRACE 2
+
+#define ALIVE UINT32_MAX
+
+/*
+ * An open addressed table with a single writer. A slot holds a pid in
+ * its high half and, in its low half, the second it expires at since the
+ * table got created, ALIVE until the child exits. Once half the slots are
+ * used, the table gets rebuilt with only the children which did not
+ * expire, so that probe sequences stay short. Readers don't lock, they
+ * look again if a rebuild happened meanwhile, which the sequence tells:
+ * it is odd during one.
+ */
+struct FacronLineage
+{
+    pid_t                 self;
+    uint64_t              start;
+    bool                  full;
+    /* Writer only */
+    size_t                n_used;
+    /*
+     * Children alive, and the second the last one to exit expires at: with
+     * none of either, no pgid can be one of ours and getpgid is skipped
+     */
+    atomic_uint           n_alive;
+    atomic_uint           last_expiry;
+    atomic_uint           seq;
+    atomic_uint_least64_t slots[N_SLOTS];
+};
+
+static inline uint32_t
+facron_lineage_now (const FacronLineage *lineage)
+{
+    return (facron_timers_now () - lineage->start) / 1000;
+}
+
+static inline size_t
+facron_lineage_slot (pid_t pid)
+{
+    return ((uint32_t) pid * 0x9E3779B1U) & (N_SLOTS - 1);
+}
+
+static inline uint64_t
+facron_lineage_value (pid_t    pid,
+                      uint32_t expiry)
+{
+    return ((uint64_t) (uint32_t) pid << 32) | expiry;
+}
+
+/* Writer only, returns the slot holding pid or the empty one it would go to */
+static atomic_uint_least64_t *
+facron_lineage_find (FacronLineage *lineage,
+                     pid_t          pid)
+{
+    size_t slot = facron_lineage_slot (pid);
+
+    for (;; slot = (slot + 1) & (N_SLOTS - 1))
+    {
+        uint64_t value = atomic_load_explicit (&lineage->slots[slot], memory_order_relaxed);
+
+        if (!value || (pid_t) (value >> 32) == pid)
+            return &lineage->slots[slot];
+    }
+}
+
+/* Returns the slot value of pid, 0 if there is none */
+static uint64_t
+facron_lineage_get (const FacronLineage *lineage,
+                    pid_t                pid)
+{
+    for (;;)
+    {
+        unsigned int seq = atomic_load_explicit (&lineage->seq, memory_order_acquire);
+        size_t slot = facron_lineage_slot (pid);
+        uint64_t found = 0;
+
+        if (seq & 1)
+            continue;
+
+        for (size_t i = 0; i < N_SLOTS; ++i, slot = (slot + 1) & (N_SLOTS - 1))
+        {
+            /* Any slot written by a rebuild orders the sequence load below after its start */
+            uint64_t value = atomic_load_explicit (&lineage->slots[slot], memory_order_acquire);
+
+            if (!value)
+                break;
+            if ((pid_t) (value >> 32) == pid)
+            {
+                found = value;
+                break;
+            }
+        }
+
+        if (atomic_load_explicit (&lineage->seq, memory_order_relaxed) == seq)
+            return found;
+    }
+}
+
+/* Drops the expired children */
+static void
+facron_lineage_rebuild (FacronLineage *lineage,
+                        uint32_t       now)
+{
+    uint64_t *kept = (uint64_t *) malloc (lineage->n_used * sizeof (uint64_t));
+    unsigned int seq = atomic_load_explicit (&lineage->seq, memory_order_relaxed);
+    size_t n_kept = 0;
+
+    for (size_t i = 0; i < N_SLOTS; ++i)
+    {
+        uint64_t value = atomic_load_explicit (&lineage->slots[i], memory_order_relaxed);
+
+        if (value && (uint32_t) value >= now)
+            kept[n_kept++] = value;
+    }
+
+    atomic_store_explicit (&lineage->seq, seq + 1, memory_order_relaxed);
+
+    for (size_t i = 0; i < N_SLOTS; ++i)
+        atomic_store_explicit (&lineage->slots[i], 0, memory_order_release);
+    for (size_t i = 0; i < n_kept; ++i)
+        atomic_store_explicit (facron_lineage_find (lineage, (pid_t) (kept[i] >> 32)), kept[i], memory_order_release);
+
+    atomic_store_explicit (&lineage->seq, seq + 2, memory_order_release);
+
+    lineage->n_used = n_kept;
+    free (kept);
+}
+
+void
+facron_lineage_add (FacronLineage *lineage,
+                    pid_t          pid)
+{
+    uint32_t now = facron_lineage_now (lineage);
+
+    if (2 * (lineage->n_used + 1) > N_SLOTS)
+        facron_lineage_rebuild (lineage, now);
+
+    /* Still more than half full of live children, this would slow every lookup down */
+    if (2 * (lineage->n_used + 1) > N_SLOTS)
+    {
+        if (!lineage->full)
+            fprintf (stderr, "Warning: too many children to keep track of, some of their events will not be recognized\n");
+        lineage->full = true;
+        return;
+    }
+
+    /* The pid may still be there from a previous child, it must not be there twice */
+    atomic_uint_least64_t *slot = facron_lineage_find (lineage, pid);
+
+    uint64_t value = atomic_load_explicit (slot, memory_order_relaxed);
+
+    if (!value)
+        ++lineage->n_used;
+    if ((uint32_t) value != ALIVE)
+        atomic_fetch_add_explicit (&lineage->n_alive, 1, memory_order_relaxed);
+    atomic_store_explicit (slot, facron_lineage_value (pid, ALIVE), memory_order_release);
+}
+
+void
+facron_lineage_exited (FacronLineage *lineage,
+                       pid_t          pid)
+{
+    atomic_uint_least64_t *slot = facron_lineage_find (lineage, pid);
+    uint32_t expiry = facron_lineage_now (lineage) + GRACE;
+
+    if ((uint32_t) atomic_load_explicit (slot, memory_order_relaxed) != ALIVE)
+        return;
+
+    atomic_store_explicit (slot, facron_lineage_value (pid, expiry), memory_order_release);
+    atomic_store_explicit (&lineage->last_expiry, expiry, memory_order_relaxed);
+    atomic_fetch_sub_explicit (&lineage->n_alive, 1, memory_order_relaxed);
+}
+
+static inline bool
+facron_lineage_is_known (const FacronLineage *lineage,
+                         pid_t                pid,
+                         uint32_t             now)
+{
+    uint64_t value = facron_lineage_get (lineage, pid);
+
+    return value && (uint32_t) value >= now;
+}
+
+bool
+facron_lineage_contains (const FacronLineage *lineage,
+                         pid_t                pid)
+{
+    uint32_t now = facron_lineage_now (lineage);
+
+    if (pid == lineage->self || facron_lineage_is_known (lineage, pid, now))
+        return true;
+
+    /*
+     * A grandchild, as long as its group leader is alive or barely exited.
+     * Past that, the pgid may as well belong to an unrelated group which
+     * got the pid of the leader.
+     */
+    if (!atomic_load_explicit (&lineage->n_alive, memory_order_relaxed) &&
+        atomic_load_explicit (&lineage->last_expiry, memory_order_relaxed) < now)
+        return false;
+
+    pid_t pgid = getpgid (pid);
+
+    return pgid > 0 && pgid != pid && facron_lineage_is_known (lineage, pgid, now);
+}
+
+void
+facron_lineage_free (FacronLineage *lineage)
+{
+    free (lineage);
+}
+
+FacronLineage *
+facron_lineage_new (void)
+{
+    FacronLineage *lineage = (FacronLineage *) calloc (1, sizeof (FacronLineage));
+
+    lineage->self = getpid ();
+    lineage->start = facron_timers_now ();
+    atomic_init (&lineage->seq, 0);
+    atomic_init (&lineage->n_alive, 0);
+    atomic_init (&lineage->last_expiry, 0);
+
+    return lineage;
+}
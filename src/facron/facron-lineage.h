@@ -0,0 +1,49 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_LINEAGE_H__
+#define __FACRON_LINEAGE_H__
+
+#include <stdbool.h>
+#include <unistd.h>
+
+/*
+ * The processes facron spawned, to recognize the events they cause.
+ * Children get their own process group, so that their own children are
+ * recognized through it, as long as the child leading their group is.
+ * Exited children are still recognized for a little while, their events
+ * may not have been read yet.
+ */
+typedef struct FacronLineage FacronLineage;
+
+/* Loop thread only */
+void facron_lineage_add    (FacronLineage *lineage,
+                            pid_t          pid);
+void facron_lineage_exited (FacronLineage *lineage,
+                            pid_t          pid);
+
+/* Any thread, whether pid is facron itself or one of its descendants */
+bool facron_lineage_contains (const FacronLineage *lineage,
+                              pid_t                pid);
+
+void facron_lineage_free (FacronLineage *lineage);
+
+FacronLineage *facron_lineage_new (void);
+
+#endif /* __FACRON_LINEAGE_H__ */
@@ -0,0 +1,186 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#define MAX_EVENTS 16
+
+typedef struct FacronLoopSource FacronLoopSource;
+struct FacronLoopSource
+{
+    FacronLoopSource  *next;
+    int                fd;
+    FacronLoopCallback callback;
+    void              *data;
+};
+
+struct FacronLoop
+{
+    int               epoll_fd;
+    FacronLoopSource *sources;
+    bool              running;
+    bool              dirty;
+    int               status;
+};
+
+bool
+facron_loop_add (FacronLoop        *loop,
+                 int                fd,
+                 FacronLoopCallback callback,
+                 void              *data)
+{
+    FacronLoopSource *source = (FacronLoopSource *) malloc (sizeof (FacronLoopSource));
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.ptr = source,
+    };
+
+    source->fd = fd;
+    source->callback = callback;
+    source->data = data;
+
+    if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        fprintf (stderr, "Error: could not watch fd %d: %s\n", fd, strerror (errno));
+        free (source);
+        return false;
+    }
+
+    source->next = loop->sources;
+    loop->sources = source;
+
+    return true;
+}
+
+void
+facron_loop_remove (FacronLoop *loop,
+                    int         fd)
+{
+    for (FacronLoopSource *source = loop->sources; source; source = source->next)
+    {
+        if (source->fd == fd && source->callback)
+        {
+            epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            /* Events for it may still be pending in the current batch */
+            source->callback = NULL;
+            loop->dirty = true;
+            return;
+        }
+    }
+}
+
+static void
+facron_loop_collect (FacronLoop *loop)
+{
+    for (FacronLoopSource **source = &loop->sources; *source;)
+    {
+        if (!(*source)->callback)
+        {
+            FacronLoopSource *dead = *source;
+            *source = dead->next;
+            free (dead);
+        }
+        else
+            source = &(*source)->next;
+    }
+
+    loop->dirty = false;
+}
+
+int
+facron_loop_run (FacronLoop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    loop->running = true;
+
+    while (loop->running)
+    {
+        int n = epoll_wait (loop->epoll_fd, events, MAX_EVENTS, -1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            fprintf (stderr, "Error: epoll_wait failed: %s\n", strerror (errno));
+            return EXIT_FAILURE;
+        }
+
+        for (int i = 0; i < n && loop->running; ++i)
+        {
+            FacronLoopSource *source = (FacronLoopSource *) events[i].data.ptr;
+
+            if (source->callback)
+                source->callback (loop, source->data);
+        }
+
+        if (loop->dirty)
+            facron_loop_collect (loop);
+    }
+
+    return loop->status;
+}
+
+void
+facron_loop_quit (FacronLoop *loop,
+                  int         status)
+{
+    loop->running = false;
+    loop->status = status;
+}
+
+void
+facron_loop_free (FacronLoop *loop)
+{
+    if (!loop)
+        return;
+
+    for (FacronLoopSource *next; loop->sources; loop->sources = next)
+    {
+        next = loop->sources->next;
+        free (loop->sources);
+    }
+
+    close (loop->epoll_fd);
+    free (loop);
+}
+
+FacronLoop *
+facron_loop_new (void)
+{
+    FacronLoop *loop = (FacronLoop *) calloc (1, sizeof (FacronLoop));
+
+    if ((loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+    {
+        fprintf (stderr, "Error: could not create epoll instance: %s\n", strerror (errno));
+        free (loop);
+        return NULL;
+    }
+
+    return loop;
+}
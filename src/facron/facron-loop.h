@@ -0,0 +1,45 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_LOOP_H__
+#define __FACRON_LOOP_H__
+
+#include <stdbool.h>
+
+typedef struct FacronLoop FacronLoop;
+
+typedef void (*FacronLoopCallback) (FacronLoop *loop,
+                                    void       *data);
+
+bool facron_loop_add    (FacronLoop        *loop,
+                         int                fd,
+                         FacronLoopCallback callback,
+                         void              *data);
+void facron_loop_remove (FacronLoop        *loop,
+                         int                fd);
+
+int  facron_loop_run  (FacronLoop *loop);
+void facron_loop_quit (FacronLoop *loop,
+                       int         status);
+
+void facron_loop_free (FacronLoop *loop);
+
+FacronLoop *facron_loop_new (void);
+
+#endif /* __FACRON_LOOP_H__ */
@@ -0,0 +1,396 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-marks.h"
+#include "facron-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/statfs.h>
+
+/* Older headers lack it, older kernels reject it */
+#ifndef AT_HANDLE_MNT_ID_UNIQUE
+#define AT_HANDLE_MNT_ID_UNIQUE 0x001
+#endif
+
+/*
+ * A mark is what the kernel attaches a mask to: an inode, a mount or a
+ * whole filesystem, known by its id whichever path it got reached from.
+ * Any of those paths is good to mark it. Paths which could not be looked
+ * up are only known as such.
+ */
+typedef struct
+{
+    const char        *path;
+    size_t             len;
+    uint64_t           hash;
+    unsigned int       mark_type;
+    bool               has_object;
+    /* Device and inode, mount id or filesystem id */
+    uint64_t           object[2];
+    unsigned long long mask;
+} FacronMark;
+
+#define MARK_THREADS 16
+#define MARK_SPLIT   64
+
+/* Open addressing, never more than half full */
+struct FacronMarks
+{
+    FacronMark *marks;
+    size_t      size;
+    size_t      n_marks;
+};
+
+static FacronMark *
+facron_marks_lookup (const FacronMarks *marks,
+                     const FacronMark  *key)
+{
+    if (!marks || !marks->size)
+        return NULL;
+
+    for (size_t i = key->hash & (marks->size - 1); marks->marks[i].path; i = (i + 1) & (marks->size - 1))
+    {
+        FacronMark *mark = &marks->marks[i];
+
+        if (mark->hash != key->hash || mark->mark_type != key->mark_type || mark->has_object != key->has_object)
+            continue;
+
+        if ((key->has_object) ? !memcmp (mark->object, key->object, sizeof (key->object)) : mark->len == key->len && !memcmp (mark->path, key->path, key->len))
+            return mark;
+    }
+
+    return NULL;
+}
+
+/* The id of the object a mark on path lands on, following symlinks as fanotify_mark does */
+static bool
+facron_marks_get_object (const char   *path,
+                         unsigned int  mark_type,
+                         uint64_t      object[2])
+{
+    union {
+        struct file_handle handle;
+        char               buf[sizeof (struct file_handle) + MAX_HANDLE_SZ];
+    } fh;
+    int mount_id;
+
+    object[1] = 0;
+
+    if (mark_type == FAN_MARK_INODE)
+    {
+        struct stat st;
+
+        if (stat (path, &st) < 0)
+            return false;
+
+        object[0] = st.st_dev;
+        object[1] = st.st_ino;
+        return true;
+    }
+
+    if (mark_type == FAN_MARK_FILESYSTEM)
+    {
+        struct statfs st;
+
+        if (statfs (path, &st) < 0)
+            return false;
+
+        memcpy (&object[0], &st.f_fsid, sizeof (object[0]));
+        return true;
+    }
+
+    /* Mount ids get reused, unique ones don't but need Linux 6.12 */
+    fh.handle.handle_bytes = MAX_HANDLE_SZ;
+    if (!name_to_handle_at (AT_FDCWD, path, &fh.handle, (int *) &object[0], AT_HANDLE_MNT_ID_UNIQUE))
+        return true;
+
+    fh.handle.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at (AT_FDCWD, path, &fh.handle, &mount_id, 0) < 0)
+        return false;
+
+    object[0] = mount_id;
+    return true;
+}
+
+/* Whether path still reaches the object the mark got computed for */
+static bool
+facron_mark_is_current (const FacronMark *mark)
+{
+    uint64_t object[2];
+
+    return !mark->has_object || (facron_marks_get_object (mark->path, mark->mark_type, object) && !memcmp (object, mark->object, sizeof (object)));
+}
+
+static void
+facron_marks_grow (FacronMarks *marks)
+{
+    FacronMark *old = marks->marks;
+    size_t old_size = marks->size;
+
+    marks->size = (old_size) ? old_size * 2 : 64;
+    marks->marks = (FacronMark *) calloc (marks->size, sizeof (FacronMark));
+
+    for (size_t i = 0; i < old_size; ++i)
+    {
+        if (!old[i].path)
+            continue;
+
+        size_t j = old[i].hash & (marks->size - 1);
+        while (marks->marks[j].path)
+            j = (j + 1) & (marks->size - 1);
+        marks->marks[j] = old[i];
+    }
+
+    free (old);
+}
+
+/* Looks the path of an entry up, from a pool of threads for slow filesystems */
+static void
+facron_marks_get_key (size_t  i,
+                      void   *data)
+{
+    FacronMark *key = &((FacronMark *) data)[i];
+
+    /* Recursive entries filter their subtree themselves */
+    if (key->mark_type != FAN_MARK_INODE)
+        key->mask &= ~FAN_EVENT_ON_CHILD;
+
+    /* Entries reaching the same inode, mount or filesystem share its mark */
+    if ((key->has_object = facron_marks_get_object (key->path, key->mark_type, key->object)))
+        key->hash = facron_hash ((const char *) key->object, sizeof (key->object));
+    else
+    {
+        /* The same directory may be spelled with or without trailing slashes */
+        while (key->len > 1 && key->path[key->len - 1] == '/')
+            --key->len;
+        key->hash = facron_hash (key->path, key->len);
+    }
+}
+
+static void
+facron_marks_add (FacronMarks      *marks,
+                  const FacronMark *key)
+{
+    FacronMark *mark = facron_marks_lookup (marks, key);
+
+    if (!mark)
+    {
+        if (2 * (marks->n_marks + 1) > marks->size)
+            facron_marks_grow (marks);
+
+        size_t i = key->hash & (marks->size - 1);
+        while (marks->marks[i].path)
+            i = (i + 1) & (marks->size - 1);
+
+        mark = &marks->marks[i];
+        *mark = *key;
+        mark->mask = 0;
+        ++marks->n_marks;
+    }
+
+    mark->mask |= key->mask;
+}
+
+/* Flags which go along with the events of either group */
+#define MARK_FLAGS (FAN_EVENT_ON_CHILD|FAN_ONDIR)
+
+/* The part of a mask meant for the permission group or for the other one */
+static inline unsigned long long
+facron_mark_split (unsigned long long mask,
+                   bool               permission)
+{
+    unsigned long long events = mask & ~MARK_FLAGS & ((permission) ? FAN_ALL_PERM_EVENTS : ~FAN_ALL_PERM_EVENTS);
+
+    return (events) ? events | (mask & MARK_FLAGS) : 0;
+}
+
+static inline void
+facron_mark_apply (const FacronMark  *mark,
+                   int                fanotify_fd,
+                   unsigned int       flag,
+                   unsigned long long mask)
+{
+    if (!mask)
+        return;
+
+    if (fanotify_mark (fanotify_fd, flag|mark->mark_type, mask, AT_FDCWD, mark->path) < 0 && flag == FAN_MARK_ADD)
+        fprintf (stderr, "Warning: could not track \"%s\": %s\n", mark->path, strerror (errno));
+}
+
+typedef struct
+{
+    const FacronMark  *mark;
+    unsigned long long remove;
+    unsigned long long add;
+} FacronMarkChange;
+
+typedef struct
+{
+    const FacronMarkChange *changes;
+    int                     fanotify_fd;
+} FacronMarksApply;
+
+static void
+facron_marks_apply_change (size_t  i,
+                           void   *data)
+{
+    const FacronMarksApply *apply = (const FacronMarksApply *) data;
+    const FacronMarkChange *change = &apply->changes[i];
+
+    /*
+     * A path now reaching another object, such as a file replaced by a
+     * rename, would get the bits of the new one removed instead. The old
+     * one can't be reached anymore.
+     */
+    if (change->remove && facron_mark_is_current (change->mark))
+        facron_mark_apply (change->mark, apply->fanotify_fd, FAN_MARK_REMOVE, change->remove);
+    facron_mark_apply (change->mark, apply->fanotify_fd, FAN_MARK_ADD, change->add);
+}
+
+/*
+ * Each mark is a path lookup which may wait on a slow filesystem, they get
+ * spread over threads. There is a single change per kernel object, so that
+ * its bits never get removed and added by two threads racing.
+ */
+static void
+facron_marks_apply_changes (const FacronMarkChange *changes,
+                            size_t                  n_changes,
+                            int                     fanotify_fd)
+{
+    FacronMarksApply apply = { .changes = changes, .fanotify_fd = fanotify_fd };
+
+    facron_util_parallel_for (n_changes, MARK_SPLIT, MARK_THREADS, facron_marks_apply_change, &apply);
+}
+
+static void
+facron_marks_update_group (const FacronMarks *from,
+                           const FacronMarks *to,
+                           int                fanotify_fd,
+                           bool               permission)
+{
+    size_t n_marks = ((from) ? from->n_marks : 0) + ((to) ? to->n_marks : 0);
+    FacronMarkChange *changes = (FacronMarkChange *) malloc ((n_marks + 1) * sizeof (FacronMarkChange));
+    size_t n_gone = 0, n_changes = 0;
+
+    /* Marks which went away entirely, removed before anything gets added */
+    for (size_t i = 0; from && i < from->size; ++i)
+    {
+        const FacronMark *mark = &from->marks[i];
+
+        if (mark->path && !facron_marks_lookup (to, mark))
+            changes[n_gone++] = (FacronMarkChange) { .mark = mark, .remove = facron_mark_split (mark->mask, permission) };
+    }
+
+    n_changes = n_gone;
+
+    for (size_t i = 0; to && i < to->size; ++i)
+    {
+        const FacronMark *mark = &to->marks[i];
+
+        if (!mark->path)
+            continue;
+
+        const FacronMark *old = facron_marks_lookup (from, mark);
+        unsigned long long old_mask = (old) ? facron_mark_split (old->mask, permission) : 0;
+        unsigned long long mask = facron_mark_split (mark->mask, permission);
+
+        if (!old && !permission)
+            fprintf (stderr, "Notice: tracking \"%s\"%s\n", mark->path, (mark->mark_type == FAN_MARK_INODE) ? "" : " recursively");
+
+        if (fanotify_fd < 0)
+        {
+            if (mask & ~old_mask)
+                fprintf (stderr, "Warning: permission events on \"%s\" need --permissions, ignoring them\n", mark->path);
+            continue;
+        }
+
+        if (old_mask != mask)
+            changes[n_changes++] = (FacronMarkChange) { .mark = mark, .remove = old_mask & ~mask, .add = mask & ~old_mask };
+    }
+
+    if (fanotify_fd >= 0)
+    {
+        facron_marks_apply_changes (changes, n_gone, fanotify_fd);
+        facron_marks_apply_changes (changes + n_gone, n_changes - n_gone, fanotify_fd);
+    }
+
+    free (changes);
+}
+
+void
+facron_marks_update (const FacronMarks *from,
+                     const FacronMarks *to,
+                     int                fanotify_fd,
+                     int                permission_fd)
+{
+    /* Nothing is being watched, as when replaying a trace */
+    if (fanotify_fd < 0)
+        return;
+
+    facron_marks_update_group (from, to, fanotify_fd, false);
+    facron_marks_update_group (from, to, permission_fd, true);
+}
+
+void
+facron_marks_free (FacronMarks *marks)
+{
+    if (!marks)
+        return;
+
+    free (marks->marks);
+    free (marks);
+}
+
+FacronMarks *
+facron_marks_new (const FacronConfEntry *entries)
+{
+    FacronMarks *marks = (FacronMarks *) calloc (1, sizeof (FacronMarks));
+    size_t n_keys = 0;
+
+    for (const FacronConfEntry *entry = entries; entry; entry = facron_conf_entry_get_next (entry))
+        ++n_keys;
+
+    FacronMark *keys = (FacronMark *) malloc ((n_keys + 1) * sizeof (FacronMark));
+
+    n_keys = 0;
+    for (const FacronConfEntry *entry = entries; entry; entry = facron_conf_entry_get_next (entry))
+    {
+        keys[n_keys++] = (FacronMark) {
+            .path = facron_conf_entry_get_path (entry),
+            .len = facron_conf_entry_get_path_len (entry),
+            .mark_type = facron_conf_entry_get_mark_type (entry),
+            .mask = facron_conf_entry_get_mask (entry),
+        };
+    }
+
+    facron_util_parallel_for (n_keys, MARK_SPLIT, MARK_THREADS, facron_marks_get_key, keys);
+
+    for (size_t i = 0; i < n_keys; ++i)
+        facron_marks_add (marks, &keys[i]);
+
+    free (keys);
+
+    return marks;
+}
@@ -0,0 +1,45 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_MARKS_H__
+#define __FACRON_MARKS_H__
+
+#include "facron-conf-entry.h"
+
+/*
+ * The fanotify marks wanted by a set of entries: the union of their masks
+ * for each inode, mount or filesystem, whichever path reaches it.
+ */
+typedef struct FacronMarks FacronMarks;
+
+/*
+ * Turns the marks of from into the ones of to, either of which may be
+ * NULL, touching only the marks whose mask changes. Permission events are
+ * marked on permission_fd, if any, the others on fanotify_fd.
+ */
+void facron_marks_update (const FacronMarks *from,
+                          const FacronMarks *to,
+                          int                fanotify_fd,
+                          int                permission_fd);
+
+void facron_marks_free (FacronMarks *marks);
+
+FacronMarks *facron_marks_new (const FacronConfEntry *entries);
+
+#endif /* __FACRON_MARKS_H__ */
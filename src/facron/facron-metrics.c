@@ -0,0 +1,280 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-metrics.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Histograms are log-linear, HDR style: values below SUB_BUCKETS get a
+ * bucket each, then every power of two is split in SUB_BUCKETS buckets,
+ * which bounds the relative error to 1/SUB_BUCKETS whatever the
+ * magnitude. Values are nanoseconds, anything above MAX_BITS (a bit more
+ * than an hour) is clamped.
+ */
+#define SUB_BITS    4
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define MAX_BITS    42
+#define N_BUCKETS   ((MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS)
+
+/* Threads beyond that share shards, which stays correct */
+#define MAX_SHARDS 32
+
+typedef struct
+{
+    _Alignas (64) atomic_ulong metrics[FACRON_N_METRICS];
+    atomic_ulong sums[FACRON_N_HISTOGRAMS];
+    atomic_ulong buckets[FACRON_N_HISTOGRAMS][N_BUCKETS];
+} FacronMetricsShard;
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} metrics[FACRON_N_METRICS] = {
+    [FACRON_METRIC_READS]                = { "facron_reads_total",                 "Reads from fanotify."                                     },
+    [FACRON_METRIC_READ_BYTES]           = { "facron_read_bytes_total",            "Bytes read from fanotify."                                },
+    [FACRON_METRIC_EVENTS]               = { "facron_events_total",                "Events read from fanotify."                               },
+    [FACRON_METRIC_OVERFLOWS]            = { "facron_queue_overflows_total",       "Times the fanotify queue overflowed, losing events."      },
+    [FACRON_METRIC_RECOVERED]            = { "facron_recovered_events_total",      "Events synthesized by rescans after an overflow."         },
+    [FACRON_METRIC_UNRESOLVED]           = { "facron_unresolved_events_total",     "Events whose path could not be resolved."                 },
+    [FACRON_METRIC_OWN_EVENTS]           = { "facron_own_events_total",            "Events caused by facron's own commands, ignored."         },
+    [FACRON_METRIC_MATCHES]              = { "facron_matches_total",               "Commands triggered by matching events."                   },
+    [FACRON_METRIC_COALESCED]            = { "facron_coalesced_total",             "Matching events swallowed by a debounce window or batch." },
+    [FACRON_METRIC_BATCHED]              = { "facron_batched_total",               "Paths collected into batches."                            },
+    [FACRON_METRIC_RATE_LIMITED]         = { "facron_rate_limited_total",          "Matching events dropped or coalesced by a rate limit."    },
+    [FACRON_METRIC_DEFERRED]             = { "facron_deferred_total",              "Commands delayed by a rate limit."                        },
+    [FACRON_METRIC_SPAWNED]              = { "facron_spawned_total",               "Commands spawned."                                        },
+    [FACRON_METRIC_SPAWN_FAILURES]       = { "facron_spawn_failures_total",        "Commands which could not be spawned."                     },
+    [FACRON_METRIC_JOBS_REJECTED]        = { "facron_jobs_rejected_total",         "Commands dropped or coalesced for lack of a job slot."    },
+    [FACRON_METRIC_BUILTINS]             = { "facron_builtins_total",              "Built-in actions run."                                    },
+    [FACRON_METRIC_BUILTIN_FAILURES]     = { "facron_builtin_failures_total",      "Built-in actions which failed."                           },
+    [FACRON_METRIC_STREAMED]             = { "facron_streamed_total",              "Events queued for stream handlers."                       },
+    [FACRON_METRIC_STREAM_DROPPED]       = { "facron_stream_dropped_total",        "Events dropped because a stream handler lagged behind."   },
+    [FACRON_METRIC_STREAM_RESTARTS]      = { "facron_stream_restarts_total",       "Stream handlers restarted after exiting."                 },
+    [FACRON_METRIC_PERMISSIONS]          = { "facron_permissions_total",           "Permission events answered."                              },
+    [FACRON_METRIC_PERMISSION_HITS]      = { "facron_permission_cache_hits_total", "Permission events answered from the verdict cache."       },
+    [FACRON_METRIC_PERMISSION_DENIED]    = { "facron_permission_denied_total",     "Permission events denied."                                },
+    [FACRON_METRIC_PERMISSION_FALLBACKS] = { "facron_permission_fallbacks_total",  "Permission events allowed for lack of a timely verdict."  },
+};
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} histograms[FACRON_N_HISTOGRAMS] = {
+    [FACRON_HISTOGRAM_MATCH]      = { "facron_match_seconds",        "Time spent matching a batch of events."                                            },
+    [FACRON_HISTOGRAM_EXEC]       = { "facron_exec_latency_seconds", "Time from reading an event to running its command, debounce and batches excluded." },
+    [FACRON_HISTOGRAM_PERMISSION] = { "facron_permission_seconds",   "Time from reading a permission event to answering it."                             },
+};
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1 };
+
+static FacronMetricsShard shards[MAX_SHARDS];
+static atomic_uint n_shards;
+static _Thread_local FacronMetricsShard *shard;
+
+static inline FacronMetricsShard *
+facron_metrics_get_shard (void)
+{
+    if (!shard)
+        shard = &shards[atomic_fetch_add (&n_shards, 1) % MAX_SHARDS];
+    return shard;
+}
+
+static inline unsigned int
+facron_metrics_bucket (uint64_t value)
+{
+    if (value >= (1ULL << MAX_BITS))
+        value = (1ULL << MAX_BITS) - 1;
+    if (value < SUB_BUCKETS)
+        return value;
+
+    unsigned int e = 63 - __builtin_clzll (value);
+
+    return (e - SUB_BITS + 1) * SUB_BUCKETS + ((value >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The highest value which falls in that bucket */
+static inline uint64_t
+facron_metrics_bucket_max (unsigned int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+
+    unsigned int e = bucket / SUB_BUCKETS + SUB_BITS - 1;
+
+    return ((uint64_t) (SUB_BUCKETS + bucket % SUB_BUCKETS + 1) << (e - SUB_BITS)) - 1;
+}
+
+uint64_t
+facron_metrics_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void
+facron_metrics_add (FacronMetric  metric,
+                    unsigned long n)
+{
+    atomic_fetch_add_explicit (&facron_metrics_get_shard ()->metrics[metric], n, memory_order_relaxed);
+}
+
+void
+facron_metrics_record (FacronHistogram histogram,
+                       uint64_t        ns)
+{
+    FacronMetricsShard *s = facron_metrics_get_shard ();
+
+    atomic_fetch_add_explicit (&s->buckets[histogram][facron_metrics_bucket (ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&s->sums[histogram], ns, memory_order_relaxed);
+}
+
+static void
+facron_metrics_print_histogram (FILE            *out,
+                                FacronHistogram  histogram)
+{
+    unsigned long buckets[N_BUCKETS] = { 0 };
+    unsigned long count = 0, sum = 0;
+    unsigned int used = (atomic_load (&n_shards) < MAX_SHARDS) ? atomic_load (&n_shards) : MAX_SHARDS;
+
+    for (unsigned int i = 0; i < used; ++i)
+    {
+        sum += atomic_load_explicit (&shards[i].sums[histogram], memory_order_relaxed);
+        for (unsigned int b = 0; b < N_BUCKETS; ++b)
+            buckets[b] += atomic_load_explicit (&shards[i].buckets[histogram][b], memory_order_relaxed);
+    }
+    for (unsigned int b = 0; b < N_BUCKETS; ++b)
+        count += buckets[b];
+
+    fprintf (out, "# HELP %s %s\n# TYPE %s summary\n", histograms[histogram].name, histograms[histogram].help, histograms[histogram].name);
+
+    for (size_t q = 0; q < sizeof (quantiles) / sizeof (*quantiles); ++q)
+    {
+        unsigned long rank = quantiles[q] * count + 0.5;
+        unsigned long seen = 0;
+        uint64_t value = 0;
+
+        if (!rank && count)
+            rank = 1;
+
+        for (unsigned int b = 0; count && b < N_BUCKETS; ++b)
+        {
+            if ((seen += buckets[b]) >= rank)
+            {
+                value = facron_metrics_bucket_max (b);
+                break;
+            }
+        }
+
+        fprintf (out, "%s{quantile=\"%g\"} %.9f\n", histograms[histogram].name, quantiles[q], value / 1e9);
+    }
+
+    fprintf (out, "%s_sum %.9f\n%s_count %lu\n", histograms[histogram].name, sum / 1e9, histograms[histogram].name, count);
+}
+
+void
+facron_metrics_print (FILE *out)
+{
+    unsigned int used = (atomic_load (&n_shards) < MAX_SHARDS) ? atomic_load (&n_shards) : MAX_SHARDS;
+
+    for (unsigned int m = 0; m < FACRON_N_METRICS; ++m)
+    {
+        unsigned long value = 0;
+
+        for (unsigned int i = 0; i < used; ++i)
+            value += atomic_load_explicit (&shards[i].metrics[m], memory_order_relaxed);
+
+        fprintf (out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", metrics[m].name, metrics[m].help, metrics[m].name, metrics[m].name, value);
+    }
+
+    for (unsigned int h = 0; h < FACRON_N_HISTOGRAMS; ++h)
+        facron_metrics_print_histogram (out, h);
+}
+
+void
+facron_metrics_print_label (FILE       *out,
+                            const char *value)
+{
+    for (const char *c = value; *c; ++c)
+    {
+        switch (*c)
+        {
+        case '\\':
+            fputs ("\\\\", out);
+            break;
+        case '"':
+            fputs ("\\\"", out);
+            break;
+        case '\n':
+            fputs ("\\n", out);
+            break;
+        default:
+            fputc (*c, out);
+        }
+    }
+}
+
+int
+facron_metrics_listen (const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen (path) >= sizeof (addr.sun_path))
+    {
+        fprintf (stderr, "Error: metrics socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy (addr.sun_path, path);
+
+    if ((fd = socket (AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0)) < 0)
+    {
+        fprintf (stderr, "Error: could not create metrics socket: %s\n", strerror (errno));
+        return -1;
+    }
+
+    /* A leftover from a previous run would make bind fail */
+    unlink (path);
+
+    /* Only root gets to connect */
+    mode_t mask = umask (0177);
+    int err = bind (fd, (struct sockaddr *) &addr, sizeof (addr));
+    umask (mask);
+
+    if (err < 0 || listen (fd, 16) < 0)
+    {
+        fprintf (stderr, "Error: could not listen on \"%s\": %s\n", path, strerror (errno));
+        close (fd);
+        return -1;
+    }
+
+    return fd;
+}
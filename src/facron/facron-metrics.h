@@ -0,0 +1,92 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_METRICS_H__
+#define __FACRON_METRICS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Process wide counters and latency histograms. Each thread updates its
+ * own shard, which only get summed up when printed, so that recording
+ * never contends between threads.
+ */
+typedef enum
+{
+    FACRON_METRIC_READS,
+    FACRON_METRIC_READ_BYTES,
+    FACRON_METRIC_EVENTS,
+    FACRON_METRIC_OVERFLOWS,
+    FACRON_METRIC_RECOVERED,
+    FACRON_METRIC_UNRESOLVED,
+    FACRON_METRIC_OWN_EVENTS,
+    FACRON_METRIC_MATCHES,
+    FACRON_METRIC_COALESCED,
+    FACRON_METRIC_BATCHED,
+    FACRON_METRIC_RATE_LIMITED,
+    FACRON_METRIC_DEFERRED,
+    FACRON_METRIC_SPAWNED,
+    FACRON_METRIC_SPAWN_FAILURES,
+    FACRON_METRIC_JOBS_REJECTED,
+    FACRON_METRIC_BUILTINS,
+    FACRON_METRIC_BUILTIN_FAILURES,
+    FACRON_METRIC_STREAMED,
+    FACRON_METRIC_STREAM_DROPPED,
+    FACRON_METRIC_STREAM_RESTARTS,
+    FACRON_METRIC_PERMISSIONS,
+    FACRON_METRIC_PERMISSION_HITS,
+    FACRON_METRIC_PERMISSION_DENIED,
+    FACRON_METRIC_PERMISSION_FALLBACKS,
+    FACRON_N_METRICS
+} FacronMetric;
+
+typedef enum
+{
+    FACRON_HISTOGRAM_MATCH,
+    FACRON_HISTOGRAM_EXEC,
+    FACRON_HISTOGRAM_PERMISSION,
+    FACRON_N_HISTOGRAMS
+} FacronHistogram;
+
+/* Monotonic time in nanoseconds */
+uint64_t facron_metrics_now (void);
+
+void facron_metrics_add    (FacronMetric    metric,
+                            unsigned long   n);
+void facron_metrics_record (FacronHistogram histogram,
+                            uint64_t        ns);
+
+static inline void
+facron_metrics_inc (FacronMetric metric)
+{
+    facron_metrics_add (metric, 1);
+}
+
+/* In the Prometheus text exposition format */
+void facron_metrics_print (FILE *out);
+
+/* Escapes a label value, quotes excluded */
+void facron_metrics_print_label (FILE       *out,
+                                 const char *value);
+
+/* A listening unix socket, each client gets a dump and is disconnected */
+int facron_metrics_listen (const char *path);
+
+#endif /* __FACRON_METRICS_H__ */
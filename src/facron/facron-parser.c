@@ -17,118 +17,397 @@
  *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "facron-builtin.h"
 #include "facron-conf-entry.h"
+#include "facron-glob.h"
 #include "facron-lexer.h"
+#include "facron-metrics.h"
 #include "facron-parser.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+/* Pointing into the lexer */
+typedef struct
+{
+    const char **paths;
+    size_t       n_paths;
+    size_t       size;
+} FacronParserPaths;
 
 struct FacronParser
 {
-    FacronLexer     *lexer;
+    FacronLexer            *lexer;
+    FacronConfEntryBuilder *builder;
+    /* Entry paths of the last parse, as the lexer found them */
+    FacronParserPaths       readable;
+    FacronParserPaths       unreadable;
+    FacronParserTimings     timings;
 };
 
-FacronConfEntry *
-facron_parser_parse_entry (FacronParser    *parser,
-                           FacronConfEntry *previous)
+static void
+facron_parser_paths_add (FacronParserPaths *paths,
+                         const char        *path)
+{
+    if (paths->n_paths == paths->size)
+    {
+        paths->size = (paths->size) ? paths->size * 2 : 16;
+        paths->paths = (const char **) realloc (paths->paths, paths->size * sizeof (char *));
+    }
+    paths->paths[paths->n_paths++] = path;
+}
+
+typedef bool (*FacronOptionParser) (FacronConfEntryBuilder *builder,
+                                    const char             *value);
+
+static bool
+facron_parser_parse_debounce (FacronConfEntryBuilder *builder,
+                              const char             *value)
+{
+    char *end;
+    unsigned long window = (value) ? strtoul (value, &end, 10) : 0;
+    bool leading = false;
+
+    if (!window)
+        return false;
+
+    if (!strcmp (end, ":leading"))
+        leading = true;
+    else if (*end && strcmp (end, ":trailing"))
+        return false;
+
+    facron_conf_entry_builder_set_debounce (builder, window, leading);
+    return true;
+}
+
+static bool
+facron_parser_parse_batch (FacronConfEntryBuilder *builder,
+                           const char             *value)
+{
+    char *end;
+    unsigned long window = (value) ? strtoul (value, &end, 10) : 0;
+    unsigned long max = 0;
+
+    if (!window)
+        return false;
+
+    if (*end == ':')
+    {
+        const char *count = end + 1;
+
+        if (!(max = strtoul (count, &end, 10)) || *end || max > UINT_MAX)
+            return false;
+    }
+    else if (*end)
+        return false;
+
+    facron_conf_entry_builder_set_batch (builder, window, max);
+    return true;
+}
+
+static bool
+facron_parser_parse_ignore_own (FacronConfEntryBuilder *builder,
+                                const char             *value)
+{
+    if (value)
+        return false;
+
+    facron_conf_entry_builder_set_ignore_own (builder);
+    return true;
+}
+
+static bool
+facron_parser_parse_limit (FacronConfEntryBuilder *builder,
+                           const char             *value)
+{
+    char *end;
+    unsigned long count = (value) ? strtoul (value, &end, 10) : 0;
+    unsigned long burst;
+    uint64_t period;
+    FacronLimitPolicy policy = FACRON_LIMIT_DROP;
+
+    if (!count || count > UINT_MAX || *end != '/')
+        return false;
+
+    switch (*(++end))
+    {
+    case 's':
+        period = 1000000000ULL;
+        break;
+    case 'm':
+        period = 60 * 1000000000ULL;
+        break;
+    case 'h':
+        period = 3600 * 1000000000ULL;
+        break;
+    default:
+        return false;
+    }
+
+    /* One period worth of tokens, unless told otherwise */
+    burst = count;
+    if (*(++end) == ':' && end[1] >= '0' && end[1] <= '9')
+    {
+        if (!(burst = strtoul (end + 1, &end, 10)) || burst > UINT_MAX)
+            return false;
+    }
+
+    if (*end == ':')
+    {
+        if (!facron_limit_policy_from_string (end + 1, &policy))
+            return false;
+    }
+    else if (*end)
+        return false;
+
+    facron_conf_entry_builder_set_limit (builder, period / count, burst, policy);
+    return true;
+}
+
+static bool
+facron_parser_parse_recursive (FacronConfEntryBuilder *builder,
+                               const char             *value)
+{
+    if (!value || !strcmp (value, "mount"))
+        facron_conf_entry_builder_set_recursive (builder, FAN_MARK_MOUNT);
+    else if (!strcmp (value, "filesystem"))
+        facron_conf_entry_builder_set_recursive (builder, FAN_MARK_FILESYSTEM);
+    else
+        return false;
+
+    return true;
+}
+
+static bool
+facron_parser_parse_stream (FacronConfEntryBuilder *builder,
+                            const char             *value)
 {
-    if (!facron_lexer_read_line (parser->lexer))
-        return NULL;
+    if (!value || !strcmp (value, "lines"))
+        facron_conf_entry_builder_set_stream (builder, FACRON_STREAM_LINES);
+    else if (!strcmp (value, "nul"))
+        facron_conf_entry_builder_set_stream (builder, FACRON_STREAM_NUL);
+    else
+        return false;
 
-    if (facron_lexer_invalid_line (parser->lexer))
-        goto fail_early;
+    return true;
+}
+
+static const struct
+{
+    const char        *name;
+    FacronOptionParser parse;
+} options[] = {
+    { "batch",      facron_parser_parse_batch      },
+    { "debounce",   facron_parser_parse_debounce   },
+    { "ignore-own", facron_parser_parse_ignore_own },
+    { "limit",      facron_parser_parse_limit      },
+    { "recursive",  facron_parser_parse_recursive  },
+    { "stream",     facron_parser_parse_stream     },
+};
+
+static bool
+facron_parser_parse_option (FacronConfEntryBuilder *builder,
+                            char                   *option)
+{
+    char *value = strchr (option, '=');
 
-    char *path = facron_lexer_read_string (parser->lexer);
+    if (value)
+        *(value++) = '\0';
 
-    if (access (path, R_OK))
+    for (size_t i = 0; i < sizeof (options) / sizeof (*options); ++i)
     {
-        fprintf (stderr, "warning: No such file or directory: \"%s\"\n", path);
-        free (path);
-        goto fail_early;
+        if (!strcmp (options[i].name, option))
+        {
+            if (options[i].parse (builder, value))
+                return true;
+
+            fprintf (stderr, "Error: invalid value for option \"%s\": \"%s\"\n", option, (value) ? value : "");
+            return false;
+        }
     }
 
-    facron_lexer_skip_spaces (parser->lexer);
+    /* Most likely a command given as a relative path then */
+    if (!value)
+        fprintf (stderr, "Error: commands must be absolute paths or @built-ins: \"%s\"\n", option);
+    else
+        fprintf (stderr, "Error: unknown option: \"%s\"\n", option);
+    return false;
+}
+
+static bool
+facron_parser_parse_entry (FacronParser          *parser,
+                           const FacronLexerLine *line)
+{
+    const FacronLexeme *tokens = line->tokens;
+    size_t i = 0;
 
-    if (facron_lexer_end_of_line (parser->lexer))
+    if (line->readable)
+        facron_parser_paths_add (&parser->readable, tokens[0].str);
+    else
+    {
+        facron_parser_paths_add (&parser->unreadable, tokens[0].str);
+        fprintf (stderr, "warning: No such file or directory: \"%s\"\n", tokens[0].str);
+        return false;
+    }
+
+    if (line->n_tokens < 2)
     {
         fprintf (stderr, "Error: no Fanotify mask has been specified.\n");
-        free (path);
-        goto fail_early;
+        return false;
+    }
+
+    /* Their root gets resolved like any path, but matching events come with absolute paths */
+    if (*tokens[0].str != '/' && facron_glob_is_pattern (tokens[0].str))
+    {
+        fprintf (stderr, "Error: patterns must be absolute paths: \"%s\"\n", tokens[0].str);
+        return false;
     }
 
-    FacronConfEntry *entry = facron_conf_entry_new (previous, path);
+    facron_conf_entry_builder_start (parser->builder, tokens[i++].str);
 
     int n = 0;
     FacronResult result;
     unsigned long long mask;
+    const char *cursor = tokens[i++].str;
 
-    while (n < 511 && (result = facron_lexer_next_token (parser->lexer, &mask))) /* != S_END */
+    while (n < 511 && (result = facron_lexer_next_token (&cursor, &mask))) /* != S_END */
     {
         switch (result)
         {
         case R_ERROR:
-            goto fail;
+            return false;
         case R_COMMA:
-            facron_conf_entry_apply_mask (entry, n++, mask);
+            facron_conf_entry_builder_apply_mask (parser->builder, n++, mask);
             break;
         case R_PIPE:
-            facron_conf_entry_apply_mask (entry, n, mask);
+            facron_conf_entry_builder_apply_mask (parser->builder, n, mask);
             break;
         default:
             break;
         }
     }
 
-    facron_conf_entry_apply_mask (entry, n, mask);
+    facron_conf_entry_builder_apply_mask (parser->builder, n, mask);
 
-    if (!n && !facron_conf_entry_validate (entry))
+    if (!n && !facron_conf_entry_builder_validate (parser->builder))
     {
         fprintf (stderr, "Error: no Fanotify mask has been specified.\n");
-        goto fail;
+        return false;
     }
 
-    facron_lexer_skip_spaces (parser->lexer);
-
-    for (n = 0; !facron_lexer_end_of_line (parser->lexer) && n < 511; ++n)
+    /* Commands are absolute paths, possibly quoted, or built-in actions */
+    for (; i < line->n_tokens && !tokens[i].quoted && tokens[i].str[0] != '/' && tokens[i].str[0] != '@'; ++i)
     {
-        facron_conf_entry_add_command (entry, facron_lexer_read_string (parser->lexer));
-        facron_lexer_skip_spaces (parser->lexer);
+        if (!facron_parser_parse_option (parser->builder, tokens[i].str))
+            return false;
     }
 
+    const char *program = (i < line->n_tokens) ? tokens[i].str : NULL;
+
+    for (n = 0; i < line->n_tokens && n < 511; ++i, ++n)
+        facron_conf_entry_builder_add_command (parser->builder, tokens[i].str);
+
     if (!n)
     {
         fprintf (stderr, "Error: no command line specified\n");
-        goto fail;
+        return false;
     }
 
-    return entry;
+    if (*program == '@' && !facron_builtin_validate (program, n))
+        return false;
 
-fail:
-    facron_conf_entry_free (entry);
-fail_early:
-    return facron_parser_parse_entry (parser, previous);
+    return true;
+}
+
+/* Lines are tokenized and checked in parallel beforehand, then turned into entries in order */
+FacronArena *
+facron_parser_parse (FacronParser *parser)
+{
+    uint64_t start = facron_metrics_now ();
+    size_t n_lines = facron_lexer_tokenize (parser->lexer);
+    uint64_t tokenized = facron_metrics_now ();
+
+    facron_lexer_check_paths (parser->lexer);
+
+    uint64_t checked = facron_metrics_now ();
+
+    parser->readable.n_paths = 0;
+    parser->unreadable.n_paths = 0;
+
+    for (size_t i = 0; i < n_lines; ++i)
+    {
+        if (facron_parser_parse_entry (parser, facron_lexer_get_line (parser->lexer, i)))
+            facron_conf_entry_builder_commit (parser->builder);
+        else
+            facron_conf_entry_builder_discard (parser->builder);
+    }
+
+    FacronArena *entries = facron_conf_entry_builder_finish (parser->builder);
+
+    parser->timings.tokenize = tokenized - start;
+    parser->timings.check = checked - tokenized;
+    parser->timings.parse = facron_metrics_now () - checked;
+
+    return entries;
+}
+
+const FacronParserTimings *
+facron_parser_get_timings (const FacronParser *parser)
+{
+    return &parser->timings;
 }
 
 bool
 facron_parser_reload (FacronParser *parser)
 {
+    parser->readable.n_paths = 0;
+    parser->unreadable.n_paths = 0;
     return facron_lexer_reload_file (parser->lexer);
 }
 
+const char *
+facron_parser_get_source (const FacronParser *parser,
+                          size_t             *size,
+                          struct timespec    *mtime)
+{
+    return facron_lexer_get_source (parser->lexer, size, mtime);
+}
+
+const char *const *
+facron_parser_get_readable (const FacronParser *parser,
+                            size_t             *n)
+{
+    *n = parser->readable.n_paths;
+    return parser->readable.paths;
+}
+
+const char *const *
+facron_parser_get_unreadable (const FacronParser *parser,
+                              size_t             *n)
+{
+    *n = parser->unreadable.n_paths;
+    return parser->unreadable.paths;
+}
+
 void
 facron_parser_free (FacronParser *parser)
 {
     facron_lexer_free (parser->lexer);
+    facron_conf_entry_builder_free (parser->builder);
+    free (parser->readable.paths);
+    free (parser->unreadable.paths);
     free (parser);
 }
 
 FacronParser *
 facron_parser_new (const char *filename)
 {
-    FacronParser *parser = (FacronParser *) malloc (sizeof (FacronParser));
+    FacronParser *parser = (FacronParser *) calloc (1, sizeof (FacronParser));
 
     parser->lexer = facron_lexer_new (filename);
+    parser->builder = facron_conf_entry_builder_new ();
 
     return parser;
 }
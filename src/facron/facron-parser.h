@@ -20,15 +20,41 @@
 #ifndef __FACRON_CONF_PARSER_H__
 #define __FACRON_CONF_PARSER_H__
 
+#include "facron-arena.h"
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 typedef struct FacronParser FacronParser;
 
-FacronConfEntry *facron_parser_parse_entry (FacronParser    *parser,
-                                            FacronConfEntry *previous);
+/* Nanoseconds the last parse spent in each of its steps */
+typedef struct
+{
+    uint64_t tokenize;
+    uint64_t check;
+    uint64_t parse;
+} FacronParserTimings;
+
+/* Parses all the entries of the file into a fresh arena */
+FacronArena *facron_parser_parse (FacronParser *parser);
+
+const FacronParserTimings *facron_parser_get_timings (const FacronParser *parser);
 
 bool facron_parser_reload (FacronParser *parser);
 
+/* The file as mapped by the last reload, until it gets parsed */
+const char *facron_parser_get_source (const FacronParser *parser,
+                                      size_t             *size,
+                                      struct timespec    *mtime);
+
+/* Entries the last parse kept looking at, and skipped, by whether their path was readable */
+const char *const *facron_parser_get_readable   (const FacronParser *parser,
+                                                 size_t             *n);
+const char *const *facron_parser_get_unreadable (const FacronParser *parser,
+                                                 size_t             *n);
+
 void facron_parser_free (FacronParser *parser);
 
 FacronParser *facron_parser_new (const char *filename);
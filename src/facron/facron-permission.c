@@ -0,0 +1,650 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-metrics.h"
+#include "facron-permission.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <linux/limits.h>
+
+/* Direct mapped, a newer verdict simply evicts the older one */
+#define CACHE_BITS   12
+#define CACHE_SIZE   (1 << CACHE_BITS)
+#define MAX_CHILDREN 64
+#define BUFFER_SIZE  16384
+
+/* Per child: a copy of its argv, then the stacks of the command until it execs and of the child */
+#define ARGV_SIZE    (FACRON_COMMAND_SCRATCH_SIZE + MAX_CMD_LEN * sizeof (char *))
+#define STACK_SIZE   (32 * 1024)
+#define AREA_SIZE    (((ARGV_SIZE + 4095) & ~4095) + 2 * STACK_SIZE)
+
+/* Remembered pgids, a pid only gets probed again once its entry expires */
+#define PGID_CACHE_BITS 8
+#define PGID_CACHE_SIZE (1 << PGID_CACHE_BITS)
+#define PGID_TTL        1000
+
+typedef struct
+{
+    dev_t              dev;
+    ino_t              ino;
+    unsigned long long mask;
+    struct timespec    ctime;
+    unsigned int       generation;
+    bool               used;
+    bool               allow;
+} FacronPermissionKey;
+
+/* A permission event whose commands are still running */
+struct FacronVerdict
+{
+    FacronPermissions  *permissions;
+    FacronVerdict      *next;
+    FacronPermissionKey key;
+    /* -1 once answered */
+    int                 fd;
+    uint64_t            stamp;
+    uint64_t            deadline;
+    unsigned int        n_children;
+    bool                allow;
+    /* Some entry could not have its say, don't remember the outcome */
+    bool                uncertain;
+};
+
+/* Spawned without an exit signal, so that only its pidfd tells when it is done */
+typedef struct
+{
+    pid_t          pid;
+    int            pidfd;
+    FacronVerdict *verdict;
+    /* Its argv and stacks, in areas */
+    char          *area;
+} FacronPermissionChild;
+
+typedef struct
+{
+    pid_t    pid;
+    pid_t    pgid;
+    uint64_t expiry;
+} FacronPermissionPgid;
+
+struct FacronPermissions
+{
+    FacronConf           *conf;
+    FacronExecutor       *executor;
+    unsigned int          timeout;
+    int                   fanotify_fd;
+    int                   stop_fd;
+    pthread_t             thread;
+    bool                  started;
+    FacronVerdict        *pending;
+    FacronPermissionChild children[MAX_CHILDREN];
+    unsigned int          n_children;
+    char                 *areas;
+    char                 *free_areas[MAX_CHILDREN];
+    unsigned int          n_free_areas;
+    FacronPermissionKey   cache[CACHE_SIZE];
+    FacronPermissionPgid  pgids[PGID_CACHE_SIZE];
+};
+
+static inline FacronPermissionKey *
+facron_permissions_cache_slot (FacronPermissions         *permissions,
+                               const FacronPermissionKey *key)
+{
+    uint64_t hash = ((uint64_t) key->ino ^ ((uint64_t) key->dev << 32) ^ key->mask) * 0x9E3779B97F4A7C15ULL;
+
+    return &permissions->cache[hash >> (64 - CACHE_BITS)];
+}
+
+static const FacronPermissionKey *
+facron_permissions_cache_lookup (FacronPermissions         *permissions,
+                                 const FacronPermissionKey *key)
+{
+    const FacronPermissionKey *slot = facron_permissions_cache_slot (permissions, key);
+
+    if (slot->used && slot->ino == key->ino && slot->dev == key->dev && slot->mask == key->mask &&
+        slot->generation == key->generation &&
+        slot->ctime.tv_sec == key->ctime.tv_sec && slot->ctime.tv_nsec == key->ctime.tv_nsec)
+        return slot;
+
+    return NULL;
+}
+
+static void
+facron_permissions_answer (FacronPermissions *permissions,
+                           FacronVerdict     *verdict,
+                           bool               allow)
+{
+    struct fanotify_response response = {
+        .fd = verdict->fd,
+        .response = (allow) ? FAN_ALLOW : FAN_DENY,
+    };
+
+    if (write (permissions->fanotify_fd, &response, sizeof (response)) < 0)
+        fprintf (stderr, "Warning: could not answer a permission event: %s\n", strerror (errno));
+
+    close (verdict->fd);
+    verdict->fd = -1;
+
+    facron_metrics_inc (FACRON_METRIC_PERMISSIONS);
+    if (!allow)
+        facron_metrics_inc (FACRON_METRIC_PERMISSION_DENIED);
+    facron_metrics_record (FACRON_HISTOGRAM_PERMISSION, facron_metrics_now () - verdict->stamp);
+}
+
+/* All the commands are done, even if the event may have been answered without them */
+static void
+facron_permissions_settle (FacronPermissions *permissions,
+                           FacronVerdict     *verdict)
+{
+    if (!verdict->uncertain && verdict->key.used)
+    {
+        FacronPermissionKey *slot = facron_permissions_cache_slot (permissions, &verdict->key);
+
+        *slot = verdict->key;
+        slot->allow = verdict->allow;
+    }
+
+    if (verdict->fd >= 0)
+        facron_permissions_answer (permissions, verdict, verdict->allow);
+}
+
+/* The command, running on its parent's memory until it execs */
+static int
+facron_permissions_exec (void *data)
+{
+    char **argv = (char **) data;
+    sigset_t empty;
+
+    /* Same setup as the executor gives its children */
+    sigemptyset (&empty);
+    sigprocmask (SIG_SETMASK, &empty, NULL);
+    signal (SIGPIPE, SIG_DFL);
+    syscall (SYS_execve, argv[0], argv, environ);
+    syscall (SYS_exit_group, 127);
+    return 127;
+}
+
+/*
+ * Without an exit signal, the child is left alone by the main loop's
+ * waitpid (-1), but execve would give it SIGCHLD back. So it never execs:
+ * it runs the command in a child of its own and exits with its status.
+ * It shares our memory rather than copying it, on its own stack, so that
+ * it only touches its area and what is left of errno on failure.
+ */
+static int
+facron_permissions_run (void *data)
+{
+    char *area = (char *) data;
+    int status;
+
+    /* The command's children get recognized through its group */
+    syscall (SYS_setpgid, 0, 0);
+
+    pid_t pid = clone (facron_permissions_exec, area + AREA_SIZE - STACK_SIZE, CLONE_VM|CLONE_VFORK|SIGCHLD, area);
+
+    if (pid < 0 || syscall (SYS_wait4, pid, &status, 0, NULL) < 0)
+        syscall (SYS_exit_group, 127);
+    syscall (SYS_exit_group, (WIFEXITED (status)) ? WEXITSTATUS (status) : 128 + WTERMSIG (status));
+    return 127;
+}
+
+static pid_t
+facron_permissions_spawn (char  *area,
+                          char **argv,
+                          int   *pidfd)
+{
+    char **copy = (char **) area;
+    size_t argc = 0;
+
+    for (; argv[argc]; ++argc);
+
+    /* The strings follow each other in the scratch, they still will in the area */
+    char *str = (char *) &copy[argc + 1];
+
+    for (size_t i = 0; i < argc; ++i)
+    {
+        size_t len = strlen (argv[i]) + 1;
+        copy[i] = memcpy (str, argv[i], len);
+        str += len;
+    }
+    copy[argc] = NULL;
+
+    return clone (facron_permissions_run, area + AREA_SIZE, CLONE_VM|CLONE_PIDFD, area, pidfd);
+}
+
+bool
+facron_verdict_add (FacronVerdict       *verdict,
+                    const FacronCommand *command,
+                    const char          *path,
+                    pid_t                pid)
+{
+    FacronPermissions *permissions = verdict->permissions;
+    char scratch[FACRON_COMMAND_SCRATCH_SIZE];
+    char *argv[MAX_CMD_LEN];
+
+    /* Stream handlers are only told about the event, they have no say */
+    if (facron_command_get_stream (command))
+    {
+        facron_executor_run (permissions->executor, command, path, pid, verdict->stamp);
+        return true;
+    }
+
+    if (!facron_command_expand (command, path, pid, scratch, sizeof (scratch), argv))
+    {
+        fprintf (stderr, "Warning: command line too long for \"%s\", skipping\n", path);
+        verdict->uncertain = true;
+        return false;
+    }
+
+    if (!argv[0])
+        return false;
+
+    if (facron_executor_is_dry_run (permissions->executor))
+    {
+        facron_metrics_inc ((facron_command_get_builtin (command)) ? FACRON_METRIC_BUILTINS : FACRON_METRIC_SPAWNED);
+        return true;
+    }
+
+    if (facron_command_get_builtin (command))
+    {
+        if (facron_builtin_run (facron_command_get_builtin (command), argv))
+            facron_metrics_inc (FACRON_METRIC_BUILTINS);
+        else
+        {
+            facron_metrics_inc (FACRON_METRIC_BUILTIN_FAILURES);
+            verdict->allow = false;
+        }
+        return true;
+    }
+
+    FacronPermissionChild *child = &permissions->children[permissions->n_children];
+
+    if (permissions->n_children == MAX_CHILDREN)
+    {
+        fprintf (stderr, "Warning: too many permission commands running, not running \"%s\"\n", argv[0]);
+        errno = EAGAIN;
+    }
+    else if ((child->pid = facron_permissions_spawn (permissions->free_areas[permissions->n_free_areas - 1], argv, &child->pidfd)) >= 0)
+    {
+        child->verdict = verdict;
+        child->area = permissions->free_areas[--permissions->n_free_areas];
+        ++permissions->n_children;
+        /* A pid remembered as someone else's may be reused by the command */
+        memset (permissions->pgids, 0, sizeof (permissions->pgids));
+        ++verdict->n_children;
+        facron_metrics_inc (FACRON_METRIC_SPAWNED);
+        return true;
+    }
+    else
+        fprintf (stderr, "Warning: could not run \"%s\": %s\n", argv[0], strerror (errno));
+
+    facron_metrics_inc (FACRON_METRIC_SPAWN_FAILURES);
+    verdict->uncertain = true;
+    return false;
+}
+
+static pid_t
+facron_permissions_get_pgid (FacronPermissions *permissions,
+                             pid_t              pid)
+{
+    FacronPermissionPgid *slot = &permissions->pgids[((uint32_t) pid * 0x9E3779B1U) >> (32 - PGID_CACHE_BITS)];
+    uint64_t now = facron_timers_now ();
+
+    if (slot->pid != pid || slot->expiry <= now)
+    {
+        slot->pid = pid;
+        slot->pgid = getpgid (pid);
+        slot->expiry = now + PGID_TTL;
+    }
+
+    return slot->pgid;
+}
+
+static bool
+facron_permissions_is_own (FacronPermissions *permissions,
+                           pid_t              pid)
+{
+    if (facron_executor_is_own (permissions->executor, pid))
+        return true;
+    if (!permissions->n_children)
+        return false;
+
+    /* Our children lead their own process group */
+    pid_t pgid = facron_permissions_get_pgid (permissions, pid);
+
+    for (unsigned int i = 0; i < permissions->n_children; ++i)
+    {
+        if (permissions->children[i].pid == pid || permissions->children[i].pid == pgid)
+            return true;
+    }
+
+    return false;
+}
+
+static void
+facron_permissions_handle (FacronPermissions          *permissions,
+                           const FacronConfGeneration *generation,
+                           const FacronMetadata       *metadata,
+                           uint64_t                    stamp)
+{
+    FacronVerdict verdict = {
+        .permissions = permissions,
+        .fd = metadata->fd,
+        .stamp = stamp,
+        .allow = true,
+    };
+    char path[PATH_MAX];
+    char proc_path[sizeof ("/proc/self/fd/") + 3 * sizeof (int)];
+    ssize_t path_len;
+    struct stat st;
+
+    /* Our own commands would otherwise wait for themselves */
+    if (facron_permissions_is_own (permissions, metadata->pid) || fstat (metadata->fd, &st) < 0)
+    {
+        facron_permissions_answer (permissions, &verdict, true);
+        return;
+    }
+
+    verdict.key = (FacronPermissionKey) {
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .mask = metadata->mask & FAN_ALL_PERM_EVENTS,
+        .ctime = st.st_ctim,
+        .generation = facron_conf_get_generation (generation),
+        .used = true,
+    };
+
+    const FacronPermissionKey *cached = facron_permissions_cache_lookup (permissions, &verdict.key);
+
+    if (cached)
+    {
+        facron_metrics_inc (FACRON_METRIC_PERMISSION_HITS);
+        facron_permissions_answer (permissions, &verdict, cached->allow);
+        return;
+    }
+
+    sprintf (proc_path, "/proc/self/fd/%d", metadata->fd);
+    if ((path_len = readlink (proc_path, path, sizeof (path) - 1)) < 0)
+    {
+        facron_metrics_inc (FACRON_METRIC_UNRESOLVED);
+        facron_permissions_answer (permissions, &verdict, true);
+        return;
+    }
+    path[path_len] = '\0';
+
+    FacronEvent event = {
+        .path = path,
+        .path_len = path_len,
+        .metadata = metadata,
+        .stamp = stamp,
+        .verdict = &verdict,
+    };
+
+    facron_conf_handle (generation, permissions->executor, &event);
+
+    if (!verdict.n_children)
+    {
+        facron_permissions_settle (permissions, &verdict);
+        return;
+    }
+
+    FacronVerdict *pending = (FacronVerdict *) malloc (sizeof (FacronVerdict));
+
+    *pending = verdict;
+    pending->deadline = facron_timers_now () + permissions->timeout;
+    pending->next = permissions->pending;
+    permissions->pending = pending;
+
+    for (unsigned int i = 0; i < permissions->n_children; ++i)
+    {
+        if (permissions->children[i].verdict == &verdict)
+            permissions->children[i].verdict = pending;
+    }
+}
+
+static void
+facron_permissions_read (FacronPermissions *permissions,
+                         char              *buffer)
+{
+    ssize_t len = read (permissions->fanotify_fd, buffer, BUFFER_SIZE);
+
+    if (len < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+            fprintf (stderr, "Error: could not read permission events: %s\n", strerror (errno));
+        return;
+    }
+
+    uint64_t stamp = facron_metrics_now ();
+    FacronConfGeneration *generation = facron_conf_acquire (permissions->conf);
+
+    for (FacronMetadata *metadata = (FacronMetadata *) buffer; FAN_EVENT_OK (metadata, len); metadata = FAN_EVENT_NEXT (metadata, len))
+    {
+        if (metadata->fd >= 0)
+            facron_permissions_handle (permissions, generation, metadata, stamp);
+    }
+
+    facron_conf_release (generation);
+}
+
+static void
+facron_permissions_reap (FacronPermissions *permissions,
+                         unsigned int       i)
+{
+    FacronPermissionChild *child = &permissions->children[i];
+    FacronVerdict *verdict = child->verdict;
+    siginfo_t info = { 0 };
+
+    if (waitid (P_PIDFD, child->pidfd, &info, WEXITED|__WALL) < 0)
+    {
+        fprintf (stderr, "Warning: could not wait for permission command %d: %s\n", child->pid, strerror (errno));
+        verdict->uncertain = true;
+    }
+    else if (info.si_code != CLD_EXITED || info.si_status)
+        verdict->allow = false;
+
+    close (child->pidfd);
+    permissions->free_areas[permissions->n_free_areas++] = child->area;
+    *child = permissions->children[--permissions->n_children];
+
+    if (--verdict->n_children)
+        return;
+
+    facron_permissions_settle (permissions, verdict);
+
+    for (FacronVerdict **v = &permissions->pending; *v; v = &(*v)->next)
+    {
+        if (*v == verdict)
+        {
+            *v = verdict->next;
+            break;
+        }
+    }
+    free (verdict);
+}
+
+/* Allows what waited too long, returns the poll timeout until the next deadline */
+static int
+facron_permissions_expire (FacronPermissions *permissions)
+{
+    uint64_t now = facron_timers_now ();
+    uint64_t next = UINT64_MAX;
+
+    for (FacronVerdict *verdict = permissions->pending; verdict; verdict = verdict->next)
+    {
+        if (verdict->fd < 0)
+            continue;
+
+        if (verdict->deadline <= now)
+        {
+            facron_metrics_inc (FACRON_METRIC_PERMISSION_FALLBACKS);
+            facron_permissions_answer (permissions, verdict, true);
+        }
+        else if (verdict->deadline < next)
+            next = verdict->deadline;
+    }
+
+    return (next == UINT64_MAX) ? -1 : (int) (next - now);
+}
+
+static void *
+facron_permissions_thread (void *data)
+{
+    FacronPermissions *permissions = (FacronPermissions *) data;
+    struct pollfd fds[2 + MAX_CHILDREN];
+    _Alignas (FacronMetadata) char buffer[BUFFER_SIZE];
+
+    for (;;)
+    {
+        unsigned int n_children = permissions->n_children;
+        int timeout = facron_permissions_expire (permissions);
+
+        fds[0] = (struct pollfd) { .fd = permissions->fanotify_fd, .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = permissions->stop_fd,     .events = POLLIN };
+        for (unsigned int i = 0; i < n_children; ++i)
+            fds[2 + i] = (struct pollfd) { .fd = permissions->children[i].pidfd, .events = POLLIN };
+
+        if (poll (fds, 2 + n_children, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf (stderr, "Error: could not wait for permission events: %s\n", strerror (errno));
+            break;
+        }
+
+        if (fds[1].revents)
+            break;
+
+        /* Backwards, reaping moves the last child in the freed spot */
+        for (unsigned int i = n_children; i-- > 0;)
+        {
+            if (fds[2 + i].revents)
+                facron_permissions_reap (permissions, i);
+        }
+
+        if (fds[0].revents & POLLIN)
+            facron_permissions_read (permissions, buffer);
+    }
+
+    return NULL;
+}
+
+int
+facron_permissions_get_fanotify_fd (const FacronPermissions *permissions)
+{
+    return permissions->fanotify_fd;
+}
+
+void
+facron_permissions_free (FacronPermissions *permissions)
+{
+    uint64_t one = 1;
+
+    if (!permissions)
+        return;
+
+    if (permissions->started)
+    {
+        if (write (permissions->stop_fd, &one, sizeof (one)) < 0)
+            fprintf (stderr, "Error: could not stop the permission thread: %s\n", strerror (errno));
+        pthread_join (permissions->thread, NULL);
+    }
+
+    /* Whatever is still running is left alone, nobody waits for it anymore */
+    while (permissions->pending)
+    {
+        FacronVerdict *verdict = permissions->pending;
+
+        permissions->pending = verdict->next;
+        if (verdict->fd >= 0)
+            facron_permissions_answer (permissions, verdict, true);
+        free (verdict);
+    }
+
+    for (unsigned int i = 0; i < permissions->n_children; ++i)
+        close (permissions->children[i].pidfd);
+
+    if (permissions->fanotify_fd >= 0)
+        close (permissions->fanotify_fd);
+    if (permissions->stop_fd >= 0)
+        close (permissions->stop_fd);
+    /* Children still running are on the areas, they go away with us */
+    if (permissions->areas && !permissions->n_children)
+        munmap (permissions->areas, MAX_CHILDREN * AREA_SIZE);
+    free (permissions);
+}
+
+FacronPermissions *
+facron_permissions_new (FacronConf     *conf,
+                        FacronExecutor *executor,
+                        unsigned int    timeout)
+{
+    FacronPermissions *permissions = (FacronPermissions *) calloc (1, sizeof (FacronPermissions));
+    int err;
+
+    permissions->conf = conf;
+    permissions->executor = executor;
+    permissions->timeout = timeout;
+    permissions->stop_fd = eventfd (0, EFD_CLOEXEC);
+    permissions->fanotify_fd = fanotify_init (FAN_CLASS_CONTENT|FAN_CLOEXEC|FAN_NONBLOCK, O_RDONLY|O_LARGEFILE|O_CLOEXEC);
+
+    if (permissions->stop_fd < 0 || permissions->fanotify_fd < 0)
+    {
+        fprintf (stderr, "Error: could not create the permission fanotify group: %s\n", strerror (errno));
+        goto fail;
+    }
+
+    permissions->areas = (char *) mmap (NULL, MAX_CHILDREN * AREA_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_STACK, -1, 0);
+    if (permissions->areas == MAP_FAILED)
+    {
+        fprintf (stderr, "Error: could not allocate permission command stacks: %s\n", strerror (errno));
+        permissions->areas = NULL;
+        goto fail;
+    }
+    for (unsigned int i = 0; i < MAX_CHILDREN; ++i)
+        permissions->free_areas[permissions->n_free_areas++] = permissions->areas + i * AREA_SIZE;
+
+    if ((err = pthread_create (&permissions->thread, NULL, facron_permissions_thread, permissions)))
+    {
+        fprintf (stderr, "Error: could not start permission thread: %s\n", strerror (err));
+        goto fail;
+    }
+    permissions->started = true;
+
+    return permissions;
+
+fail:
+    facron_permissions_free (permissions);
+    return NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_PERMISSION_H__
+#define __FACRON_PERMISSION_H__
+
+#include "facron-conf.h"
+
+/*
+ * Answers the permission events of a FAN_CLASS_CONTENT group from a
+ * dedicated thread. Verdicts are cached by (dev, ino, mask) for as long
+ * as neither the file's ctime nor the configuration change. On a miss
+ * the matching entries decide: built-in actions right away, commands by
+ * their exit status, any failure denying. No verdict before the timeout
+ * means the access is allowed, the commands' answer only gets cached.
+ */
+typedef struct FacronPermissions FacronPermissions;
+
+/* Entries matching a permission event hand their command over, permission thread only */
+bool facron_verdict_add (FacronVerdict       *verdict,
+                         const FacronCommand *command,
+                         const char          *path,
+                         pid_t                pid);
+
+/* The group to mark with the permission part of the masks */
+int facron_permissions_get_fanotify_fd (const FacronPermissions *permissions);
+
+/* Pending events are allowed */
+void facron_permissions_free (FacronPermissions *permissions);
+
+/* timeout in milliseconds */
+FacronPermissions *facron_permissions_new (FacronConf     *conf,
+                                           FacronExecutor *executor,
+                                           unsigned int    timeout);
+
+#endif /* __FACRON_PERMISSION_H__ */
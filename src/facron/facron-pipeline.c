@@ -0,0 +1,466 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2012-2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-fid.h"
+#include "facron-metrics.h"
+#include "facron-pipeline.h"
+#include "facron-recovery.h"
+#include "facron-ring.h"
+#include "facron-trace.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+
+#include <linux/limits.h>
+
+typedef struct
+{
+    size_t   len;
+    uint64_t seq;
+    uint64_t stamp;
+    uint64_t data[];
+} FacronBatch;
+
+typedef struct
+{
+    FacronPipeline *pipeline;
+    FacronFidCache *fid_cache;
+    pthread_t       thread;
+    bool            started;
+    atomic_ulong    n_events;
+    atomic_ulong    n_batches;
+} FacronMatcher;
+
+struct FacronPipeline
+{
+    int             fanotify_fd;
+    FacronConf     *conf;
+    FacronExecutor *executor;
+    FacronRecovery *recovery;
+    FacronTrace    *trace;
+    /* Drop the events facron's own commands cause, unresolved */
+    bool            ignore_own;
+    size_t          buffer_size;
+    FacronRing     *work;
+    FacronRing     *pool;
+    FacronBatch   **batches;
+    size_t          n_batches;
+    FacronMatcher  *matchers;
+    unsigned int    n_matchers;
+    pthread_t       reader;
+    bool            reading;
+    int             stop_fd;
+    int             fd;
+    uint64_t        n_read;
+    pthread_mutex_t lock;
+    /* Batches done ahead of the watermark, by sequence */
+    FacronBatch   **parked;
+    uint64_t        watermark;
+    uint64_t        overflow;
+};
+
+/* Matchers stop when they get the pipeline itself instead of a batch */
+#define STOP(pipeline) ((void *) (pipeline))
+
+static inline void
+facron_pipeline_match (FacronPipeline             *pipeline,
+                       const FacronConfGeneration *conf,
+                       const FacronEvent          *event)
+{
+    unsigned int n = facron_conf_handle (conf, pipeline->executor, event);
+
+    if (pipeline->trace)
+        facron_trace_record (pipeline->trace, event);
+    if (pipeline->recovery)
+        facron_recovery_touch (pipeline->recovery, event, n);
+}
+
+/* Returns whether the queue overflowed */
+static bool
+facron_pipeline_handle (FacronMatcher *matcher,
+                        FacronBatch   *batch)
+{
+    FacronPipeline *pipeline = matcher->pipeline;
+    char path[PATH_MAX];
+    char proc_path[sizeof ("/proc/self/fd/") + 3 * sizeof (int)];
+    ssize_t path_len;
+    ssize_t len = batch->len;
+    unsigned long n_events = 0, n_overflows = 0, n_unresolved = 0, n_own = 0;
+    FacronEvent event = { .path = path, .stamp = batch->stamp };
+    uint64_t start = facron_metrics_now ();
+
+    /* The whole batch is handled against the same generation */
+    FacronConfGeneration *conf = facron_conf_acquire (pipeline->conf);
+
+    for (FacronMetadata *metadata = (FacronMetadata *) batch->data; FAN_EVENT_OK (metadata, len); metadata = FAN_EVENT_NEXT (metadata, len))
+    {
+        ++n_events;
+        event.metadata = metadata;
+
+        if (metadata->mask & FAN_Q_OVERFLOW)
+        {
+            fprintf (stderr, "Warning: fanotify queue overflowed, events were lost\n");
+            ++n_overflows;
+            continue;
+        }
+
+        if (pipeline->ignore_own && facron_executor_is_own (pipeline->executor, metadata->pid))
+        {
+            if (metadata->fd >= 0)
+                close (metadata->fd);
+            ++n_own;
+            continue;
+        }
+
+        if (matcher->fid_cache)
+        {
+            if ((path_len = facron_fid_cache_resolve (matcher->fid_cache, conf, metadata, path, sizeof (path))) >= 0)
+            {
+                event.path_len = path_len;
+                facron_pipeline_match (pipeline, conf, &event);
+            }
+            else
+                ++n_unresolved;
+            continue;
+        }
+
+        if (metadata->fd < 0)
+        {
+            ++n_unresolved;
+            continue;
+        }
+
+        sprintf (proc_path, "/proc/self/fd/%d", metadata->fd);
+        path_len = readlink (proc_path, path, sizeof (path) - 1);
+        if (path_len >= 0)
+        {
+            path[path_len] = '\0';
+            event.path_len = path_len;
+            facron_pipeline_match (pipeline, conf, &event);
+        }
+        else
+            ++n_unresolved;
+
+        close (metadata->fd);
+    }
+
+    facron_conf_release (conf);
+
+    atomic_fetch_add_explicit (&matcher->n_events, n_events, memory_order_relaxed);
+    atomic_fetch_add_explicit (&matcher->n_batches, 1, memory_order_relaxed);
+    facron_metrics_add (FACRON_METRIC_EVENTS, n_events);
+    if (n_overflows)
+        facron_metrics_add (FACRON_METRIC_OVERFLOWS, n_overflows);
+    if (n_unresolved)
+        facron_metrics_add (FACRON_METRIC_UNRESOLVED, n_unresolved);
+    if (n_own)
+        facron_metrics_add (FACRON_METRIC_OWN_EVENTS, n_own);
+    facron_metrics_record (FACRON_HISTOGRAM_MATCH, facron_metrics_now () - start);
+
+    return n_overflows;
+}
+
+/*
+ * With several matchers, batches complete out of order. The watermark
+ * counts the leading batches which all did: a rescan is only worth it
+ * once everything read before the overflow got handled. Batches only go
+ * back to the pool once the watermark passed them, so that the reader
+ * never gets more than n_batches ahead of it and sequences never share
+ * a slot.
+ */
+static void
+facron_pipeline_complete (FacronPipeline *pipeline,
+                          FacronBatch    *batch,
+                          bool            overflowed)
+{
+    FacronBatch *done;
+    bool rescan;
+
+    pthread_mutex_lock (&pipeline->lock);
+
+    pipeline->parked[batch->seq % pipeline->n_batches] = batch;
+    while ((done = pipeline->parked[pipeline->watermark % pipeline->n_batches]))
+    {
+        pipeline->parked[pipeline->watermark++ % pipeline->n_batches] = NULL;
+        facron_ring_push (pipeline->pool, done);
+    }
+
+    if (overflowed && batch->seq + 1 > pipeline->overflow)
+        pipeline->overflow = batch->seq + 1;
+    if ((rescan = pipeline->overflow && pipeline->watermark >= pipeline->overflow))
+        pipeline->overflow = 0;
+
+    pthread_mutex_unlock (&pipeline->lock);
+
+    if (rescan)
+        facron_recovery_overflow (pipeline->recovery);
+}
+
+static void *
+facron_pipeline_matcher (void *data)
+{
+    FacronMatcher *matcher = (FacronMatcher *) data;
+    FacronPipeline *pipeline = matcher->pipeline;
+
+    for (;;)
+    {
+        FacronBatch *batch = (FacronBatch *) facron_ring_pop (pipeline->work);
+
+        if (batch == STOP (pipeline))
+            break;
+
+        bool overflowed = facron_pipeline_handle (matcher, batch);
+
+        if (pipeline->recovery)
+            facron_pipeline_complete (pipeline, batch, overflowed);
+        else
+            facron_ring_push (pipeline->pool, batch);
+    }
+
+    return NULL;
+}
+
+/* Waits for fd to be readable, returns false when asked to stop */
+static bool
+facron_pipeline_wait (FacronPipeline *pipeline,
+                      int             fd)
+{
+    struct pollfd fds[2] = {
+        { .fd = fd,                 .events = POLLIN },
+        { .fd = pipeline->stop_fd,  .events = POLLIN },
+    };
+
+    while (poll (fds, 2, -1) < 0)
+    {
+        if (errno != EINTR)
+            return false;
+    }
+
+    return !fds[1].revents;
+}
+
+static void *
+facron_pipeline_reader (void *data)
+{
+    FacronPipeline *pipeline = (FacronPipeline *) data;
+    uint64_t one = 1;
+
+    for (;;)
+    {
+        FacronBatch *batch;
+        ssize_t len;
+
+        while (!(batch = (FacronBatch *) facron_ring_try_pop (pipeline->pool)))
+        {
+            if (!facron_pipeline_wait (pipeline, facron_ring_get_fd (pipeline->pool)))
+                return NULL;
+        }
+
+        for (;;)
+        {
+            if (!facron_pipeline_wait (pipeline, pipeline->fanotify_fd))
+            {
+                facron_ring_push (pipeline->pool, batch);
+                return NULL;
+            }
+
+            if ((len = read (pipeline->fanotify_fd, batch->data, pipeline->buffer_size)) >= 0)
+                break;
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                fprintf (stderr, "Error: could not read fanotify events: %s\n", strerror (errno));
+                goto fail;
+            }
+        }
+
+        if (len >= (ssize_t) FAN_EVENT_METADATA_LEN && ((FacronMetadata *) batch->data)->vers < 2)
+        {
+            fprintf (stderr, "Kernel fanotify version too old\n");
+            goto fail;
+        }
+
+        facron_metrics_inc (FACRON_METRIC_READS);
+        facron_metrics_add (FACRON_METRIC_READ_BYTES, len);
+
+        batch->len = len;
+        batch->seq = pipeline->n_read++;
+        batch->stamp = facron_metrics_now ();
+        facron_ring_push (pipeline->work, batch);
+    }
+
+fail:
+    if (write (pipeline->fd, &one, sizeof (one)) < 0)
+        fprintf (stderr, "Error: could not report the failure of the reader: %s\n", strerror (errno));
+    return NULL;
+}
+
+int
+facron_pipeline_get_fd (const FacronPipeline *pipeline)
+{
+    return pipeline->fd;
+}
+
+void
+facron_pipeline_print_metrics (const FacronPipeline *pipeline,
+                               FILE                 *out)
+{
+    fprintf (out, "# HELP facron_batches_queued Batches read and waiting for a matcher.\n"
+                  "# TYPE facron_batches_queued gauge\n"
+                  "facron_batches_queued %zu\n", facron_ring_get_depth (pipeline->work));
+    fprintf (out, "# HELP facron_matcher_events_total Events handled by each matcher thread.\n"
+                  "# TYPE facron_matcher_events_total counter\n");
+    for (unsigned int i = 0; i < pipeline->n_matchers; ++i)
+        fprintf (out, "facron_matcher_events_total{matcher=\"%u\"} %lu\n", i, atomic_load (&pipeline->matchers[i].n_events));
+    fprintf (out, "# HELP facron_matcher_batches_total Batches handled by each matcher thread.\n"
+                  "# TYPE facron_matcher_batches_total counter\n");
+    for (unsigned int i = 0; i < pipeline->n_matchers; ++i)
+        fprintf (out, "facron_matcher_batches_total{matcher=\"%u\"} %lu\n", i, atomic_load (&pipeline->matchers[i].n_batches));
+}
+
+void
+facron_pipeline_free (FacronPipeline *pipeline)
+{
+    uint64_t one = 1;
+
+    if (!pipeline)
+        return;
+
+    if (pipeline->reading)
+    {
+        if (write (pipeline->stop_fd, &one, sizeof (one)) < 0)
+            fprintf (stderr, "Error: could not stop the reader: %s\n", strerror (errno));
+        pthread_join (pipeline->reader, NULL);
+    }
+
+    for (unsigned int i = 0; pipeline->matchers && i < pipeline->n_matchers; ++i)
+    {
+        if (pipeline->matchers[i].started)
+            facron_ring_push (pipeline->work, STOP (pipeline));
+    }
+
+    for (unsigned int i = 0; pipeline->matchers && i < pipeline->n_matchers; ++i)
+    {
+        if (pipeline->matchers[i].started)
+            pthread_join (pipeline->matchers[i].thread, NULL);
+        facron_fid_cache_free (pipeline->matchers[i].fid_cache);
+    }
+
+    for (size_t i = 0; pipeline->batches && i < pipeline->n_batches; ++i)
+        free (pipeline->batches[i]);
+
+    facron_ring_free (pipeline->work);
+    facron_ring_free (pipeline->pool);
+    free (pipeline->batches);
+    free (pipeline->parked);
+    free (pipeline->matchers);
+    pthread_mutex_destroy (&pipeline->lock);
+    if (pipeline->stop_fd >= 0)
+        close (pipeline->stop_fd);
+    if (pipeline->fd >= 0)
+        close (pipeline->fd);
+    free (pipeline);
+}
+
+FacronPipeline *
+facron_pipeline_new (int             fanotify_fd,
+                     FacronConf     *conf,
+                     FacronExecutor *executor,
+                     FacronRecovery *recovery,
+                     FacronTrace    *trace,
+                     size_t          buffer_size,
+                     unsigned int    n_matchers,
+                     bool            fid,
+                     bool            ignore_own)
+{
+    FacronPipeline *pipeline = (FacronPipeline *) calloc (1, sizeof (FacronPipeline));
+    int err;
+
+    pipeline->fanotify_fd = fanotify_fd;
+    pipeline->conf = conf;
+    pipeline->executor = executor;
+    pipeline->recovery = recovery;
+    pipeline->trace = trace;
+    pipeline->ignore_own = ignore_own;
+    pthread_mutex_init (&pipeline->lock, NULL);
+    pipeline->buffer_size = buffer_size;
+    pipeline->n_matchers = (n_matchers) ? n_matchers : 1;
+    /* Enough for the reader to keep going while every matcher is busy */
+    pipeline->n_batches = 2 * pipeline->n_matchers + 2;
+    pipeline->stop_fd = eventfd (0, EFD_CLOEXEC);
+    pipeline->fd = eventfd (0, EFD_CLOEXEC|EFD_NONBLOCK);
+
+    if (pipeline->stop_fd < 0 || pipeline->fd < 0 ||
+        !(pipeline->work = facron_ring_new (pipeline->n_batches + pipeline->n_matchers, FACRON_RING_WAKE_EACH)) ||
+        !(pipeline->pool = facron_ring_new (pipeline->n_batches, FACRON_RING_WAKE_EACH)))
+    {
+        fprintf (stderr, "Error: could not create the event pipeline: %s\n", strerror (errno));
+        goto fail;
+    }
+
+    pipeline->batches = (FacronBatch **) calloc (pipeline->n_batches, sizeof (FacronBatch *));
+    pipeline->parked = (FacronBatch **) calloc (pipeline->n_batches, sizeof (FacronBatch *));
+    for (size_t i = 0; i < pipeline->n_batches; ++i)
+    {
+        if (!(pipeline->batches[i] = (FacronBatch *) malloc (sizeof (FacronBatch) + buffer_size)))
+        {
+            fprintf (stderr, "Error: could not allocate %zu bytes event buffers: %s\n", buffer_size, strerror (errno));
+            goto fail;
+        }
+        facron_ring_push (pipeline->pool, pipeline->batches[i]);
+    }
+
+    pipeline->matchers = (FacronMatcher *) calloc (pipeline->n_matchers, sizeof (FacronMatcher));
+    for (unsigned int i = 0; i < pipeline->n_matchers; ++i)
+    {
+        FacronMatcher *matcher = &pipeline->matchers[i];
+
+        matcher->pipeline = pipeline;
+        /* Each matcher resolves handles with its own cache */
+        matcher->fid_cache = (fid) ? facron_fid_cache_new () : NULL;
+        atomic_init (&matcher->n_events, 0);
+        atomic_init (&matcher->n_batches, 0);
+
+        if ((err = pthread_create (&matcher->thread, NULL, facron_pipeline_matcher, matcher)))
+        {
+            fprintf (stderr, "Error: could not start matcher thread: %s\n", strerror (err));
+            goto fail;
+        }
+        matcher->started = true;
+    }
+
+    if ((err = pthread_create (&pipeline->reader, NULL, facron_pipeline_reader, pipeline)))
+    {
+        fprintf (stderr, "Error: could not start reader thread: %s\n", strerror (err));
+        goto fail;
+    }
+    pipeline->reading = true;
+
+    return pipeline;
+
+fail:
+    facron_pipeline_free (pipeline);
+    return NULL;
+}
@@ -0,0 +1,56 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2012-2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_PIPELINE_H__
+#define __FACRON_PIPELINE_H__
+
+#include "facron-conf.h"
+#include "facron-recovery.h"
+#include "facron-trace.h"
+
+#include <stdio.h>
+
+/*
+ * A reader thread drains fanotify into batches, which matcher threads
+ * resolve and match against the current generation, handing what must
+ * be run over to the executor. recovery, which may be NULL, gets told
+ * about the events and overflows, and trace, which may be NULL as well,
+ * records them.
+ */
+typedef struct FacronPipeline FacronPipeline;
+
+/* Readable once the reader stopped because of an error */
+int facron_pipeline_get_fd (const FacronPipeline *pipeline);
+
+void facron_pipeline_print_metrics (const FacronPipeline *pipeline,
+                                    FILE                 *out);
+
+void facron_pipeline_free (FacronPipeline *pipeline);
+
+FacronPipeline *facron_pipeline_new (int             fanotify_fd,
+                                     FacronConf     *conf,
+                                     FacronExecutor *executor,
+                                     FacronRecovery *recovery,
+                                     FacronTrace    *trace,
+                                     size_t          buffer_size,
+                                     unsigned int    n_matchers,
+                                     bool            fid,
+                                     bool            ignore_own);
+
+#endif /* __FACRON_PIPELINE_H__ */
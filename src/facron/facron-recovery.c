@@ -0,0 +1,710 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-metrics.h"
+#include "facron-recovery.h"
+#include "facron-util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+/* Bounds the memory and the duration of a rescan whatever the watch set */
+#define MAX_TRACKED  65536
+#define SCAN_THREADS 4
+#define SCAN_SPLIT   256
+
+/* Matchers only contend on the records of a shard, picked by the top bits of the hash */
+#define SHARD_BITS 6
+#define N_SHARDS   (1 << SHARD_BITS)
+
+typedef struct
+{
+    bool            known;
+    bool            exists;
+    bool            dir;
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+    struct timespec ctime;
+} FacronSnapshot;
+
+/* Their path is never freed nor moved until the recovery itself */
+typedef struct
+{
+    char          *path;
+    size_t         len;
+    uint64_t       hash;
+    /* Touched by an event, waiting for the recovery thread to take a new snapshot */
+    bool           dirty;
+    FacronSnapshot snapshot;
+} FacronRecord;
+
+/* An open addressed table, at most half full */
+typedef struct
+{
+    pthread_mutex_t lock;
+    FacronRecord   *records;
+    size_t          size;
+    size_t          n_records;
+} FacronRecoveryShard;
+
+typedef struct
+{
+    char *path;
+    /* Not listed yet, its children are unknown */
+    bool  fresh;
+} FacronRecoveryDir;
+
+struct FacronRecovery
+{
+    FacronConf          *conf;
+    FacronExecutor      *executor;
+    FacronRecoveryShard  shards[N_SHARDS];
+    atomic_size_t        n_records;
+    atomic_bool          full;
+    /* Some records are dirty */
+    atomic_bool          dirty;
+    /* Directories watched for their children, only used by the recovery thread */
+    FacronRecoveryDir   *dirs;
+    size_t               n_dirs;
+    struct timespec      last_scan;
+    pthread_t            thread;
+    bool                 started;
+    int                  fd;
+    atomic_bool          track;
+    atomic_bool          rescan;
+    atomic_bool          stop;
+};
+
+typedef struct
+{
+    FacronRecovery       *recovery;
+    FacronConfGeneration *generation;
+    char                **paths;
+    size_t                n_paths;
+    const char          **dirs;
+    bool                  synthesize;
+    struct timespec       since;
+    atomic_ulong          n_recovered;
+} FacronScan;
+
+static void
+facron_recovery_take (const char     *path,
+                      FacronSnapshot *snapshot)
+{
+    struct stat st;
+
+    memset (snapshot, 0, sizeof (*snapshot));
+    snapshot->known = true;
+
+    if (stat (path, &st) < 0)
+        return;
+
+    snapshot->exists = true;
+    snapshot->dir = S_ISDIR (st.st_mode);
+    snapshot->ino = st.st_ino;
+    snapshot->size = st.st_size;
+    snapshot->mtime = st.st_mtim;
+    snapshot->ctime = st.st_ctim;
+}
+
+/* The events which would have led from old to new */
+static unsigned long long
+facron_recovery_diff (const FacronSnapshot *old,
+                      const FacronSnapshot *new)
+{
+    unsigned long long mask = 0;
+
+    if (!old->known || (!old->exists && !new->exists))
+        return 0;
+
+    if (!new->exists)
+        mask = FAN_DELETE|FAN_DELETE_SELF;
+    else if (!old->exists || old->ino != new->ino)
+        mask = FAN_CREATE|FAN_MODIFY|FAN_CLOSE_WRITE;
+    /* The mtime of a directory only tells about its children, which are checked on their own */
+    else if (!new->dir && (old->size != new->size ||
+                           old->mtime.tv_sec != new->mtime.tv_sec ||
+                           old->mtime.tv_nsec != new->mtime.tv_nsec))
+        mask = FAN_MODIFY|FAN_CLOSE_WRITE;
+
+    if (mask && ((new->exists) ? new->dir : old->dir))
+        mask |= FAN_ONDIR;
+
+    return mask;
+}
+
+static inline FacronRecoveryShard *
+facron_recovery_get_shard (FacronRecovery *recovery,
+                           uint64_t        hash)
+{
+    return &recovery->shards[hash >> (64 - SHARD_BITS)];
+}
+
+/* Called with the lock of the shard held */
+static FacronRecord *
+facron_recovery_lookup (const FacronRecoveryShard *shard,
+                        const char                *path,
+                        size_t                     len,
+                        uint64_t                   hash)
+{
+    if (!shard->n_records)
+        return NULL;
+
+    for (size_t i = hash & (shard->size - 1); shard->records[i].path; i = (i + 1) & (shard->size - 1))
+    {
+        FacronRecord *record = &shard->records[i];
+        if (record->hash == hash && record->len == len && !memcmp (record->path, path, len))
+            return record;
+    }
+
+    return NULL;
+}
+
+/* Called with the lock of the shard held */
+static FacronRecord *
+facron_recovery_insert (FacronRecovery      *recovery,
+                        FacronRecoveryShard *shard,
+                        const char          *path,
+                        size_t               len,
+                        uint64_t             hash)
+{
+    if (atomic_fetch_add (&recovery->n_records, 1) >= MAX_TRACKED)
+    {
+        atomic_fetch_sub (&recovery->n_records, 1);
+        if (!atomic_exchange (&recovery->full, true))
+            fprintf (stderr, "Warning: overflow recovery tracks at most %d paths\n", MAX_TRACKED);
+        return NULL;
+    }
+
+    if (2 * (shard->n_records + 1) > shard->size)
+    {
+        FacronRecord *old = shard->records;
+        size_t old_size = shard->size;
+
+        shard->size = (old_size) ? old_size * 2 : 16;
+        shard->records = (FacronRecord *) calloc (shard->size, sizeof (FacronRecord));
+
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (!old[i].path)
+                continue;
+
+            size_t j = old[i].hash & (shard->size - 1);
+            while (shard->records[j].path)
+                j = (j + 1) & (shard->size - 1);
+            shard->records[j] = old[i];
+        }
+
+        free (old);
+    }
+
+    size_t i = hash & (shard->size - 1);
+    while (shard->records[i].path)
+        i = (i + 1) & (shard->size - 1);
+
+    FacronRecord *record = &shard->records[i];
+    record->path = strndup (path, len);
+    record->len = len;
+    record->hash = hash;
+    ++shard->n_records;
+
+    return record;
+}
+
+static bool
+facron_recovery_contains (FacronRecovery *recovery,
+                          const char     *path,
+                          size_t          len,
+                          uint64_t        hash)
+{
+    FacronRecoveryShard *shard = facron_recovery_get_shard (recovery, hash);
+
+    pthread_mutex_lock (&shard->lock);
+    bool found = facron_recovery_lookup (shard, path, len, hash);
+    pthread_mutex_unlock (&shard->lock);
+
+    return found;
+}
+
+/* Starts tracking the path, keeping its snapshot if it already was */
+static void
+facron_recovery_add (FacronRecovery *recovery,
+                     const char     *path,
+                     size_t          len,
+                     uint64_t        hash)
+{
+    FacronRecoveryShard *shard = facron_recovery_get_shard (recovery, hash);
+
+    pthread_mutex_lock (&shard->lock);
+    if (!facron_recovery_lookup (shard, path, len, hash))
+        facron_recovery_insert (recovery, shard, path, len, hash);
+    pthread_mutex_unlock (&shard->lock);
+}
+
+/* Stores the new snapshot and returns the previous one, unknown if there was none */
+static FacronSnapshot
+facron_recovery_update (FacronRecovery       *recovery,
+                        const char           *path,
+                        size_t                len,
+                        uint64_t              hash,
+                        const FacronSnapshot *snapshot,
+                        bool                  insert)
+{
+    FacronRecoveryShard *shard = facron_recovery_get_shard (recovery, hash);
+    FacronSnapshot old = { .known = false };
+
+    pthread_mutex_lock (&shard->lock);
+
+    FacronRecord *record = facron_recovery_lookup (shard, path, len, hash);
+
+    if (!record && insert)
+        record = facron_recovery_insert (recovery, shard, path, len, hash);
+    if (record)
+    {
+        old = record->snapshot;
+        record->snapshot = *snapshot;
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    return old;
+}
+
+static void
+facron_recovery_emit (FacronScan         *scan,
+                      const char         *path,
+                      size_t              len,
+                      unsigned long long  mask)
+{
+    FacronMetadata metadata = {
+        .event_len = FAN_EVENT_METADATA_LEN,
+        .vers = FANOTIFY_METADATA_VERSION,
+        .metadata_len = FAN_EVENT_METADATA_LEN,
+        .mask = mask,
+        .fd = FAN_NOFD,
+        .pid = 0,
+    };
+    FacronEvent event = { .path = path, .path_len = len, .metadata = &metadata, .stamp = facron_metrics_now () };
+
+    facron_conf_handle (scan->generation, scan->recovery->executor, &event);
+    atomic_fetch_add_explicit (&scan->n_recovered, 1, memory_order_relaxed);
+}
+
+static void
+facron_recovery_check (FacronScan *scan,
+                       const char *path)
+{
+    size_t len = strlen (path);
+    FacronSnapshot snapshot;
+
+    facron_recovery_take (path, &snapshot);
+
+    FacronSnapshot old = facron_recovery_update (scan->recovery, path, len, facron_hash (path, len), &snapshot, false);
+    unsigned long long mask = (scan->synthesize) ? facron_recovery_diff (&old, &snapshot) : 0;
+
+    if (mask)
+        facron_recovery_emit (scan, path, len, mask);
+}
+
+/* Looks for children which appeared since the last scan */
+static void
+facron_recovery_list (FacronScan *scan,
+                      const char *dir)
+{
+    FacronRecovery *recovery = scan->recovery;
+    size_t dir_len = strlen (dir);
+    char path[PATH_MAX];
+    struct dirent *ent;
+    DIR *d;
+
+    if (dir_len + 2 > sizeof (path) || !(d = opendir (dir)))
+        return;
+
+    memcpy (path, dir, dir_len);
+    if (dir_len > 1)
+        path[dir_len++] = '/';
+
+    while ((ent = readdir (d)) && !atomic_load (&recovery->stop))
+    {
+        size_t name_len = strlen (ent->d_name);
+        size_t len = dir_len + name_len;
+
+        if (!strcmp (ent->d_name, ".") || !strcmp (ent->d_name, "..") || len >= sizeof (path))
+            continue;
+
+        memcpy (path + dir_len, ent->d_name, name_len + 1);
+
+        uint64_t hash = facron_hash (path, len);
+        FacronSnapshot snapshot;
+
+        if (facron_recovery_contains (recovery, path, len, hash))
+            continue;
+
+        facron_recovery_take (path, &snapshot);
+        if (!snapshot.exists)
+            continue;
+
+        FacronSnapshot old = facron_recovery_update (recovery, path, len, hash, &snapshot, true);
+
+        /* Older children simply were not tracked yet */
+        if (!scan->synthesize || old.known ||
+            snapshot.ctime.tv_sec < scan->since.tv_sec ||
+            (snapshot.ctime.tv_sec == scan->since.tv_sec && snapshot.ctime.tv_nsec < scan->since.tv_nsec))
+                continue;
+
+        facron_recovery_emit (scan, path, len, FAN_CREATE|FAN_MODIFY|FAN_CLOSE_WRITE|((snapshot.dir) ? FAN_ONDIR : 0));
+    }
+
+    closedir (d);
+}
+
+static void
+facron_recovery_scan_item (size_t  i,
+                           void   *data)
+{
+    FacronScan *scan = (FacronScan *) data;
+
+    /* What is left gets skipped when stopping */
+    if (atomic_load (&scan->recovery->stop))
+        return;
+
+    if (i < scan->n_paths)
+        facron_recovery_check (scan, scan->paths[i]);
+    else
+        facron_recovery_list (scan, scan->dirs[i - scan->n_paths]);
+}
+
+/*
+ * A rescan checks every known path and lists every directory, comparing
+ * against the snapshot. Otherwise, only what isn't known yet gets its
+ * first snapshot taken, so that what got lost is never taken for granted.
+ */
+static void
+facron_recovery_scan (FacronRecovery *recovery,
+                      bool            synthesize)
+{
+    FacronScan scan = { .recovery = recovery, .synthesize = synthesize, .since = recovery->last_scan };
+    size_t n_dirs = 0;
+
+    if (synthesize || !recovery->last_scan.tv_sec)
+        clock_gettime (CLOCK_REALTIME, &recovery->last_scan);
+
+    /* The records get checked from a copy of their paths, the tables may grow meanwhile */
+    for (unsigned int s = 0; s < N_SHARDS; ++s)
+    {
+        FacronRecoveryShard *shard = &recovery->shards[s];
+
+        pthread_mutex_lock (&shard->lock);
+        scan.paths = (char **) realloc (scan.paths, (scan.n_paths + shard->n_records + 1) * sizeof (char *));
+        for (size_t i = 0; i < shard->size; ++i)
+        {
+            FacronRecord *record = &shard->records[i];
+
+            if (record->path && record->snapshot.known == synthesize)
+                scan.paths[scan.n_paths++] = strndup (record->path, record->len);
+        }
+        pthread_mutex_unlock (&shard->lock);
+    }
+
+    scan.dirs = (const char **) malloc ((recovery->n_dirs + 1) * sizeof (char *));
+    for (size_t i = 0; i < recovery->n_dirs; ++i)
+    {
+        if (synthesize || recovery->dirs[i].fresh)
+            scan.dirs[n_dirs++] = recovery->dirs[i].path;
+        recovery->dirs[i].fresh = false;
+    }
+
+    scan.generation = facron_conf_acquire (recovery->conf);
+    atomic_init (&scan.n_recovered, 0);
+
+    if (synthesize)
+        fprintf (stderr, "Notice: rescanning %zu paths and %zu directories\n", scan.n_paths, n_dirs);
+
+    facron_util_parallel_for (scan.n_paths + n_dirs, SCAN_SPLIT, SCAN_THREADS, facron_recovery_scan_item, &scan);
+
+    if (synthesize)
+    {
+        unsigned long n_recovered = atomic_load (&scan.n_recovered);
+
+        facron_metrics_add (FACRON_METRIC_RECOVERED, n_recovered);
+        fprintf (stderr, "Notice: recovered %lu events\n", n_recovered);
+    }
+
+    facron_conf_release (scan.generation);
+    for (size_t i = 0; i < scan.n_paths; ++i)
+        free (scan.paths[i]);
+    free (scan.paths);
+    free (scan.dirs);
+}
+
+static void
+facron_recovery_clear (FacronRecovery *recovery)
+{
+    for (unsigned int s = 0; s < N_SHARDS; ++s)
+    {
+        for (size_t i = 0; i < recovery->shards[s].size; ++i)
+            free (recovery->shards[s].records[i].path);
+        free (recovery->shards[s].records);
+    }
+
+    for (size_t i = 0; i < recovery->n_dirs; ++i)
+        free (recovery->dirs[i].path);
+    free (recovery->dirs);
+}
+
+/*
+ * Adds the paths of the current generation. Those already known keep
+ * their snapshot, which might be what tells about events lost meanwhile.
+ */
+static void
+facron_recovery_refresh (FacronRecovery *recovery)
+{
+    FacronConfGeneration *generation = facron_conf_acquire (recovery->conf);
+    FacronRecoveryDir *dirs = NULL;
+    size_t n_dirs = 0;
+
+    for (const FacronConfEntry *entry = facron_conf_get_entries (generation); entry; entry = facron_conf_entry_get_next (entry))
+    {
+        const char *path = facron_conf_entry_get_path (entry);
+        size_t len = facron_conf_entry_get_path_len (entry);
+
+        /* Events come without the trailing slashes */
+        while (len > 1 && path[len - 1] == '/')
+            --len;
+
+        facron_recovery_add (recovery, path, len, facron_hash (path, len));
+
+        if (facron_conf_entry_get_child_mask (entry))
+        {
+            bool fresh = true;
+
+            for (size_t i = 0; i < recovery->n_dirs && fresh; ++i)
+                fresh = strlen (recovery->dirs[i].path) != len || memcmp (recovery->dirs[i].path, path, len);
+
+            dirs = (FacronRecoveryDir *) realloc (dirs, (n_dirs + 1) * sizeof (FacronRecoveryDir));
+            dirs[n_dirs].path = strndup (path, len);
+            dirs[n_dirs++].fresh = fresh;
+        }
+    }
+
+    facron_conf_release (generation);
+
+    for (size_t i = 0; i < recovery->n_dirs; ++i)
+        free (recovery->dirs[i].path);
+    free (recovery->dirs);
+    recovery->dirs = dirs;
+    recovery->n_dirs = n_dirs;
+}
+
+/* Takes the new snapshots of the dirty records, one shard at a time */
+static void
+facron_recovery_sweep (FacronRecovery *recovery)
+{
+    FacronRecord *dirty = NULL;
+    size_t n_dirty = 0, dirty_size = 0;
+
+    if (!atomic_exchange (&recovery->dirty, false))
+        return;
+
+    for (unsigned int s = 0; s < N_SHARDS; ++s)
+    {
+        FacronRecoveryShard *shard = &recovery->shards[s];
+
+        /* Records may move as the table grows, not their path */
+        pthread_mutex_lock (&shard->lock);
+        for (size_t i = 0; i < shard->size; ++i)
+        {
+            FacronRecord *record = &shard->records[i];
+
+            if (!record->dirty)
+                continue;
+
+            if (n_dirty == dirty_size)
+            {
+                dirty_size = (dirty_size) ? dirty_size * 2 : 16;
+                dirty = (FacronRecord *) realloc (dirty, dirty_size * sizeof (FacronRecord));
+            }
+            record->dirty = false;
+            dirty[n_dirty++] = *record;
+        }
+        pthread_mutex_unlock (&shard->lock);
+
+        for (size_t i = 0; i < n_dirty; ++i)
+        {
+            FacronSnapshot snapshot;
+
+            facron_recovery_take (dirty[i].path, &snapshot);
+            facron_recovery_update (recovery, dirty[i].path, dirty[i].len, dirty[i].hash, &snapshot, false);
+        }
+        n_dirty = 0;
+    }
+
+    free (dirty);
+}
+
+static void *
+facron_recovery_run (void *data)
+{
+    FacronRecovery *recovery = (FacronRecovery *) data;
+    uint64_t count;
+
+    for (;;)
+    {
+        if (read (recovery->fd, &count, sizeof (count)) < 0 && errno != EINTR)
+        {
+            fprintf (stderr, "Error: could not wait for overflows: %s\n", strerror (errno));
+            break;
+        }
+
+        if (atomic_load (&recovery->stop))
+            break;
+
+        /* Before any rescan, as events got handled before the overflow was */
+        facron_recovery_sweep (recovery);
+
+        if (atomic_exchange (&recovery->rescan, false))
+            facron_recovery_scan (recovery, true);
+
+        if (atomic_exchange (&recovery->track, false))
+        {
+            facron_recovery_refresh (recovery);
+            facron_recovery_scan (recovery, false);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+facron_recovery_wake (FacronRecovery *recovery)
+{
+    uint64_t one = 1;
+
+    if (write (recovery->fd, &one, sizeof (one)) < 0)
+        fprintf (stderr, "Error: could not wake the recovery thread: %s\n", strerror (errno));
+}
+
+/* Only flags the record, the recovery thread takes its snapshot */
+void
+facron_recovery_touch (FacronRecovery    *recovery,
+                       const FacronEvent *event,
+                       unsigned int       n)
+{
+    uint64_t hash = facron_hash (event->path, event->path_len);
+    FacronRecoveryShard *shard = facron_recovery_get_shard (recovery, hash);
+    bool wake = false;
+
+    pthread_mutex_lock (&shard->lock);
+
+    FacronRecord *record = facron_recovery_lookup (shard, event->path, event->path_len, hash);
+
+    if (!record && n)
+        record = facron_recovery_insert (recovery, shard, event->path, event->path_len, hash);
+    if (record && !record->dirty)
+    {
+        record->dirty = true;
+        wake = !atomic_exchange (&recovery->dirty, true);
+    }
+
+    pthread_mutex_unlock (&shard->lock);
+
+    if (wake)
+        facron_recovery_wake (recovery);
+}
+
+void
+facron_recovery_overflow (FacronRecovery *recovery)
+{
+    atomic_store (&recovery->rescan, true);
+    facron_recovery_wake (recovery);
+}
+
+void
+facron_recovery_track (FacronRecovery *recovery)
+{
+    atomic_store (&recovery->track, true);
+    facron_recovery_wake (recovery);
+}
+
+void
+facron_recovery_free (FacronRecovery *recovery)
+{
+    if (!recovery)
+        return;
+
+    if (recovery->started)
+    {
+        atomic_store (&recovery->stop, true);
+        facron_recovery_wake (recovery);
+        pthread_join (recovery->thread, NULL);
+    }
+
+    facron_recovery_clear (recovery);
+    for (unsigned int s = 0; s < N_SHARDS; ++s)
+        pthread_mutex_destroy (&recovery->shards[s].lock);
+    if (recovery->fd >= 0)
+        close (recovery->fd);
+    free (recovery);
+}
+
+FacronRecovery *
+facron_recovery_new (FacronConf     *conf,
+                     FacronExecutor *executor)
+{
+    FacronRecovery *recovery = (FacronRecovery *) calloc (1, sizeof (FacronRecovery));
+    int err;
+
+    recovery->conf = conf;
+    recovery->executor = executor;
+    for (unsigned int s = 0; s < N_SHARDS; ++s)
+        pthread_mutex_init (&recovery->shards[s].lock, NULL);
+    atomic_init (&recovery->n_records, 0);
+    atomic_init (&recovery->full, false);
+    atomic_init (&recovery->dirty, false);
+    atomic_init (&recovery->track, false);
+    atomic_init (&recovery->rescan, false);
+    atomic_init (&recovery->stop, false);
+
+    if ((recovery->fd = eventfd (0, EFD_CLOEXEC)) < 0)
+    {
+        fprintf (stderr, "Error: could not create eventfd: %s\n", strerror (errno));
+        facron_recovery_free (recovery);
+        return NULL;
+    }
+
+    if ((err = pthread_create (&recovery->thread, NULL, facron_recovery_run, recovery)))
+    {
+        fprintf (stderr, "Error: could not start the recovery thread: %s\n", strerror (err));
+        facron_recovery_free (recovery);
+        return NULL;
+    }
+    recovery->started = true;
+
+    return recovery;
+}
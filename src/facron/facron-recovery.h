@@ -0,0 +1,47 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_RECOVERY_H__
+#define __FACRON_RECOVERY_H__
+
+#include "facron-conf.h"
+
+/*
+ * Keeps a (inode, size, mtime) snapshot of the watched paths, the
+ * children of the watched directories and the paths which triggered a
+ * command. When fanotify overflows, a background thread rescans them in
+ * parallel and synthesizes the events which got lost from what changed.
+ */
+typedef struct FacronRecovery FacronRecovery;
+
+/* Any thread, n being how many commands the event triggered */
+void facron_recovery_touch    (FacronRecovery    *recovery,
+                               const FacronEvent *event,
+                               unsigned int       n);
+void facron_recovery_overflow (FacronRecovery    *recovery);
+
+/* Takes a new snapshot based on the current generation */
+void facron_recovery_track (FacronRecovery *recovery);
+
+void facron_recovery_free (FacronRecovery *recovery);
+
+FacronRecovery *facron_recovery_new (FacronConf     *conf,
+                                     FacronExecutor *executor);
+
+#endif /* __FACRON_RECOVERY_H__ */
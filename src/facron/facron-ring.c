@@ -0,0 +1,347 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2012-2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-ring.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#define CACHELINE 64
+
+/*
+ * Dmitry Vyukov's bounded MPMC queue: each cell carries a sequence number
+ * telling whether it is ready to be written to or read from for a given
+ * lap, so that producers and consumers only contend on their own index.
+ */
+typedef struct
+{
+    atomic_size_t seq;
+    void         *item;
+} FacronRingCell;
+
+struct FacronRing
+{
+    FacronRingCell *cells;
+    size_t          mask;
+    FacronRingWake  wake;
+    int             fd;
+    /* Dequeued by the single consumer and not yet settled in count */
+    long            n_taken;
+    char            pad0[CACHELINE];
+    atomic_size_t   head;
+    char            pad1[CACHELINE - sizeof (atomic_size_t)];
+    atomic_size_t   tail;
+    char            pad2[CACHELINE - sizeof (atomic_size_t)];
+    /*
+     * Pushed minus settled, the push taking it from 0 signals the fd.
+     * Goes negative while the pushes of dequeued items are not over.
+     */
+    atomic_long     count;
+    /* Producers sleeping in facron_ring_push_wait, on the space futex */
+    atomic_uint     n_waiting;
+    atomic_uint     space;
+    char            pad3[CACHELINE];
+};
+
+static bool
+facron_ring_enqueue (FacronRing *ring,
+                     void       *item)
+{
+    size_t pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    FacronRingCell *cell;
+
+    for (;;)
+    {
+        cell = &ring->cells[pos & ring->mask];
+        intptr_t dif = (intptr_t) atomic_load_explicit (&cell->seq, memory_order_acquire) - (intptr_t) pos;
+
+        if (!dif)
+        {
+            if (atomic_compare_exchange_weak_explicit (&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+            return false;
+        else
+            pos = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    }
+
+    cell->item = item;
+    atomic_store_explicit (&cell->seq, pos + 1, memory_order_release);
+
+    return true;
+}
+
+static void *
+facron_ring_dequeue (FacronRing *ring)
+{
+    size_t pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    FacronRingCell *cell;
+
+    for (;;)
+    {
+        cell = &ring->cells[pos & ring->mask];
+        intptr_t dif = (intptr_t) atomic_load_explicit (&cell->seq, memory_order_acquire) - (intptr_t) (pos + 1);
+
+        if (!dif)
+        {
+            if (atomic_compare_exchange_weak_explicit (&ring->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (dif < 0)
+            return NULL;
+        else
+            pos = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+    }
+
+    void *item = cell->item;
+    atomic_store_explicit (&cell->seq, pos + ring->mask + 1, memory_order_release);
+
+    return item;
+}
+
+static void
+facron_ring_signal (FacronRing *ring)
+{
+    uint64_t one = 1;
+
+    switch (ring->wake)
+    {
+    case FACRON_RING_WAKE_NONE:
+        return;
+    case FACRON_RING_WAKE_BATCH:
+        if (atomic_fetch_add (&ring->count, 1))
+            return;
+        break;
+    case FACRON_RING_WAKE_EACH:
+        break;
+    }
+
+    if (write (ring->fd, &one, sizeof (one)) < 0)
+        fprintf (stderr, "Error: could not wake ring consumers: %s\n", strerror (errno));
+}
+
+bool
+facron_ring_push (FacronRing *ring,
+                  void       *item)
+{
+    if (!facron_ring_enqueue (ring, item))
+        return false;
+
+    facron_ring_signal (ring);
+
+    return true;
+}
+
+void
+facron_ring_push_wait (FacronRing *ring,
+                       void       *item)
+{
+    if (!facron_ring_enqueue (ring, item))
+    {
+        /* Announce ourselves before trying again, for the consumer not to miss us */
+        atomic_fetch_add (&ring->n_waiting, 1);
+        atomic_thread_fence (memory_order_seq_cst);
+
+        for (;;)
+        {
+            unsigned int space = atomic_load (&ring->space);
+
+            if (facron_ring_enqueue (ring, item))
+                break;
+            syscall (SYS_futex, &ring->space, FUTEX_WAIT_PRIVATE, space, NULL, NULL, 0);
+        }
+
+        atomic_fetch_sub (&ring->n_waiting, 1);
+    }
+
+    facron_ring_signal (ring);
+}
+
+static void
+facron_ring_wake_producers (FacronRing *ring)
+{
+    /* Pairs with the one in facron_ring_push_wait */
+    atomic_thread_fence (memory_order_seq_cst);
+    if (!atomic_load_explicit (&ring->n_waiting, memory_order_relaxed))
+        return;
+
+    atomic_fetch_add (&ring->space, 1);
+    syscall (SYS_futex, &ring->space, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Only settles with the producers once the ring looks empty */
+static void *
+facron_ring_take (FacronRing *ring)
+{
+    uint64_t token;
+    void *item;
+
+    for (;;)
+    {
+        if ((item = facron_ring_dequeue (ring)))
+        {
+            ++ring->n_taken;
+            return item;
+        }
+
+        long n_taken = ring->n_taken;
+
+        ring->n_taken = 0;
+        if (n_taken)
+            facron_ring_wake_producers (ring);
+
+        /* Reset before settling, the next push from an empty ring signals it again */
+        if (read (ring->fd, &token, sizeof (token)) < 0 && errno != EAGAIN)
+            fprintf (stderr, "Error: could not reset ring fd: %s\n", strerror (errno));
+
+        if (atomic_fetch_sub (&ring->count, n_taken) - n_taken <= 0)
+            return NULL;
+
+        /* Pushed items may still be in the middle of being published */
+        sched_yield ();
+    }
+}
+
+void *
+facron_ring_try_pop (FacronRing *ring)
+{
+    uint64_t token;
+    void *item;
+
+    switch (ring->wake)
+    {
+    case FACRON_RING_WAKE_NONE:
+        return facron_ring_dequeue (ring);
+    case FACRON_RING_WAKE_BATCH:
+        return facron_ring_take (ring);
+    case FACRON_RING_WAKE_EACH:
+        break;
+    }
+
+    /* Each item pushed posted one token on the fd, take one before dequeuing */
+    if (read (ring->fd, &token, sizeof (token)) < 0)
+        return NULL;
+
+    /* The item may still be in the middle of being published */
+    while (!(item = facron_ring_dequeue (ring)))
+        sched_yield ();
+
+    return item;
+}
+
+void *
+facron_ring_pop (FacronRing *ring)
+{
+    struct pollfd pfd = {
+        .fd = ring->fd,
+        .events = POLLIN,
+    };
+    void *item;
+
+    while (!(item = facron_ring_try_pop (ring)))
+        poll (&pfd, 1, -1);
+
+    return item;
+}
+
+int
+facron_ring_get_fd (const FacronRing *ring)
+{
+    return ring->fd;
+}
+
+size_t
+facron_ring_get_depth (const FacronRing *ring)
+{
+    size_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+
+    return (head > tail) ? head - tail : 0;
+}
+
+size_t
+facron_ring_get_capacity (const FacronRing *ring)
+{
+    return ring->mask + 1;
+}
+
+void
+facron_ring_free (FacronRing *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->fd >= 0)
+        close (ring->fd);
+    free (ring->cells);
+    free (ring);
+}
+
+FacronRing *
+facron_ring_new (size_t         capacity,
+                 FacronRingWake wake)
+{
+    FacronRing *ring = (FacronRing *) calloc (1, sizeof (FacronRing));
+    int flags = EFD_NONBLOCK|EFD_CLOEXEC;
+    size_t size = 2;
+
+    while (size < capacity)
+        size *= 2;
+
+    if (wake == FACRON_RING_WAKE_EACH)
+        flags |= EFD_SEMAPHORE;
+
+    ring->wake = wake;
+    ring->fd = -1;
+    if (wake != FACRON_RING_WAKE_NONE && (ring->fd = eventfd (0, flags)) < 0)
+    {
+        fprintf (stderr, "Error: could not create eventfd: %s\n", strerror (errno));
+        free (ring);
+        return NULL;
+    }
+
+    ring->mask = size - 1;
+    ring->cells = (FacronRingCell *) malloc (size * sizeof (FacronRingCell));
+    for (size_t i = 0; i < size; ++i)
+    {
+        atomic_init (&ring->cells[i].seq, i);
+        ring->cells[i].item = NULL;
+    }
+    atomic_init (&ring->head, 0);
+    atomic_init (&ring->tail, 0);
+    atomic_init (&ring->count, 0);
+    atomic_init (&ring->n_waiting, 0);
+    atomic_init (&ring->space, 0);
+
+    return ring;
+}
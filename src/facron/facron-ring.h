@@ -0,0 +1,62 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2012-2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_RING_H__
+#define __FACRON_RING_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A bounded lock-free queue of pointers, usable by any number of producers
+ * and consumers. How its fd wakes them up depends on its mode.
+ */
+typedef struct FacronRing FacronRing;
+
+typedef enum
+{
+    /* The fd counts the queued items, each consumer waits for one */
+    FACRON_RING_WAKE_EACH,
+    /*
+     * For a single consumer: the fd is only signaled when the ring stops
+     * being empty, facron_ring_try_pop then drains it until it is empty
+     */
+    FACRON_RING_WAKE_BATCH,
+    /* No fd, as a free list */
+    FACRON_RING_WAKE_NONE
+} FacronRingWake;
+
+bool  facron_ring_push      (FacronRing *ring,
+                             void       *item);
+/* Sleeps while the ring is full, only for FACRON_RING_WAKE_BATCH */
+void  facron_ring_push_wait (FacronRing *ring,
+                             void       *item);
+void *facron_ring_pop       (FacronRing *ring);
+void *facron_ring_try_pop   (FacronRing *ring);
+
+int    facron_ring_get_fd       (const FacronRing *ring);
+size_t facron_ring_get_depth    (const FacronRing *ring);
+size_t facron_ring_get_capacity (const FacronRing *ring);
+
+void facron_ring_free (FacronRing *ring);
+
+FacronRing *facron_ring_new (size_t         capacity,
+                             FacronRingWake wake);
+
+#endif /* __FACRON_RING_H__ */
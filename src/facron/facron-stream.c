@@ -0,0 +1,471 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-metrics.h"
+#include "facron-stream.h"
+#include "facron-util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+
+/* Per handler, records coming in beyond that while it lags behind are dropped */
+#define MAX_BUFFERED (256 * 1024)
+
+/* Records written with a single syscall */
+#define MAX_IOV 64
+
+/* In milliseconds: how soon to try again once the pipe is full, and how long to wait before restarting */
+#define RETRY_DELAY 10
+#define MIN_BACKOFF 100
+#define MAX_BACKOFF 10000
+
+/*
+ * The buffer holds the records not written yet, each prefixed by its
+ * length, the first one possibly partially written already. A record is
+ * never split across two runs of a handler: what is left of it is
+ * dropped when the handler exits.
+ */
+typedef struct FacronStream FacronStream;
+struct FacronStream
+{
+    FacronStream  *next;
+    FacronStreams *streams;
+    FacronTimer    timer;
+    FacronCommand *command;
+    uint64_t       hash;
+    char          *name;
+    pid_t          pid;
+    int            fd;
+    uint64_t       started;
+    unsigned int   backoff;
+    bool           retained;
+    bool           closing;
+    bool           dropping;
+    size_t         head;
+    size_t         tail;
+    size_t         partial;
+    char          *buffer;
+};
+
+struct FacronStreams
+{
+    FacronTimers            *timers;
+    const posix_spawnattr_t *attr;
+    FacronLineage           *lineage;
+    FacronStream            *streams;
+};
+
+size_t
+facron_stream_format (FacronStreamFormat  format,
+                      const char         *path,
+                      pid_t               pid,
+                      char               *record,
+                      size_t              size)
+{
+    char separator = (format == FACRON_STREAM_NUL) ? '\0' : '\t';
+    char end = (format == FACRON_STREAM_NUL) ? '\0' : '\n';
+    const char *basename = strrchr (path, '/');
+    size_t dir_len;
+    const char *dirname = facron_command_dirname (path, &dir_len);
+    int len = snprintf (record, size, "%s%c%.*s%c%s%c%d%c", path, separator, (int) dir_len, dirname, separator,
+                        (basename) ? basename + 1 : path, separator, pid, end);
+
+    return (len < 0 || (size_t) len >= size) ? 0 : (size_t) len;
+}
+
+static inline uint32_t
+facron_stream_record_len (const FacronStream *stream,
+                          size_t              offset)
+{
+    uint32_t len;
+
+    memcpy (&len, stream->buffer + offset, sizeof (len));
+    return len;
+}
+
+static void
+facron_stream_schedule (FacronStream *stream,
+                        unsigned int  delay)
+{
+    facron_timers_cancel (stream->streams->timers, &stream->timer);
+    facron_timers_schedule (stream->streams->timers, &stream->timer, facron_timers_now () + delay);
+}
+
+static void
+facron_stream_flush (FacronStream *stream)
+{
+    while (stream->fd >= 0 && stream->head < stream->tail)
+    {
+        struct iovec iov[MAX_IOV];
+        int n = 0;
+
+        for (size_t offset = stream->head; offset < stream->tail && n < MAX_IOV; ++n)
+        {
+            uint32_t len = facron_stream_record_len (stream, offset);
+            size_t skip = (offset == stream->head) ? stream->partial : 0;
+
+            iov[n].iov_base = stream->buffer + offset + sizeof (len) + skip;
+            iov[n].iov_len = len - skip;
+            offset += sizeof (len) + len;
+        }
+
+        ssize_t written = writev (stream->fd, iov, n);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                if (!facron_timer_is_scheduled (&stream->timer))
+                    facron_stream_schedule (stream, RETRY_DELAY);
+                return;
+            }
+
+            /* The handler is gone, it gets restarted once reaped */
+            if (errno != EPIPE)
+                fprintf (stderr, "Warning: could not write to stream handler \"%s\": %s\n", stream->name, strerror (errno));
+            close (stream->fd);
+            stream->fd = -1;
+            return;
+        }
+
+        while (written > 0)
+        {
+            uint32_t len = facron_stream_record_len (stream, stream->head);
+            size_t left = len - stream->partial;
+
+            if ((size_t) written < left)
+            {
+                stream->partial += written;
+                break;
+            }
+
+            written -= left;
+            stream->head += sizeof (len) + len;
+            stream->partial = 0;
+        }
+    }
+
+    if (stream->head == stream->tail)
+    {
+        stream->head = stream->tail = 0;
+        stream->dropping = false;
+    }
+}
+
+static void
+facron_stream_start (FacronStream *stream)
+{
+    char scratch[FACRON_COMMAND_SCRATCH_SIZE];
+    char *argv[MAX_CMD_LEN];
+    posix_spawn_file_actions_t actions;
+    int fds[2], err;
+
+    /* The command line is all literals, there is nothing to substitute */
+    facron_command_expand (stream->command, "", 0, scratch, sizeof (scratch), argv);
+
+    if (pipe2 (fds, O_CLOEXEC) < 0)
+    {
+        fprintf (stderr, "Warning: could not create a pipe for \"%s\": %s\n", stream->name, strerror (errno));
+        facron_stream_schedule (stream, stream->backoff);
+        return;
+    }
+
+    /* dup2 clears FD_CLOEXEC on the handler's stdin */
+    posix_spawn_file_actions_init (&actions);
+    posix_spawn_file_actions_adddup2 (&actions, fds[0], STDIN_FILENO);
+    err = posix_spawn (&stream->pid, argv[0], &actions, stream->streams->attr, argv, environ);
+    posix_spawn_file_actions_destroy (&actions);
+    close (fds[0]);
+
+    if (err)
+    {
+        fprintf (stderr, "Warning: could not run stream handler \"%s\": %s\n", stream->name, strerror (err));
+        close (fds[1]);
+        stream->pid = 0;
+        facron_stream_schedule (stream, stream->backoff);
+        return;
+    }
+
+    facron_lineage_add (stream->streams->lineage, stream->pid);
+    fcntl (fds[1], F_SETFL, O_NONBLOCK);
+    stream->fd = fds[1];
+    stream->started = facron_timers_now ();
+    fprintf (stderr, "Notice: started stream handler \"%s\"\n", stream->name);
+}
+
+static void
+facron_stream_fire (FacronTimer *timer,
+                    void        *data)
+{
+    FacronStream *stream = (FacronStream *) data;
+
+    (void) timer;
+
+    if (!stream->pid)
+        facron_stream_start (stream);
+    facron_stream_flush (stream);
+}
+
+static bool
+facron_stream_append (FacronStream *stream,
+                      const char   *record,
+                      uint32_t      len)
+{
+    size_t needed = sizeof (len) + len;
+
+    if (stream->tail + needed > MAX_BUFFERED && stream->head)
+    {
+        memmove (stream->buffer, stream->buffer + stream->head, stream->tail - stream->head);
+        stream->tail -= stream->head;
+        stream->head = 0;
+    }
+
+    if (stream->tail + needed > MAX_BUFFERED)
+        return false;
+
+    memcpy (stream->buffer + stream->tail, &len, sizeof (len));
+    memcpy (stream->buffer + stream->tail + sizeof (len), record, len);
+    stream->tail += needed;
+
+    return true;
+}
+
+static FacronStream *
+facron_streams_lookup (const FacronStreams *streams,
+                       const FacronCommand *command,
+                       uint64_t             hash)
+{
+    size_t size = facron_command_get_size (command);
+
+    for (FacronStream *stream = streams->streams; stream; stream = stream->next)
+    {
+        if (stream->hash == hash && !stream->closing &&
+            facron_command_get_size (stream->command) == size && !memcmp (stream->command, command, size))
+            return stream;
+    }
+
+    return NULL;
+}
+
+static FacronStream *
+facron_streams_add (FacronStreams       *streams,
+                    const FacronCommand *command,
+                    uint64_t             hash)
+{
+    FacronStream *stream = (FacronStream *) calloc (1, sizeof (FacronStream));
+    size_t size = facron_command_get_size (command);
+    char scratch[FACRON_COMMAND_SCRATCH_SIZE];
+    char *argv[MAX_CMD_LEN];
+
+    facron_command_expand (command, "", 0, scratch, sizeof (scratch), argv);
+
+    stream->streams = streams;
+    stream->timer = (FacronTimer) FACRON_TIMER_INIT (facron_stream_fire, stream);
+    stream->command = (FacronCommand *) memcpy (malloc (size), command, size);
+    stream->hash = hash;
+    stream->name = strdup (argv[0]);
+    stream->fd = -1;
+    stream->backoff = MIN_BACKOFF;
+    stream->buffer = (char *) malloc (MAX_BUFFERED);
+
+    stream->next = streams->streams;
+    streams->streams = stream;
+
+    facron_stream_start (stream);
+
+    return stream;
+}
+
+static void
+facron_stream_free (FacronStream *stream)
+{
+    facron_timers_cancel (stream->streams->timers, &stream->timer);
+    if (stream->fd >= 0)
+        close (stream->fd);
+    free (stream->buffer);
+    free (stream->name);
+    free (stream->command);
+    free (stream);
+}
+
+bool
+facron_streams_write (FacronStreams       *streams,
+                      const FacronCommand *command,
+                      const char          *record,
+                      size_t               len)
+{
+    uint64_t hash = facron_hash ((const char *) command, facron_command_get_size (command));
+    FacronStream *stream = facron_streams_lookup (streams, command, hash);
+
+    if (!stream)
+        stream = facron_streams_add (streams, command, hash);
+
+    if (!facron_stream_append (stream, record, len))
+    {
+        if (!stream->dropping)
+            fprintf (stderr, "Warning: stream handler \"%s\" lags behind, dropping events\n", stream->name);
+        stream->dropping = true;
+        facron_metrics_inc (FACRON_METRIC_STREAM_DROPPED);
+        return false;
+    }
+
+    /* A pending retry means the pipe is full, or the handler not running */
+    if (!facron_timer_is_scheduled (&stream->timer))
+        facron_stream_flush (stream);
+
+    return true;
+}
+
+bool
+facron_streams_reap (FacronStreams *streams,
+                     pid_t          pid)
+{
+    for (FacronStream **link = &streams->streams; *link; link = &(*link)->next)
+    {
+        FacronStream *stream = *link;
+
+        if (stream->pid != pid)
+            continue;
+
+        if (stream->closing)
+        {
+            *link = stream->next;
+            facron_stream_free (stream);
+            return true;
+        }
+
+        if (stream->fd >= 0)
+            close (stream->fd);
+        stream->fd = -1;
+        stream->pid = 0;
+
+        if (stream->partial)
+        {
+            stream->head += sizeof (uint32_t) + facron_stream_record_len (stream, stream->head);
+            stream->partial = 0;
+        }
+
+        /* Back off while it keeps on exiting early */
+        if (facron_timers_now () - stream->started >= MAX_BACKOFF)
+            stream->backoff = MIN_BACKOFF;
+
+        fprintf (stderr, "Warning: stream handler \"%s\" exited, restarting it in %u ms\n", stream->name, stream->backoff);
+        facron_metrics_inc (FACRON_METRIC_STREAM_RESTARTS);
+        facron_stream_schedule (stream, stream->backoff);
+
+        stream->backoff = (stream->backoff * 2 < MAX_BACKOFF) ? stream->backoff * 2 : MAX_BACKOFF;
+        return true;
+    }
+
+    return false;
+}
+
+void
+facron_streams_retain (FacronStreams       *streams,
+                       const FacronCommand *command)
+{
+    FacronStream *stream = facron_streams_lookup (streams, command, facron_hash ((const char *) command, facron_command_get_size (command)));
+
+    if (stream)
+        stream->retained = true;
+}
+
+void
+facron_streams_sweep (FacronStreams *streams)
+{
+    for (FacronStream **link = &streams->streams; *link;)
+    {
+        FacronStream *stream = *link;
+
+        if (stream->retained || stream->closing)
+        {
+            stream->retained = false;
+            link = &stream->next;
+            continue;
+        }
+
+        fprintf (stderr, "Notice: stopping stream handler \"%s\"\n", stream->name);
+
+        /* Closing its stdin tells it to exit, it stays around until reaped */
+        if (stream->pid)
+        {
+            facron_timers_cancel (streams->timers, &stream->timer);
+            if (stream->fd >= 0)
+                close (stream->fd);
+            stream->fd = -1;
+            stream->closing = true;
+            link = &stream->next;
+        }
+        else
+        {
+            *link = stream->next;
+            facron_stream_free (stream);
+        }
+    }
+}
+
+bool
+facron_streams_is_idle (const FacronStreams *streams)
+{
+    for (const FacronStream *stream = streams->streams; stream; stream = stream->next)
+    {
+        if (stream->fd >= 0 && stream->head < stream->tail)
+            return false;
+    }
+
+    return true;
+}
+
+void
+facron_streams_free (FacronStreams *streams)
+{
+    if (!streams)
+        return;
+
+    for (FacronStream *next; streams->streams; streams->streams = next)
+    {
+        next = streams->streams->next;
+        facron_stream_free (streams->streams);
+    }
+
+    free (streams);
+}
+
+FacronStreams *
+facron_streams_new (FacronTimers            *timers,
+                    const posix_spawnattr_t *attr,
+                    FacronLineage           *lineage)
+{
+    FacronStreams *streams = (FacronStreams *) calloc (1, sizeof (FacronStreams));
+
+    streams->timers = timers;
+    streams->attr = attr;
+    streams->lineage = lineage;
+
+    return streams;
+}
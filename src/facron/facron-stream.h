@@ -0,0 +1,74 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_STREAM_H__
+#define __FACRON_STREAM_H__
+
+#include "facron-command.h"
+#include "facron-lineage.h"
+#include "facron-timers.h"
+
+#include <spawn.h>
+#include <stdbool.h>
+
+/*
+ * Long-lived handlers for the stream entries, one per command line,
+ * started on their first event and restarted when they exit. The events
+ * are written to their stdin as records of four fields, the same as $$,
+ * $@, $# and $*, tab separated and newline terminated, or each NUL
+ * terminated. When a handler lags behind, records are buffered up to a
+ * bound, then dropped.
+ */
+typedef struct FacronStreams FacronStreams;
+
+/* Room for the longest record */
+#define FACRON_STREAM_RECORD_SIZE (3 * PATH_MAX)
+
+/* Any thread, returns the length of the record, 0 if it does not fit */
+size_t facron_stream_format (FacronStreamFormat  format,
+                             const char         *path,
+                             pid_t               pid,
+                             char               *record,
+                             size_t              size);
+
+/* Loop thread only, returns false if the record got dropped */
+bool facron_streams_write (FacronStreams       *streams,
+                           const FacronCommand *command,
+                           const char          *record,
+                           size_t               len);
+
+/* Returns false if pid was not a handler */
+bool facron_streams_reap (FacronStreams *streams,
+                          pid_t          pid);
+
+/* Handlers which did not get retained since the last sweep are closed */
+void facron_streams_retain (FacronStreams       *streams,
+                            const FacronCommand *command);
+void facron_streams_sweep  (FacronStreams       *streams);
+
+/* Whether every running handler got all of its records */
+bool facron_streams_is_idle (const FacronStreams *streams);
+
+void facron_streams_free (FacronStreams *streams);
+
+FacronStreams *facron_streams_new (FacronTimers            *timers,
+                                   const posix_spawnattr_t *attr,
+                                   FacronLineage           *lineage);
+
+#endif /* __FACRON_STREAM_H__ */
@@ -0,0 +1,225 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-timers.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+/*
+ * Pending timers are kept in a binary min-heap on their deadline. The heap
+ * is 1-based so that a slot of 0 means "not scheduled", and each timer
+ * remembers its slot so that it can be moved or cancelled in O(log n).
+ * A single timerfd is armed on the earliest deadline.
+ */
+struct FacronTimers
+{
+    int           fd;
+    FacronTimer **heap;
+    size_t        n_timers;
+    size_t        size;
+    uint64_t      armed;
+};
+
+uint64_t
+facron_timers_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+bool
+facron_timer_is_scheduled (const FacronTimer *timer)
+{
+    return timer->slot != 0;
+}
+
+static inline void
+facron_timers_place (FacronTimers *timers,
+                     FacronTimer  *timer,
+                     size_t        slot)
+{
+    timers->heap[slot] = timer;
+    timer->slot = slot;
+}
+
+static void
+facron_timers_sift_up (FacronTimers *timers,
+                       size_t        slot)
+{
+    FacronTimer *timer = timers->heap[slot];
+
+    while (slot > 1 && timers->heap[slot / 2]->deadline > timer->deadline)
+    {
+        facron_timers_place (timers, timers->heap[slot / 2], slot);
+        slot /= 2;
+    }
+
+    facron_timers_place (timers, timer, slot);
+}
+
+static void
+facron_timers_sift_down (FacronTimers *timers,
+                         size_t        slot)
+{
+    FacronTimer *timer = timers->heap[slot];
+
+    for (size_t child; (child = slot * 2) <= timers->n_timers; slot = child)
+    {
+        if (child < timers->n_timers && timers->heap[child + 1]->deadline < timers->heap[child]->deadline)
+            ++child;
+        if (timers->heap[child]->deadline >= timer->deadline)
+            break;
+        facron_timers_place (timers, timers->heap[child], slot);
+    }
+
+    facron_timers_place (timers, timer, slot);
+}
+
+static void
+facron_timers_arm (FacronTimers *timers)
+{
+    uint64_t deadline = (timers->n_timers) ? timers->heap[1]->deadline : 0;
+
+    if (deadline == timers->armed)
+        return;
+
+    /* An all-zero itimerspec disarms the timer */
+    struct itimerspec its;
+    memset (&its, 0, sizeof (its));
+    its.it_value.tv_sec = deadline / 1000;
+    its.it_value.tv_nsec = (deadline % 1000) * 1000000;
+
+    if (deadline && !its.it_value.tv_sec && !its.it_value.tv_nsec)
+        its.it_value.tv_nsec = 1;
+
+    timerfd_settime (timers->fd, TFD_TIMER_ABSTIME, &its, NULL);
+    timers->armed = deadline;
+}
+
+static void
+facron_timers_remove (FacronTimers *timers,
+                      FacronTimer  *timer)
+{
+    size_t slot = timer->slot;
+    FacronTimer *last = timers->heap[timers->n_timers--];
+
+    timer->slot = 0;
+    if (last == timer)
+        return;
+
+    facron_timers_place (timers, last, slot);
+    facron_timers_sift_up (timers, slot);
+    facron_timers_sift_down (timers, last->slot);
+}
+
+void
+facron_timers_schedule (FacronTimers *timers,
+                        FacronTimer  *timer,
+                        uint64_t      deadline)
+{
+    if (!timer->slot)
+    {
+        if (timers->n_timers + 1 >= timers->size)
+        {
+            timers->size = (timers->size) ? timers->size * 2 : 64;
+            timers->heap = (FacronTimer **) realloc (timers->heap, timers->size * sizeof (FacronTimer *));
+        }
+
+        facron_timers_place (timers, timer, ++timers->n_timers);
+    }
+
+    timer->deadline = deadline;
+    facron_timers_sift_up (timers, timer->slot);
+    facron_timers_sift_down (timers, timer->slot);
+    facron_timers_arm (timers);
+}
+
+void
+facron_timers_cancel (FacronTimers *timers,
+                      FacronTimer  *timer)
+{
+    if (!timer->slot)
+        return;
+
+    facron_timers_remove (timers, timer);
+    facron_timers_arm (timers);
+}
+
+int
+facron_timers_get_fd (const FacronTimers *timers)
+{
+    return timers->fd;
+}
+
+void
+facron_timers_dispatch (FacronTimers *timers)
+{
+    uint64_t expirations;
+
+    if (read (timers->fd, &expirations, sizeof (expirations)) < 0 && errno != EAGAIN)
+        return;
+
+    /* Timers scheduled by callbacks that are already due fire in this pass */
+    uint64_t now = facron_timers_now ();
+    while (timers->n_timers && timers->heap[1]->deadline <= now)
+    {
+        FacronTimer *timer = timers->heap[1];
+
+        facron_timers_remove (timers, timer);
+        timer->callback (timer, timer->data);
+    }
+
+    timers->armed = 0;
+    facron_timers_arm (timers);
+}
+
+void
+facron_timers_free (FacronTimers *timers)
+{
+    if (!timers)
+        return;
+
+    close (timers->fd);
+    free (timers->heap);
+    free (timers);
+}
+
+FacronTimers *
+facron_timers_new (void)
+{
+    FacronTimers *timers = (FacronTimers *) calloc (1, sizeof (FacronTimers));
+
+    if ((timers->fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+    {
+        fprintf (stderr, "Error: could not create timerfd: %s\n", strerror (errno));
+        free (timers);
+        return NULL;
+    }
+
+    return timers;
+}
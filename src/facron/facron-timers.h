@@ -0,0 +1,61 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_TIMERS_H__
+#define __FACRON_TIMERS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct FacronTimers FacronTimers;
+typedef struct FacronTimer  FacronTimer;
+
+typedef void (*FacronTimerCallback) (FacronTimer *timer,
+                                     void        *data);
+
+/* Meant to be embedded in the structure it schedules */
+struct FacronTimer
+{
+    uint64_t            deadline;
+    size_t              slot;
+    FacronTimerCallback callback;
+    void               *data;
+};
+
+#define FACRON_TIMER_INIT(callback, data) { 0, 0, (callback), (data) }
+
+uint64_t facron_timers_now (void);
+
+bool facron_timer_is_scheduled (const FacronTimer *timer);
+
+void facron_timers_schedule (FacronTimers *timers,
+                             FacronTimer  *timer,
+                             uint64_t      deadline);
+void facron_timers_cancel   (FacronTimers *timers,
+                             FacronTimer  *timer);
+
+int  facron_timers_get_fd   (const FacronTimers *timers);
+void facron_timers_dispatch (FacronTimers       *timers);
+
+void facron_timers_free (FacronTimers *timers);
+
+FacronTimers *facron_timers_new (void);
+
+#endif /* __FACRON_TIMERS_H__ */
@@ -0,0 +1,370 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "facron-metrics.h"
+#include "facron-trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#define MAGIC     "facron\0\1"
+#define MAGIC_LEN 8
+
+/* Each record is stamp (8 bytes), mask (4), pid (4), path length (2), then the path */
+#define RECORD_LEN 18
+
+/* Events replayed against the same generation, like a read from fanotify */
+#define BATCH_EVENTS 64
+
+typedef struct
+{
+    uint64_t stamp;
+    uint32_t mask;
+    int32_t  pid;
+    uint16_t path_len;
+} FacronTraceRecord;
+
+struct FacronTrace
+{
+    FILE     *file;
+    char     *filename;
+    uint64_t  start;
+};
+
+struct FacronReplay
+{
+    FacronConf     *conf;
+    FacronExecutor *executor;
+    bool            realtime;
+    const char     *data;
+    size_t          size;
+    pthread_t       thread;
+    bool            started;
+    atomic_bool     stopping;
+    int             stop_fd;
+    int             fd;
+    atomic_ulong    n_events;
+    atomic_ulong    n_commands;
+    atomic_ulong    elapsed;
+};
+
+static inline void
+facron_trace_encode (char                    *buffer,
+                     const FacronTraceRecord *record)
+{
+    memcpy (buffer, &record->stamp, 8);
+    memcpy (buffer + 8, &record->mask, 4);
+    memcpy (buffer + 12, &record->pid, 4);
+    memcpy (buffer + 16, &record->path_len, 2);
+}
+
+static inline void
+facron_trace_decode (const char        *buffer,
+                     FacronTraceRecord *record)
+{
+    memcpy (&record->stamp, buffer, 8);
+    memcpy (&record->mask, buffer + 8, 4);
+    memcpy (&record->pid, buffer + 12, 4);
+    memcpy (&record->path_len, buffer + 16, 2);
+}
+
+void
+facron_trace_record (FacronTrace       *trace,
+                     const FacronEvent *event)
+{
+    char buffer[RECORD_LEN + PATH_MAX];
+    FacronTraceRecord record = {
+        .stamp = (event->stamp > trace->start) ? event->stamp - trace->start : 0,
+        .mask = event->metadata->mask,
+        .pid = event->metadata->pid,
+        .path_len = event->path_len,
+    };
+
+    if (event->path_len >= PATH_MAX)
+        return;
+
+    facron_trace_encode (buffer, &record);
+    memcpy (buffer + RECORD_LEN, event->path, event->path_len);
+
+    /* stdio locks the stream, a single write keeps records from interleaving */
+    fwrite (buffer, RECORD_LEN + event->path_len, 1, trace->file);
+}
+
+void
+facron_trace_free (FacronTrace *trace)
+{
+    if (!trace)
+        return;
+
+    if (ferror (trace->file) | fclose (trace->file))
+        fprintf (stderr, "Error: could not write trace \"%s\"\n", trace->filename);
+
+    free (trace->filename);
+    free (trace);
+}
+
+FacronTrace *
+facron_trace_new (const char *filename)
+{
+    FacronTrace *trace = (FacronTrace *) calloc (1, sizeof (FacronTrace));
+
+    if (!(trace->file = fopen (filename, "we")))
+    {
+        fprintf (stderr, "Error: could not open trace \"%s\": %s\n", filename, strerror (errno));
+        free (trace);
+        return NULL;
+    }
+
+    /* Records are small, only hit the disk once in a while */
+    setvbuf (trace->file, NULL, _IOFBF, 1024 * 1024);
+    fwrite (MAGIC, MAGIC_LEN, 1, trace->file);
+
+    trace->filename = strdup (filename);
+    trace->start = facron_metrics_now ();
+
+    return trace;
+}
+
+/* Reads the record at offset, false once there is none left */
+static bool
+facron_replay_peek (const FacronReplay *replay,
+                    size_t              offset,
+                    FacronTraceRecord  *record)
+{
+    if (offset >= replay->size)
+        return false;
+
+    if (replay->size - offset >= RECORD_LEN)
+    {
+        facron_trace_decode (replay->data + offset, record);
+        if (record->path_len < PATH_MAX && replay->size - offset - RECORD_LEN >= record->path_len)
+            return true;
+    }
+
+    fprintf (stderr, "Warning: trace truncated, ignoring its last %zu bytes\n", replay->size - offset);
+    return false;
+}
+
+/* Sleeps until when, returns false when asked to stop */
+static bool
+facron_replay_wait (FacronReplay *replay,
+                    uint64_t      when)
+{
+    struct pollfd fd = { .fd = replay->stop_fd, .events = POLLIN };
+    uint64_t now;
+
+    while ((now = facron_metrics_now ()) < when)
+    {
+        struct timespec timeout = {
+            .tv_sec = (when - now) / 1000000000,
+            .tv_nsec = (when - now) % 1000000000,
+        };
+
+        if (ppoll (&fd, 1, &timeout, NULL) > 0)
+            return false;
+    }
+
+    return true;
+}
+
+static void *
+facron_replay_run (void *data)
+{
+    FacronReplay *replay = (FacronReplay *) data;
+    char path[PATH_MAX];
+    FacronMetadata metadata = {
+        .event_len = FAN_EVENT_METADATA_LEN,
+        .vers = FANOTIFY_METADATA_VERSION,
+        .metadata_len = FAN_EVENT_METADATA_LEN,
+        .fd = FAN_NOFD,
+    };
+    FacronEvent event = { .path = path, .metadata = &metadata };
+    FacronTraceRecord record;
+    size_t offset = MAGIC_LEN;
+    bool more = facron_replay_peek (replay, offset, &record);
+    /* The first event is due right away, the others keep their spacing */
+    uint64_t first = (more) ? record.stamp : 0;
+    uint64_t start = facron_metrics_now ();
+    unsigned long n_events = 0, n_commands = 0;
+    uint64_t one = 1;
+
+#define DUE(record) (start + (((record).stamp > first) ? (record).stamp - first : 0))
+
+    while (more && !atomic_load_explicit (&replay->stopping, memory_order_relaxed))
+    {
+        if (replay->realtime && !facron_replay_wait (replay, DUE (record)))
+            break;
+
+        uint64_t batch_start = facron_metrics_now ();
+        unsigned long n = 0;
+        FacronConfGeneration *conf = facron_conf_acquire (replay->conf);
+
+        /* Everything already due makes a batch */
+        do
+        {
+            memcpy (path, replay->data + offset + RECORD_LEN, record.path_len);
+            path[record.path_len] = '\0';
+            metadata.mask = record.mask;
+            metadata.pid = record.pid;
+            event.path_len = record.path_len;
+            event.stamp = (replay->realtime) ? DUE (record) : batch_start;
+
+            n_commands += facron_conf_handle (conf, replay->executor, &event);
+            offset += RECORD_LEN + record.path_len;
+            ++n;
+        } while ((more = facron_replay_peek (replay, offset, &record)) && n < BATCH_EVENTS &&
+                 (!replay->realtime || DUE (record) <= facron_metrics_now ()));
+
+        facron_conf_release (conf);
+
+        n_events += n;
+        facron_metrics_add (FACRON_METRIC_EVENTS, n);
+        facron_metrics_record (FACRON_HISTOGRAM_MATCH, facron_metrics_now () - batch_start);
+    }
+
+#undef DUE
+
+    atomic_store (&replay->n_events, n_events);
+    atomic_store (&replay->n_commands, n_commands);
+    atomic_store (&replay->elapsed, facron_metrics_now () - start);
+
+    if (write (replay->fd, &one, sizeof (one)) < 0)
+        fprintf (stderr, "Error: could not report the end of the replay: %s\n", strerror (errno));
+
+    return NULL;
+}
+
+int
+facron_replay_get_fd (const FacronReplay *replay)
+{
+    return replay->fd;
+}
+
+void
+facron_replay_print_summary (const FacronReplay *replay,
+                             FILE               *out)
+{
+    unsigned long n_events = atomic_load (&replay->n_events);
+    double elapsed = atomic_load (&replay->elapsed) / 1e9;
+
+    fprintf (out, "Replayed %lu events in %.3f s (%.0f events/s), which triggered %lu commands\n",
+             n_events, elapsed, (elapsed > 0) ? n_events / elapsed : 0, atomic_load (&replay->n_commands));
+}
+
+void
+facron_replay_free (FacronReplay *replay)
+{
+    uint64_t one = 1;
+
+    if (!replay)
+        return;
+
+    if (replay->started)
+    {
+        atomic_store (&replay->stopping, true);
+        if (write (replay->stop_fd, &one, sizeof (one)) < 0)
+            fprintf (stderr, "Error: could not stop the replay: %s\n", strerror (errno));
+        pthread_join (replay->thread, NULL);
+    }
+
+    if (replay->data)
+        munmap ((void *) replay->data, replay->size);
+    if (replay->stop_fd >= 0)
+        close (replay->stop_fd);
+    if (replay->fd >= 0)
+        close (replay->fd);
+    free (replay);
+}
+
+FacronReplay *
+facron_replay_new (const char     *filename,
+                   FacronConf     *conf,
+                   FacronExecutor *executor,
+                   bool            realtime)
+{
+    FacronReplay *replay = (FacronReplay *) calloc (1, sizeof (FacronReplay));
+    struct stat st;
+    void *data;
+    int fd, err;
+
+    replay->conf = conf;
+    replay->executor = executor;
+    replay->realtime = realtime;
+    replay->stop_fd = eventfd (0, EFD_CLOEXEC);
+    replay->fd = eventfd (0, EFD_CLOEXEC|EFD_NONBLOCK);
+    atomic_init (&replay->stopping, false);
+    atomic_init (&replay->n_events, 0);
+    atomic_init (&replay->n_commands, 0);
+    atomic_init (&replay->elapsed, 0);
+
+    if (replay->stop_fd < 0 || replay->fd < 0)
+    {
+        fprintf (stderr, "Error: could not create eventfd: %s\n", strerror (errno));
+        goto fail;
+    }
+
+    if ((fd = open (filename, O_RDONLY|O_CLOEXEC)) < 0 || fstat (fd, &st) < 0)
+    {
+        fprintf (stderr, "Error: could not open trace \"%s\": %s\n", filename, strerror (errno));
+        if (fd >= 0)
+            close (fd);
+        goto fail;
+    }
+
+    data = (st.st_size >= MAGIC_LEN) ? mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close (fd);
+
+    if (data == MAP_FAILED || memcmp (data, MAGIC, MAGIC_LEN))
+    {
+        fprintf (stderr, "Error: \"%s\" is not a facron trace\n", filename);
+        if (data != MAP_FAILED)
+            munmap (data, st.st_size);
+        goto fail;
+    }
+
+    replay->data = (const char *) data;
+    replay->size = st.st_size;
+    /* Read once, front to back */
+    madvise (data, st.st_size, MADV_SEQUENTIAL);
+
+    if ((err = pthread_create (&replay->thread, NULL, facron_replay_run, replay)))
+    {
+        fprintf (stderr, "Error: could not start replay thread: %s\n", strerror (err));
+        goto fail;
+    }
+    replay->started = true;
+
+    return replay;
+
+fail:
+    facron_replay_free (replay);
+    return NULL;
+}
@@ -0,0 +1,61 @@
+/*
+ *      This file is part of facron.
+ *
+ *      Copyright 2015 Marc-Antoine Perennou <Marc-Antoine@Perennou.com>
+ *
+ *      facron is free software: you can redistribute it and/or modify
+ *      it under the terms of the GNU General Public License as published by
+ *      the Free Software Foundation, either version 3 of the License, or
+ *      (at your option) any later version.
+ *
+ *      facron is distributed in the hope that it will be useful,
+ *      but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *      MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *      GNU General Public License for more details.
+ *
+ *      You should have received a copy of the GNU General Public License
+ *      along with facron.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FACRON_TRACE_H__
+#define __FACRON_TRACE_H__
+
+#include "facron-conf.h"
+
+#include <stdio.h>
+
+/*
+ * A binary log of the events handled, to replay a real workload offline.
+ * After an 8 bytes magic, each record holds when the event got read, in
+ * nanoseconds since the trace started, its mask, the pid which caused it
+ * and its resolved path, in host byte order.
+ */
+typedef struct FacronTrace FacronTrace;
+
+/* Any thread */
+void facron_trace_record (FacronTrace       *trace,
+                          const FacronEvent *event);
+
+void facron_trace_free (FacronTrace *trace);
+
+FacronTrace *facron_trace_new (const char *filename);
+
+/*
+ * Feeds a trace through the current generation from a background thread,
+ * either as fast as possible or at the pace it got recorded at. Its fd
+ * becomes readable once it is done.
+ */
+typedef struct FacronReplay FacronReplay;
+
+int  facron_replay_get_fd        (const FacronReplay *replay);
+void facron_replay_print_summary (const FacronReplay *replay,
+                                  FILE               *out);
+
+void facron_replay_free (FacronReplay *replay);
+
+FacronReplay *facron_replay_new (const char     *filename,
+                                 FacronConf     *conf,
+                                 FacronExecutor *executor,
+                                 bool            realtime);
+
+#endif /* __FACRON_TRACE_H__ */
@@ -19,131 +19,58 @@
 
 #include "facron-util.h"
 
-#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
-#define basename
-#include <string.h>
-#undef basename
 
-#include <sys/wait.h>
-
-typedef struct CommandBackup CommandBackup;
-struct CommandBackup
-{
-    int            index;
-    char          *field;
-    CommandBackup *next;
-};
-
-static inline char *
-print_pid (pid_t pid)
+typedef struct
 {
-    char *tmp = NULL;
-    if (asprintf (&tmp, "%d", pid) < 1)
-        return strdup ("0");
-    return tmp;
-}
-
-static inline char *
-print_number (unsigned int n)
+    FacronUtilItemFunc fn;
+    void              *data;
+    size_t             n_items;
+    atomic_size_t      next;
+} FacronUtilParallel;
+
+static void *
+facron_util_parallel_worker (void *data)
 {
-    char *tmp = NULL;
-    if (asprintf (&tmp, "%u", n) < 1)
-        return strdup ("0");
-    return tmp;
-}
+    FacronUtilParallel *parallel = (FacronUtilParallel *) data;
 
-static inline char *
-basename (const char *filename)
-{
-    char *bn = strrchr (filename, '/');
-    return strdup (bn ? bn + 1 : filename);
-}
+    for (size_t i; (i = atomic_fetch_add (&parallel->next, 1)) < parallel->n_items;)
+        parallel->fn (i, parallel->data);
 
-static inline char *
-substr (const char *str,
-        size_t      len)
-{
-    return (char *) memcpy (calloc (len + 1, sizeof (char)), str, len);
-}
-
-static inline char *
-dirname (const char *filename)
-{
-    char *c = strrchr (filename, '/');
-    if (!c)
-        return strdup (".");
-
-    if (c[1] == '\0')
-    {
-        while (c != filename && c[-1] == '/')
-            --c;
-        c = memrchr (filename, '/', c - filename);
-    }
-
-    while (c != filename && c[-1] == '/')
-        --c;
-    return (c != filename) ? substr (filename, c - filename) :
-                             (filename[1] == '/') ? strdup ("//") :
-                                                    strdup ("/");
+    return NULL;
 }
 
 void
-facron_exec_command (char       *command[MAX_CMD_LEN],
-                     const char *path,
-                     pid_t       pid)
+facron_util_parallel_for (size_t             n_items,
+                          size_t             split,
+                          unsigned int       max_threads,
+                          FacronUtilItemFunc fn,
+                          void              *data)
 {
-    static unsigned int count = 0;
-
-    if (!command || !*command)
-        return;
+    FacronUtilParallel parallel = { .fn = fn, .data = data, .n_items = n_items };
+    size_t wanted = (max_threads > 1) ? n_items / split : 0;
+    pthread_t *threads = NULL;
+    unsigned int n_threads = 0;
 
-    CommandBackup *backup = NULL;
-    for (unsigned int i = 0; i < MAX_CMD_LEN && command[i]; ++i)
-    {
-        char *field = command[i];
-        char *subst = NULL;
+    atomic_init (&parallel.next, 0);
 
-        if (!strcmp ("$$", field))
-            subst = strdup (path);
-        else if (!strcmp ("$@", field))
-            subst = dirname (path);
-        else if (!strcmp ("$#", field))
-            subst = basename (path);
-	else if (!strcmp ("$*", field))
-            subst = print_pid (pid);
-        else if (!strcmp ("$+", field))
-            subst = print_number (++count);
-        else if (!strcmp ("$-", field))
-            subst = print_number (--count);
-        else if (!strcmp ("$=", field))
-            subst = print_number (count);
+    /* The calling thread is one of them */
+    if (wanted > max_threads - 1)
+        wanted = max_threads - 1;
+    if (wanted)
+        threads = (pthread_t *) malloc (wanted * sizeof (pthread_t));
 
-        if (subst)
-        {
-            CommandBackup *b = (CommandBackup *) malloc (sizeof (CommandBackup));
-            b->index = i;
-            b->field = field;
-            b->next = backup;
-            backup = b;
-            command[i] = subst;
-        }
-    }
-
-    pid_t p = fork ();
-    if (p)
-        waitpid (p, NULL, 0);
-    else
+    for (; n_threads < wanted; ++n_threads)
     {
-        if (fork ())
-            _exit (EXIT_SUCCESS);
-        else
-            execv (command[0], command);
+        if (pthread_create (&threads[n_threads], NULL, facron_util_parallel_worker, &parallel))
+            break;
     }
 
-    for (CommandBackup *next; backup != NULL; next = backup->next, free (backup), backup = next)
-    {
-        free (command[backup->index]);
-        command[backup->index] = backup->field;
-    }
+    facron_util_parallel_worker (&parallel);
+
+    for (unsigned int i = 0; i < n_threads; ++i)
+        pthread_join (threads[i], NULL);
+    free (threads);
 }
@@ -20,12 +20,44 @@
 #ifndef __FACRON_UTIL_H__
 #define __FACRON_UTIL_H__
 
-#define MAX_CMD_LEN 512
+#include <stddef.h>
+#include <stdint.h>
 
-#include <unistd.h>
+#define FACRON_HASH_INIT 14695981039346656037ULL
 
-void facron_exec_command (char       *command[MAX_CMD_LEN],
-                          const char *path,
-                          pid_t       pid);
+/* FNV-1a, cheap enough to be computed incrementally while walking a path */
+static inline uint64_t
+facron_hash_step (uint64_t hash,
+                  char     c)
+{
+    return (hash ^ (unsigned char) c) * 1099511628211ULL;
+}
+
+static inline uint64_t
+facron_hash (const char *str,
+             size_t      len)
+{
+    uint64_t hash = FACRON_HASH_INIT;
+
+    for (size_t i = 0; i < len; ++i)
+        hash = facron_hash_step (hash, str[i]);
+
+    return hash;
+}
+
+typedef void (*FacronUtilItemFunc) (size_t  i,
+                                    void   *data);
+
+/*
+ * Calls fn for each of the n_items, from up to max_threads threads, the
+ * calling one included, with a thread for every split items. Meant for
+ * items which mostly wait on the filesystem, such as path lookups, which
+ * are worth more threads than CPUs. Returns once all of them are done.
+ */
+void facron_util_parallel_for (size_t             n_items,
+                               size_t             split,
+                               unsigned int       max_threads,
+                               FacronUtilItemFunc fn,
+                               void              *data);
 
 #endif /* __FACRON_UTIL_H_ */
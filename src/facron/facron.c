@@ -18,50 +18,303 @@
  */
 
 #include "facron-conf.h"
+#include "facron-loop.h"
+#include "facron-metrics.h"
+#include "facron-permission.h"
+#include "facron-pipeline.h"
+#include "facron-recovery.h"
+#include "facron-trace.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 
 #include <linux/limits.h>
 
+/* Two of those buffers per matcher, plus two */
+#define MAX_BUFFER_SIZE (64 * 1024 * 1024)
+
+/* Past that, they mostly contend on the requests ring */
+#define MAX_MATCHERS 64
+
+/* In milliseconds, the accessing process is stuck meanwhile */
+#define MAX_PERMISSION_TIMEOUT 60000
+
 static int fanotify_fd;
 static FacronConf *_conf = NULL;
+static FacronExecutor *_executor = NULL;
+static FacronTimers *_timers = NULL;
+static FacronLoop *_loop = NULL;
+static FacronPipeline *_pipeline = NULL;
+static FacronPermissions *_permissions = NULL;
+static FacronRecovery *_recovery = NULL;
+static FacronTrace *_trace = NULL;
+static FacronReplay *_replay = NULL;
+static bool replayed = false;
+static int signal_fd = -1;
+static int metrics_fd = -1;
+static const char *metrics_socket = NULL;
 
 static inline void
 cleanup (void)
 {
+    /* Stop producing work before tearing down what it refers to */
+    facron_pipeline_free (_pipeline);
+    facron_replay_free (_replay);
+    facron_trace_free (_trace);
+    facron_recovery_free (_recovery);
+    /* Pending permission events get allowed, the marks go away with the group */
+    facron_permissions_free (_permissions);
+    if (_conf)
+        facron_conf_set_permission_fd (_conf, -1);
     facron_conf_free (_conf, fanotify_fd);
+    facron_executor_free (_executor);
+    facron_timers_free (_timers);
+    facron_loop_free (_loop);
+    if (signal_fd >= 0)
+        close (signal_fd);
+    if (metrics_fd >= 0)
+    {
+        close (metrics_fd);
+        unlink (metrics_socket);
+    }
     close (fanotify_fd);
 }
 
 static void
-signal_handler (int signum)
+on_pipeline_error (FacronLoop *loop,
+                   void       *data)
+{
+    (void) data;
+
+    facron_loop_quit (loop, EXIT_FAILURE);
+}
+
+static void
+print_metrics (FILE *out)
+{
+    facron_metrics_print (out);
+    if (_pipeline)
+        facron_pipeline_print_metrics (_pipeline, out);
+    facron_executor_print_metrics (_executor, out);
+    facron_conf_print_metrics (_conf, out);
+}
+
+/* A replay is over once the trace got fed and its commands are done */
+static void
+check_replayed (FacronLoop *loop)
+{
+    if (!replayed || !facron_executor_is_idle (_executor))
+        return;
+
+    facron_replay_print_summary (_replay, stdout);
+    print_metrics (stdout);
+    facron_loop_quit (loop, EXIT_SUCCESS);
+}
+
+static void
+on_request (FacronLoop *loop,
+            void       *data)
+{
+    (void) data;
+
+    facron_executor_dispatch (_executor);
+    check_replayed (loop);
+}
+
+static void
+on_child_exit (FacronLoop *loop,
+               void       *data)
+{
+    (void) data;
+
+    facron_executor_reap (_executor);
+    check_replayed (loop);
+}
+
+static void
+on_replay_done (FacronLoop *loop,
+                void       *data)
+{
+    uint64_t done;
+
+    (void) data;
+
+    if (read (facron_replay_get_fd (_replay), &done, sizeof (done)) < 0)
+        return;
+
+    replayed = true;
+    facron_executor_dispatch (_executor);
+    check_replayed (loop);
+}
+
+static void
+on_timer (FacronLoop *loop,
+          void       *data)
+{
+    (void) data;
+
+    facron_timers_dispatch (_timers);
+    /* A batch may have been the last thing a replay waited for */
+    check_replayed (loop);
+}
+
+static void
+on_conf_loaded (FacronLoop *loop,
+                void       *data)
+{
+    (void) loop;
+    (void) data;
+
+    if (!facron_conf_dispatch (_conf, fanotify_fd))
+        return;
+
+    facron_conf_sweep_streams (_conf, _executor);
+    if (_recovery)
+        facron_recovery_track (_recovery);
+}
+
+static void
+on_metrics_client (FacronLoop *loop,
+                   void       *data)
 {
-    int status = signum;
+    /* Don't let a client which doesn't read stall the main loop for long */
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    int client;
 
-    switch (signum)
+    (void) loop;
+    (void) data;
+
+    while ((client = accept4 (metrics_fd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+    {
+        FILE *out;
+
+        setsockopt (client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+        if (!(out = fdopen (client, "w")))
+        {
+            close (client);
+            continue;
+        }
+
+        print_metrics (out);
+        fclose (out);
+    }
+}
+
+static void
+on_signal (FacronLoop *loop,
+           void       *data)
+{
+    struct signalfd_siginfo info;
+
+    (void) data;
+
+    while (read (signal_fd, &info, sizeof (info)) == sizeof (info))
+    {
+        switch (info.ssi_signo)
+        {
+        case SIGUSR1:
+            facron_conf_reload (_conf);
+            break;
+        case SIGUSR2:
+            print_metrics (stderr);
+            break;
+        default:
+            fprintf (stderr, "Signal %d received, exiting.\n", info.ssi_signo);
+            facron_loop_quit (loop, (info.ssi_signo == SIGTERM) ? EXIT_SUCCESS : (int) info.ssi_signo);
+            return;
+        }
+    }
+}
+
+static int
+replay (const char *conf_file,
+        const char *cache_file,
+        const char *trace_file,
+        bool        realtime)
+{
+    fanotify_fd = -1;
+
+    if (!(_conf = facron_conf_new (conf_file, cache_file)) ||
+        !(_loop = facron_loop_new ()) ||
+        !(_replay = facron_replay_new (trace_file, _conf, _executor, realtime)) ||
+        !facron_loop_add (_loop, facron_replay_get_fd (_replay), on_replay_done, NULL) ||
+        !facron_loop_add (_loop, facron_executor_get_queue_fd (_executor), on_request, NULL) ||
+        !facron_loop_add (_loop, facron_executor_get_fd (_executor), on_child_exit, NULL) ||
+        !facron_loop_add (_loop, facron_timers_get_fd (_timers), on_timer, NULL) ||
+        !facron_loop_add (_loop, facron_conf_get_fd (_conf), on_conf_loaded, NULL) ||
+        !facron_loop_add (_loop, signal_fd, on_signal, NULL) ||
+        (metrics_socket && ((metrics_fd = facron_metrics_listen (metrics_socket)) < 0 ||
+                            !facron_loop_add (_loop, metrics_fd, on_metrics_client, NULL))))
     {
-    case SIGUSR1:
-        facron_conf_reapply (_conf, fanotify_fd);
-        break;
-    case SIGTERM:
-        status = EXIT_SUCCESS;
-        // fall through
-    default:
-        fprintf (stderr, "Signal %d received, exiting.\n", signum);
         cleanup ();
-        exit (status);
+        return EXIT_FAILURE;
+    }
+
+    int status = facron_loop_run (_loop);
+
+    cleanup ();
+
+    return status;
+}
+
+/* A plain decimal number, within [min, max] */
+static bool
+parse_number (const char    *arg,
+              unsigned long  min,
+              unsigned long  max,
+              unsigned long *value)
+{
+    char *end;
+
+    if (*arg < '0' || *arg > '9')
+        return false;
+
+    errno = 0;
+    *value = strtoul (arg, &end, 10);
+
+    return !*end && !errno && *value >= min && *value <= max;
+}
+
+/* jobs[:pending][:drop|:coalesce|:queue] */
+static bool
+parse_max_jobs (const char        *arg,
+                unsigned int      *max_jobs,
+                unsigned int      *max_pending,
+                FacronLimitPolicy *overflow)
+{
+    char *end;
+    unsigned long value = strtoul (arg, &end, 10);
+
+    if (end == arg || value > UINT_MAX)
+        return false;
+    *max_jobs = value;
+
+    if (*end == ':' && end[1] >= '0' && end[1] <= '9')
+    {
+        if ((value = strtoul (end + 1, &end, 10)) > UINT_MAX)
+            return false;
+        *max_pending = value;
     }
+
+    if (*end == ':')
+        return facron_limit_policy_from_string (end + 1, overflow);
+
+    return !*end;
 }
 
 static inline void
 usage (char *callee)
 {
-    fprintf (stderr, "USAGE: %s [--conf|-c config_file] [--daemon|-d]\n", callee);
+    fprintf (stderr, "USAGE: %s [--conf|-c config_file] [--conf-cache|-k path] [--daemon|-d] [--max-jobs|-j jobs[:pending][:drop|:coalesce|:queue]] [--buffer-size|-b bytes] [--fid|-f] [--ignore-own|-i] [--matchers|-m threads] [--metrics-socket|-s path] [--permissions|-e] [--permission-timeout|-w ms] [--unlimited-queue|-u] [--recover|-r] [--record|-o trace] [--replay|-p trace] [--realtime|-t] [--dry-run|-n]\n", callee);
     exit (EXIT_FAILURE);
 }
 
@@ -70,26 +323,124 @@ main (int   argc,
       char *argv[])
 {
     struct option long_options[] = {
-        { "background", no_argument,       NULL, 'd' }, /* legacy compat */
-        { "conf",       required_argument, NULL, 'c' },
-        { "daemon",     no_argument,       NULL, 'd' },
-        { 0,            no_argument,       NULL, 0   }
+        { "background",         no_argument,       NULL, 'd' }, /* legacy compat */
+        { "buffer-size",        required_argument, NULL, 'b' },
+        { "conf",               required_argument, NULL, 'c' },
+        { "conf-cache",         required_argument, NULL, 'k' },
+        { "daemon",             no_argument,       NULL, 'd' },
+        { "dry-run",            no_argument,       NULL, 'n' },
+        { "fid",                no_argument,       NULL, 'f' },
+        { "ignore-own",         no_argument,       NULL, 'i' },
+        { "matchers",           required_argument, NULL, 'm' },
+        { "max-jobs",           required_argument, NULL, 'j' },
+        { "metrics-socket",     required_argument, NULL, 's' },
+        { "permission-timeout", required_argument, NULL, 'w' },
+        { "permissions",        no_argument,       NULL, 'e' },
+        { "realtime",           no_argument,       NULL, 't' },
+        { "record",             required_argument, NULL, 'o' },
+        { "recover",            no_argument,       NULL, 'r' },
+        { "replay",             required_argument, NULL, 'p' },
+        { "unlimited-queue",    no_argument,       NULL, 'u' },
+        { 0,                    no_argument,       NULL, 0   }
     };
 
     const char *conf_file = SYSCONFDIR "/facron.conf";
+    const char *cache_file = NULL;
+    const char *record_file = NULL;
+    const char *replay_file = NULL;
     bool daemon = false;
+    bool dry_run = false;
+    bool fid = false;
+    bool ignore_own = false;
+    bool permissions = false;
+    bool realtime = false;
+    bool recover = false;
+    bool unlimited = false;
+    size_t buffer_size = 256 * 1024;
+    unsigned int max_jobs = 0;
+    unsigned int max_pending = 1024;
+    FacronLimitPolicy overflow = FACRON_LIMIT_QUEUE;
+    unsigned int n_matchers = 1;
+    unsigned int permission_timeout = 250;
     int c;
 
-    while ((c = getopt_long (argc, argv, "c:d", long_options, NULL)) != -1)
+    while ((c = getopt_long (argc, argv, "b:c:defij:k:m:no:p:rs:tuw:", long_options, NULL)) != -1)
     {
         switch (c)
         {
+        case 'b':
+        {
+            unsigned long value;
+
+            if (!parse_number (optarg, 0, MAX_BUFFER_SIZE, &value))
+                usage (argv[0]);
+            buffer_size = value;
+            if (buffer_size < FAN_EVENT_METADATA_LEN + PATH_MAX)
+                buffer_size = FAN_EVENT_METADATA_LEN + PATH_MAX;
+            break;
+        }
         case 'c':
             conf_file = optarg;
             break;
         case 'd':
             daemon = true;
             break;
+        case 'e':
+            permissions = true;
+            break;
+        case 'f':
+            fid = true;
+            break;
+        case 'i':
+            ignore_own = true;
+            break;
+        case 'j':
+            if (!parse_max_jobs (optarg, &max_jobs, &max_pending, &overflow))
+                usage (argv[0]);
+            break;
+        case 'k':
+            cache_file = optarg;
+            break;
+        case 'm':
+        {
+            unsigned long value;
+
+            if (!parse_number (optarg, 1, MAX_MATCHERS, &value))
+                usage (argv[0]);
+            n_matchers = value;
+            break;
+        }
+        case 'n':
+            dry_run = true;
+            break;
+        case 'o':
+            record_file = optarg;
+            break;
+        case 'p':
+            replay_file = optarg;
+            break;
+        case 'r':
+            recover = true;
+            break;
+        case 's':
+            metrics_socket = optarg;
+            break;
+        case 't':
+            realtime = true;
+            break;
+        case 'u':
+            unlimited = true;
+            break;
+        case 'w':
+        {
+            unsigned long value;
+
+            if (!parse_number (optarg, 1, MAX_PERMISSION_TIMEOUT, &value))
+                usage (argv[0]);
+            permissions = true;
+            permission_timeout = value;
+            break;
+        }
         default:
             usage (argv[0]);
             return EXIT_FAILURE;
@@ -111,54 +462,97 @@ main (int   argc,
         }
     }
 
-    signal (SIGTERM, &signal_handler);
-    signal (SIGINT,  &signal_handler);
-    signal (SIGUSR1, &signal_handler);
+    sigset_t signals;
+
+    /* Blocked before any thread gets started so that they all inherit it */
+    sigemptyset (&signals);
+    sigaddset (&signals, SIGTERM);
+    sigaddset (&signals, SIGINT);
+    sigaddset (&signals, SIGUSR1);
+    sigaddset (&signals, SIGUSR2);
+    sigprocmask (SIG_BLOCK, &signals, NULL);
 
-    if ((fanotify_fd = fanotify_init (FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK, O_RDONLY|O_LARGEFILE)) < 0)
+    if ((signal_fd = signalfd (-1, &signals, SFD_CLOEXEC|SFD_NONBLOCK)) < 0)
     {
-        fprintf (stderr, "Could not initialize fanotify\n");
+        fprintf (stderr, "Error: could not create signalfd: %s\n", strerror (errno));
         return EXIT_FAILURE;
     }
 
-    _conf = facron_conf_new (conf_file);
-    facron_conf_apply (_conf, fanotify_fd);
+    if (!(_timers = facron_timers_new ()) ||
+        !(_executor = facron_executor_new (max_jobs, max_pending, overflow, _timers)))
+            return EXIT_FAILURE;
+    facron_executor_set_dry_run (_executor, dry_run);
+
+    /* Replays don't watch anything, the events all come from the trace */
+    if (replay_file)
+        return replay (conf_file, cache_file, replay_file, realtime);
+
+    unsigned int flags = FAN_CLASS_NOTIF|FAN_CLOEXEC|FAN_NONBLOCK;
 
-    char buf[4096];
-    size_t len;
+    /* Events then carry their directory's handle and their name instead of an fd */
+    if (fid)
+        flags |= FAN_REPORT_DFID_NAME;
+    /* Events are then only lost when running out of memory */
+    if (unlimited)
+        flags |= FAN_UNLIMITED_QUEUE;
 
-    while ((len = read (fanotify_fd, buf, sizeof (buf))) > 0)
+    if ((fanotify_fd = fanotify_init (flags, O_RDONLY|O_LARGEFILE)) < 0)
     {
-        char path[PATH_MAX];
-        int path_len;
+        fprintf (stderr, "Could not initialize fanotify\n");
+        return EXIT_FAILURE;
+    }
 
-        for (FacronMetadata *metadata = (FacronMetadata *) buf; FAN_EVENT_OK (metadata, len); metadata = FAN_EVENT_NEXT (metadata, len))
+    if (!(_conf = facron_conf_new (conf_file, cache_file)))
+    {
+        close (fanotify_fd);
+        return EXIT_FAILURE;
+    }
+
+    if (permissions)
+    {
+        if (!(_permissions = facron_permissions_new (_conf, _executor, permission_timeout)))
         {
-            if (metadata->vers < 2)
-            {
-                fprintf (stderr, "Kernel fanotify version too old\n");
-                close (metadata->fd);
-                goto fail;
-            }
-
-            if (metadata->fd < 0)
-                continue;
-
-            sprintf (path, "/proc/self/fd/%d", metadata->fd);
-            path_len = readlink (path, path, sizeof (path) - 1);
-            if (path_len < 0)
-                goto next;
-            path[path_len] = '\0';
-
-            facron_conf_handle (_conf, path, path_len, metadata);
-
-next:
-            close (metadata->fd);
+            cleanup ();
+            return EXIT_FAILURE;
         }
+        facron_conf_set_permission_fd (_conf, facron_permissions_get_fanotify_fd (_permissions));
     }
+    facron_conf_apply (_conf, fanotify_fd);
+
+    if (recover)
+    {
+        if (!(_recovery = facron_recovery_new (_conf, _executor)))
+        {
+            cleanup ();
+            return EXIT_FAILURE;
+        }
+        facron_recovery_track (_recovery);
+    }
+
+    if (record_file && !(_trace = facron_trace_new (record_file)))
+    {
+        cleanup ();
+        return EXIT_FAILURE;
+    }
+
+    if (!(_loop = facron_loop_new ()) ||
+        !(_pipeline = facron_pipeline_new (fanotify_fd, _conf, _executor, _recovery, _trace, buffer_size, n_matchers, fid, ignore_own)) ||
+        !facron_loop_add (_loop, facron_pipeline_get_fd (_pipeline), on_pipeline_error, NULL) ||
+        !facron_loop_add (_loop, facron_executor_get_queue_fd (_executor), on_request, NULL) ||
+        !facron_loop_add (_loop, facron_executor_get_fd (_executor), on_child_exit, NULL) ||
+        !facron_loop_add (_loop, facron_timers_get_fd (_timers), on_timer, NULL) ||
+        !facron_loop_add (_loop, facron_conf_get_fd (_conf), on_conf_loaded, NULL) ||
+        !facron_loop_add (_loop, signal_fd, on_signal, NULL) ||
+        (metrics_socket && ((metrics_fd = facron_metrics_listen (metrics_socket)) < 0 ||
+                            !facron_loop_add (_loop, metrics_fd, on_metrics_client, NULL))))
+    {
+        cleanup ();
+        return EXIT_FAILURE;
+    }
+
+    int status = facron_loop_run (_loop);
 
-fail:
     cleanup ();
 
-    return EXIT_FAILURE;
+    return status;
 }